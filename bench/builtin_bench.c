@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "../wsh.h"
+
+// Script run time with in-process builtins against the same script
+// calling the external utilities by path (one fork+exec per line).
+// usage: builtin_bench [lines]
+
+static const char *corpus[] = {
+    "echo deploying release 42",
+    "true",
+    "false",
+    "test -d /tmp",
+    "[ 3 -lt 7 ]",
+    "printf %s-%d\\n build 7",
+    "pwd",
+    "sleep 0",
+    "kill -0 1",
+    "read -r line < /etc/hostname",
+};
+
+static const char *externals[] = {
+    "/bin/echo", "/bin/true", "/bin/false", "/usr/bin/test", "/usr/bin/[",
+    "/usr/bin/printf", "/bin/pwd", "/bin/sleep", "/bin/kill", "/usr/bin/head -n 1",
+};
+
+#define CORPUS_SIZE (sizeof(corpus) / sizeof(corpus[0]))
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void write_script(const char *path, int lines, int external) {
+    FILE *fp = fopen(path, "w");
+    int i;
+
+    for (i = 0; i < lines; i++) {
+        const char *line = corpus[i % CORPUS_SIZE];
+        if (external) {
+            const char *args = strchr(line, ' ');
+            if (strncmp(line, "read", 4) == 0) {
+                args = " < /etc/hostname";
+            }
+            fprintf(fp, "%s%s\n", externals[i % CORPUS_SIZE], args != NULL ? args : "");
+        } else {
+            fprintf(fp, "%s\n", line);
+        }
+    }
+    fclose(fp);
+}
+
+static double run(const char *path, int lines) {
+    int saved = dup(1), null_fd = open("/dev/null", O_WRONLY);
+
+    dup2(null_fd, 1);
+    double start = now();
+    wsh_run_script(path, 0);
+    double elapsed = now() - start;
+    dup2(saved, 1);
+    close(saved);
+    close(null_fd);
+
+    return lines / elapsed;
+}
+
+int main(int argc, char **argv) {
+    int lines = argc > 1 ? atoi(argv[1]) : 10000;
+    char builtin_path[] = "/tmp/wsh_builtin_bench.wsh", external_path[] = "/tmp/wsh_external_bench.wsh";
+
+    wsh_shell_init();
+
+    write_script(builtin_path, lines, 0);
+    write_script(external_path, lines, 1);
+
+    double builtin_rate = run(builtin_path, lines);
+    double external_rate = run(external_path, lines);
+
+    printf("lines: %d\n", lines);
+    printf("builtins:  %10.0f lines/sec\n", builtin_rate);
+    printf("externals: %10.0f lines/sec\n", external_rate);
+
+    unlink(builtin_path);
+    unlink(external_path);
+
+    return EXIT_SUCCESS;
+}
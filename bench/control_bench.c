@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "../wsh.h"
+
+// Loops whose bodies are builtins only, run in process by the wsh script
+// runner and, when installed, by dash and bash for reference: an if in a
+// for loop, an && / || chain, and a while loop around nested fors.
+// usage: control_bench [iterations]
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void write_script(const char *path, const char *text) {
+    FILE *fp = fopen(path, "w");
+
+    if (fp == NULL) {
+        perror("control_bench");
+        exit(EXIT_FAILURE);
+    }
+    fputs(text, fp);
+    fclose(fp);
+}
+
+static double run_shell(const char *shell, const char *path) {
+    double start = now();
+    int status;
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        execlp(shell, shell, path, (char*) NULL);
+        _exit(127);
+    }
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) != 127 ? now() - start : -1;
+}
+
+static void bench(const char *name, const char *text, int count) {
+    static const char *others[] = {"dash", "bash"};
+    char path[] = "/tmp/wsh_control_bench.sh";
+    size_t i;
+
+    write_script(path, text);
+    double start = now();
+    wsh_run_script(path, 0);
+    double elapsed = now() - start;
+    printf("%-9s %7d iterations  wsh  %8.1f ms  %6.2f us/iteration\n", name, count, elapsed * 1e3,
+           elapsed / count * 1e6);
+    for (i = 0; i < sizeof(others) / sizeof(others[0]); i++) {
+        elapsed = run_shell(others[i], path);
+        if (elapsed >= 0) {
+            printf("%-9s %7d iterations  %-4s %8.1f ms  %6.2f us/iteration\n", "", count, others[i],
+                   elapsed * 1e3, elapsed / count * 1e6);
+        }
+    }
+    unlink(path);
+}
+
+int main(int argc, char **argv) {
+    int count = argc > 1 ? atoi(argv[1]) : 100000;
+    int outer = count / 100 > 0 ? count / 100 : 1;
+    char text[1024], inner[512] = "";
+    int i;
+
+    wsh_shell_init();
+    snprintf(text, sizeof(text),
+             "for i in $(seq %d); do\n"
+             "    if test $i = 500; then\n"
+             "        echo hit > /dev/null\n"
+             "    else\n"
+             "        last=$i\n"
+             "    fi\n"
+             "done\n", count);
+    bench("if", text, count);
+
+    snprintf(text, sizeof(text),
+             "for i in $(seq %d); do\n"
+             "    test $i = 500 && echo hit > /dev/null || last=$i\n"
+             "done\n", count);
+    bench("and-or", text, count);
+
+    // the while condition runs once per outer pass, 100 inner passes each
+    for (i = 1; i <= 100; i++) {
+        snprintf(inner + strlen(inner), sizeof(inner) - strlen(inner), " %d", i);
+    }
+    snprintf(text, sizeof(text),
+             "n=\n"
+             "for j in $(seq %d); do\n"
+             "    while test \"$n\" != x; do\n"
+             "        for k in%s; do last=$k; done\n"
+             "        n=x\n"
+             "    done\n"
+             "    n=\n"
+             "done\n", outer, inner);
+    bench("while", text, outer * 100);
+
+    return EXIT_SUCCESS;
+}
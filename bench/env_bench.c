@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../wsh.h"
+
+extern struct shell_info *wsh_shell;
+
+// Spawn cost with a large environment: /bin/true through wsh_launch_job
+// with the cached envp reused, and with an exported variable changed
+// before every spawn so the array is rebuilt each time. The cost of
+// getting the array alone is measured both ways too.
+// usage: env_bench [variables] [iterations]
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double envp_time(int change, int iterations) {
+    char value[32];
+    double start = now();
+    int i;
+
+    for (i = 0; i < iterations; i++) {
+        if (change) {
+            snprintf(value, sizeof(value), "%d", i);
+            wsh_set_var("WSH_BENCH_CHANGED", 17, value, VAR_EXPORT);
+        }
+        wsh_var_envp();
+    }
+    return (now() - start) / iterations;
+}
+
+static double spawn_time(int change, int iterations) {
+    char line[32], value[32];
+    double start = now();
+    int i;
+
+    for (i = 0; i < iterations; i++) {
+        if (change) {
+            snprintf(value, sizeof(value), "%d", i);
+            wsh_set_var("WSH_BENCH_CHANGED", 17, value, VAR_EXPORT);
+        }
+        strcpy(line, "/bin/true");
+        wsh_launch_job(wsh_parse_command(line));
+    }
+    return (now() - start) / iterations;
+}
+
+int main(int argc, char **argv) {
+    int variables = argc > 1 ? atoi(argv[1]) : 500;
+    int iterations = argc > 2 ? atoi(argv[2]) : 2000;
+    char name[32], value[64];
+    int i;
+
+    wsh_shell_init();
+    for (i = 0; i < variables; i++) {
+        snprintf(name, sizeof(name), "WSH_BENCH_%d", i);
+        snprintf(value, sizeof(value), "value-%d-%032d", i, i);
+        wsh_set_var(name, strlen(name), value, VAR_EXPORT);
+    }
+    wsh_var_envp();
+
+    long builds = wsh_shell->vars->envp_builds;
+    double envp_cached = envp_time(0, iterations * 100);
+    double spawn_cached = spawn_time(0, iterations);
+    long cached_builds = wsh_shell->vars->envp_builds - builds;
+    double envp_changed = envp_time(1, iterations);
+    double spawn_changed = spawn_time(1, iterations);
+
+    printf("%d exported variables, %d spawns of /bin/true\n", wsh_shell->vars->exported, iterations);
+    printf("%-16s envp %8.3f us  spawn %8.1f us  (%ld rebuilds)\n", "unchanged", envp_cached * 1e6,
+           spawn_cached * 1e6, cached_builds);
+    printf("%-16s envp %8.3f us  spawn %8.1f us\n", "after a change", envp_changed * 1e6, spawn_changed * 1e6);
+
+    return EXIT_SUCCESS;
+}
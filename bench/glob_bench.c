@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "../wsh.h"
+
+// Glob expansion over a generated tree: libc glob() against the wsh
+// engine with a cold listing cache (flushed before every pattern) and a
+// warm one. Results of the patterns libc understands are compared.
+// usage: glob_bench [dirs] [files_per_dir] [rounds]
+
+static const char *patterns[] = {
+    "d*/f1*.c",
+    "d1?/*",
+    "d[0-4]*/f[!0-8]*.h",
+    "*/f[[:digit:]]0.c",
+    "d*/",
+    "d1/nomatch*",
+};
+
+static const char *wsh_patterns[] = {
+    "**/f98.c",
+    "d{1..3}/f{0..8..2}.c",
+};
+
+#define PATTERN_COUNT (sizeof(patterns) / sizeof(patterns[0]))
+#define WSH_PATTERN_COUNT (sizeof(wsh_patterns) / sizeof(wsh_patterns[0]))
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void make_tree(const char *root, int dirs, int files) {
+    struct timespec past[2] = {{0, UTIME_OMIT}, {0, 0}};
+    char path[256];
+    int i, j;
+
+    past[1].tv_sec = time(NULL) - 60;     // listings of fresh dirs are never cached
+    mkdir(root, 0755);
+    for (i = 0; i < dirs; i++) {
+        snprintf(path, sizeof(path), "%s/d%d", root, i);
+        mkdir(path, 0755);
+        for (j = 0; j < files; j++) {
+            snprintf(path, sizeof(path), "%s/d%d/f%d.%s", root, i, j, j % 2 ? "h" : "c");
+            close(open(path, O_WRONLY|O_CREAT, 0644));
+        }
+        snprintf(path, sizeof(path), "%s/d%d", root, i);
+        utimensat(AT_FDCWD, path, past, 0);
+    }
+    utimensat(AT_FDCWD, root, past, 0);
+}
+
+static void remove_tree(const char *root, int dirs, int files) {
+    char path[256];
+    int i, j;
+
+    for (i = 0; i < dirs; i++) {
+        for (j = 0; j < files; j++) {
+            snprintf(path, sizeof(path), "%s/d%d/f%d.%s", root, i, j, j % 2 ? "h" : "c");
+            unlink(path);
+        }
+        snprintf(path, sizeof(path), "%s/d%d", root, i);
+        rmdir(path);
+    }
+    rmdir(root);
+}
+
+static long libc_round() {
+    long total = 0;
+    size_t i;
+
+    for (i = 0; i < PATTERN_COUNT; i++) {
+        glob_t buffer;
+        if (glob(patterns[i], 0, NULL, &buffer) == 0) {
+            total += buffer.gl_pathc;
+        }
+        globfree(&buffer);
+    }
+    return total;
+}
+
+static long wsh_round(int cold) {
+    struct arena *arena = arena_create();
+    long total = 0;
+    size_t i;
+
+    for (i = 0; i < PATTERN_COUNT; i++) {
+        char **results;
+        if (cold) {
+            glob_cache_flush();
+        }
+        total += wsh_glob(patterns[i], arena, &results);
+    }
+    arena_release(arena);
+    return total;
+}
+
+static int compare(void) {
+    struct arena *arena = arena_create();
+    int mismatches = 0;
+    size_t i;
+    int j;
+
+    for (i = 0; i < PATTERN_COUNT; i++) {
+        glob_t buffer;
+        char **results;
+        int count = wsh_glob(patterns[i], arena, &results);
+        if (glob(patterns[i], GLOB_NOCHECK, NULL, &buffer) != 0 || (size_t) count != buffer.gl_pathc) {
+            printf("mismatch: %s (%d vs %zu)\n", patterns[i], count, buffer.gl_pathc);
+            mismatches++;
+        } else {
+            for (j = 0; j < count; j++) {
+                if (strcmp(results[j], buffer.gl_pathv[j]) != 0) {
+                    printf("mismatch: %s: %s vs %s\n", patterns[i], results[j], buffer.gl_pathv[j]);
+                    mismatches++;
+                    break;
+                }
+            }
+        }
+        globfree(&buffer);
+    }
+    arena_release(arena);
+    return mismatches;
+}
+
+int main(int argc, char **argv) {
+    int dirs = argc > 1 ? atoi(argv[1]) : 200;
+    int files = argc > 2 ? atoi(argv[2]) : 100;
+    int rounds = argc > 3 ? atoi(argv[3]) : 20;
+    char root[] = "/tmp/wsh_glob_bench", cwd[PATH_BUFSIZE];
+    int i;
+    size_t j;
+
+    wsh_shell_init();
+    make_tree(root, dirs, files);
+    if (getcwd(cwd, sizeof(cwd)) == NULL || chdir(root) < 0) {
+        perror("wsh: glob_bench");
+        return EXIT_FAILURE;
+    }
+
+    int mismatches = compare();
+
+    long matches = 0;
+    double start = now();
+    for (i = 0; i < rounds; i++) {
+        matches = libc_round();
+    }
+    double libc_time = (now() - start) / rounds;
+
+    start = now();
+    for (i = 0; i < rounds; i++) {
+        wsh_round(1);
+    }
+    double cold_time = (now() - start) / rounds;
+
+    wsh_round(0);
+    start = now();
+    for (i = 0; i < rounds; i++) {
+        wsh_round(0);
+    }
+    double warm_time = (now() - start) / rounds;
+
+    printf("tree: %d dirs x %d files, %ld matches per round\n", dirs, files, matches);
+    printf("libc glob: %8.3f ms/round\n", libc_time * 1e3);
+    printf("wsh cold:  %8.3f ms/round\n", cold_time * 1e3);
+    printf("wsh warm:  %8.3f ms/round\n", warm_time * 1e3);
+    printf("mismatches: %d\n", mismatches);
+
+    struct arena *arena = arena_create();
+    for (j = 0; j < WSH_PATTERN_COUNT; j++) {
+        char **results;
+        start = now();
+        int count = wsh_glob(wsh_patterns[j], arena, &results);
+        printf("%-20s %6d matches, %8.3f ms warm\n", wsh_patterns[j], count, (now() - start) * 1e3);
+    }
+    arena_release(arena);
+
+    if (chdir(cwd) < 0) {
+        perror("wsh: glob_bench");
+    }
+    remove_tree(root, dirs, files);
+
+    return mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,67 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../wsh.h"
+
+// A build-shaped script: width compile steps, each a short sleep, then a
+// link step after all of them and a test step after the link. Run line
+// by line, then as a job graph with sched -j set to the width.
+// usage: graph_bench [width] [step_ms]
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double run(const char *path, int width, int step_ms, int graph) {
+    FILE *fp = fopen(path, "w");
+    int i;
+
+    if (fp == NULL) {
+        perror("graph_bench");
+        exit(EXIT_FAILURE);
+    }
+    if (graph) {
+        fprintf(fp, "sched -j %d\n", width);
+    }
+    for (i = 0; i < width; i++) {
+        if (graph) {
+            fprintf(fp, "%%cc%d: ", i);
+        }
+        fprintf(fp, "/bin/sleep %g\n", step_ms / 1e3);
+    }
+    if (graph) {
+        fprintf(fp, "%%link: after");
+        for (i = 0; i < width; i++) {
+            fprintf(fp, " %%cc%d%s", i, i + 1 < width ? "" : ":");
+        }
+        fprintf(fp, " /bin/sleep %g\n%%test: after %%link: /bin/true\n", step_ms / 1e3);
+    } else {
+        fprintf(fp, "/bin/sleep %g\n/bin/true\n", step_ms / 1e3);
+    }
+    fclose(fp);
+
+    double start = now();
+    wsh_run_script(path, 0);
+    return now() - start;
+}
+
+int main(int argc, char **argv) {
+    int width = argc > 1 ? atoi(argv[1]) : 8;
+    int step_ms = argc > 2 ? atoi(argv[2]) : 50;
+    char path[] = "/tmp/wsh_graph_bench.wsh";
+
+    wsh_shell_init();
+    double serial = run(path, width, step_ms, 0);
+    double graph = run(path, width, step_ms, 1);
+    unlink(path);
+
+    printf("%d compile steps of %d ms, link, test\n", width, step_ms);
+    printf("line by line: %8.1f ms\n", serial * 1e3);
+    printf("job graph:    %8.1f ms  (%.1fx)\n", graph * 1e3, serial / graph);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "../wsh.h"
+
+// Feeding inline text to a command: the memfd behind << and <<< against
+// writing a temp file, redirecting from it and unlinking it afterwards.
+// Setup is the cost of getting a readable fd, run is /bin/cat reading it
+// to /dev/null through wsh_launch_job. Temp files go to $TMPDIR or /tmp.
+// usage: here_bench [iterations]
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int temp_file(const char *data, size_t length, char *path) {
+    int fd = mkstemp(path);
+
+    if (fd < 0 || write(fd, data, length) != (ssize_t) length) {
+        perror("here_bench");
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+static double setup_memfd(const char *data, size_t length, int iterations) {
+    double start = now();
+    int i;
+
+    for (i = 0; i < iterations; i++) {
+        close(wsh_open_here(data, length));
+    }
+    return (now() - start) / iterations;
+}
+
+static double setup_temp(const char *data, size_t length, const char *dir, int iterations) {
+    char path[PATH_BUFSIZE];
+    double start = now();
+    int i;
+
+    for (i = 0; i < iterations; i++) {
+        snprintf(path, sizeof(path), "%s/wsh_here_XXXXXX", dir);
+        close(temp_file(data, length, path));
+        close(open(path, O_RDONLY));
+        unlink(path);
+    }
+    return (now() - start) / iterations;
+}
+
+static double run_memfd(char *data, size_t length, int iterations) {
+    char line[64];
+    double start = now();
+    int i;
+
+    for (i = 0; i < iterations; i++) {
+        strcpy(line, "/bin/cat <<< x > /dev/null");
+        struct job *job = wsh_parse_command(line);
+        job->root->here_doc = data;
+        job->root->here_length = length;
+        wsh_launch_job(job);
+    }
+    return (now() - start) / iterations;
+}
+
+static double run_temp(const char *data, size_t length, const char *dir, int iterations) {
+    char path[PATH_BUFSIZE], line[PATH_BUFSIZE + 32];
+    double start = now();
+    int i;
+
+    for (i = 0; i < iterations; i++) {
+        snprintf(path, sizeof(path), "%s/wsh_here_XXXXXX", dir);
+        close(temp_file(data, length, path));
+        snprintf(line, sizeof(line), "/bin/cat < %s > /dev/null", path);
+        wsh_launch_job(wsh_parse_command(line));
+        unlink(path);
+    }
+    return (now() - start) / iterations;
+}
+
+int main(int argc, char **argv) {
+    static const size_t sizes[] = {64, 4 << 10, 256 << 10, 16 << 20};
+    int iterations = argc > 1 ? atoi(argv[1]) : 200;
+    const char *dir = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+    size_t s;
+
+    wsh_shell_init();
+    char *data = malloc(sizes[3]);
+    memset(data, 'x', sizes[3]);
+
+    printf("temp files in %s, %d iterations (fewer for 16 MiB)\n", dir, iterations);
+    printf("%10s %14s %14s %14s %14s\n", "bytes", "memfd setup", "temp setup", "memfd run", "temp run");
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        int n = sizes[s] >= (1 << 20) ? iterations / 10 + 1 : iterations;
+        double memfd_setup = setup_memfd(data, sizes[s], n);
+        double temp_setup = setup_temp(data, sizes[s], dir, n);
+        double memfd_run = run_memfd(data, sizes[s], n);
+        double temp_run = run_temp(data, sizes[s], dir, n);
+        printf("%10zu %11.1f us %11.1f us %11.1f us %11.1f us\n", sizes[s], memfd_setup * 1e6,
+               temp_setup * 1e6, memfd_run * 1e6, temp_run * 1e6);
+    }
+    free(data);
+
+    return EXIT_SUCCESS;
+}
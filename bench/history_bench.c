@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../wsh.h"
+
+// History at scale: a generated log of a million entries is indexed once,
+// then reopened (which must not depend on its size), appended to and
+// searched. Search latency is compared with a linear scan of the log.
+// usage: history_bench [entries]
+
+static const char *corpus[] = {
+    "git commit -am 'fix flaky test %d'",
+    "make -j%d bench",
+    "ssh ops%d.example.com uptime",
+    "kubectl -n team%d get pods",
+    "grep -rn TODO src/module%d",
+    "tar czf backup-%d.tgz /srv/data",
+    "curl -s http://localhost:%d/health",
+    "docker logs --tail 100 worker-%d",
+};
+
+static const char *queries[] = {
+    "ops17.example",
+    "backup-99999.tgz",
+    "worker-3",
+    "team4 get",
+    "nothing-like-this",
+};
+
+#define CORPUS_SIZE (sizeof(corpus) / sizeof(corpus[0]))
+#define QUERY_COUNT (sizeof(queries) / sizeof(queries[0]))
+#define SEARCH_ROUNDS 200
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double*) a, y = *(const double*) b;
+    return x < y ? -1 : x > y;
+}
+
+static long linear_search(const char *path, const char *query) {
+    FILE *fp = fopen(path, "r");
+    char line[COMMAND_BUFSIZE];
+    long offset = 0, result = -1;
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (strstr(line, query) != NULL) {
+            result = offset;
+        }
+        offset += strlen(line);
+    }
+    fclose(fp);
+    return result;
+}
+
+int main(int argc, char **argv) {
+    long entries = argc > 1 ? atol(argv[1]) : 1000000, i;
+    char path[] = "/tmp/wsh_history_bench", index_path[] = "/tmp/wsh_history_bench.idx";
+    double samples[SEARCH_ROUNDS], start;
+    size_t q;
+
+    unlink(path);
+    unlink(index_path);
+    FILE *fp = fopen(path, "w");
+    for (i = 0; i < entries; i++) {
+        fprintf(fp, corpus[i % CORPUS_SIZE], (int) (i / CORPUS_SIZE));
+        fputc('\n', fp);
+    }
+    fclose(fp);
+
+    setenv("HISTFILE", path, 1);
+    wsh_shell_init();
+
+    start = now();
+    wsh_history_open();
+    double build = now() - start;
+    wsh_history_close();
+
+    start = now();
+    wsh_history_open();
+    double reopen = now() - start;
+
+    start = now();
+    for (i = 0; i < 1000; i++) {
+        char line[64];
+        snprintf(line, sizeof(line), "echo appended %ld", i);
+        wsh_history_add(line);
+    }
+    double append = (now() - start) / 1000;
+
+    printf("entries: %ld\n", entries);
+    printf("index build: %10.3f ms (first open only)\n", build * 1e3);
+    printf("open:        %10.3f us\n", reopen * 1e6);
+    printf("append:      %10.3f us\n", append * 1e6);
+
+    for (q = 0; q < QUERY_COUNT; q++) {
+        long match = -1;
+        for (i = 0; i < SEARCH_ROUNDS; i++) {
+            start = now();
+            match = wsh_history_search(queries[q], -1);
+            samples[i] = now() - start;
+        }
+        qsort(samples, SEARCH_ROUNDS, sizeof(double), compare_double);
+
+        start = now();
+        linear_search(path, queries[q]);
+        double linear = now() - start;
+
+        printf("%-20s %s  p50 %8.1f us  p99 %8.1f us  linear scan %8.1f us\n", queries[q],
+               match >= 0 ? "hit " : "miss", samples[SEARCH_ROUNDS / 2] * 1e6,
+               samples[SEARCH_ROUNDS * 99 / 100] * 1e6, linear * 1e6);
+    }
+
+    wsh_history_close();
+    unlink(path);
+    unlink(index_path);
+
+    return EXIT_SUCCESS;
+}
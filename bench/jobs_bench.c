@@ -0,0 +1,67 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../wsh.h"
+
+// Job table stress: insert, pid lookup, status update and removal with
+// thousands of live jobs. Per-operation cost should not grow with the
+// table size.
+// usage: jobs_bench [max_jobs]
+
+extern struct shell_info *wsh_shell;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run(int count) {
+    struct job **jobs = malloc(count * sizeof(struct job*));
+    char line[32];
+    int i;
+
+    for (i = 0; i < count; i++) {
+        strcpy(line, "sleep 1");
+        jobs[i] = wsh_parse_command(line);
+        jobs[i]->root->pid = 100000 + i;
+    }
+
+    double t0 = now();
+    for (i = 0; i < count; i++) {
+        insert_job(jobs[i]);
+        pid_index_insert(jobs[i]->root->pid, jobs[i]->id, jobs[i]->root);
+    }
+    double t1 = now();
+    for (i = 0; i < count; i++) {
+        int pid = 100000 + (int) ((i * 7919L) % count);
+        set_process_status(pid, STATUS_DONE);
+        if (get_job_id_by_pid(pid) < 0) {
+            fprintf(stderr, "lookup failed for %d\n", pid);
+            exit(EXIT_FAILURE);
+        }
+    }
+    double t2 = now();
+    for (i = 0; i < count; i++) {
+        remove_job(jobs[i]->id);
+    }
+    double t3 = now();
+
+    printf("%8d jobs: insert %7.1f ns  reap-lookup %7.1f ns  remove %7.1f ns\n", count,
+           (t1 - t0) * 1e9 / count, (t2 - t1) * 1e9 / count, (t3 - t2) * 1e9 / count);
+    free(jobs);
+}
+
+int main(int argc, char **argv) {
+    int max_jobs = argc > 1 ? atoi(argv[1]) : 100000;
+    int count;
+
+    wsh_init();
+
+    for (count = 10; count <= max_jobs; count *= 10) {
+        run(count);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,51 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../wsh.h"
+
+// Throughput of the parallel builtin against xargs -P on many small,
+// uneven tasks (mostly 1ms sleeps, every 50th task 50ms).
+// usage: parallel_bench [tasks] [slots]
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double run(const char *line, int tasks) {
+    char buffer[COMMAND_BUFSIZE];
+
+    strcpy(buffer, line);
+    double start = now();
+    wsh_launch_job(wsh_parse_command(buffer));
+    return tasks / (now() - start);
+}
+
+int main(int argc, char **argv) {
+    int tasks = argc > 1 ? atoi(argv[1]) : 2000;
+    int slots = argc > 2 ? atoi(argv[2]) : 16;
+    char path[64], line[COMMAND_BUFSIZE];
+    int i;
+
+    snprintf(path, sizeof(path), "/tmp/parallel_bench.%d", getpid());
+    FILE *file = fopen(path, "w");
+    for (i = 0; i < tasks; i++) {
+        fprintf(file, "%s\n", i % 50 == 0 ? "0.05" : "0.001");
+    }
+    fclose(file);
+
+    wsh_init();
+
+    printf("tasks: %d, slots: %d\n", tasks, slots);
+    snprintf(line, sizeof(line), "parallel -j %d -u -a %s sleep", slots, path);
+    printf("parallel: %8.0f tasks/sec\n", run(line, tasks));
+    snprintf(line, sizeof(line), "xargs -P %d -n 1 -a %s sleep", slots, path);
+    printf("xargs -P: %8.0f tasks/sec\n", run(line, tasks));
+
+    unlink(path);
+
+    return EXIT_SUCCESS;
+}
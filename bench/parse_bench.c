@@ -0,0 +1,205 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../wsh.h"
+
+// Parse throughput of the single-pass lexer against the previous
+// strtok-based parser, which is kept below as legacy_parse_command.
+// usage: parse_bench [rounds]
+
+static const char *corpus[] = {
+    "ls -la",
+    "git log --oneline -n 20 | head -5",
+    "grep -rn TODO src include | sort | uniq -c | sort -rn | head -20",
+    "find . -name *.o -newer Makefile",
+    "tar -czf /tmp/backup.tar.gz /etc/nginx /etc/ssl > /tmp/backup.log",
+    "sort < /var/log/syslog | uniq | wc -l",
+    "make -j8 all > build.log &",
+    "cat access.log | awk {print} | cut -d : -f 1 | sort | uniq -c",
+    "ssh deploy@host01 systemctl restart app",
+    "curl -s -o /tmp/index.html https://example.com/index.html",
+    "sleep 30 &",
+    "cp -r build/release /opt/app/releases/2024-10-01",
+};
+
+#define CORPUS_SIZE (sizeof(corpus) / sizeof(corpus[0]))
+
+static struct process* legacy_parse_command_segment(char *segment, struct arena *arena) {
+    int bufsize = TOKEN_BUFSIZE;
+    int position = 0;
+    char *command = arena_strdup(arena, segment);
+    char *token;
+    char **tokens = (char**) arena_alloc(arena, bufsize * sizeof(char*));
+
+    token = strtok(segment, " ");
+    while (token != NULL) {
+        if (position + 1 >= bufsize) {
+            char **grown = (char**) arena_alloc(arena, (bufsize + TOKEN_BUFSIZE) * sizeof(char*));
+            memcpy(grown, tokens, position * sizeof(char*));
+            bufsize += TOKEN_BUFSIZE;
+            tokens = grown;
+        }
+
+        tokens[position] = token;
+        position++;
+
+        token = strtok(NULL, " ");
+    }
+
+    int i = 0, argc = 0;
+    char *input_path = NULL, *output_path = NULL;
+    while (i < position) {
+        if (tokens[i][0] == '<' || tokens[i][0] == '>') {
+            break;
+        }
+        i++;
+    }
+    argc = i;
+
+    for (; i < position; i++) {
+        if (tokens[i][0] == '<') {
+            if (strlen(tokens[i]) == 1) {
+                input_path = tokens[i + 1];
+                i++;
+            } else {
+                input_path = tokens[i] + 1;
+            }
+        } else if (tokens[i][0] == '>') {
+            if (strlen(tokens[i]) == 1) {
+                output_path = tokens[i + 1];
+                i++;
+            } else {
+                output_path = tokens[i] + 1;
+            }
+        } else {
+            break;
+        }
+    }
+
+    for (i = argc; i <= position; i++) {
+        tokens[i] = NULL;
+    }
+
+    // Initializing the process with the job details
+
+    struct process *new_proc = (struct process*) arena_alloc(arena, sizeof(struct process));
+    new_proc->command = command;
+    new_proc->argv = tokens;
+    new_proc->argc = argc;
+    new_proc->globs = NULL;
+    new_proc->input_paths = NULL;
+    new_proc->output_paths = NULL;
+    if (input_path != NULL) {
+        new_proc->input_paths = (char**) arena_alloc(arena, 2 * sizeof(char*));
+        new_proc->input_paths[0] = input_path;
+        new_proc->input_paths[1] = NULL;
+    }
+    if (output_path != NULL) {
+        new_proc->output_paths = (char**) arena_alloc(arena, 2 * sizeof(char*));
+        new_proc->output_paths[0] = output_path;
+        new_proc->output_paths[1] = NULL;
+    }
+    new_proc->pid = -1;
+    new_proc->status = STATUS_RUNNING;
+    new_proc->exit_status = 0;
+    new_proc->builtin = wsh_find_builtin(tokens[0]);
+    new_proc->next = NULL;
+    return new_proc;
+}
+
+static struct job* legacy_parse_command(char *line) {
+    struct arena *arena = arena_create();
+    line = helper_strtrim(line);
+    char *command = arena_strdup(arena, line);
+
+    struct process *root_proc = NULL, *proc = NULL;
+    char *line_cursor = line, *c = line, *seg;
+    int seg_len = 0, mode = FOREGROUND_EXECUTION;
+
+    if (line[strlen(line) - 1] == '&') {
+        mode = BACKGROUND_EXECUTION;
+        line[strlen(line) - 1] = '\0';
+    }
+
+    while (1) {
+        if (*c == '\0' || *c == '|') {
+            seg = arena_strndup(arena, line_cursor, seg_len);
+
+            struct process* new_proc = legacy_parse_command_segment(seg, arena);
+            if (!root_proc) {
+                root_proc = new_proc;
+                proc = root_proc;
+            } else {
+                proc->next = new_proc;
+                proc = new_proc;
+            }
+
+            if (*c != '\0') {
+                line_cursor = c;
+                while (*(++line_cursor) == ' ');
+                c = line_cursor;
+                seg_len = 0;
+                continue;
+            } else {
+                break;
+            }
+        } else {
+            seg_len++;
+            c++;
+        }
+    }
+
+    struct job *new_job = (struct job*) arena_alloc(arena, sizeof(struct job));
+    new_job->arena = arena;
+    new_job->root = root_proc;
+    new_job->command = command;
+    new_job->id = -1;
+    new_job->pgid = -1;
+    new_job->mode = mode;
+    return new_job;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Best of five passes, the machine is rarely quiet enough for one
+
+static double run(struct job *(*parse)(char *), int rounds) {
+    char line[COMMAND_BUFSIZE];
+    double best = 0;
+    int i, pass;
+    size_t j;
+
+    for (pass = 0; pass < 5; pass++) {
+        double start = now();
+        for (i = 0; i < rounds; i++) {
+            for (j = 0; j < CORPUS_SIZE; j++) {
+                strcpy(line, corpus[j]);
+                free_job(parse(line));
+            }
+        }
+        double rate = rounds * CORPUS_SIZE / (now() - start);
+        best = rate > best ? rate : best;
+    }
+    return best;
+}
+
+int main(int argc, char **argv) {
+    int rounds = argc > 1 ? atoi(argv[1]) : 20000;
+
+    wsh_shell_init();
+
+    run(wsh_parse_command, rounds / 10 + 1);
+    double lexer = run(wsh_parse_command, rounds);
+    double legacy = run(legacy_parse_command, rounds);
+
+    printf("corpus: %zu lines x %d rounds\n", CORPUS_SIZE, rounds);
+    printf("single-pass lexer: %12.0f lines/sec\n", lexer);
+    printf("strtok parser:     %12.0f lines/sec\n", legacy);
+
+    return EXIT_SUCCESS;
+}
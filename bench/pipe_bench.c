@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../wsh.h"
+
+// Pipeline plumbing throughput: default vs enlarged pipes, tee/splice
+// fan-out vs the tee command, splice concatenation vs cat.
+// usage: pipe_bench [size_mb] [passes]
+
+static char path[64], out1[80], out2[80];
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double run(const char *format, double bytes, int passes) {
+    char line[COMMAND_BUFSIZE];
+    double best = 0;
+    int i;
+
+    for (i = 0; i < passes; i++) {
+        snprintf(line, sizeof(line), format, path, path, out1, out2);
+        double start = now();
+        wsh_launch_job(wsh_parse_command(line));
+        double rate = bytes / (now() - start) / 1e9;
+        if (rate > best) {
+            best = rate;
+        }
+    }
+    return best;
+}
+
+int main(int argc, char **argv) {
+    size_t size_mb = argc > 1 ? atoi(argv[1]) : 256;
+    int passes = argc > 2 ? atoi(argv[2]) : 3;
+    double bytes = size_mb << 20;
+    char block[1 << 16];
+    size_t i;
+
+    snprintf(path, sizeof(path), "/tmp/pipe_bench.%d", getpid());
+    snprintf(out1, sizeof(out1), "%s.o1", path);
+    snprintf(out2, sizeof(out2), "%s.o2", path);
+    FILE *file = fopen(path, "w");
+    memset(block, 'x', sizeof(block));
+    for (i = 0; i < (size_mb << 20) / sizeof(block); i++) {
+        fwrite(block, 1, sizeof(block), file);
+    }
+    fclose(file);
+
+    wsh_init();
+
+    printf("size: %zu MiB, best of %d\n", size_mb, passes);
+    printf("cat | wc -c, default pipes: %6.2f GB/s\n", run("cat %s | wc -c > /dev/null", bytes, passes));
+    printf("cat | wc -c, pipesize 1M:   %6.2f GB/s\n", run("pipesize 1M cat %s | wc -c > /dev/null", bytes, passes));
+    printf("cat > o1 > o2 (tee/splice): %6.2f GB/s\n", run("cat %1$s > %3$s > %4$s", bytes, passes));
+    printf("cat | tee o1 > o2:          %6.2f GB/s\n", run("cat %1$s | tee %3$s > %4$s", bytes, passes));
+    printf("wc -c < big < big (splice): %6.2f GB/s\n", run("wc -c < %s < %s > /dev/null", 2 * bytes, passes));
+    printf("cat big big | wc -c:        %6.2f GB/s\n", run("cat %s %s | wc -c > /dev/null", 2 * bytes, passes));
+
+    unlink(path);
+    unlink(out1);
+    unlink(out2);
+
+    return EXIT_SUCCESS;
+}
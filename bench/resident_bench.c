@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "../wsh.h"
+
+// Latency of a tiny script: a cold `wsh script` start per task against
+// a resident `wsh --server`, reached through an exec'd `wsh --client` and
+// through wsh_client() called in process (the socket round trip alone).
+// usage: resident_bench [iterations] [wsh_binary]
+
+static const char *script_lines =
+    "echo task > /dev/null\n"
+    "test -d /tmp\n";
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double*) a, y = *(const double*) b;
+    return x < y ? -1 : x > y;
+}
+
+static void run_exec(char **argv) {
+    int status;
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "resident_bench: %s failed\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void report(const char *name, double *samples, int iterations) {
+    qsort(samples, iterations, sizeof(double), compare_double);
+    printf("%-16s p50 %8.1f us  p99 %8.1f us\n", name, samples[iterations / 2] * 1e6,
+           samples[iterations * 99 / 100] * 1e6);
+}
+
+int main(int argc, char **argv) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 500;
+    char *wsh = argc > 2 ? argv[2] : "./wsh";
+    char script[] = "/tmp/wsh_resident_bench.wsh", socket_path[] = "/tmp/wsh_resident_bench.sock";
+    char *cold_argv[] = {wsh, script, NULL};
+    char *client_argv[] = {wsh, "--client", socket_path, script, NULL};
+    double *samples = malloc(iterations * sizeof(double));
+    int i;
+
+    FILE *fp = fopen(script, "w");
+    if (fp == NULL || access(wsh, X_OK) < 0) {
+        fprintf(stderr, "resident_bench: need %s and a writable /tmp\n", wsh);
+        return EXIT_FAILURE;
+    }
+    fputs(script_lines, fp);
+    fclose(fp);
+
+    pid_t server = fork();
+    if (server == 0) {
+        wsh_shell_init();
+        _exit(wsh_resident_serve(socket_path));
+    }
+    for (i = 0; i < 100 && access(socket_path, F_OK) < 0; i++) {
+        usleep(10000);
+    }
+
+    for (i = 0; i < iterations; i++) {
+        double start = now();
+        run_exec(cold_argv);
+        samples[i] = now() - start;
+    }
+    report("cold wsh script", samples, iterations);
+
+    for (i = 0; i < iterations; i++) {
+        double start = now();
+        run_exec(client_argv);
+        samples[i] = now() - start;
+    }
+    report("wsh --client", samples, iterations);
+
+    for (i = 0; i < iterations; i++) {
+        double start = now();
+        if (wsh_client(socket_path, RESIDENT_SCRIPT, script) != 0) {
+            fprintf(stderr, "resident_bench: request failed\n");
+            break;
+        }
+        samples[i] = now() - start;
+    }
+    report("wsh_client()", samples, iterations);
+
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+    unlink(socket_path);
+    unlink(script);
+    free(samples);
+
+    return EXIT_SUCCESS;
+}
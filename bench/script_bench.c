@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "../wsh.h"
+
+// Script parse time: parsing a generated script into an image against
+// mapping the saved image back.
+// usage: script_bench [lines] [rounds]
+
+static const char *corpus[] = {
+    "echo deploying release",
+    "ls -l /var/log/*.log | grep -v old | wc -l",
+    "cp build/app.tar.gz /tmp/stage/app.tar.gz",
+    "tar -xzf /tmp/stage/app.tar.gz -C /opt/app > /tmp/stage/untar.log",
+    "sort < /tmp/stage/hosts.txt | uniq | head -n 20",
+    "sleep 1 &",
+};
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+    int lines = argc > 1 ? atoi(argv[1]) : 10000;
+    int rounds = argc > 2 ? atoi(argv[2]) : 20;
+    char path[] = "/tmp/wsh_script_bench.wsh";
+    char *cache_path = script_image_cache_path(path);
+    struct script_image *image = NULL;
+    struct stat st;
+    size_t length;
+    int i;
+
+    wsh_shell_init();
+
+    FILE *fp = fopen(path, "w");
+    for (i = 0; i < lines; i++) {
+        fprintf(fp, "%s\n", corpus[i % (sizeof(corpus) / sizeof(corpus[0]))]);
+    }
+    fclose(fp);
+
+    int fd = open(path, O_RDONLY);
+    fstat(fd, &st);
+    char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    double start = now();
+    for (i = 0; i < rounds; i++) {
+        image = script_image_build(path, data, st.st_size, &st);
+        if (i < rounds - 1) {
+            free(image);
+        }
+    }
+    double parse_time = (now() - start) / rounds;
+
+    script_image_save(image, cache_path);
+    free(image);
+
+    start = now();
+    for (i = 0; i < rounds; i++) {
+        image = script_image_load(cache_path, path, &st, &length);
+        if (image == NULL) {
+            fprintf(stderr, "cached image rejected\n");
+            return EXIT_FAILURE;
+        }
+        munmap(image, length);
+    }
+    double load_time = (now() - start) / rounds;
+
+    printf("script: %d lines, %ld bytes\n", lines, (long) st.st_size);
+    printf("parse:        %10.1f us\n", parse_time * 1e6);
+    printf("cached image: %10.1f us\n", load_time * 1e6);
+
+    unlink(cache_path);
+    unlink(path);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../wsh.h"
+
+// Launch latency of /bin/true through each spawn engine, as the shell
+// grows: p50/p99 per engine for every ballast size. The fork server is
+// started before any ballast, like the shell starts it at init.
+// usage: server_bench [iterations] [max_ballast_mb]
+
+extern struct shell_info *wsh_shell;
+
+static const char *ENGINE_NAMES[] = {"posix_spawn", "fork", "fork server"};
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double*) a, y = *(const double*) b;
+    return x < y ? -1 : x > y;
+}
+
+static void run(int engine, int iterations, double *samples) {
+    char line[64];
+    int i;
+
+    wsh_shell->spawn_engine = engine;
+    for (i = 0; i < iterations; i++) {
+        strcpy(line, "/bin/true");
+        double start = now();
+        wsh_launch_job(wsh_parse_command(line));
+        samples[i] = now() - start;
+    }
+    qsort(samples, iterations, sizeof(double), compare_double);
+}
+
+int main(int argc, char **argv) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 1000;
+    size_t max_mb = argc > 2 ? atoi(argv[2]) : 1024, ballast_mb = 0;
+    double *samples = malloc(iterations * sizeof(double));
+    int engine;
+
+    setenv("WSH_SPAWN", "server", 1);
+    wsh_init();
+    if (wsh_shell->spawn_engine != SPAWN_ENGINE_SERVER) {
+        printf("fork server unavailable\n");
+        return EXIT_FAILURE;
+    }
+
+    for (ballast_mb = 0; ballast_mb <= max_mb; ballast_mb = ballast_mb ? ballast_mb * 4 : 64) {
+        if (ballast_mb > 0) {
+            size_t grow = ballast_mb - (ballast_mb == 64 ? 0 : ballast_mb / 4);
+            char *ballast = malloc(grow << 20);
+            memset(ballast, 1, grow << 20);
+        }
+        printf("ballast: %zu MiB\n", ballast_mb);
+        for (engine = SPAWN_ENGINE_POSIX; engine <= SPAWN_ENGINE_SERVER; engine++) {
+            run(engine, iterations / 10 + 1, samples);
+            run(engine, iterations, samples);
+            printf("  %-12s p50 %8.1f us  p99 %8.1f us\n", ENGINE_NAMES[engine],
+                   samples[iterations / 2] * 1e6, samples[iterations * 99 / 100] * 1e6);
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "../wsh.h"
+
+// Startup of an interactive wsh fed through pipes, from exec to the first
+// prompt and to the output of the first command, with no rc file, with
+// an rc that exports variables and hashes commands, and with a snapshot
+// of that rc saved by wsh --save-snapshot. HOME points at a scratch dir.
+// usage: snapshot_bench [iterations] [variables] [wsh_binary]
+
+static const char *commands[] = {
+    "ls", "cat", "grep", "sed", "awk", "sort", "head", "tail", "wc", "tr",
+    "cut", "find", "xargs", "env", "date", "uname", "id", "stat", "touch", "mkdir",
+};
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double*) a, y = *(const double*) b;
+    return x < y ? -1 : x > y;
+}
+
+static void write_rc(const char *path, int variables) {
+    FILE *fp = fopen(path, "w");
+    size_t i;
+    int j;
+
+    if (fp == NULL) {
+        perror("snapshot_bench");
+        exit(EXIT_FAILURE);
+    }
+    for (j = 0; j < variables; j++) {
+        fprintf(fp, "export WSH_BENCH_%d=value_%d_$HOME\n", j, j);
+    }
+    for (i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+        fprintf(fp, "hash %s\n", commands[i]);
+    }
+    fprintf(fp, "sched -j 4\ntimeout -k 2\nset -o globunsorted\n");
+    fclose(fp);
+}
+
+// One start: the prompt and the first command's output timed from fork
+
+static void start_once(const char *wsh, double *prompt, double *command) {
+    int in[2], out[2];
+    char buffer[4096], seen[8192];
+    size_t length = 0;
+    ssize_t n;
+    double start = now();
+
+    if (pipe(in) < 0 || pipe(out) < 0) {
+        perror("snapshot_bench");
+        exit(EXIT_FAILURE);
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(in[0], 0);
+        dup2(out[1], 1);
+        close(in[0]);
+        close(in[1]);
+        close(out[0]);
+        close(out[1]);
+        execl(wsh, wsh, (char*) NULL);
+        _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+    if (write(in[1], "echo ready\n", 11) != 11) {
+        perror("snapshot_bench");
+    }
+
+    *prompt = *command = -1;
+    while (*command < 0 && (n = read(out[0], buffer, sizeof(buffer))) > 0) {
+        if (length + n >= sizeof(seen)) {
+            break;
+        }
+        memcpy(seen + length, buffer, n);
+        length += n;
+        seen[length] = '\0';
+        if (*prompt < 0 && strstr(seen, "wsh> ") != NULL) {
+            *prompt = now() - start;
+        }
+        if (strstr(seen, "ready\n") != NULL) {
+            *command = now() - start;
+        }
+    }
+    close(in[1]);
+    close(out[0]);
+    waitpid(pid, NULL, 0);
+}
+
+static void bench(const char *name, const char *wsh, int iterations) {
+    double *prompts = malloc(iterations * sizeof(double));
+    double *commands_run = malloc(iterations * sizeof(double));
+    int i;
+
+    for (i = 0; i < iterations; i++) {
+        start_once(wsh, &prompts[i], &commands_run[i]);
+    }
+    qsort(prompts, iterations, sizeof(double), compare_double);
+    qsort(commands_run, iterations, sizeof(double), compare_double);
+    printf("%-10s first prompt p50 %8.1f us  p99 %8.1f us   first command p50 %8.1f us  p99 %8.1f us\n",
+           name, prompts[iterations / 2] * 1e6, prompts[iterations * 99 / 100] * 1e6,
+           commands_run[iterations / 2] * 1e6, commands_run[iterations * 99 / 100] * 1e6);
+    free(prompts);
+    free(commands_run);
+}
+
+int main(int argc, char **argv) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 300;
+    int variables = argc > 2 ? atoi(argv[2]) : 100;
+    const char *wsh = argc > 3 ? argv[3] : "./wsh";
+    char home[] = "/tmp/wsh_snapshot_bench", rc[64], snapshot[64], save[PATH_BUFSIZE];
+
+    if (access(wsh, X_OK) < 0) {
+        fprintf(stderr, "snapshot_bench: need %s\n", wsh);
+        return EXIT_FAILURE;
+    }
+    snprintf(rc, sizeof(rc), "%s/%s", home, RC_FILE);
+    snprintf(snapshot, sizeof(snapshot), "%s/%s", home, SNAPSHOT_FILE);
+    mkdir(home, 0755);
+    unlink(rc);
+    unlink(snapshot);
+    setenv("HOME", home, 1);
+    unsetenv("WSHRC");
+    unsetenv("WSH_SNAPSHOT");
+
+    bench("no rc", wsh, iterations);
+    write_rc(rc, variables);
+    bench("rc", wsh, iterations);
+    snprintf(save, sizeof(save), "%s --save-snapshot > /dev/null", wsh);
+    if (system(save) != 0) {
+        fprintf(stderr, "snapshot_bench: --save-snapshot failed\n");
+        return EXIT_FAILURE;
+    }
+    bench("snapshot", wsh, iterations);
+
+    unlink(snapshot);
+    unlink(rc);
+    rmdir(home);
+
+    return EXIT_SUCCESS;
+}
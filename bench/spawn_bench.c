@@ -0,0 +1,53 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../wsh.h"
+
+// Spawn throughput of the posix_spawn engine against the fork() fallback.
+// usage: spawn_bench [iterations] [ballast_mb]
+// The ballast is touched heap memory that stands in for a long-lived shell.
+
+extern struct shell_info *wsh_shell;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double run(int engine, int iterations) {
+    char line[64];
+    int i;
+
+    wsh_shell->spawn_engine = engine;
+
+    double start = now();
+    for (i = 0; i < iterations; i++) {
+        strcpy(line, "/bin/true");
+        wsh_launch_job(wsh_parse_command(line));
+    }
+    return iterations / (now() - start);
+}
+
+int main(int argc, char **argv) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 2000;
+    size_t ballast_mb = argc > 2 ? atoi(argv[2]) : 0;
+
+    wsh_init();
+
+    if (ballast_mb > 0) {
+        char *ballast = malloc(ballast_mb << 20);
+        memset(ballast, 1, ballast_mb << 20);
+    }
+
+    run(SPAWN_ENGINE_POSIX, iterations / 10 + 1);
+    double spawn_rate = run(SPAWN_ENGINE_POSIX, iterations);
+    double fork_rate = run(SPAWN_ENGINE_FORK, iterations);
+
+    printf("ballast: %zu MiB, iterations: %d\n", ballast_mb, iterations);
+    printf("posix_spawn: %10.0f spawns/sec\n", spawn_rate);
+    printf("fork:        %10.0f spawns/sec\n", fork_rate);
+
+    return EXIT_SUCCESS;
+}
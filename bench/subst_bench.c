@@ -0,0 +1,77 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "../wsh.h"
+
+// Scripts doing many $(...) of tiny commands, run in process by the wsh
+// script runner and, when installed, by dash and bash for reference:
+// a builtin (captured without forking) and an external command.
+// usage: subst_bench [builtin_count] [external_count]
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void write_script(const char *path, const char *line, int count) {
+    FILE *fp = fopen(path, "w");
+    int i;
+
+    if (fp == NULL) {
+        perror("subst_bench");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < count; i++) {
+        fprintf(fp, "%s\n", line);
+    }
+    fclose(fp);
+}
+
+static double run_shell(const char *shell, const char *path) {
+    double start = now();
+    int status;
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        execlp(shell, shell, path, (char*) NULL);
+        _exit(127);
+    }
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) != 127 ? now() - start : -1;
+}
+
+static void bench(const char *name, const char *line, int count) {
+    static const char *others[] = {"dash", "bash"};
+    char path[] = "/tmp/wsh_subst_bench.sh";
+    size_t i;
+
+    write_script(path, line, count);
+    double start = now();
+    wsh_run_script(path, 0);
+    double elapsed = now() - start;
+    printf("%-9s %6d x %-34s wsh  %8.1f ms  %6.2f us/subst\n", name, count, line, elapsed * 1e3, elapsed / count * 1e6);
+    for (i = 0; i < sizeof(others) / sizeof(others[0]); i++) {
+        elapsed = run_shell(others[i], path);
+        if (elapsed >= 0) {
+            printf("%-9s %6d x %-34s %-4s %8.1f ms  %6.2f us/subst\n", "", count, line, others[i],
+                   elapsed * 1e3, elapsed / count * 1e6);
+        }
+    }
+    unlink(path);
+}
+
+int main(int argc, char **argv) {
+    int builtin_count = argc > 1 ? atoi(argv[1]) : 10000;
+    int external_count = argc > 2 ? atoi(argv[2]) : 10000;
+
+    wsh_shell_init();
+    bench("builtin", "echo $(echo x) > /dev/null", builtin_count);
+    bench("quoted", "echo \"$(printf '%s' x)\" > /dev/null", builtin_count);
+    bench("external", "echo $(/bin/echo x) > /dev/null", external_count);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,373 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "../wsh.h"
+
+// Microbenchmark suite for the shell internals. Every case is calibrated
+// until one sample runs for at least --min-ms, warmed up once, then
+// sampled --samples times; the median is the figure to compare. Results
+// are one JSON object per line with --json, and --baseline file marks
+// cases whose median moved past --threshold percent against a previous
+// run (exit status 1 on a regression).
+// usage: suite_bench [--json] [--filter text] [--samples n] [--min-ms n]
+//                    [--baseline file] [--threshold pct]
+
+struct bench_case {
+    const char *name;
+    void (*run)(long iterations, long param);
+    long param;
+};
+
+struct bench_result {
+    long iterations;
+    double min;
+    double median;
+    double max;
+};
+
+static const char *corpus[] = {
+    "ls -la",
+    "git log --oneline -n 20 | head -5",
+    "grep -rn TODO src include | sort | uniq -c | sort -rn | head -20",
+    "tar -czf /tmp/backup.tar.gz /etc/nginx /etc/ssl > /tmp/backup.log",
+    "sort < /var/log/syslog | uniq | wc -l",
+    "make -j8 all > build.log &",
+    "echo 'quoted words' \"and $HOME\" with\\ escapes",
+    "cp -r build/release /opt/app/releases/2024-10-01",
+};
+
+static const char *glob_line = "ls src/*.c include/*.h lib/**/*.o test_[0-9]*.sh {alpha,beta}/*.txt ?.md";
+
+extern struct shell_info *wsh_shell;
+
+#define CORPUS_SIZE (sizeof(corpus) / sizeof(corpus[0]))
+#define GLOB_ROOT "/tmp/wsh_suite_bench"
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double*) a, y = *(const double*) b;
+    return x < y ? -1 : x > y;
+}
+
+static void parse_line(const char *text) {
+    char line[COMMAND_BUFSIZE];
+
+    strcpy(line, text);
+    free_job(wsh_parse_command(line));
+}
+
+static void bench_parse(long iterations, long param) {
+    long i;
+
+    for (i = 0; i < iterations; i++) {
+        parse_line(corpus[param >= 0 ? param : i % (long) CORPUS_SIZE]);
+    }
+}
+
+static void bench_parse_glob(long iterations, long param) {
+    long i;
+
+    for (i = 0; i < iterations; i++) {
+        parse_line(glob_line);
+    }
+}
+
+static void bench_glob(long iterations, long param) {
+    struct arena *arena = arena_create();
+    static const char *patterns[] = {"d*/f1*.c", "d1?/*", "**/f7.h", "d{1,2,3}/f[0-4].c"};
+    char **results;
+    long i;
+
+    for (i = 0; i < iterations; i++) {
+        wsh_glob(patterns[i % 4], arena, &results);
+        if (i % 64 == 63) {
+            arena_release(arena);
+            arena = arena_create();
+        }
+    }
+    arena_release(arena);
+}
+
+// Job table operations with param jobs already live: one insert and
+// remove of an extra job plus a pid lookup, per iteration
+
+static struct job **live_jobs;
+static long live_count;
+
+static void jobs_fill(long count) {
+    char line[32];
+    long i;
+
+    while (live_count > 0) {
+        remove_job(live_jobs[--live_count]->id);
+    }
+    free(live_jobs);
+    live_jobs = malloc(count * sizeof(struct job*));
+    for (i = 0; i < count; i++) {
+        strcpy(line, "sleep 1");
+        live_jobs[i] = wsh_parse_command(line);
+        live_jobs[i]->root->pid = 1000000 + i;
+        insert_job(live_jobs[i]);
+        pid_index_insert(live_jobs[i]->root->pid, live_jobs[i]->id, live_jobs[i]->root);
+    }
+    live_count = count;
+}
+
+static void bench_jobs(long iterations, long param) {
+    char line[32];
+    long i;
+
+    if (live_count != param) {
+        jobs_fill(param);
+    }
+    for (i = 0; i < iterations; i++) {
+        strcpy(line, "sleep 1");
+        struct job *job = wsh_parse_command(line);
+        job->root->pid = 900000;
+        int id = insert_job(job);
+        pid_index_insert(job->root->pid, id, job->root);
+        if (get_job_id_by_pid(1000000 + (int) ((i * 7919) % param)) < 0 || get_job_id_by_pid(900000) != id) {
+            fprintf(stderr, "suite_bench: job lookup failed\n");
+            exit(EXIT_FAILURE);
+        }
+        remove_job(id);
+    }
+}
+
+// Deadline heap with param running jobs holding a timeout: one deadline
+// dropped and re-added per iteration (the timerfd is only re-armed when
+// the earliest deadline changes)
+
+static void bench_timers(long iterations, long param) {
+    long i, now = wsh_timer_now();
+
+    if (live_count != param || wsh_shell->timer_count != param) {
+        jobs_fill(param);
+        for (i = 0; i < param; i++) {
+            wsh_timer_add(live_jobs[i], now + 3600000 + (i * 7919) % 1000000, 0);
+        }
+    }
+    for (i = 0; i < iterations; i++) {
+        struct job *job = live_jobs[(i * 7919) % param];
+        wsh_timer_remove(job);
+        wsh_timer_add(job, now + 3600000 + (i * 104729) % 1000000, 0);
+    }
+}
+
+// Launch latency: a foreground job of param /bin/true stages, so 1 is
+// the spawn path of wsh_launch_process and more is pipeline setup too
+
+static void bench_launch(long iterations, long param) {
+    char line[COMMAND_BUFSIZE];
+    long i, j;
+
+    if (live_count > 0) {
+        jobs_fill(0);
+    }
+    for (i = 0; i < iterations; i++) {
+        line[0] = '\0';
+        for (j = 0; j < param; j++) {
+            strcat(line, j > 0 ? " | /bin/true" : "/bin/true");
+        }
+        wsh_launch_job(wsh_parse_command(line));
+    }
+}
+
+static const struct bench_case cases[] = {
+    {"parse/simple", bench_parse, 0},
+    {"parse/pipeline", bench_parse, 2},
+    {"parse/redirect", bench_parse, 4},
+    {"parse/quoted", bench_parse, 6},
+    {"parse/corpus", bench_parse, -1},
+    {"parse/glob-tokens", bench_parse_glob, 0},
+    {"glob/expand-warm", bench_glob, 0},
+    {"jobs/10", bench_jobs, 10},
+    {"jobs/1k", bench_jobs, 1000},
+    {"jobs/10k", bench_jobs, 10000},
+    {"timers/10", bench_timers, 10},
+    {"timers/10k", bench_timers, 10000},
+    {"launch/spawn", bench_launch, 1},
+    {"launch/pipeline-2", bench_launch, 2},
+    {"launch/pipeline-8", bench_launch, 8},
+};
+
+#define CASE_COUNT (sizeof(cases) / sizeof(cases[0]))
+
+static void make_glob_tree() {
+    struct timespec past[2] = {{0, UTIME_OMIT}, {0, 0}};
+    char path[128];
+    int i, j;
+
+    past[1].tv_sec = time(NULL) - 60;     // listings of fresh dirs are never cached
+    mkdir(GLOB_ROOT, 0755);
+    for (i = 0; i < 20; i++) {
+        snprintf(path, sizeof(path), "%s/d%d", GLOB_ROOT, i);
+        mkdir(path, 0755);
+        for (j = 0; j < 50; j++) {
+            snprintf(path, sizeof(path), "%s/d%d/f%d.%s", GLOB_ROOT, i, j, j % 2 ? "h" : "c");
+            close(open(path, O_WRONLY|O_CREAT, 0644));
+        }
+        snprintf(path, sizeof(path), "%s/d%d", GLOB_ROOT, i);
+        utimensat(AT_FDCWD, path, past, 0);
+    }
+    utimensat(AT_FDCWD, GLOB_ROOT, past, 0);
+}
+
+static void remove_glob_tree() {
+    char path[128];
+    int i, j;
+
+    for (i = 0; i < 20; i++) {
+        for (j = 0; j < 50; j++) {
+            snprintf(path, sizeof(path), "%s/d%d/f%d.%s", GLOB_ROOT, i, j, j % 2 ? "h" : "c");
+            unlink(path);
+        }
+        snprintf(path, sizeof(path), "%s/d%d", GLOB_ROOT, i);
+        rmdir(path);
+    }
+    rmdir(GLOB_ROOT);
+}
+
+static struct bench_result measure(const struct bench_case *c, int samples, double min_time) {
+    struct bench_result result;
+    double *times = malloc(samples * sizeof(double)), start, elapsed;
+    long iterations = 1;
+    int i;
+
+    while (1) {              // calibration, doubles as the warm-up
+        start = now();
+        c->run(iterations, c->param);
+        elapsed = now() - start;
+        if (elapsed >= min_time) {
+            break;
+        }
+        iterations = elapsed > min_time / 16 ? (long) (iterations * min_time / elapsed) + 1 : iterations * 16;
+    }
+
+    for (i = 0; i < samples; i++) {
+        start = now();
+        c->run(iterations, c->param);
+        times[i] = (now() - start) / iterations;
+    }
+    qsort(times, samples, sizeof(double), compare_double);
+
+    result.iterations = iterations;
+    result.min = times[0];
+    result.median = times[samples / 2];
+    result.max = times[samples - 1];
+    free(times);
+
+    return result;
+}
+
+// Getting a case's median from a previous --json run, -1 when absent
+
+static double baseline_median(const char *path, const char *name) {
+    FILE *fp = path != NULL ? fopen(path, "r") : NULL;
+    char line[512], key[128];
+    double median = -1;
+
+    if (fp == NULL) {
+        return -1;
+    }
+    snprintf(key, sizeof(key), "\"name\":\"%s\"", name);
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        char *field = strstr(line, "\"median_ns\":");
+        if (strstr(line, key) != NULL && field != NULL) {
+            median = atof(field + strlen("\"median_ns\":"));
+            break;
+        }
+    }
+    fclose(fp);
+
+    return median;
+}
+
+int main(int argc, char **argv) {
+    const char *filter = NULL, *baseline = NULL;
+    int json = 0, samples = 7, regressions = 0, i;
+    double min_time = 0.05, threshold = 10;
+    size_t c;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0) {
+            json = 1;
+        } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (strcmp(argv[i], "--samples") == 0 && i + 1 < argc) {
+            samples = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--min-ms") == 0 && i + 1 < argc) {
+            min_time = atof(argv[++i]) / 1e3;
+        } else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+            baseline = argv[++i];
+        } else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) {
+            threshold = atof(argv[++i]);
+        } else {
+            fprintf(stderr, "usage: suite_bench [--json] [--filter text] [--samples n] [--min-ms n] "
+                            "[--baseline file] [--threshold pct]\n");
+            return EXIT_FAILURE;
+        }
+    }
+    if (samples < 1) {
+        samples = 1;
+    }
+
+    char cwd[PATH_BUFSIZE];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        strcpy(cwd, "/");
+    }
+    unsetenv("WSH_TRACE");
+    wsh_shell_init();
+    make_glob_tree();
+    if (chdir(GLOB_ROOT) < 0) {
+        perror("suite_bench");
+        return EXIT_FAILURE;
+    }
+
+    for (c = 0; c < CASE_COUNT; c++) {
+        if (filter != NULL && strstr(cases[c].name, filter) == NULL) {
+            continue;
+        }
+        struct bench_result result = measure(&cases[c], samples, min_time);
+        double previous = baseline_median(baseline, cases[c].name);
+        double change = previous > 0 ? (result.median * 1e9 - previous) / previous * 100 : 0;
+        int regressed = previous > 0 && change > threshold;
+        regressions += regressed;
+
+        if (json) {
+            printf("{\"name\":\"%s\",\"iterations\":%ld,\"samples\":%d,\"min_ns\":%.1f,\"median_ns\":%.1f,"
+                   "\"max_ns\":%.1f", cases[c].name, result.iterations, samples,
+                   result.min * 1e9, result.median * 1e9, result.max * 1e9);
+            if (previous > 0) {
+                printf(",\"baseline_ns\":%.1f,\"change_pct\":%.1f,\"regression\":%s",
+                       previous, change, regressed ? "true" : "false");
+            }
+            printf("}\n");
+        } else {
+            printf("%-20s %12.1f ns  (min %.1f, max %.1f, %ld iterations x %d)", cases[c].name,
+                   result.median * 1e9, result.min * 1e9, result.max * 1e9, result.iterations, samples);
+            if (previous > 0) {
+                printf("  %+.1f%%%s", change, regressed ? "  REGRESSION" : "");
+            }
+            printf("\n");
+        }
+        fflush(stdout);
+    }
+
+    jobs_fill(0);
+    if (chdir(cwd) < 0) {
+        perror("suite_bench");
+    }
+    remove_glob_tree();
+
+    return regressions > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,67 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../wsh.h"
+
+// Cost of the trace probes: the per-probe cost with tracing off against
+// an empty loop, then a parse+launch loop of an in-shell builtin (the
+// path with the most probes per unit of work) with tracing off and on.
+// usage: trace_bench [iterations]
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double run_lines(int iterations) {
+    char line[64];
+    int i;
+
+    double start = now();
+    for (i = 0; i < iterations; i++) {
+        strcpy(line, "true");
+        wsh_launch_job(wsh_parse_command(line));
+    }
+    return (now() - start) / iterations;
+}
+
+int main(int argc, char **argv) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 200000, i;
+    volatile long sink = 0;
+    char trace_path[] = "/tmp/wsh_trace_bench.json";
+
+    unsetenv("WSH_TRACE");
+    wsh_shell_init();
+
+    double start = now();
+    for (i = 0; i < iterations * 10; i++) {
+        __asm__ volatile("" ::: "memory");     // wsh_tracing is reloaded every time
+        sink += i;
+    }
+    double empty = (now() - start) / (iterations * 10);
+
+    start = now();
+    for (i = 0; i < iterations * 10; i++) {
+        __asm__ volatile("" ::: "memory");
+        TRACE_START(trace_start);
+        sink += i;
+        TRACE_SPAN("bench", 0, trace_start, NULL);
+    }
+    double probed = (now() - start) / (iterations * 10);
+
+    run_lines(iterations / 10);
+    double off = run_lines(iterations);
+    wsh_trace_init(trace_path);
+    double on = run_lines(iterations);
+    wsh_trace_close();
+
+    printf("probe, tracing off: %6.2f ns (empty loop %.2f ns)\n", probed * 1e9, empty * 1e9);
+    printf("parse+launch, off:  %8.1f ns/line\n", off * 1e9);
+    printf("parse+launch, on:   %8.1f ns/line\n", on * 1e9);
+    unlink(trace_path);
+
+    return EXIT_SUCCESS;
+}
@@ -1,41 +1,232 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <ctype.h>
 #include <unistd.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <spawn.h>
 #include <string.h>
+#include <strings.h>
 #include <signal.h>
 #include <pwd.h>
-#include <glob.h>
+#include <dirent.h>
 #include <sys/wait.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/signalfd.h>
+#include <sys/mman.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <termios.h>
 #include "wsh.h"
 
+extern char **environ;
+
 struct shell_info *wsh_shell;
+const char *STATUS_STRING[] = {"Running", "Done", "Suspended", "Continued", "Terminated", "Queued", "Timed out"};
+struct alloc_stats wsh_alloc_stats;
+static struct arena *arena_pool;
 
-// Getting the job id by process id
+// Getting an arena, recycled from the pool when one is available
 
-int get_job_id_by_pid(int pid) {
-    int i;
-    struct process *proc;
+struct arena *arena_create() {
+    struct arena *arena = arena_pool;
 
-    for (i = 1; i <= MAX_JOBS; i++) {
-        if (wsh_shell->jobs[i] != NULL) {
-            for (proc = wsh_shell->jobs[i]->root; proc != NULL; proc = proc->next) {
-                if (proc->pid == pid) {
-                    return i;
-                }
-            }
+    if (arena != NULL) {
+        arena_pool = arena->next_free;
+        wsh_alloc_stats.arenas_pooled--;
+        wsh_alloc_stats.arenas_reused++;
+    } else {
+        arena = (struct arena*) malloc(sizeof(struct arena));
+        if (!arena) {
+            fprintf(stderr, "wsh: allocation error");
+            exit(EXIT_FAILURE);
+        }
+        arena->head = NULL;
+        wsh_alloc_stats.arenas_created++;
+    }
+
+    arena->next_free = NULL;
+    wsh_alloc_stats.arenas_live++;
+    return arena;
+}
+
+// Allocating from an arena, a fresh chunk is chained when the head is full
+
+void *arena_alloc(struct arena *arena, size_t size) {
+    struct arena_chunk *chunk = arena->head;
+
+    size = (size + 15) & ~(size_t) 15;
+    if (chunk == NULL || chunk->used + size > chunk->size) {
+        size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        chunk = (struct arena_chunk*) malloc(sizeof(struct arena_chunk) + chunk_size);
+        if (!chunk) {
+            fprintf(stderr, "wsh: allocation error");
+            exit(EXIT_FAILURE);
+        }
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        chunk->next = arena->head;
+        arena->head = chunk;
+        wsh_alloc_stats.chunk_mallocs++;
+    }
+
+    void *ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    wsh_alloc_stats.allocations++;
+    wsh_alloc_stats.bytes += size;
+    return ptr;
+}
+
+char *arena_strndup(struct arena *arena, const char *str, size_t length) {
+    char *copy = (char*) arena_alloc(arena, length + 1);
+
+    memcpy(copy, str, length);
+    copy[length] = '\0';
+    return copy;
+}
+
+char *arena_strdup(struct arena *arena, const char *str) {
+    return arena_strndup(arena, str, strlen(str));
+}
+
+// Releasing an arena: one chunk is kept and the arena goes back to the pool
+
+void arena_release(struct arena *arena) {
+    struct arena_chunk *chunk, *tmp;
+
+    if (arena == NULL) {
+        return;
+    }
+
+    int pooled = wsh_alloc_stats.arenas_pooled < ARENA_POOL_MAX;
+    for (chunk = arena->head; chunk != NULL; chunk = tmp) {
+        tmp = chunk->next;
+        if (pooled && tmp == NULL && chunk->size == ARENA_CHUNK_SIZE) {
+            chunk->used = 0;
+            arena->head = chunk;
+            break;
+        }
+        free(chunk);
+        arena->head = NULL;
+    }
+    wsh_alloc_stats.arenas_live--;
+
+    if (pooled) {
+        arena->next_free = arena_pool;
+        arena_pool = arena;
+        wsh_alloc_stats.arenas_pooled++;
+    } else {
+        free(arena);
+    }
+}
+
+// Looking up a process in the pid index, open addressing with linear probing
+
+static int pid_index_find(pid_t pid) {
+    unsigned int mask = wsh_shell->pid_index_size - 1;
+    unsigned int i = ((unsigned int) pid * 2654435761u) & mask;
+
+    while (wsh_shell->pid_index[i].pid != 0) {
+        if (wsh_shell->pid_index[i].pid == pid) {
+            return i;
         }
+        i = (i + 1) & mask;
     }
 
     return -1;
 }
 
+// Adding a launched process to the pid index, growing it at half load
+
+void pid_index_insert(pid_t pid, int job_id, struct process *proc) {
+    if (pid <= 0) {
+        return;
+    }
+
+    if ((wsh_shell->pid_index_count + 1) * 2 > wsh_shell->pid_index_size) {
+        struct pid_slot *old = wsh_shell->pid_index;
+        int i, old_size = wsh_shell->pid_index_size;
+
+        wsh_shell->pid_index_size *= 2;
+        wsh_shell->pid_index = (struct pid_slot*) calloc(wsh_shell->pid_index_size, sizeof(struct pid_slot));
+        if (!wsh_shell->pid_index) {
+            fprintf(stderr, "wsh: allocation error");
+            exit(EXIT_FAILURE);
+        }
+        wsh_shell->pid_index_count = 0;
+        for (i = 0; i < old_size; i++) {
+            if (old[i].pid != 0) {
+                pid_index_insert(old[i].pid, old[i].job_id, old[i].proc);
+            }
+        }
+        free(old);
+    }
+
+    unsigned int mask = wsh_shell->pid_index_size - 1;
+    unsigned int i = ((unsigned int) pid * 2654435761u) & mask;
+    while (wsh_shell->pid_index[i].pid != 0 && wsh_shell->pid_index[i].pid != pid) {
+        i = (i + 1) & mask;
+    }
+    if (wsh_shell->pid_index[i].pid == 0) {
+        wsh_shell->pid_index_count++;
+    }
+    wsh_shell->pid_index[i].pid = pid;
+    wsh_shell->pid_index[i].job_id = job_id;
+    wsh_shell->pid_index[i].proc = proc;
+}
+
+// Removing a process from the pid index, shifting the probe chain back
+
+void pid_index_remove(pid_t pid) {
+    int i = pid_index_find(pid);
+
+    if (i < 0) {
+        return;
+    }
+
+    unsigned int mask = wsh_shell->pid_index_size - 1;
+    unsigned int hole = i, j = i;
+    while (1) {
+        j = (j + 1) & mask;
+        if (wsh_shell->pid_index[j].pid == 0) {
+            break;
+        }
+        unsigned int home = ((unsigned int) wsh_shell->pid_index[j].pid * 2654435761u) & mask;
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            wsh_shell->pid_index[hole] = wsh_shell->pid_index[j];
+            hole = j;
+        }
+    }
+    wsh_shell->pid_index[hole].pid = 0;
+    wsh_shell->pid_index_count--;
+}
+
+// Getting the job id by process id
+
+int get_job_id_by_pid(int pid) {
+    int i = pid_index_find(pid);
+
+    if (i < 0) {
+        return -1;
+    }
+
+    return wsh_shell->pid_index[i].job_id;
+}
+
 // Getting the job by id
 
 struct job* get_job_by_id(int id) {
-    if (id > MAX_JOBS) {
+    if (id <= 0 || id >= wsh_shell->jobs_capacity) {
         return NULL;
     }
 
@@ -57,32 +248,26 @@ int get_pgid_by_job_id(int id) {
 // Releasing the job
 
 int release_job(int id) {
-    if (id > MAX_JOBS || wsh_shell->jobs[id] == NULL) {
+    struct job *job = get_job_by_id(id);
+
+    if (job == NULL) {
         return -1;
     }
 
-    struct job *job = wsh_shell->jobs[id];
-    struct process *proc, *tmp;
-    for (proc = job->root; proc != NULL; ) {
-        tmp = proc->next;        
-        free(proc->output_path);
-        free(proc->command);
-        free(proc->argv);
-        free(proc->input_path);
-        free(proc);
-        proc = tmp;
-    }
+    free_job(job);
+    return 0;
+}
 
-    free(job->command);
-    free(job);
+// Freeing a job that is not (or no longer) in the job table
 
-    return 0;
+void free_job(struct job *job) {
+    arena_release(job->arena);
 }
 
 // Getting the process count
 
 int get_proc_count(int id, int filter) {
-    if (id > MAX_JOBS || wsh_shell->jobs[id] == NULL) {
+    if (get_job_by_id(id) == NULL) {
         return -1;
     }
 
@@ -99,99 +284,165 @@ int get_proc_count(int id, int filter) {
     return count;
 }
 
-// Getting the next job id
+// Getting the next job id, the lowest clear bit of the id bitmap
+
 int get_next_job_id() {
+    int words = wsh_shell->jobs_capacity / JOB_ID_WORD_BITS;
     int i;
-    int used[MAX_JOBS + 1]; // An array to keep track of used job IDs
 
-    for (i = 1; i <= MAX_JOBS; i++) {
-        used[i] = 0; // Initialize all IDs as unused
-        if (wsh_shell->jobs[i] != NULL) {
-            used[wsh_shell->jobs[i]->id] = 1; // Mark used IDs
+    for (i = wsh_shell->job_id_hint; i < words; i++) {
+        if (~wsh_shell->job_id_map[i] != 0) {
+            wsh_shell->job_id_hint = i;
+            return i * JOB_ID_WORD_BITS + __builtin_ctzl(~wsh_shell->job_id_map[i]);
         }
     }
 
-    for (i = 1; i <= MAX_JOBS; i++) {
-        if (!used[i]) {
-            return i; // Return the first unused ID
+    wsh_shell->job_id_hint = words;
+    return wsh_shell->jobs_capacity;   // table is full, insert_job grows it
+}
+
+// Getting the highest job id in use, the default target of fg and bg
+
+int get_last_job_id() {
+    int i;
+
+    for (i = wsh_shell->jobs_capacity / JOB_ID_WORD_BITS - 1; i >= 0; i--) {
+        unsigned long word = wsh_shell->job_id_map[i];
+        if (i == 0) {
+            word &= ~1UL;             // id 0 is never handed out
+        }
+        if (word != 0) {
+            return i * JOB_ID_WORD_BITS + JOB_ID_WORD_BITS - 1 - __builtin_clzl(word);
         }
     }
 
-    return -1; // No available IDs
+    return -1;
 }
 
-// Getting the job id
+// Getting the id of the running (or queued) job named %name, -1 if none
 
-int small_job_id(){
-    int id;
-    int found = 0;
+int get_job_id_by_name(const char *name) {
+    int i;
 
-    while (!found && id <= MAX_JOBS)
-    {
-        found = 1;
-        for (int i=0; i<MAX_JOBS; i++)
-        {
-            if (wsh_shell->jobs[i]->job_id == id)
-            {
-                found = 0;
-                break;
-            }
-        }
-        if (!found)
-        {
-            id++;
+    for (i = 1; i < wsh_shell->jobs_capacity; i++) {
+        struct job *job = wsh_shell->jobs[i];
+        if (job != NULL && job->name != NULL && strcmp(job->name, name) == 0) {
+            return i;
         }
     }
 
-    if (id > MAX_JOBS)
-    {
-        return -1;
-    }
-    else
-    {
-        return id;
+    return -1;
+}
+
+// Keeping the exit code of a finished background job for wait, in a ring
+// of the most recent ones
+
+static void job_result_record(struct job *job) {
+    struct job_result *result = &wsh_shell->job_results[wsh_shell->job_result_next];
+
+    free(result->name);
+    result->job_id = job->id;
+    result->pgid = job->pgid;
+    result->name = job->name != NULL ? strdup(job->name) : NULL;
+    result->status = wsh_exit_code(job);
+    wsh_shell->job_result_next = (wsh_shell->job_result_next + 1) % JOB_RESULTS_MAX;
+}
+
+// Finding the kept result for %N, %name or a pid, the newest first
+
+static struct job_result *job_result_find(const char *spec) {
+    int i;
+
+    for (i = 1; i <= JOB_RESULTS_MAX; i++) {
+        struct job_result *result =
+            &wsh_shell->job_results[(wsh_shell->job_result_next - i + JOB_RESULTS_MAX) % JOB_RESULTS_MAX];
+        if (result->job_id <= 0) {
+            continue;
+        }
+        if (spec[0] == '%' && isdigit((unsigned char) spec[1]) ? result->job_id == atoi(spec + 1) :
+            spec[0] == '%' ? result->name != NULL && strcmp(result->name, spec + 1) == 0 :
+            result->pgid == atoi(spec)) {
+            return result;
+        }
     }
-    
+
+    return NULL;
 }
 
 // Removing the job
 
 int remove_job(int id) {
-    if (id > MAX_JOBS || wsh_shell->jobs[id] == NULL) {
+    struct job *job = get_job_by_id(id);
+    struct process *proc;
+
+    if (job == NULL) {
         return -1;
     }
 
+    wsh_timer_remove(job);
+    if (job->sched_counted) {
+        wsh_shell->sched_running--;
+    }
+    if (job->mode == BACKGROUND_EXECUTION && is_job_completed(id)) {
+        job_result_record(job);
+    }
+    if (job->root->status == STATUS_QUEUED) {
+        wsh_sched_dequeue(job);
+    } else if (job->timed && is_job_completed(id)) {
+        wsh_time_report(job);
+    }
+    for (proc = job->root; proc != NULL; proc = proc->next) {
+        if (proc->pid > 0) {
+            pid_index_remove(proc->pid);
+        }
+    }
+
     release_job(id);
     wsh_shell->jobs[id] = NULL;
+    wsh_shell->job_id_map[id / JOB_ID_WORD_BITS] &= ~(1UL << (id % JOB_ID_WORD_BITS));
+    if (id / JOB_ID_WORD_BITS < wsh_shell->job_id_hint) {
+        wsh_shell->job_id_hint = id / JOB_ID_WORD_BITS;
+    }
 
     return 0;
 }
 
-// Inserting the job
+// Inserting the job, doubling the table when every id is taken
 
 int insert_job(struct job *job) {
     int id = get_next_job_id();
-    //int job_id = -1;
 
-    if (id < 0) {
-        return -1;
+    if (id >= wsh_shell->jobs_capacity) {
+        int capacity = wsh_shell->jobs_capacity * 2;
+        struct job **jobs = (struct job**) realloc(wsh_shell->jobs, capacity * sizeof(struct job*));
+        unsigned long *map = (unsigned long*) realloc(wsh_shell->job_id_map, capacity / 8);
+        if (!jobs || !map) {
+            fprintf(stderr, "wsh: allocation error");
+            exit(EXIT_FAILURE);
+        }
+        memset(jobs + wsh_shell->jobs_capacity, 0, wsh_shell->jobs_capacity * sizeof(struct job*));
+        memset((char*) map + wsh_shell->jobs_capacity / 8, 0, wsh_shell->jobs_capacity / 8);
+        wsh_shell->jobs = jobs;
+        wsh_shell->job_id_map = map;
+        wsh_shell->jobs_capacity = capacity;
     }
-    
+
     job->id = id;
     wsh_shell->jobs[id] = job;
+    wsh_shell->job_id_map[id / JOB_ID_WORD_BITS] |= 1UL << (id % JOB_ID_WORD_BITS);
     return id;
 }
 
 // Checking if the job is completed
 
 int is_job_completed(int id) {
-    if (id > MAX_JOBS || wsh_shell->jobs[id] == NULL) {
+    if (get_job_by_id(id) == NULL) {
         return 0;
     }
 
     struct process *proc;
     for (proc = wsh_shell->jobs[id]->root; proc != NULL; proc = proc->next) {
-        if (proc->status != STATUS_DONE) {
+        if (proc->status != STATUS_DONE && proc->status != STATUS_TERMINATED && proc->status != STATUS_TIMEDOUT) {
             return 0;
         }
     }
@@ -199,49 +450,47 @@ int is_job_completed(int id) {
     return 1;
 }
 
+// Getting the process by process id
+
+struct process *get_process_by_pid(int pid) {
+    int i = pid_index_find(pid);
+
+    if (i < 0) {
+        return NULL;
+    }
+
+    return wsh_shell->pid_index[i].proc;
+}
+
 // Setting the status of the process
 
 int set_process_status(int pid, int status) {
-    int i;
-    struct process *proc;
+    struct process *proc = get_process_by_pid(pid);
 
-    for (i = 1; i <= MAX_JOBS; i++) {
-        if (wsh_shell->jobs[i] == NULL) {
-            continue;
-        }
-        for (proc = wsh_shell->jobs[i]->root; proc != NULL; proc = proc->next) {
-            if (proc->pid == pid) {
-                proc->status = status;
-                return 0;
-            }
-        }
+    if (proc == NULL) {
+        return -1;
     }
 
-    return -1;
+    proc->status = status;
+    return 0;
 }
 
 // Waiting for the process to complete
 
 int wait_for_pid(int pid) {
-    int status = 0;
+    int job_id = get_job_id_by_pid(pid);
 
-    waitpid(pid, &status, WUNTRACED);
-    if (WIFEXITED(status)) {
-        set_process_status(pid, STATUS_DONE);
-    } else if (WIFSIGNALED(status)) {
-        set_process_status(pid, STATUS_TERMINATED);
-    } else if (WSTOPSIG(status)) {
-        status = -1;
-        set_process_status(pid, STATUS_SUSPENDED);
+    if (job_id < 0) {
+        return -1;
     }
 
-    return status;
+    return wait_for_job(job_id);
 }
 
 // Setting the status of the jobs
 
 int set_job_status(int id, int status) {
-    if (id > MAX_JOBS || wsh_shell->jobs[id] == NULL) {
+    if (get_job_by_id(id) == NULL) {
         return -1;
     }
 
@@ -253,6 +502,7 @@ int set_job_status(int id, int status) {
             proc->status = status;
         }
     }
+    wsh_sched_account(wsh_shell->jobs[id]);
 
     return 0;
 }
@@ -260,16 +510,28 @@ int set_job_status(int id, int status) {
 // Printing the status of the jobs the print response when jobs command is run
 
 int print_job_status(int id) {
-    if (id > MAX_JOBS || wsh_shell->jobs[id] == NULL) {
+    if (get_job_by_id(id) == NULL) {
         return -1;
     }
 
     printf("%d: ", id);
+    if (wsh_shell->jobs[id]->root->status == STATUS_QUEUED) {
+        printf("(%s) ", STATUS_STRING[STATUS_QUEUED]);
+    } else if (wsh_shell->jobs[id]->timed_out) {
+        printf("(%s) ", STATUS_STRING[STATUS_TIMEDOUT]);
+    }
+
+    struct parallel *run = wsh_shell->jobs[id]->parallel;
+    if (run != NULL) {
+        printf("parallel %s [%d/%d done, %d failed, %d steals]\n",
+               wsh_shell->jobs[id]->command, run->finished, run->task_count, run->failed, run->steals);
+        return 0;
+    }
 
     struct process *proc;
-    for (proc = wsh_shell ->jobs[id]->root; proc != NULL; proc = proc->next) {
+    for (proc = wsh_shell ->jobs[id]->root; proc != NULL && !proc->plumbing; proc = proc->next) {
         printf("%s\n",proc->command);
-        if (proc->next != NULL) {
+        if (proc->next != NULL && !proc->next->plumbing) {
             printf("|");
         }
     }
@@ -277,61 +539,220 @@ int print_job_status(int id) {
     return 0;
 }
 
-// Waiting for jobs
+// Waiting for jobs, the event loop reaps the children and we only watch
+// the job's processes until none of them is running any more
 
 int wait_for_job(int id) {
-    if (id > MAX_JOBS || wsh_shell->jobs[id] == NULL) {
+    struct job *job = get_job_by_id(id);
+    struct process *proc;
+    TRACE_START(trace_start);
+
+    if (job == NULL) {
         return -1;
     }
 
-    int proc_count = get_proc_count(id, PROC_FILTER_REMAINING);
-    int wait_pid = -1, wait_count = 0;
-    int status = 0;
+    while (1) {
+        int running = job->parallel != NULL && job->root->status == STATUS_RUNNING, suspended = 0;
+        for (proc = job->root; proc != NULL; proc = proc->next) {
+            if (proc->pid <= 0) {
+                continue;
+            }
+            if (proc->status == STATUS_RUNNING || proc->status == STATUS_CONTINUED) {
+                running = 1;
+            } else if (proc->status == STATUS_SUSPENDED) {
+                suspended = 1;
+            }
+        }
 
-    do {
-        wait_pid = waitpid(-wsh_shell->jobs[id]->pgid, &status, WUNTRACED);
-        wait_count++;
-
-        if (WIFEXITED(status)) {
-            set_process_status(wait_pid, STATUS_DONE);
-        } else if (WIFSIGNALED(status)) {
-            set_process_status(wait_pid, STATUS_TERMINATED);
-        } else if (WSTOPSIG(status)) {
-            status = -1;
-            set_process_status(wait_pid, STATUS_SUSPENDED);
+        if (!running) {
+            if (suspended) {
+                job->mode = BACKGROUND_EXECUTION;
+                wsh_sched_account(job);
+                TRACE_SPAN("wait", id, trace_start, "suspended");
+                return -1;
+            }
+            break;
         }
-    } while (wait_count < proc_count);
+
+        wsh_event_wait_child(-1);
+    }
+
+    int status = 0;
+    for (proc = job->root; proc != NULL && !proc->plumbing; proc = proc->next) {
+        status = proc->exit_status;
+    }
+    TRACE_SPAN("wait", id, trace_start, NULL);
 
     return status;
 }
 
-// Extracting the type of commands from the command line
+// Prefix builtins take their arguments off the first stage of a job and
+// return how many they used, 0 when the words are not a prefix use
 
-int get_command_type(char *command) {
-    if (strcmp(command, "exit") == 0) {
-        return COMMAND_EXIT;
-    } else if (strcmp(command, "cd") == 0) {
-        return COMMAND_CD;
-    } else if (strcmp(command, "jobs") == 0) {
-        return COMMAND_JOBS;
-    } else if (strcmp(command, "fg") == 0) {
-        return COMMAND_FG;
-    } else if (strcmp(command, "bg") == 0) {
-        return COMMAND_BG;
-    } else {
-        return COMMAND_EXTERNAL;
+static int prefix_pipesize(struct job *job, int argc, char **argv) {
+    long size;
+
+    if (argc <= 2 || (size = wsh_parse_size(argv[1])) < 0) {
+        return 0;
+    }
+    job->pipe_size = size;
+    return 2;
+}
+
+static int prefix_prio(struct job *job, int argc, char **argv) {
+    char *end;
+    long priority;
+
+    if (argc <= 2) {
+        return 0;
+    }
+    priority = strtol(argv[1], &end, 10);
+    if (*end != '\0' || priority < -20 || priority > 19) {
+        return 0;
+    }
+    job->priority = priority;
+    return 2;
+}
+
+static int prefix_timeout(struct job *job, int argc, char **argv) {
+    long timeout;
+
+    if (argc <= 2 || (timeout = wsh_parse_duration(argv[1])) <= 0) {
+        return 0;
+    }
+    job->timeout_ms = timeout;
+    return 2;
+}
+
+static int prefix_time(struct job *job, int argc, char **argv) {
+    if (argc <= 1) {
+        return 0;
+    }
+    job->timed = 1;
+    return 1;
+}
+
+// Builtin registry. Lookups go through a perfect hash: wsh_builtin_init
+// searches for a seed that gives every name a slot of its own, so finding
+// a builtin (or finding there is none) is one hash and at most one strcmp
+
+static const struct builtin builtins[] = {
+    {"[", wsh_test, NULL, BUILTIN_UTILITY},
+    {"bg", wsh_bg, NULL, 0},
+    {"cd", wsh_cd, NULL, 0},
+    {"echo", wsh_echo, NULL, BUILTIN_UTILITY},
+    {"exit", wsh_exit, NULL, 0},
+    {"export", wsh_export, NULL, 0},
+    {"false", wsh_false, NULL, BUILTIN_UTILITY},
+    {"fg", wsh_fg, NULL, 0},
+    {"hash", wsh_hash, NULL, 0},
+    {"history", wsh_history, NULL, 0},
+    {"jobs", wsh_jobs, NULL, 0},
+    {"kill", wsh_kill, NULL, BUILTIN_UTILITY},
+    {"memstat", wsh_memstat, NULL, 0},
+    {"parallel", wsh_parallel, NULL, 0},
+    {"pipesize", wsh_pipesize, prefix_pipesize, 0},
+    {"printf", wsh_printf, NULL, BUILTIN_UTILITY},
+    {"prio", wsh_prio, prefix_prio, 0},
+    {"pwd", wsh_pwd, NULL, BUILTIN_UTILITY},
+    {"read", wsh_read, NULL, BUILTIN_UTILITY},
+    {"sched", wsh_sched, NULL, 0},
+    {"set", wsh_set, NULL, 0},
+    {"sleep", wsh_sleep, NULL, BUILTIN_UTILITY|BUILTIN_BLOCKING},
+    {"test", wsh_test, NULL, BUILTIN_UTILITY},
+    {"time", wsh_time, prefix_time, 0},
+    {"timeout", wsh_timeout, prefix_timeout, 0},
+    {"true", wsh_true, NULL, BUILTIN_UTILITY},
+    {"unset", wsh_unset, NULL, 0},
+    {"wait", wsh_wait, NULL, 0},
+};
+
+#define BUILTIN_COUNT (sizeof(builtins) / sizeof(builtins[0]))
+
+static const struct builtin *builtin_table[1 << BUILTIN_TABLE_BITS];
+static unsigned int builtin_seed;
+
+static unsigned int builtin_slot(const char *name, unsigned int seed) {
+    unsigned int hash = seed;
+
+    while (*name != '\0') {
+        hash ^= (unsigned char) *name++;
+        hash *= 16777619u;
+    }
+
+    return hash >> (32 - BUILTIN_TABLE_BITS);     // the top bits depend on every byte
+}
+
+// Filling the table for a seed, 0 when two names share a slot
+
+static int builtin_fill(unsigned int seed) {
+    size_t i;
+
+    memset(builtin_table, 0, sizeof(builtin_table));
+    for (i = 0; i < BUILTIN_COUNT; i++) {
+        unsigned int slot = builtin_slot(builtins[i].name, seed);
+        if (builtin_table[slot] != NULL) {
+            return 0;
+        }
+        builtin_table[slot] = &builtins[i];
+    }
+    builtin_seed = seed;
+
+    return 1;
+}
+
+// Built on the first lookup, unless a snapshot already gave the seed
+
+void wsh_builtin_init() {
+    unsigned int seed;
+
+    for (seed = 2166136261u; !builtin_fill(seed); seed++);
+}
+
+// A command made only of NAME=value words sets those variables. It runs
+// like a builtin but is never found by name.
+
+// A line of assignments only exits with the status of its last command
+// substitution, 0 without one
+
+static int wsh_assign(int argc, char **argv) {
+    int i;
+
+    for (i = 0; i < argc; i++) {
+        char *equals = strchr(argv[i], '=');
+        wsh_set_var(argv[i], equals - argv[i], equals + 1, 0);
+    }
+
+    return wsh_shell->subst_status;
+}
+
+static const struct builtin assign_builtin = {"NAME=value", wsh_assign, NULL, 0};
+
+// Getting the builtin for a command name, NULL for external commands
+
+const struct builtin *wsh_find_builtin(const char *name) {
+    if (builtin_seed == 0) {
+        wsh_builtin_init();
+    }
+
+    const struct builtin *builtin = builtin_table[builtin_slot(name, builtin_seed)];
+
+    if (builtin == NULL || strcmp(builtin->name, name) != 0) {
+        return NULL;
     }
+
+    return builtin;
 }
 
 // Trim the leading and trailing spaces of the command line
 
 char* helper_strtrim(char* line) {
-    char *head = line, *tail = line + strlen(line);
+    char *head = line, *tail = line + strlen(line) - 1;
 
-    while (*head == ' ') {
+    while (*head == ' ' || *head == '\t') {
         head++;
     }
-    while (*tail == ' ') {
+    while (tail >= head && (*tail == ' ' || *tail == '\t' || *tail == '\n' || *tail == '\r')) {
         tail--;
     }
     *(tail + 1) = '\0';
@@ -352,11 +773,17 @@ int wsh_cd(int argc, char** argv) {
 
 
 int wsh_jobs(int argc, char **argv) {
-    int i;
+    int i, details = argc > 1 && strcmp(argv[1], "-l") == 0;
 
-    for (i = 0; i < MAX_JOBS; i++) {
+    for (i = 1; i < wsh_shell->jobs_capacity; i++) {
         if (wsh_shell->jobs[i] != NULL) {
            print_job_status(i);
+           if (details) {
+               print_job_usage(i);
+           }
+           if (wsh_shell->jobs[i]->mode == BACKGROUND_EXECUTION && is_job_completed(i)) {
+               remove_job(i);
+           }
         }
     }
 
@@ -379,17 +806,22 @@ int wsh_fg(int argc, char **argv) {
             job_id = atoi(argv[1]);
         }
     } else {
-        for (int i = MAX_JOBS; i >= 1; i--) {
-            if (wsh_shell->jobs[i] != NULL) {
-                job_id = i;
-                break;
-            }
+        job_id = get_last_job_id();
+    }
+
+    struct job *job = get_job_by_id(job_id);
+    if (job != NULL && job->root->status == STATUS_QUEUED) {
+        wsh_sched_dequeue(job);
+        job->mode = FOREGROUND_EXECUTION;
+        if (wsh_start_job(job, 1) >= 0) {
+            remove_job(job_id);
         }
+        return 0;
     }
 
     pid = get_pgid_by_job_id(job_id);
 
-    if (kill(-pid, SIGCONT) < 0) {
+    if (pid < 0 || kill(-pid, SIGCONT) < 0) {
         return -1;
     }
 
@@ -397,6 +829,8 @@ int wsh_fg(int argc, char **argv) {
 
     if (job_id > 0) {
         set_job_status(job_id, STATUS_CONTINUED);
+        get_job_by_id(job_id)->mode = FOREGROUND_EXECUTION;
+        wsh_sched_account(get_job_by_id(job_id));
         if (wait_for_job(job_id) >= 0) {
             remove_job(job_id);
         }
@@ -426,408 +860,8012 @@ int wsh_bg(int argc, char **argv) {
             job_id = atoi(argv[1]);
         }
     } else {
-        for (int i = MAX_JOBS; i >= 1; i--) {
-            if (wsh_shell->jobs[i] != NULL) {
-                job_id = i;
-                break;
-            }
-        }
+        job_id = get_last_job_id();
+    }
+
+    struct job *job = get_job_by_id(job_id);
+    if (job != NULL && job->root->status == STATUS_QUEUED) {
+        wsh_sched_dequeue(job);
+        wsh_start_job(job, 1);
+        return 0;
     }
 
     pid = get_pgid_by_job_id(job_id);
 
-    if (kill(-pid, SIGCONT) < 0) {
+    if (pid < 0 || kill(-pid, SIGCONT) < 0) {
         return -1;
     }
 
     if (job_id > 0) {
         set_job_status(job_id, STATUS_CONTINUED);
+        get_job_by_id(job_id)->mode = BACKGROUND_EXECUTION;
+        wsh_sched_account(get_job_by_id(job_id));
     }
 
     return 0;
 }
 
-int wsh_exit() {
-    exit(0);
-}
-
-// Launching jobs
+// Getting the table id of a running or queued job from %N, %name or a
+// pid, -1 when it is not there (it may have finished already)
 
-void check_zombie() {
-    int status, pid;
-    while ((pid = waitpid(-1, &status, WNOHANG|WUNTRACED|WCONTINUED)) > 0) {
-        if (WIFEXITED(status)) {
-            set_process_status(pid, STATUS_DONE);
-        } else if (WIFSTOPPED(status)) {
-            set_process_status(pid, STATUS_SUSPENDED);
-        } else if (WIFCONTINUED(status)) {
-            set_process_status(pid, STATUS_CONTINUED);
-        }
-
-        int job_id = get_job_id_by_pid(pid);
-        if (job_id > 0 && is_job_completed(job_id)) {
-            remove_job(job_id);
-        }
+static int job_spec_id(const char *spec) {
+    if (spec[0] == '%' && isdigit((unsigned char) spec[1])) {
+        return get_job_by_id(atoi(spec + 1)) != NULL ? atoi(spec + 1) : -1;
     }
+    if (spec[0] == '%') {
+        return get_job_id_by_name(spec + 1);
+    }
+    return get_job_id_by_pid(atoi(spec));
 }
 
-// Execute built-in commands
+// wait [%job|%name|pid ...]: waiting for background jobs, every one of
+// them without arguments. Returns the exit code of the last one; jobs
+// that finished earlier are found in the kept results.
 
-int wsh_execute_builtin_command(struct process *proc) {
-    int status = 1;
+int wsh_wait(int argc, char **argv) {
+    struct job_result *result;
+    int i, status = 0;
 
-    switch (proc->type) {
-        case COMMAND_CD:
-            wsh_cd(proc->argc, proc->argv);
-            break;
-        case COMMAND_JOBS:
-            wsh_jobs(proc->argc, proc->argv);
-            break;
-        case COMMAND_FG:
-            wsh_fg(proc->argc, proc->argv);
-            break;
-        case COMMAND_BG:
-            wsh_bg(proc->argc, proc->argv);
-            break;        
-        case COMMAND_EXIT:
-            wsh_exit();
-            break;
-        default:
+    if (argc == 1) {
+        for (i = 1; i < wsh_shell->jobs_capacity; i++) {
+            struct job *job = wsh_shell->jobs[i];
+            if (job != NULL && job->mode == BACKGROUND_EXECUTION) {
+                wsh_join_job(i);
+            }
+        }
+        return 0;
+    }
+
+    for (i = 1; i < argc; i++) {
+        int id = job_spec_id(argv[i]);
+        if (id > 0) {
+            status = wsh_join_job(id);
+        } else if ((result = job_result_find(argv[i])) != NULL) {
+            status = result->status;
+        } else {
+            printf("wsh: wait: %s: no such job\n", argv[i]);
+            status = 127;
+        }
+    }
+
+    return status;
+}
+
+int wsh_hash(int argc, char **argv) {
+    struct path_cache *cache = &wsh_shell->path_cache;
+    struct path_entry *entry;
+    int i;
+
+    if (argc > 1 && strcmp(argv[1], "-r") == 0) {
+        path_cache_flush();
+        cache->hits = 0;
+        cache->misses = 0;
+        return 0;
+    }
+    if (argc > 1) {
+        int status = 0;
+        for (i = 1; i < argc; i++) {
+            if (wsh_find_builtin(argv[i]) == NULL && path_cache_lookup(argv[i]) == NULL) {
+                printf("wsh: hash: %s: not found\n", argv[i]);
+                status = 1;
+            }
+        }
+        return status;
+    }
+
+    printf("hits\tcommand\n");
+    for (i = 0; i < PATH_CACHE_BUCKETS; i++) {
+        for (entry = cache->buckets[i]; entry != NULL; entry = entry->next) {
+            printf("%4d\t%s\n", entry->hits, entry->path);
+        }
+    }
+    printf("hash: %ld hits, %ld misses\n", cache->hits, cache->misses);
+
+    return 0;
+}
+
+static size_t var_name_length(const char *str);
+
+static int compare_strings(const void *a, const void *b) {
+    return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+// export [NAME[=value] ...]: marks variables for the environment of
+// commands, setting them first when given a value. Without names the
+// exported variables are listed.
+
+int wsh_export(int argc, char **argv) {
+    int i, count, status = 0;
+
+    if (argc == 1) {
+        char **envp = wsh_var_envp();
+        for (count = 0; envp[count] != NULL; count++);
+        char **sorted = (char**) malloc((count + 1) * sizeof(char*));
+        if (!sorted) {
+            fprintf(stderr, "wsh: allocation error");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(sorted, envp, count * sizeof(char*));
+        qsort(sorted, count, sizeof(char*), compare_strings);
+        for (i = 0; i < count; i++) {
+            printf("export %s\n", sorted[i]);
+        }
+        free(sorted);
+        return 0;
+    }
+
+    for (i = 1; i < argc; i++) {
+        size_t length = var_name_length(argv[i]);
+        if (length == 0 || (argv[i][length] != '=' && argv[i][length] != '\0')) {
+            printf("wsh: export: %s: not a valid identifier\n", argv[i]);
+            status = 1;
+            continue;
+        }
+        wsh_set_var(argv[i], length, argv[i][length] == '=' ? argv[i] + length + 1 : NULL, VAR_EXPORT);
+    }
+
+    return status;
+}
+
+int wsh_unset(int argc, char **argv) {
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        wsh_unset_var(argv[i], strlen(argv[i]));
+    }
+
+    return 0;
+}
+
+int wsh_memstat(int argc, char **argv) {
+    printf("arenas: %ld live, %ld pooled, %ld created, %ld reused\n",
+           wsh_alloc_stats.arenas_live, wsh_alloc_stats.arenas_pooled,
+           wsh_alloc_stats.arenas_created, wsh_alloc_stats.arenas_reused);
+    printf("chunks: %ld malloc calls\n", wsh_alloc_stats.chunk_mallocs);
+    printf("allocations: %ld (%ld bytes)\n", wsh_alloc_stats.allocations, wsh_alloc_stats.bytes);
+
+    return 0;
+}
+
+int wsh_pipesize(int argc, char **argv) {
+    if (argc == 1) {
+        if (wsh_shell->pipe_size > 0) {
+            printf("%d\n", wsh_shell->pipe_size);
+        } else {
+            printf("default\n");
+        }
+        return 0;
+    }
+
+    long size = wsh_parse_size(argv[1]);
+    if (size < 0 || size > INT_MAX) {
+        printf("wsh: pipesize: invalid size: %s\n", argv[1]);
+        return -1;
+    }
+    wsh_shell->pipe_size = size;
+
+    return 0;
+}
+
+int wsh_sched(int argc, char **argv) {
+    int i;
+
+    for (i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-j") == 0) {
+            wsh_shell->sched_max_jobs = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-l") == 0) {
+            wsh_shell->sched_max_load = atof(argv[i + 1]);
+        } else {
+            break;
+        }
+    }
+    if (i < argc) {
+        printf("usage: sched [-j max_jobs] [-l max_load]\n");
+        return -1;
+    }
+    if (argc > 1) {
+        wsh_sched_run();
+        return 0;
+    }
+
+    int queued = 0;
+    struct job *job;
+    for (job = wsh_shell->sched_queue; job != NULL; job = job->queue_next) {
+        queued++;
+    }
+    if (wsh_shell->sched_max_jobs > 0) {
+        printf("max jobs: %d\n", wsh_shell->sched_max_jobs);
+    } else {
+        printf("max jobs: unlimited\n");
+    }
+    if (wsh_shell->sched_max_load > 0) {
+        printf("max load: %.2f\n", wsh_shell->sched_max_load);
+    } else {
+        printf("max load: off\n");
+    }
+    printf("running: %d, queued: %d\n", wsh_sched_running(), queued);
+
+    return 0;
+}
+
+static const struct {
+    const char *name;
+    int flag;
+} wsh_options[] = {
+    {"globcache", OPTION_GLOB_CACHE},
+    {"globunsorted", OPTION_GLOB_UNSORTED},
+};
+
+// Parsing a duration: a number with an optional ms, s, m or h suffix
+// (seconds by default). Returns milliseconds, -1 when invalid.
+
+long wsh_parse_duration(const char *str) {
+    char *end;
+    double value = strtod(str, &end);
+
+    if (end == str || value < 0) {
+        return -1;
+    }
+    if (strcmp(end, "ms") == 0) {
+        return (long) value;
+    } else if (*end == '\0' || strcmp(end, "s") == 0) {
+        return (long) (value * 1000);
+    } else if (strcmp(end, "m") == 0) {
+        return (long) (value * 60000);
+    } else if (strcmp(end, "h") == 0) {
+        return (long) (value * 3600000);
+    }
+    return -1;
+}
+
+// timeout DURATION command ... is a prefix; as a command it sets the
+// deadline given to every job (-d, 0 turns it off) and the time between
+// SIGTERM and SIGKILL (-k), or shows them
+
+int wsh_timeout(int argc, char **argv) {
+    int i;
+
+    for (i = 1; i + 1 < argc; i += 2) {
+        long value = wsh_parse_duration(argv[i + 1]);
+        if (value < 0) {
+            break;
+        } else if (strcmp(argv[i], "-d") == 0) {
+            wsh_shell->timeout_default_ms = value;
+        } else if (strcmp(argv[i], "-k") == 0) {
+            wsh_shell->timeout_grace_ms = value;
+        } else {
+            break;
+        }
+    }
+    if (i < argc) {
+        printf("usage: timeout DURATION command ... | timeout [-d default] [-k kill_after]\n");
+        return -1;
+    }
+    if (argc > 1) {
+        return 0;
+    }
+
+    if (wsh_shell->timeout_default_ms > 0) {
+        printf("default: %.3gs\n", wsh_shell->timeout_default_ms / 1000.0);
+    } else {
+        printf("default: off\n");
+    }
+    printf("kill after: %.3gs\n", wsh_shell->timeout_grace_ms / 1000.0);
+    printf("deadlines: %d\n", wsh_shell->timer_count);
+
+    return 0;
+}
+
+int wsh_set(int argc, char **argv) {
+    size_t i;
+
+    if (argc == 1 || (argc == 2 && strcmp(argv[1], "-o") == 0)) {
+        for (i = 0; i < sizeof(wsh_options) / sizeof(wsh_options[0]); i++) {
+            printf("%-16s%s\n", wsh_options[i].name, (wsh_shell->options & wsh_options[i].flag) ? "on" : "off");
+        }
+        printf("glob cache: %d dirs, %ld hits, %ld misses\n", wsh_shell->glob_cache_dirs,
+               wsh_shell->glob_cache_hits, wsh_shell->glob_cache_misses);
+        return 0;
+    }
+    if (argc != 3 || (strcmp(argv[1], "-o") != 0 && strcmp(argv[1], "+o") != 0)) {
+        printf("usage: set [-o|+o option]\n");
+        return -1;
+    }
+    for (i = 0; i < sizeof(wsh_options) / sizeof(wsh_options[0]); i++) {
+        if (strcmp(argv[2], wsh_options[i].name) == 0) {
+            break;
+        }
+    }
+    if (i == sizeof(wsh_options) / sizeof(wsh_options[0])) {
+        printf("wsh: set: %s: invalid option name\n", argv[2]);
+        return -1;
+    }
+    if (argv[1][0] == '-') {
+        wsh_shell->options |= wsh_options[i].flag;
+    } else {
+        wsh_shell->options &= ~wsh_options[i].flag;
+        if (wsh_options[i].flag == OPTION_GLOB_CACHE) {
+            glob_cache_flush();
+        }
+    }
+
+    return 0;
+}
+
+static double timeval_seconds(struct timeval *tv);
+
+int wsh_time(int argc, char **argv) {
+    struct rusage self, children;
+
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &children);
+    printf("shell:    user %.3fs sys %.3fs\n", timeval_seconds(&self.ru_utime), timeval_seconds(&self.ru_stime));
+    printf("children: user %.3fs sys %.3fs\n", timeval_seconds(&children.ru_utime), timeval_seconds(&children.ru_stime));
+
+    return 0;
+}
+
+int wsh_exit(int argc, char **argv) {
+    fflush(stdout);
+    if (wsh_shell->resident) {         // ends the request, not the server
+        wsh_shell->exit_requested = 1;
+        return argc > 1 ? atoi(argv[1]) : 0;
+    }
+    exit(argc > 1 ? atoi(argv[1]) : 0);
+}
+
+// Printing one backslash escape of echo -e, printf formats and %b, with
+// *str on the backslash. Returns 1 for \c, which stops all output
+
+static int print_escape(const char **str) {
+    const char *c = *str + 1;
+    int value = 0, digits;
+
+    switch (*c) {
+        case 'a': putchar('\a'); break;
+        case 'b': putchar('\b'); break;
+        case 'c': *str = c; return 1;
+        case 'e': putchar('\033'); break;
+        case 'f': putchar('\f'); break;
+        case 'n': putchar('\n'); break;
+        case 'r': putchar('\r'); break;
+        case 't': putchar('\t'); break;
+        case 'v': putchar('\v'); break;
+        case '\\': putchar('\\'); break;
+        case '0':
+            for (digits = 0, c++; digits < 3 && *c >= '0' && *c <= '7'; digits++, c++) {
+                value = value * 8 + *c - '0';
+            }
+            putchar(value);
+            *str = c - 1;
+            return 0;
+        case '\0':
+            putchar('\\');
+            *str = c - 1;
+            return 0;
+        default:
+            putchar('\\');
+            putchar(*c);
+            break;
+    }
+
+    *str = c;
+    return 0;
+}
+
+static int print_escaped(const char *str) {
+    for (; *str != '\0'; str++) {
+        if (*str != '\\') {
+            putchar(*str);
+        } else if (print_escape(&str)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int wsh_echo(int argc, char **argv) {
+    int i, newline = 1, escapes = 0;
+
+    for (i = 1; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+        if (strspn(argv[i] + 1, "neE") != strlen(argv[i] + 1)) {
+            break;
+        }
+        newline = newline && strchr(argv[i], 'n') == NULL;
+        escapes = strchr(argv[i], 'e') != NULL || (escapes && strchr(argv[i], 'E') == NULL);
+    }
+
+    for (; i < argc; i++) {
+        if (escapes) {
+            if (print_escaped(argv[i])) {
+                return 0;
+            }
+        } else {
+            fputs(argv[i], stdout);
+        }
+        if (i + 1 < argc) {
+            putchar(' ');
+        }
+    }
+    if (newline) {
+        putchar('\n');
+    }
+
+    return 0;
+}
+
+int wsh_true(int argc, char **argv) {
+    return 0;
+}
+
+int wsh_false(int argc, char **argv) {
+    return 1;
+}
+
+// printf FORMAT [ARG ...], the format is reused while arguments remain
+
+int wsh_printf(int argc, char **argv) {
+    int arg = 2;
+
+    if (argc < 2) {
+        fprintf(stderr, "wsh: printf: usage: printf format [arguments]\n");
+        return 2;
+    }
+
+    do {
+        const char *c;
+        for (c = argv[1]; *c != '\0'; c++) {
+            if (*c == '\\') {
+                if (print_escape(&c)) {
+                    return 0;
+                }
+                continue;
+            }
+            if (*c != '%') {
+                putchar(*c);
+                continue;
+            }
+            if (c[1] == '%') {
+                putchar('%');
+                c++;
+                continue;
+            }
+
+            char spec[32];
+            size_t n = 0;
+            spec[n++] = *c++;
+            while (*c != '\0' && strchr("-+ #0", *c) != NULL && n < 8) {
+                spec[n++] = *c++;
+            }
+            while (isdigit((unsigned char) *c) && n < 16) {
+                spec[n++] = *c++;
+            }
+            if (*c == '.') {
+                spec[n++] = *c++;
+                while (isdigit((unsigned char) *c) && n < 24) {
+                    spec[n++] = *c++;
+                }
+            }
+            if (*c == '\0') {
+                break;
+            }
+
+            const char *value = arg < argc ? argv[arg++] : NULL;
+            switch (*c) {
+                case 'd': case 'i':
+                    spec[n++] = 'l';
+                    spec[n++] = *c;
+                    spec[n] = '\0';
+                    printf(spec, value != NULL ? strtol(value, NULL, 0) : 0L);
+                    break;
+                case 'u': case 'o': case 'x': case 'X':
+                    spec[n++] = 'l';
+                    spec[n++] = *c;
+                    spec[n] = '\0';
+                    printf(spec, value != NULL ? strtoul(value, NULL, 0) : 0UL);
+                    break;
+                case 'e': case 'E': case 'f': case 'F': case 'g': case 'G':
+                    spec[n++] = *c;
+                    spec[n] = '\0';
+                    printf(spec, value != NULL ? strtod(value, NULL) : 0.0);
+                    break;
+                case 'c':
+                    spec[n++] = 'c';
+                    spec[n] = '\0';
+                    printf(spec, value != NULL ? value[0] : '\0');
+                    break;
+                case 's':
+                    spec[n++] = 's';
+                    spec[n] = '\0';
+                    printf(spec, value != NULL ? value : "");
+                    break;
+                case 'b':
+                    if (value != NULL && print_escaped(value)) {
+                        return 0;
+                    }
+                    break;
+                default:
+                    fprintf(stderr, "wsh: printf: %%%c: invalid directive\n", *c);
+                    return 1;
+            }
+        }
+    } while (arg > 2 && arg < argc);
+
+    return 0;
+}
+
+int wsh_pwd(int argc, char **argv) {
+    char path[PATH_MAX];
+
+    if (getcwd(path, sizeof(path)) == NULL) {
+        fprintf(stderr, "wsh: pwd: %s\n", strerror(errno));
+        return 1;
+    }
+    printf("%s\n", path);
+
+    return 0;
+}
+
+// sleep runs in the shell, so SIGINT (ignored by the shell) is caught for
+// the length of the sleep to keep it interruptible. The shell itself
+// sleeps in its event loop, where deadlines and reaping go on; a forked
+// copy shares those descriptors and just sleeps
+
+static volatile sig_atomic_t builtin_interrupted;
+
+static void builtin_interrupt(int sig) {
+    builtin_interrupted = 1;
+}
+
+int wsh_sleep(int argc, char **argv) {
+    struct sigaction action = { .sa_handler = builtin_interrupt }, saved;
+    double seconds = 0;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        char *end;
+        double value = strtod(argv[i], &end);
+        switch (*end) {
+            case 'd': value *= 24;  // fall through
+            case 'h': value *= 60;  // fall through
+            case 'm': value *= 60;  // fall through
+            case 's': end++; break;
+        }
+        if (end == argv[i] || *end != '\0' || value < 0) {
+            fprintf(stderr, "wsh: sleep: invalid time interval '%s'\n", argv[i]);
+            return 1;
+        }
+        seconds += value;
+    }
+    if (argc < 2) {
+        fprintf(stderr, "wsh: sleep: missing operand\n");
+        return 1;
+    }
+
+    struct timespec ts = { .tv_sec = (time_t) seconds, .tv_nsec = (long) ((seconds - (time_t) seconds) * 1e9) };
+    long end = wsh_timer_now() + (long) (seconds * 1000 + 0.999), left;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, &saved);
+    builtin_interrupted = 0;
+    if (getpid() != wsh_shell->pid) {
+        while (nanosleep(&ts, &ts) < 0 && errno == EINTR && !builtin_interrupted);
+    } else {
+        while (!builtin_interrupted && (left = end - wsh_timer_now()) > 0) {
+            wsh_event_wait_child(left > INT_MAX ? INT_MAX : (int) left);
+        }
+    }
+    sigaction(SIGINT, &saved, NULL);
+
+    return builtin_interrupted ? 128 + SIGINT : 0;
+}
+
+static const struct {
+    const char *name;
+    int number;
+} signal_names[] = {
+    {"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT}, {"ILL", SIGILL},
+    {"TRAP", SIGTRAP}, {"ABRT", SIGABRT}, {"BUS", SIGBUS}, {"FPE", SIGFPE},
+    {"KILL", SIGKILL}, {"USR1", SIGUSR1}, {"SEGV", SIGSEGV}, {"USR2", SIGUSR2},
+    {"PIPE", SIGPIPE}, {"ALRM", SIGALRM}, {"TERM", SIGTERM}, {"CHLD", SIGCHLD},
+    {"CONT", SIGCONT}, {"STOP", SIGSTOP}, {"TSTP", SIGTSTP}, {"TTIN", SIGTTIN},
+    {"TTOU", SIGTTOU}, {"URG", SIGURG}, {"XCPU", SIGXCPU}, {"XFSZ", SIGXFSZ},
+    {"VTALRM", SIGVTALRM}, {"PROF", SIGPROF}, {"WINCH", SIGWINCH}, {"IO", SIGIO},
+    {"SYS", SIGSYS},
+};
+
+// Getting a signal number from a name (TERM, SIGTERM) or a number, -1 if unknown
+
+int wsh_signal_number(const char *name) {
+    size_t i;
+
+    if (isdigit((unsigned char) name[0])) {
+        return atoi(name) < NSIG ? atoi(name) : -1;
+    }
+    if (strncmp(name, "SIG", 3) == 0) {
+        name += 3;
+    }
+    for (i = 0; i < sizeof(signal_names) / sizeof(signal_names[0]); i++) {
+        if (strcasecmp(signal_names[i].name, name) == 0) {
+            return signal_names[i].number;
+        }
+    }
+
+    return -1;
+}
+
+// kill [-s SIG | -SIG] pid|%job ..., kill -l
+
+int wsh_kill(int argc, char **argv) {
+    int i = 1, sig = SIGTERM, status = 0;
+    size_t j;
+
+    if (argc > 1 && strcmp(argv[1], "-l") == 0) {
+        for (j = 0; j < sizeof(signal_names) / sizeof(signal_names[0]); j++) {
+            printf("%2d) SIG%s\n", signal_names[j].number, signal_names[j].name);
+        }
+        return 0;
+    }
+    if (i + 1 < argc && strcmp(argv[i], "-s") == 0) {
+        sig = wsh_signal_number(argv[i + 1]);
+        i += 2;
+    } else if (i < argc && argv[i][0] == '-' && argv[i][1] != '\0') {
+        sig = wsh_signal_number(argv[i] + 1);
+        i++;
+    }
+    if (sig < 0 || i >= argc) {
+        fprintf(stderr, "wsh: kill: usage: kill [-s sigspec | -sigspec] pid | %%job ...\n");
+        return 2;
+    }
+
+    for (; i < argc; i++) {
+        pid_t pid;
+        if (argv[i][0] == '%') {
+            int id = atoi(argv[i] + 1);
+            struct job *job = get_job_by_id(id);
+            if (job == NULL) {
+                fprintf(stderr, "wsh: kill: %s: no such job\n", argv[i]);
+                status = 1;
+                continue;
+            }
+            if (job->root->status == STATUS_QUEUED) {
+                remove_job(id);     // never started, nothing to signal
+                continue;
+            }
+            pid = -job->pgid;
+        } else {
+            char *end;
+            pid = strtol(argv[i], &end, 10);
+            if (end == argv[i] || *end != '\0') {
+                fprintf(stderr, "wsh: kill: %s: arguments must be process or job IDs\n", argv[i]);
+                status = 1;
+                continue;
+            }
+        }
+        if (kill(pid, sig) < 0) {
+            fprintf(stderr, "wsh: kill: %s: %s\n", argv[i], strerror(errno));
+            status = 1;
+        }
+    }
+
+    return status;
+}
+
+// Reading one byte for read: from the shell's own input buffer first when
+// stdin is the shell's input, so read sees the line after it
+
+static int read_byte(int from_shell_input) {
+    struct shell_info *shell = wsh_shell;
+    unsigned char c;
+
+    if (from_shell_input && shell->input_pos < shell->input_len) {
+        return (unsigned char) shell->input_buf[shell->input_pos++];
+    }
+    while (1) {
+        ssize_t n = read(0, &c, 1);
+        if (n == 1) {
+            return c;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        return -1;
+    }
+}
+
+// read [-r] [NAME ...]: one line split on blanks, the last name takes the
+// rest of the line. Without names the line goes to REPLY. The values are
+// set as shell variables, not exported
+
+int wsh_read(int argc, char **argv) {
+    int i = 1, raw = 0, c, from_shell_input = wsh_shell->builtin_input;
+    size_t length = 0, capacity = TOKEN_BUFSIZE;
+    char *line = (char*) malloc(capacity);
+
+    if (i < argc && strcmp(argv[i], "-r") == 0) {
+        raw = 1;
+        i++;
+    }
+
+    while ((c = read_byte(from_shell_input)) >= 0 && c != '\n') {
+        if (c == '\\' && !raw) {
+            c = read_byte(from_shell_input);
+            if (c == '\n' || c < 0) {
+                continue;
+            }
+        }
+        if (length + 1 >= capacity) {
+            capacity *= 2;
+            line = (char*) realloc(line, capacity);
+        }
+        if (!line) {
+            fprintf(stderr, "wsh: allocation error");
+            exit(EXIT_FAILURE);
+        }
+        line[length++] = c;
+    }
+    line[length] = '\0';
+
+    if (i == argc) {
+        wsh_set_var("REPLY", 5, line, 0);
+    }
+    char *field = line;
+    for (; i < argc; i++) {
+        field += strspn(field, " \t");
+        char *end = field + strcspn(field, " \t");
+        if (i + 1 == argc) {
+            end = field + strlen(field);
+            while (end > field && (end[-1] == ' ' || end[-1] == '\t')) {
+                end--;
+            }
+        }
+        char saved = *end;
+        *end = '\0';
+        wsh_set_var(argv[i], strlen(argv[i]), field, 0);
+        *end = saved;
+        field = *end != '\0' ? end + 1 : end;
+    }
+    free(line);
+
+    return c < 0 && length == 0 ? 1 : 0;
+}
+
+// test EXPR / [ EXPR ]: recursive descent over -o, -a, ! and ( )
+
+struct test_state {
+    int argc;
+    char **argv;
+    int pos;
+    int error;
+};
+
+static int test_or(struct test_state *t);
+
+static long test_integer(struct test_state *t, const char *str) {
+    char *end;
+    long value = strtol(str, &end, 10);
+
+    if (end == str || *end != '\0') {
+        fprintf(stderr, "wsh: test: %s: integer expression expected\n", str);
+        t->error = 1;
+    }
+    return value;
+}
+
+static int test_binary(struct test_state *t, const char *left, const char *op, const char *right) {
+    struct stat a, b;
+
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) {
+        return strcmp(left, right) == 0;
+    } else if (strcmp(op, "!=") == 0) {
+        return strcmp(left, right) != 0;
+    } else if (strcmp(op, "<") == 0) {
+        return strcmp(left, right) < 0;
+    } else if (strcmp(op, ">") == 0) {
+        return strcmp(left, right) > 0;
+    } else if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0 || strcmp(op, "-ef") == 0) {
+        int left_ok = stat(left, &a) == 0, right_ok = stat(right, &b) == 0;
+        if (op[1] == 'e') {
+            return left_ok && right_ok && a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+        }
+        if (op[1] == 'n') {
+            return left_ok && (!right_ok || a.st_mtim.tv_sec > b.st_mtim.tv_sec ||
+                               (a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec > b.st_mtim.tv_nsec));
+        }
+        return right_ok && (!left_ok || a.st_mtim.tv_sec < b.st_mtim.tv_sec ||
+                            (a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec < b.st_mtim.tv_nsec));
+    }
+
+    long l = test_integer(t, left), r = test_integer(t, right);
+    switch (op[1] << 8 | op[2]) {
+        case 'e' << 8 | 'q': return l == r;
+        case 'n' << 8 | 'e': return l != r;
+        case 'l' << 8 | 't': return l < r;
+        case 'l' << 8 | 'e': return l <= r;
+        case 'g' << 8 | 't': return l > r;
+        default: return l >= r;
+    }
+}
+
+static int test_is_binary(const char *op) {
+    static const char *ops[] = {"=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", "-nt", "-ot", "-ef"};
+    size_t i;
+
+    for (i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        if (strcmp(op, ops[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int test_unary(const char *op, const char *arg) {
+    struct stat st;
+
+    switch (op[1]) {
+        case 'z': return arg[0] == '\0';
+        case 'n': return arg[0] != '\0';
+        case 't': return isatty(atoi(arg));
+        case 'r': return access(arg, R_OK) == 0;
+        case 'w': return access(arg, W_OK) == 0;
+        case 'x': return access(arg, X_OK) == 0;
+        case 'L': case 'h': return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+    }
+    if (stat(arg, &st) < 0) {
+        return 0;
+    }
+    switch (op[1]) {
+        case 'e': return 1;
+        case 'f': return S_ISREG(st.st_mode);
+        case 'd': return S_ISDIR(st.st_mode);
+        case 's': return st.st_size > 0;
+        case 'p': return S_ISFIFO(st.st_mode);
+        case 'S': return S_ISSOCK(st.st_mode);
+        case 'b': return S_ISBLK(st.st_mode);
+        case 'c': return S_ISCHR(st.st_mode);
+    }
+    return 0;
+}
+
+static int test_primary(struct test_state *t) {
+    char *arg;
+
+    if (t->pos >= t->argc) {
+        t->error = 1;
+        return 0;
+    }
+    arg = t->argv[t->pos];
+
+    if (t->pos + 2 < t->argc && test_is_binary(t->argv[t->pos + 1])) {
+        t->pos += 3;
+        return test_binary(t, arg, t->argv[t->pos - 2], t->argv[t->pos - 1]);
+    }
+    if (strcmp(arg, "(") == 0 && t->pos + 1 < t->argc) {
+        t->pos++;
+        int result = test_or(t);
+        if (t->pos >= t->argc || strcmp(t->argv[t->pos], ")") != 0) {
+            t->error = 1;
+        }
+        t->pos++;
+        return result;
+    }
+    if (arg[0] == '-' && arg[1] != '\0' && arg[2] == '\0' && strchr("zntrwxLhefdspSbc", arg[1]) != NULL
+            && t->pos + 1 < t->argc) {
+        t->pos += 2;
+        return test_unary(arg, t->argv[t->pos - 1]);
+    }
+
+    t->pos++;
+    return arg[0] != '\0';
+}
+
+static int test_not(struct test_state *t) {
+    if (t->pos + 1 < t->argc && strcmp(t->argv[t->pos], "!") == 0) {
+        t->pos++;
+        return !test_not(t);
+    }
+    return test_primary(t);
+}
+
+static int test_and(struct test_state *t) {
+    int result = test_not(t);
+
+    while (t->pos < t->argc && strcmp(t->argv[t->pos], "-a") == 0) {
+        t->pos++;
+        result = test_not(t) && result;
+    }
+    return result;
+}
+
+static int test_or(struct test_state *t) {
+    int result = test_and(t);
+
+    while (t->pos < t->argc && strcmp(t->argv[t->pos], "-o") == 0) {
+        t->pos++;
+        result = test_and(t) || result;
+    }
+    return result;
+}
+
+int wsh_test(int argc, char **argv) {
+    struct test_state t = { argc, argv, 1, 0 };
+
+    if (strcmp(argv[0], "[") == 0) {
+        if (strcmp(argv[argc - 1], "]") != 0) {
+            fprintf(stderr, "wsh: [: missing ']'\n");
+            return 2;
+        }
+        t.argc--;
+    }
+    if (t.argc == 1) {
+        return 1;
+    }
+
+    int result = test_or(&t);
+    if (t.error || t.pos != t.argc) {
+        if (!t.error) {
+            fprintf(stderr, "wsh: %s: syntax error\n", argv[0]);
+        }
+        return 2;
+    }
+
+    return result ? 0 : 1;
+}
+
+int wsh_prio(int argc, char **argv) {
+    fprintf(stderr, "wsh: prio: usage: prio N command ...\n");
+    return 2;
+}
+
+// Resource accounting: check_zombie reaps with wait4 and keeps the rusage
+// and the wall clock of every process
+
+static double timespec_seconds(struct timespec *ts) {
+    return ts->tv_sec + ts->tv_nsec / 1e9;
+}
+
+static double timeval_seconds(struct timeval *tv) {
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+double wsh_process_wall(struct process *proc) {
+    struct timespec now;
+
+    if (proc->started.tv_sec == 0 && proc->started.tv_nsec == 0) {
+        return 0;
+    }
+    if (proc->ended.tv_sec == 0 && proc->ended.tv_nsec == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return timespec_seconds(&now) - timespec_seconds(&proc->started);
+    }
+
+    return timespec_seconds(&proc->ended) - timespec_seconds(&proc->started);
+}
+
+static void print_duration(const char *label, double seconds) {
+    fprintf(stderr, "%s\t%dm%.3fs\n", label, (int) (seconds / 60), seconds - 60 * (int) (seconds / 60));
+}
+
+// Printing what a timed job cost, summed over its processes
+
+void wsh_time_report(struct job *job) {
+    struct process *proc;
+    struct timespec now;
+    double user = 0, sys = 0;
+    long maxrss = 0, minflt = 0, majflt = 0, nvcsw = 0, nivcsw = 0;
+
+    for (proc = job->root; proc != NULL; proc = proc->next) {
+        user += timeval_seconds(&proc->usage.ru_utime);
+        sys += timeval_seconds(&proc->usage.ru_stime);
+        maxrss = proc->usage.ru_maxrss > maxrss ? proc->usage.ru_maxrss : maxrss;
+        minflt += proc->usage.ru_minflt;
+        majflt += proc->usage.ru_majflt;
+        nvcsw += proc->usage.ru_nvcsw;
+        nivcsw += proc->usage.ru_nivcsw;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    fprintf(stderr, "\n");
+    print_duration("real", timespec_seconds(&now) - timespec_seconds(&job->started));
+    print_duration("user", user);
+    print_duration("sys", sys);
+    fprintf(stderr, "rss\t%ldk max\nfaults\t%ld minor, %ld major\nctxsw\t%ld voluntary, %ld involuntary\n",
+            maxrss, minflt, majflt, nvcsw, nivcsw);
+}
+
+// Printing the per-stage numbers of a job for jobs -l
+
+void print_job_usage(int id) {
+    struct process *proc;
+
+    for (proc = wsh_shell->jobs[id]->root; proc != NULL; proc = proc->next) {
+        if (proc->pid <= 0) {
+            continue;
+        }
+        printf("    %6d %-10s wall %.3fs user %.3fs sys %.3fs rss %ldk flt %ld/%ld csw %ld/%ld  %s\n",
+               proc->pid, STATUS_STRING[proc->status], wsh_process_wall(proc),
+               timeval_seconds(&proc->usage.ru_utime), timeval_seconds(&proc->usage.ru_stime),
+               proc->usage.ru_maxrss, proc->usage.ru_minflt, proc->usage.ru_majflt,
+               proc->usage.ru_nvcsw, proc->usage.ru_nivcsw, proc->command);
+    }
+}
+
+// Tracing. With WSH_TRACE=file (or --trace file) spans are recorded into
+// a buffer and written as Chrome trace-event JSON, viewable in Perfetto:
+// the shell's own work on one track, each job on a track of its own and
+// every process as a thread of its job. While off, a probe is one test
+// of wsh_tracing
+
+int wsh_tracing;
+static struct trace_event *trace_buffer;
+static int trace_count;
+static int trace_fd = -1;
+static pid_t trace_owner;
+static long trace_written;
+
+long wsh_trace_now() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int trace_escape(char *out, const char *str) {
+    char *start = out;
+
+    for (; *str != '\0'; str++) {
+        if (*str == '"' || *str == '\\') {
+            *out++ = '\\';
+            *out++ = *str;
+        } else if ((unsigned char) *str < 0x20) {
+            out += sprintf(out, "\\u%04x", *str);
+        } else {
+            *out++ = *str;
+        }
+    }
+    *out = '\0';
+
+    return out - start;
+}
+
+void wsh_trace_flush() {
+    char label[TRACE_LABEL_SIZE * 6];
+    size_t size = TRACE_BUFFER_EVENTS * (TRACE_LABEL_SIZE + 192), used = 0;
+    char *out;
+    int i;
+
+    if (trace_fd < 0 || getpid() != trace_owner || trace_count == 0) {
+        trace_count = 0;        // a forked child's copy of the buffer
+        return;
+    }
+    out = malloc(size);
+    if (!out) {
+        fprintf(stderr, "wsh: allocation error");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < trace_count; i++) {
+        struct trace_event *event = &trace_buffer[i];
+        if (size - used < sizeof(label) + 256) {
+            if (write(trace_fd, out, used) < 0) {
+                break;
+            }
+            used = 0;
+        }
+        trace_escape(label, event->label);
+        if (event->phase == 'X') {
+            used += sprintf(out + used,
+                            "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%ld.%03ld,\"dur\":%ld.%03ld,"
+                            "\"args\":{\"detail\":\"%s\"}}", trace_written++ ? ",\n" : "", event->name,
+                            event->pid, event->tid, event->start / 1000, event->start % 1000,
+                            event->duration / 1000, event->duration % 1000, label);
+        } else {
+            used += sprintf(out + used,
+                            "%s{\"name\":\"%s\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                            trace_written++ ? ",\n" : "", event->name, event->pid, event->tid, label);
+        }
+    }
+    if (used > 0 && write(trace_fd, out, used) < 0) {
+        perror("wsh: trace");
+    }
+    free(out);
+    trace_count = 0;
+}
+
+static struct trace_event *trace_add(char phase, const char *name, int pid, int tid, const char *label) {
+    if (trace_count == TRACE_BUFFER_EVENTS) {
+        wsh_trace_flush();
+    }
+
+    struct trace_event *event = &trace_buffer[trace_count++];
+    event->phase = phase;
+    event->name = name;
+    event->pid = pid;
+    event->tid = tid;
+    if (label == NULL) {
+        label = "";
+    }
+    size_t length = strnlen(label, TRACE_LABEL_SIZE - 1);
+    memcpy(event->label, label, length);
+    event->label[length] = '\0';
+
+    return event;
+}
+
+// Recording a span that started at start (from wsh_trace_now) and ends
+// now, on the track of job id (the shell's track when id <= 0)
+
+void wsh_trace_span(const char *name, int id, long start, const char *label) {
+    struct trace_event *event = trace_add('X', name, id > 0 ? id : trace_owner, 0, label);
+
+    event->start = start;
+    event->duration = wsh_trace_now() - start;
+}
+
+void wsh_trace_name(int id, int tid, const char *label) {
+    trace_add('M', tid == 0 ? "process_name" : "thread_name", id > 0 ? id : trace_owner, tid, label);
+}
+
+// Recording a reaped process' run on its own thread of the job's track
+
+void wsh_trace_process(int id, struct process *proc) {
+    struct trace_event *event = trace_add('X', "run", id > 0 ? id : trace_owner, proc->pid, proc->command);
+
+    event->start = proc->started.tv_sec * 1000000000L + proc->started.tv_nsec;
+    event->duration = (proc->ended.tv_sec - proc->started.tv_sec) * 1000000000L
+                      + proc->ended.tv_nsec - proc->started.tv_nsec;
+}
+
+void wsh_trace_close() {
+    if (trace_fd < 0 || getpid() != trace_owner) {
+        return;
+    }
+    wsh_trace_flush();
+    if (write(trace_fd, "\n]\n", 3) < 0) {
+        perror("wsh: trace");
+    }
+    close(trace_fd);
+    trace_fd = -1;
+    wsh_tracing = 0;
+}
+
+int wsh_trace_init(const char *path) {
+    trace_fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+    if (trace_fd < 0) {
+        perror("wsh: trace");
+        return -1;
+    }
+    trace_buffer = (struct trace_event*) malloc(TRACE_BUFFER_EVENTS * sizeof(struct trace_event));
+    if (!trace_buffer) {
+        fprintf(stderr, "wsh: allocation error");
+        exit(EXIT_FAILURE);
+    }
+    if (write(trace_fd, "[\n", 2) < 0) {
+        perror("wsh: trace");
+    }
+    trace_owner = getpid();
+    trace_count = 0;
+    trace_written = 0;
+    atexit(wsh_trace_close);
+    wsh_tracing = 1;
+    wsh_trace_name(0, 0, "wsh");
+
+    return 0;
+}
+
+// Recording a child's state change, reaped here or by the fork server
+
+void wsh_child_changed(pid_t pid, int status, struct rusage *usage) {
+    struct process *proc = get_process_by_pid(pid);
+    if (proc == NULL) {
+        return;
+    }
+    int job_id = get_job_id_by_pid(pid);
+    struct job *job = get_job_by_id(job_id);
+
+    if (WIFEXITED(status) || WIFSIGNALED(status)) {
+        proc->usage = *usage;
+        clock_gettime(CLOCK_MONOTONIC, &proc->ended);
+    }
+    if (WIFEXITED(status)) {
+        proc->status = STATUS_DONE;
+        proc->exit_status = status;
+    } else if (WIFSIGNALED(status)) {
+        proc->status = job != NULL && job->timed_out ? STATUS_TIMEDOUT : STATUS_TERMINATED;
+        proc->exit_status = status;
+    } else if (WIFSTOPPED(status)) {
+        proc->status = STATUS_SUSPENDED;
+    } else if (WIFCONTINUED(status)) {
+        proc->status = STATUS_CONTINUED;
+    }
+
+    if (wsh_tracing && (WIFEXITED(status) || WIFSIGNALED(status))) {
+        wsh_trace_process(job_id, proc);
+    }
+    if (job != NULL) {
+        wsh_sched_account(job);
+    }
+    if (job != NULL && job->parallel != NULL) {
+        wsh_parallel_step(job);
+    }
+    // a job killed at its deadline stays listed until jobs reports it
+    if (job != NULL && job->mode == BACKGROUND_EXECUTION && is_job_completed(job_id)) {
+        if (job->timed_out) {
+            wsh_timer_remove(job);
+        } else {
+            remove_job(job_id);
+        }
+    }
+}
+
+// Reaping children, called from the event loop whenever SIGCHLD arrives
+// or the fork server reports
+
+void check_zombie() {
+    struct server_status message;
+    struct rusage usage;
+    int status, pid, reaped = 0;
+    TRACE_START(trace_start);
+
+    while ((pid = wait4(-1, &status, WNOHANG|WUNTRACED|WCONTINUED, &usage)) > 0) {
+        wsh_child_changed(pid, status, &usage);
+        reaped++;
+    }
+    while (wsh_shell->server_status_fd >= 0 &&
+           recv(wsh_shell->server_status_fd, &message, sizeof(message), MSG_DONTWAIT) == sizeof(message)) {
+        wsh_child_changed(message.pid, message.status, &message.usage);
+        reaped++;
+    }
+    if (reaped > 0) {
+        TRACE_SPAN("reap", 0, trace_start, NULL);
+    }
+
+    if (wsh_shell->sched_queue != NULL) {
+        wsh_sched_run();
+    }
+}
+
+// Setting up the event loop: SIGCHLD is blocked and delivered through a
+// signalfd, which epoll watches together with the terminal input
+
+void wsh_event_init() {
+    struct epoll_event event;
+    sigset_t mask;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+
+    wsh_shell->signal_fd = signalfd(-1, &mask, SFD_NONBLOCK|SFD_CLOEXEC);
+    wsh_shell->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (wsh_shell->signal_fd < 0 || wsh_shell->epoll_fd < 0) {
+        perror("wsh: event loop");
+        exit(EXIT_FAILURE);
+    }
+
+    event.events = EPOLLIN;
+    event.data.u32 = EVENT_SIGCHLD;
+    epoll_ctl(wsh_shell->epoll_fd, EPOLL_CTL_ADD, wsh_shell->signal_fd, &event);
+
+    if (wsh_shell->server_status_fd >= 0) {
+        event.data.u32 = EVENT_SIGCHLD;
+        epoll_ctl(wsh_shell->epoll_fd, EPOLL_CTL_ADD, wsh_shell->server_status_fd, &event);
+    }
+
+    wsh_shell->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+    if (wsh_shell->timer_fd >= 0) {
+        event.data.u32 = EVENT_TIMER;
+        epoll_ctl(wsh_shell->epoll_fd, EPOLL_CTL_ADD, wsh_shell->timer_fd, &event);
+    }
+
+    // regular files cannot be polled, reads on them never block anyway
+    event.data.u32 = EVENT_INPUT;
+    wsh_shell->input_pollable = epoll_ctl(wsh_shell->epoll_fd, EPOLL_CTL_ADD, 0, &event) == 0;
+}
+
+// Running one round of the event loop, returns 1 when input is readable
+
+int wsh_event_poll(int timeout) {
+    struct epoll_event events[EVENT_BATCH];
+    struct signalfd_siginfo info;
+    int i, count, input_ready = 0;
+
+    count = epoll_wait(wsh_shell->epoll_fd, events, EVENT_BATCH, timeout);
+
+    for (i = 0; i < count; i++) {
+        switch (events[i].data.u32) {
+            case EVENT_SIGCHLD:
+                while (read(wsh_shell->signal_fd, &info, sizeof(info)) == sizeof(info));
+                check_zombie();
+                break;
+            case EVENT_TIMER:
+                wsh_timer_expire();
+                break;
+            case EVENT_INPUT:
+                input_ready = 1;
+                break;
+        }
+    }
+
+    return input_ready;
+}
+
+// Waiting for the next child state change or deadline only, for at most
+// timeout ms (-1 for no limit). Typed-ahead input stays pending for the
+// prompt instead of waking (and spinning) the wait
+
+void wsh_event_wait_child(int timeout) {
+    struct pollfd pfd[3] = {
+        { .fd = wsh_shell->signal_fd, .events = POLLIN },
+        { .fd = wsh_shell->timer_fd, .events = POLLIN },
+        { .fd = wsh_shell->server_status_fd, .events = POLLIN },
+    };
+    struct signalfd_siginfo info;
+
+    if (poll(pfd, wsh_shell->server_status_fd >= 0 ? 3 : 2, timeout) > 0) {
+        while (read(wsh_shell->signal_fd, &info, sizeof(info)) == sizeof(info));
+        if (pfd[1].revents & POLLIN) {
+            wsh_timer_expire();
+        }
+    }
+    check_zombie();
+}
+
+// Running a builtin inside the shell. stdin and stdout point at the
+// stage's descriptors for the length of the call, so redirections and a
+// trailing pipe stage behave as they would for a command
+
+int wsh_run_builtin(struct process *proc, int in_fd, int out_fd, int mode) {
+    int saved_in = -1, saved_out = -1, status;
+
+    fflush(stdout);
+    if (in_fd != 0) {
+        saved_in = fcntl(0, F_DUPFD_CLOEXEC, 10);
+        dup2(in_fd, 0);
+    }
+    if (out_fd != 1) {
+        saved_out = fcntl(1, F_DUPFD_CLOEXEC, 10);
+        dup2(out_fd, 1);
+    }
+
+    wsh_shell->builtin_mode = mode;
+    wsh_shell->builtin_input = in_fd == 0;
+    status = proc->builtin->run(proc->argc, proc->argv);
+    fflush(stdout);
+
+    if (saved_in >= 0) {
+        dup2(saved_in, 0);
+        close(saved_in);
+    }
+    if (saved_out >= 0) {
+        dup2(saved_out, 1);
+        close(saved_out);
+    }
+
+    return status < 0 ? 1 : status;
+}
+
+// Forking a builtin that sits mid-pipeline (or a utility put in the
+// background). SIGCHLD stays blocked so the child's own event loop works
+
+pid_t wsh_fork_builtin(struct job *job, struct process *proc, int in_fd, int out_fd) {
+    pid_t childpid;
+
+    fflush(stdout);
+    childpid = fork();
+    if (childpid == 0) {
+        signal(SIGINT, SIG_DFL);
+        signal(SIGQUIT, SIG_DFL);
+        signal(SIGTSTP, SIG_DFL);
+        signal(SIGTTIN, SIG_DFL);
+        signal(SIGTTOU, SIG_DFL);
+        setpgid(0, job->pgid > 0 ? job->pgid : 0);
+
+        if (in_fd != 0) {
+            dup2(in_fd, 0);
+            close(in_fd);
+        }
+        if (out_fd != 1) {
+            dup2(out_fd, 1);
+            close(out_fd);
+        }
+
+        wsh_shell->builtin_mode = FOREGROUND_EXECUTION;
+        wsh_shell->builtin_input = 0;
+        int status = proc->builtin->run(proc->argc, proc->argv);
+        fflush(stdout);
+        _exit(status < 0 ? 1 : status);
+    }
+
+    return childpid;
+}
+
+// Hashing strings for the shell's lookup tables (FNV-1a)
+
+unsigned int wsh_hash_string(const char *str) {
+    unsigned int hash = 2166136261u;
+
+    while (*str != '\0') {
+        hash ^= (unsigned char) *str++;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+// Shell variables. Every variable is kept as its "NAME=value" string, so
+// a child's environment is just the array of the exported ones. That
+// array is built once and handed to every spawn until an exported
+// variable changes; the strings a built array points at are retired
+// rather than freed, so it stays intact until the next one replaces it.
+
+static unsigned int var_hash(const char *name, size_t length) {
+    unsigned int hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < length; i++) {
+        hash ^= (unsigned char) name[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+// Finding the link that points at a variable, or where it would go
+
+static struct variable **var_slot(struct var_store *store, const char *name, size_t length, unsigned int hash) {
+    struct variable **link = &store->buckets[hash & (store->bucket_count - 1)];
+
+    for (; *link != NULL; link = &(*link)->next) {
+        struct variable *var = *link;
+        if (var->hash == hash && var->name_length == length && memcmp(var->entry, name, length) == 0) {
+            break;
+        }
+    }
+
+    return link;
+}
+
+// Doubling the buckets once there are more variables than buckets
+
+static void var_grow(struct var_store *store) {
+    int count = store->bucket_count * 2, i;
+    struct variable **buckets = (struct variable**) calloc(count, sizeof(struct variable*)), *var, *next;
+
+    if (!buckets) {
+        fprintf(stderr, "wsh: allocation error");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < store->bucket_count; i++) {
+        for (var = store->buckets[i]; var != NULL; var = next) {
+            next = var->next;
+            var->next = buckets[var->hash & (count - 1)];
+            buckets[var->hash & (count - 1)] = var;
+        }
+    }
+    free(store->buckets);
+    store->buckets = buckets;
+    store->bucket_count = count;
+}
+
+// Dropping the string of a variable. An exported one may be in the
+// environment array children are given, so it lives until the rebuild.
+
+static void var_retire(struct var_store *store, struct variable *var) {
+    if (!var->exported || store->envp == NULL) {
+        free(var->entry);
+        return;
+    }
+    if (store->retired_count == store->retired_capacity) {
+        store->retired_capacity = store->retired_capacity * 2 + 16;
+        store->retired = (char**) realloc(store->retired, store->retired_capacity * sizeof(char*));
+        if (!store->retired) {
+            fprintf(stderr, "wsh: allocation error");
+            exit(EXIT_FAILURE);
+        }
+    }
+    store->retired[store->retired_count++] = var->entry;
+}
+
+// Setting a variable in a store; a NULL value only changes its flags
+
+static void var_store_set(struct var_store *store, const char *name, size_t length, const char *value, int flags) {
+    unsigned int hash = var_hash(name, length);
+    struct variable **link = var_slot(store, name, length, hash), *var = *link;
+
+    if (var == NULL) {
+        if (value == NULL) {
+            return;
+        }
+        var = (struct variable*) malloc(sizeof(struct variable));
+        if (!var) {
+            fprintf(stderr, "wsh: allocation error");
+            exit(EXIT_FAILURE);
+        }
+        var->entry = NULL;
+        var->name_length = length;
+        var->hash = hash;
+        var->exported = 0;
+        var->next = NULL;
+        *link = var;
+        if (++store->count > store->bucket_count) {
+            var_grow(store);
+        }
+    }
+
+    if (value != NULL) {
+        size_t value_length = strlen(value);
+        char *entry = (char*) malloc(length + value_length + 2);
+        if (!entry) {
+            fprintf(stderr, "wsh: allocation error");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(entry, name, length);
+        entry[length] = '=';
+        memcpy(entry + length + 1, value, value_length + 1);
+        if (var->entry != NULL) {
+            var_retire(store, var);
+        }
+        var->entry = entry;
+        store->envp_stale |= var->exported;
+    }
+    if ((flags & VAR_EXPORT) && !var->exported) {
+        var->exported = 1;
+        store->exported++;
+        store->envp_stale = 1;
+    }
+}
+
+// Creating a store holding the NAME=value strings of env, all exported
+
+struct var_store *var_store_create(char **env) {
+    struct var_store *store = (struct var_store*) calloc(1, sizeof(struct var_store));
+
+    if (store != NULL) {
+        store->bucket_count = VAR_BUCKETS_INITIAL;
+        store->buckets = (struct variable**) calloc(store->bucket_count, sizeof(struct variable*));
+    }
+    if (!store || !store->buckets) {
+        fprintf(stderr, "wsh: allocation error");
+        exit(EXIT_FAILURE);
+    }
+    store->envp_stale = 1;
+
+    for (; env != NULL && *env != NULL; env++) {
+        char *equals = strchr(*env, '=');
+        if (equals != NULL) {
+            var_store_set(store, *env, equals - *env, equals + 1, VAR_EXPORT);
+        }
+    }
+
+    return store;
+}
+
+void var_store_free(struct var_store *store) {
+    struct variable *var, *next;
+    int i;
+
+    for (i = 0; i < store->bucket_count; i++) {
+        for (var = store->buckets[i]; var != NULL; var = next) {
+            next = var->next;
+            free(var->entry);
+            free(var);
+        }
+    }
+    for (i = 0; i < store->retired_count; i++) {
+        free(store->retired[i]);
+    }
+    free(store->retired);
+    free(store->envp);
+    free(store->buckets);
+    free(store);
+}
+
+// Looking up the value of a variable, NULL when it is not set
+
+const char *wsh_get_var(const char *name, size_t length) {
+    struct var_store *store = wsh_shell->vars;
+    struct variable *var = *var_slot(store, name, length, var_hash(name, length));
+
+    return var != NULL ? var->entry + length + 1 : NULL;
+}
+
+void wsh_set_var(const char *name, size_t length, const char *value, int flags) {
+    var_store_set(wsh_shell->vars, name, length, value, flags);
+}
+
+int wsh_unset_var(const char *name, size_t length) {
+    struct var_store *store = wsh_shell->vars;
+    struct variable **link = var_slot(store, name, length, var_hash(name, length)), *var = *link;
+
+    if (var == NULL) {
+        return 0;
+    }
+    *link = var->next;
+    store->count--;
+    if (var->exported) {
+        store->exported--;
+        store->envp_stale = 1;
+    }
+    var_retire(store, var);
+    free(var);
+
+    return 1;
+}
+
+// The environment for a child: the cached array, rebuilt first when an
+// exported variable changed since it was built. environ follows it so
+// getenv() in the shell sees the same variables.
+
+char **wsh_var_envp() {
+    struct var_store *store = wsh_shell->vars;
+    struct variable *var;
+    int i, count = 0;
+
+    if (!store->envp_stale) {
+        return store->envp;
+    }
+
+    char **envp = (char**) malloc((store->exported + 1) * sizeof(char*));
+    if (!envp) {
+        fprintf(stderr, "wsh: allocation error");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < store->bucket_count; i++) {
+        for (var = store->buckets[i]; var != NULL; var = var->next) {
+            if (var->exported) {
+                envp[count++] = var->entry;
+            }
+        }
+    }
+    envp[count] = NULL;
+
+    for (i = 0; i < store->retired_count; i++) {
+        free(store->retired[i]);
+    }
+    store->retired_count = 0;
+    free(store->envp);
+    store->envp = envp;
+    store->envp_stale = 0;
+    store->envp_builds++;
+    environ = envp;
+
+    return envp;
+}
+
+// The environment of a command with assignments of its own, NAME=value
+// cmd: the cached array with those variables replaced, in the job's arena
+
+static char **var_overlay(char **assigns, int count, struct arena *arena) {
+    char **base = wsh_var_envp(), **envp;
+    int i, j, n = 0;
+
+    while (base[n] != NULL) {
+        n++;
+    }
+    envp = (char**) arena_alloc(arena, (n + count + 1) * sizeof(char*));
+
+    n = 0;
+    for (i = 0; base[i] != NULL; i++) {
+        size_t length = strchr(base[i], '=') - base[i] + 1;
+        for (j = 0; j < count && strncmp(assigns[j], base[i], length) != 0; j++);
+        if (j == count) {
+            envp[n++] = base[i];
+        }
+    }
+    for (i = 0; i < count; i++) {
+        size_t length = strchr(assigns[i], '=') - assigns[i] + 1;
+        for (j = i + 1; j < count && strncmp(assigns[j], assigns[i], length) != 0; j++);
+        if (j == count) {          // the last assignment to a name wins
+            envp[n++] = assigns[i];
+        }
+    }
+    envp[n] = NULL;
+
+    return envp;
+}
+
+// Length of the variable name at the start of str, 0 when there is none
+
+static size_t var_name_length(const char *str) {
+    size_t length = 0;
+
+    if (!isalpha((unsigned char) *str) && *str != '_') {
+        return 0;
+    }
+    while (isalnum((unsigned char) str[length]) || str[length] == '_') {
+        length++;
+    }
+
+    return length;
+}
+
+// Freeing a cache entry; entries loaded from a snapshot keep their
+// strings in the mapping
+
+static void path_entry_free(struct path_entry *entry) {
+    char *snapshot = (char*) wsh_shell->snapshot;
+
+    if (snapshot == NULL || entry->name < snapshot || entry->name >= snapshot + wsh_shell->snapshot_length) {
+        free(entry->name);
+        free(entry->path);
+    }
+    free(entry);
+}
+
+// Flushing the PATH lookup cache
+
+void path_cache_flush() {
+    struct path_cache *cache = &wsh_shell->path_cache;
+    struct path_entry *entry, *tmp;
+    int i;
+
+    for (i = 0; i < PATH_CACHE_BUCKETS; i++) {
+        for (entry = cache->buckets[i]; entry != NULL; ) {
+            tmp = entry->next;
+            path_entry_free(entry);
+            entry = tmp;
+        }
+        cache->buckets[i] = NULL;
+    }
+}
+
+// Checking the PATH directories for changes, a new binary dropped into an
+// earlier directory would shadow what we cached so any change flushes all
+
+int path_cache_dirs_changed() {
+    struct path_cache *cache = &wsh_shell->path_cache;
+    struct stat st;
+    char *dirs = strdup(cache->path_env), *dir, *saveptr = NULL;
+    int i = 0, changed = 0;
+
+    for (dir = strtok_r(dirs, ":", &saveptr); dir != NULL; dir = strtok_r(NULL, ":", &saveptr), i++) {
+        struct timespec mtime = {0, 0};
+        if (stat(dir, &st) == 0) {
+            mtime = st.st_mtim;
+        }
+        if (i < cache->dir_count &&
+            (cache->dir_mtimes[i].tv_sec != mtime.tv_sec || cache->dir_mtimes[i].tv_nsec != mtime.tv_nsec)) {
+            changed = 1;
+        }
+        if (i >= cache->dir_count) {
+            cache->dir_mtimes = realloc(cache->dir_mtimes, (i + 1) * sizeof(struct timespec));
+            cache->dir_count = i + 1;
+            changed = 1;
+        }
+        cache->dir_mtimes[i] = mtime;
+    }
+
+    free(dirs);
+    return changed;
+}
+
+// Resolving a command name to an absolute path through the PATH cache
+
+char *path_cache_lookup(char *name) {
+    struct path_cache *cache = &wsh_shell->path_cache;
+    struct path_entry *entry, **link;
+    struct stat st;
+    const char *path_env = wsh_get_var("PATH", 4);
+    time_t now = time(NULL);
+
+    if (strchr(name, '/') != NULL) {
+        return name;
+    }
+    if (path_env == NULL) {
+        path_env = "/usr/local/bin:/usr/bin:/bin";
+    }
+
+    if (cache->path_env == NULL || strcmp(cache->path_env, path_env) != 0) {
+        path_cache_flush();
+        free(cache->path_env);
+        cache->path_env = strdup(path_env);
+        cache->dir_count = 0;
+        path_cache_dirs_changed();
+        cache->checked_at = now;
+    } else if (now - cache->checked_at >= PATH_CACHE_RECHECK) {
+        if (path_cache_dirs_changed()) {
+            path_cache_flush();
+        }
+        cache->checked_at = now;
+    }
+
+    unsigned int bucket = wsh_hash_string(name) % PATH_CACHE_BUCKETS;
+    for (link = &cache->buckets[bucket]; (entry = *link) != NULL; link = &entry->next) {
+        if (strcmp(entry->name, name) != 0) {
+            continue;
+        }
+        if (stat(entry->path, &st) == 0 && S_ISREG(st.st_mode) && (st.st_mode & 0111)) {
+            entry->hits++;
+            cache->hits++;
+            return entry->path;
+        }
+        *link = entry->next;         // the cached binary is gone
+        path_entry_free(entry);
+        break;
+    }
+
+    cache->misses++;
+
+    char *dirs = strdup(cache->path_env), *dir, *saveptr = NULL;
+    char *path = NULL;
+    for (dir = strtok_r(dirs, ":", &saveptr); dir != NULL; dir = strtok_r(NULL, ":", &saveptr)) {
+        path = malloc(strlen(dir) + strlen(name) + 2);
+        sprintf(path, "%s/%s", dir, name);
+        if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, X_OK) == 0) {
+            break;
+        }
+        free(path);
+        path = NULL;
+    }
+    free(dirs);
+
+    if (path == NULL) {
+        return NULL;
+    }
+
+    entry = (struct path_entry*) malloc(sizeof(struct path_entry));
+    entry->name = strdup(name);
+    entry->path = path;
+    entry->hits = 1;
+    entry->next = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+
+    return path;
+}
+
+// Picking the spawn engine, WSH_SPAWN=fork forces the plain fork() path
+// and WSH_SPAWN=server launches through the fork server
+
+int wsh_get_spawn_engine() {
+    char *engine = getenv("WSH_SPAWN");
+
+    if (engine != NULL && strcmp(engine, "fork") == 0) {
+        return SPAWN_ENGINE_FORK;
+    }
+    if (engine != NULL && strcmp(engine, "server") == 0) {
+        return SPAWN_ENGINE_SERVER;
+    }
+
+    return SPAWN_ENGINE_POSIX;
+}
+
+// Spawning external commands with posix_spawn, glibc runs it on top of
+// clone(CLONE_VM|CLONE_VFORK) so the shell's page tables are never copied
+
+pid_t wsh_spawn_process(struct job *job, struct process *proc, int in_fd, int out_fd) {
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t actions;
+    sigset_t sigdefault, sigmask;
+    pid_t childpid = -1;
+    short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETPGROUP;
+    int err;
+
+#ifdef POSIX_SPAWN_USEVFORK
+    flags |= POSIX_SPAWN_USEVFORK;
+#endif
+
+    sigemptyset(&sigdefault);
+    sigaddset(&sigdefault, SIGINT);
+    sigaddset(&sigdefault, SIGQUIT);
+    sigaddset(&sigdefault, SIGTSTP);
+    sigaddset(&sigdefault, SIGTTIN);
+    sigaddset(&sigdefault, SIGTTOU);
+    sigaddset(&sigdefault, SIGCHLD);
+    sigemptyset(&sigmask);
+
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, flags);
+    posix_spawnattr_setsigdefault(&attr, &sigdefault);
+    posix_spawnattr_setsigmask(&attr, &sigmask);
+    posix_spawnattr_setpgroup(&attr, job->pgid > 0 ? job->pgid : 0);
+
+    posix_spawn_file_actions_init(&actions);
+    if (in_fd != 0) {
+        posix_spawn_file_actions_adddup2(&actions, in_fd, 0);
+        posix_spawn_file_actions_addclose(&actions, in_fd);
+    }
+    if (out_fd != 1) {
+        posix_spawn_file_actions_adddup2(&actions, out_fd, 1);
+        posix_spawn_file_actions_addclose(&actions, out_fd);
+    }
+
+    char *path = path_cache_lookup(proc->argv[0]);
+    err = path != NULL ? posix_spawn(&childpid, path, &actions, &attr, proc->argv, proc->envp) : ENOENT;
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+
+    if (err != 0) {
+        if (err == ENOENT) {
+            printf("wsh: %s: command not found\n", proc->argv[0]);
+        } else {
+            printf("wsh: %s: %s\n", proc->argv[0], strerror(err));
+        }
+        return -1;
+    }
+
+    return childpid;
+}
+
+// Fork server. A helper forked at startup, while the shell is still small,
+// spawns external commands on request so launch cost does not grow with
+// the shell. Requests and spawn replies share one stream socket; the
+// server reaps its children and reports them on a second, datagram-style
+// socket that the shell's event loop watches
+
+static int server_read_full(int fd, void *buf, size_t size) {
+    size_t done = 0;
+
+    while (done < size) {
+        ssize_t n = read(fd, (char*) buf + done, size - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+// Receiving one request with its descriptors, -1 once the peer is gone.
+// Used by the fork server and the resident shell, whose requests both
+// start with the size of the payload that follows them.
+
+static int server_receive(int fd, void *request, size_t request_size, char **payload, int fds[SERVER_FD_COUNT]) {
+    char control[CMSG_SPACE(SERVER_FD_COUNT * sizeof(int))];
+    struct iovec iov = { .iov_base = request, .iov_len = request_size };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+    struct cmsghdr *cmsg;
+    ssize_t n;
+
+    while ((n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR);
+    if (n <= 0) {
+        return -1;
+    }
+    if ((size_t) n < request_size && server_read_full(fd, (char*) request + n, request_size - n) < 0) {
+        return -1;
+    }
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(SERVER_FD_COUNT * sizeof(int))) {
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), SERVER_FD_COUNT * sizeof(int));
+
+    uint32_t size = *(uint32_t*) request;     // every request starts with its payload size
+    *payload = malloc(size + 1);
+    if (*payload == NULL || server_read_full(fd, *payload, size) < 0) {
+        return -1;
+    }
+    (*payload)[size] = '\0';
+    return 0;
+}
+
+static void server_spawn(int fd, struct server_request *request, char *payload, int fds[SERVER_FD_COUNT]) {
+    char **argv = malloc((request->argc + request->envc + 2) * sizeof(char*)), **envp = argv + request->argc + 1;
+    char *path = payload, *cwd = path + strlen(path) + 1, *c = cwd + strlen(cwd) + 1;
+    struct server_reply reply = { .pid = -1, .error = 0 };
+    int i;
+
+    for (i = 0; i < request->argc + request->envc; i++) {
+        argv[i < request->argc ? i : i + 1] = c;
+        c += strlen(c) + 1;
+    }
+    argv[request->argc] = NULL;
+    envp[request->envc] = NULL;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        sigset_t mask;
+        signal(SIGINT, SIG_DFL);
+        signal(SIGQUIT, SIG_DFL);
+        signal(SIGTSTP, SIG_DFL);
+        signal(SIGTTIN, SIG_DFL);
+        signal(SIGTTOU, SIG_DFL);
+        signal(SIGCHLD, SIG_DFL);
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+
+        setpgid(0, request->pgid);
+        for (i = 0; i < SERVER_FD_COUNT; i++) {
+            dup2(fds[i], i);
+        }
+        if (chdir(cwd) < 0 || execve(path, argv, envp) < 0) {
+            dprintf(2, "wsh: %s: %s\n", argv[0], strerror(errno));
+        }
+        _exit(127);
+    }
+
+    if (pid > 0) {
+        setpgid(pid, request->pgid > 0 ? request->pgid : pid);
+        reply.pid = pid;
+    } else {
+        reply.error = errno;
+    }
+    if (write(fd, &reply, sizeof(reply)) < 0) {
+        _exit(EXIT_FAILURE);
+    }
+    free(argv);
+}
+
+// The server's loop: spawning on request, reaping on SIGCHLD. Reports
+// are queued while the shell's socket is full so neither side can block
+// the other
+
+static void server_loop(int fd, int status_fd) {
+    struct server_status *queue = NULL;
+    int queued = 0, capacity = 0, i;
+    sigset_t mask;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    int signal_fd = signalfd(-1, &mask, SFD_NONBLOCK|SFD_CLOEXEC);
+
+    while (1) {
+        struct pollfd pfd[3] = {
+            { .fd = fd, .events = POLLIN },
+            { .fd = signal_fd, .events = POLLIN },
+            { .fd = status_fd, .events = queued > 0 ? POLLOUT : 0 },
+        };
+        if (poll(pfd, 3, -1) < 0) {
+            continue;
+        }
+
+        if (pfd[0].revents) {
+            struct server_request request;
+            char *payload = NULL;
+            int fds[SERVER_FD_COUNT];
+            if (server_receive(fd, &request, sizeof(request), &payload, fds) < 0) {
+                _exit(EXIT_SUCCESS);
+            }
+            server_spawn(fd, &request, payload, fds);
+            for (i = 0; i < SERVER_FD_COUNT; i++) {
+                close(fds[i]);
+            }
+            free(payload);
+        }
+
+        if (pfd[1].revents) {
+            struct signalfd_siginfo info;
+            struct server_status status;
+            while (read(signal_fd, &info, sizeof(info)) == sizeof(info));
+            while ((status.pid = wait4(-1, &status.status, WNOHANG|WUNTRACED|WCONTINUED, &status.usage)) > 0) {
+                if (queued == capacity) {
+                    capacity = capacity ? capacity * 2 : TOKEN_BUFSIZE;
+                    queue = realloc(queue, capacity * sizeof(struct server_status));
+                    if (!queue) {
+                        _exit(EXIT_FAILURE);
+                    }
+                }
+                queue[queued++] = status;
+            }
+        }
+
+        for (i = 0; i < queued; i++) {
+            if (send(status_fd, &queue[i], sizeof(queue[i]), MSG_DONTWAIT) != sizeof(queue[i])) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    _exit(EXIT_SUCCESS);
+                }
+                break;
+            }
+        }
+        memmove(queue, queue + i, (queued - i) * sizeof(struct server_status));
+        queued -= i;
+    }
+}
+
+// Starting the fork server, returns -1 (and the shell keeps posix_spawn)
+// when it cannot be set up
+
+int wsh_server_start() {
+    int request_fds[2], status_fds[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, request_fds) < 0) {
+        return -1;
+    }
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0, status_fds) < 0) {
+        close(request_fds[0]);
+        close(request_fds[1]);
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(request_fds[0]);
+        close(status_fds[0]);
+        server_loop(request_fds[1], status_fds[1]);
+    }
+    close(request_fds[1]);
+    close(status_fds[1]);
+    if (pid < 0) {
+        close(request_fds[0]);
+        close(status_fds[0]);
+        return -1;
+    }
+
+    wsh_shell->server_pid = pid;
+    wsh_shell->server_fd = request_fds[0];
+    wsh_shell->server_status_fd = status_fds[0];
+    return 0;
+}
+
+// Spawning an external command through the fork server
+
+pid_t wsh_server_spawn(struct job *job, struct process *proc, int in_fd, int out_fd) {
+    char *path = path_cache_lookup(proc->argv[0]), cwd[PATH_MAX];
+    struct server_request request = { .size = 0, .pgid = job->pgid > 0 ? job->pgid : 0 };
+    struct server_reply reply;
+    int fds[SERVER_FD_COUNT] = { in_fd, out_fd, 2 }, i;
+
+    if (path == NULL) {
+        printf("wsh: %s: command not found\n", proc->argv[0]);
+        return -1;
+    }
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        strcpy(cwd, "/");
+    }
+
+    request.size = strlen(path) + 1 + strlen(cwd) + 1;
+    for (i = 0; i < proc->argc; i++) {
+        request.size += strlen(proc->argv[i]) + 1;
+    }
+    for (i = 0; proc->envp[i] != NULL; i++) {
+        request.size += strlen(proc->envp[i]) + 1;
+    }
+    request.argc = proc->argc;
+    request.envc = i;
+
+    size_t length = sizeof(request) + request.size;
+    char *message = malloc(length), *c = message + sizeof(request);
+    if (!message) {
+        fprintf(stderr, "wsh: allocation error");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(message, &request, sizeof(request));
+    c = stpcpy(c, path) + 1;
+    c = stpcpy(c, cwd) + 1;
+    for (i = 0; i < proc->argc; i++) {
+        c = stpcpy(c, proc->argv[i]) + 1;
+    }
+    for (i = 0; proc->envp[i] != NULL; i++) {
+        c = stpcpy(c, proc->envp[i]) + 1;
+    }
+
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = { .iov_base = message, .iov_len = length };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    ssize_t n;
+    while ((n = sendmsg(wsh_shell->server_fd, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR);
+    size_t sent = n > 0 ? (size_t) n : 0;
+    while (n > 0 && sent < length) {
+        n = write(wsh_shell->server_fd, message + sent, length - sent);
+        if (n > 0) {
+            sent += n;
+        } else if (n < 0 && errno == EINTR) {
+            n = 1;
+        }
+    }
+    free(message);
+
+    if (sent < length || server_read_full(wsh_shell->server_fd, &reply, sizeof(reply)) < 0) {
+        printf("wsh: fork server exited, using posix_spawn\n");
+        close(wsh_shell->server_fd);
+        wsh_shell->server_fd = -1;
+        wsh_shell->spawn_engine = SPAWN_ENGINE_POSIX;
+        return wsh_spawn_process(job, proc, in_fd, out_fd);
+    }
+    if (reply.pid < 0) {
+        printf("wsh: %s: %s\n", proc->argv[0], strerror(reply.error));
+    }
+
+    return reply.pid;
+}
+
+// Spawning external commands with a plain fork, kept as the fallback engine
+
+pid_t wsh_fork_process(struct job *job, struct process *proc, int in_fd, int out_fd) {
+    char *path = path_cache_lookup(proc->argv[0]);
+    pid_t childpid = fork();
+
+    if (childpid == 0) {         // child process
+        signal(SIGINT, SIG_DFL);
+        signal(SIGQUIT, SIG_DFL);
+        signal(SIGTSTP, SIG_DFL);
+        signal(SIGTTIN, SIG_DFL);
+        signal(SIGTTOU, SIG_DFL);
+        signal(SIGCHLD, SIG_DFL);
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+
+        proc->pid = getpid();
+        if (job->pgid > 0) {
+            setpgid(0, job->pgid);
+        } else {
+            job->pgid = proc->pid;
+            setpgid(0, job->pgid);
+        }
+
+        if (in_fd != 0) {
+            dup2(in_fd, 0);
+            close(in_fd);
+        }
+
+        if (out_fd != 1) {
+            dup2(out_fd, 1);
+            close(out_fd);
+        }
+
+        // straight to the fd: the stdio buffers are the parent's copies
+        if (path == NULL || execve(path, proc->argv, proc->envp) < 0) {
+            dprintf(STDOUT_FILENO, "wsh: %s: command not found\n", proc->argv[0]);
+        }
+
+        _exit(127);
+    }
+
+    return childpid;
+}
+
+// Whether a builtin runs inside the shell: always as the last stage of a
+// foreground job, shell builtins in the background too, and never mid-pipeline.
+// One that can block for long is forked when the shell owns the terminal,
+// since the shell ignores SIGTSTP and Ctrl-Z could not stop it
+
+int wsh_builtin_in_shell(struct process *proc, int mode) {
+    if (mode == FOREGROUND_EXECUTION && (proc->builtin->flags & BUILTIN_BLOCKING) &&
+        isatty(0) && tcgetpgrp(0) == getpgrp()) {
+        return 0;
+    }
+    return mode == FOREGROUND_EXECUTION ||
+           (mode == BACKGROUND_EXECUTION && !(proc->builtin->flags & BUILTIN_UTILITY));
+}
+
+// Launching commands, the descriptors are handed over and closed in the
+// shell before any foreground wait
+
+int wsh_launch_process(struct job *job, struct process *proc, int in_fd, int out_fd, int mode) {
+    proc->status = STATUS_RUNNING;
+    // a builtin under a deadline runs in a child the timer can kill
+    if (proc->builtin != NULL && job->timeout_ms == 0 && wsh_builtin_in_shell(proc, mode)) {
+        TRACE_START(trace_start);
+        int code = wsh_run_builtin(proc, in_fd, out_fd, mode);
+        TRACE_SPAN("builtin", job->id, trace_start, proc->argv[0]);
+        if (in_fd != 0) {
+            close(in_fd);
+        }
+        if (out_fd != 1) {
+            close(out_fd);
+        }
+        proc->status = STATUS_DONE;
+        proc->exit_status = W_EXITCODE(code & 0xff, 0);
+        // the earlier stages of a foreground pipeline are still running
+        if (mode == FOREGROUND_EXECUTION && job->id > 0 && job->pgid > 0) {
+            return wsh_wait_foreground(job);
+        }
+        return 0;
+    }
+
+    pid_t childpid;
+    int status = 0;
+    TRACE_START(trace_start);
+
+    if (proc->envp == NULL) {          // no assignments of its own
+        proc->envp = wsh_var_envp();
+    }
+    if (proc->builtin != NULL) {
+        childpid = wsh_fork_builtin(job, proc, in_fd, out_fd);
+    } else if (wsh_shell->spawn_engine == SPAWN_ENGINE_FORK) {
+        childpid = wsh_fork_process(job, proc, in_fd, out_fd);
+    } else if (wsh_shell->spawn_engine == SPAWN_ENGINE_SERVER) {
+        childpid = wsh_server_spawn(job, proc, in_fd, out_fd);
+    } else {
+        childpid = wsh_spawn_process(job, proc, in_fd, out_fd);
+    }
+
+    if (in_fd != 0) {
+        close(in_fd);
+    }
+    if (out_fd != 1) {
+        close(out_fd);
+    }
+
+    if (wsh_tracing) {
+        static const char *SPAWN_SPANS[] = {"posix_spawn", "fork", "server spawn"};
+        wsh_trace_span(proc->builtin != NULL ? "builtin fork" : SPAWN_SPANS[wsh_shell->spawn_engine],
+                       job->id, trace_start, proc->argv[0]);
+        if (childpid > 0) {
+            char name[TRACE_LABEL_SIZE];
+            snprintf(name, sizeof(name), "%s [%d]", proc->argv[0], childpid);
+            wsh_trace_name(job->id, childpid, name);
+        }
+    }
+
+    if (childpid < 0) {
+        proc->status = STATUS_DONE;
+        proc->exit_status = W_EXITCODE(127, 0);
+    } else {   // parent process
+        proc->pid = childpid;
+        clock_gettime(CLOCK_MONOTONIC, &proc->started);
+        if (job->id > 0) {
+            pid_index_insert(childpid, job->id, proc);
+        }
+        if (job->pgid > 0) {
+            setpgid(childpid, job->pgid);
+        } else {
+            job->pgid = proc->pid;
+            setpgid(childpid, job->pgid);
+        }
+        if (job->priority != 0) {
+            wsh_apply_priority(childpid, job->priority);
+        }
+    }
+
+    if (mode == FOREGROUND_EXECUTION && job->pgid > 0) {
+        status = wsh_wait_foreground(job);
+    }
+
+    return status;
+}
+
+// Waiting for a foreground job with the terminal handed to it
+
+int wsh_wait_foreground(struct job *job) {
+    tcsetpgrp(0, job->pgid);
+    int status = wait_for_job(job->id);
+    signal(SIGTTOU, SIG_IGN);
+    tcsetpgrp(0, getpid());
+    signal(SIGTTOU, SIG_DFL);
+
+    return status;
+}
+
+static char *glob_unescape(struct arena *arena, const char *pattern);
+
+// Glob engine. Patterns are matched one path component at a time against
+// directory listings read with getdents64 and cached per directory; a
+// listing is reused while the directory's inode and mtime are unchanged.
+// Supports *, ?, [...] with ranges and [:classes:], {a,b} and {1..3}
+// braces, and ** for any number of directories
+
+struct wsh_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+void glob_cache_flush() {
+    int i;
+
+    if (wsh_shell->glob_cache == NULL) {
+        return;
+    }
+    for (i = 0; i < GLOB_CACHE_BUCKETS; i++) {
+        struct glob_dir *dir = wsh_shell->glob_cache[i];
+        while (dir != NULL) {
+            struct glob_dir *next = dir->next;
+            free(dir->path);
+            free(dir->names);
+            free(dir->offsets);
+            free(dir->types);
+            free(dir);
+            dir = next;
+        }
+        wsh_shell->glob_cache[i] = NULL;
+    }
+    wsh_shell->glob_cache_dirs = 0;
+}
+
+static void *glob_grow(void *ptr, size_t size) {
+    ptr = realloc(ptr, size);
+    if (!ptr) {
+        fprintf(stderr, "wsh: allocation error");
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+// Getting the listing of a directory, from the cache when it is still
+// valid. A directory modified within the last second is re-read every
+// time, its mtime may not have ticked since the listing was taken
+
+struct glob_dir *glob_read_dir(const char *path) {
+    const char *open_path = path[0] != '\0' ? path : ".";
+    unsigned int bucket = wsh_hash_string(open_path) & (GLOB_CACHE_BUCKETS - 1);
+    struct glob_dir *dir, **link;
+    struct timespec now;
+    struct stat st;
+
+    if (stat(open_path, &st) < 0 || !S_ISDIR(st.st_mode)) {
+        return NULL;
+    }
+
+    for (link = &wsh_shell->glob_cache[bucket]; (dir = *link) != NULL; link = &dir->next) {
+        if (strcmp(dir->path, open_path) == 0) {
+            break;
+        }
+    }
+    if (dir != NULL) {
+        if (!dir->racy && dir->ino == st.st_ino && dir->mtime.tv_sec == st.st_mtim.tv_sec
+                && dir->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+            wsh_shell->glob_cache_hits++;
+            return dir;
+        }
+        *link = dir->next;
+        free(dir->path);
+        free(dir->names);
+        free(dir->offsets);
+        free(dir->types);
+        free(dir);
+        wsh_shell->glob_cache_dirs--;
+    }
+    wsh_shell->glob_cache_misses++;
+
+    int fd = open(open_path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    char buffer[GLOB_DIRENT_BUFSIZE];
+    size_t names_len = 0, names_cap = 0;
+    int capacity = 0;
+    long n;
+
+    dir = (struct glob_dir*) glob_grow(NULL, sizeof(struct glob_dir));
+    memset(dir, 0, sizeof(struct glob_dir));
+    while ((n = syscall(SYS_getdents64, fd, buffer, sizeof(buffer))) > 0) {
+        long pos;
+        for (pos = 0; pos < n; ) {
+            struct wsh_dirent64 *entry = (struct wsh_dirent64*) (buffer + pos);
+            size_t length = strlen(entry->d_name) + 1;
+            pos += entry->d_reclen;
+
+            if (dir->count == capacity) {
+                capacity = capacity ? capacity * 2 : TOKEN_BUFSIZE;
+                dir->offsets = (uint32_t*) glob_grow(dir->offsets, capacity * sizeof(uint32_t));
+                dir->types = (unsigned char*) glob_grow(dir->types, capacity);
+            }
+            if (names_len + length > names_cap) {
+                names_cap = (names_len + length) * 2;
+                dir->names = (char*) glob_grow(dir->names, names_cap);
+            }
+            memcpy(dir->names + names_len, entry->d_name, length);
+            dir->offsets[dir->count] = names_len;
+            dir->types[dir->count] = entry->d_type;
+            dir->count++;
+            names_len += length;
+        }
+    }
+    close(fd);
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    dir->path = strdup(open_path);
+    dir->ino = st.st_ino;
+    dir->mtime = st.st_mtim;
+    dir->racy = st.st_mtim.tv_sec >= now.tv_sec - 1;
+    dir->next = wsh_shell->glob_cache[bucket];
+    wsh_shell->glob_cache[bucket] = dir;
+    wsh_shell->glob_cache_dirs++;
+
+    return dir;
+}
+
+// Matching a bracket expression at *pattern (just past the '['), which is
+// advanced past the closing ']'. Returns -1 when the bracket is not closed
+
+static int glob_match_bracket(const char **pattern, unsigned char c) {
+    const char *p = *pattern;
+    int negate = 0, matched = 0;
+
+    if (*p == '!' || *p == '^') {
+        negate = 1;
+        p++;
+    }
+    do {
+        if (*p == '\0') {
+            return -1;
+        }
+        if (p[0] == '[' && p[1] == ':') {
+            const char *end = strstr(p + 2, ":]");
+            if (end != NULL) {
+                size_t length = end - (p + 2);
+                if ((length == 5 && strncmp(p + 2, "alpha", 5) == 0 && isalpha(c)) ||
+                    (length == 5 && strncmp(p + 2, "digit", 5) == 0 && isdigit(c)) ||
+                    (length == 5 && strncmp(p + 2, "alnum", 5) == 0 && isalnum(c)) ||
+                    (length == 5 && strncmp(p + 2, "space", 5) == 0 && isspace(c)) ||
+                    (length == 5 && strncmp(p + 2, "upper", 5) == 0 && isupper(c)) ||
+                    (length == 5 && strncmp(p + 2, "lower", 5) == 0 && islower(c)) ||
+                    (length == 5 && strncmp(p + 2, "punct", 5) == 0 && ispunct(c)) ||
+                    (length == 6 && strncmp(p + 2, "xdigit", 6) == 0 && isxdigit(c))) {
+                    matched = 1;
+                }
+                p = end + 2;
+                continue;
+            }
+        }
+        unsigned char low = *p == '\\' && p[1] != '\0' ? *++p : *p;
+        unsigned char high = low;
+        p++;
+        if (p[0] == '-' && p[1] != ']' && p[1] != '\0') {
+            high = p[1] == '\\' && p[2] != '\0' ? p[2] : p[1];
+            p += p[1] == '\\' && p[2] != '\0' ? 3 : 2;
+        }
+        if (c >= low && c <= high) {
+            matched = 1;
+        }
+    } while (*p != ']');
+
+    *pattern = p + 1;
+    return matched != negate;
+}
+
+// Matching one name against one pattern component, with backtracking on
+// the last * only. A leading dot has to be matched explicitly
+
+int glob_match(const char *pattern, const char *name) {
+    const char *star = NULL, *star_name = NULL;
+
+    if (name[0] == '.' && pattern[0] != '.' && !(pattern[0] == '\\' && pattern[1] == '.')) {
+        return 0;
+    }
+
+    while (1) {
+        if (*pattern == '*') {
+            star = ++pattern;
+            star_name = name;
+            continue;
+        }
+        if (*name == '\0') {
+            return *pattern == '\0';
+        }
+
+        int matched;
+        const char *next = pattern + 1;
+        if (*pattern == '?') {
+            matched = 1;
+        } else if (*pattern == '[') {
+            matched = glob_match_bracket(&next, *name);
+            if (matched < 0) {
+                matched = *name == '[';
+                next = pattern + 1;
+            }
+        } else if (*pattern == '\\' && pattern[1] != '\0') {
+            matched = pattern[1] == *name;
+            next = pattern + 2;
+        } else {
+            matched = *pattern != '\0' && *pattern == *name;
+        }
+
+        if (matched) {
+            pattern = next;
+            name++;
+        } else if (star != NULL) {
+            pattern = star;
+            name = ++star_name;
+        } else {
+            return 0;
+        }
+    }
+}
+
+static int glob_has_meta(const char *pattern) {
+    for (; *pattern != '\0'; pattern++) {
+        if (*pattern == '\\' && pattern[1] != '\0') {
+            pattern++;
+        } else if (*pattern == '*' || *pattern == '?' || (*pattern == '[' && strchr(pattern, ']') != NULL)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+struct glob_walk {
+    struct arena *arena;
+    char **results;
+    int count;
+    int capacity;
+    int dir_only;
+    char path[PATH_MAX];
+};
+
+static void glob_add(struct glob_walk *w, char *word) {
+    if (w->count == w->capacity) {
+        char **grown;
+        w->capacity = w->capacity ? w->capacity * 2 : TOKEN_BUFSIZE;
+        grown = (char**) arena_alloc(w->arena, w->capacity * sizeof(char*));
+        memcpy(grown, w->results, w->count * sizeof(char*));
+        w->results = grown;
+    }
+    w->results[w->count++] = word;
+}
+
+static int glob_is_dir(struct glob_walk *w, struct glob_dir *dir, int i, int follow) {
+    struct stat st;
+
+    if (dir->types[i] == DT_DIR) {
+        return 1;
+    }
+    if (dir->types[i] != DT_UNKNOWN && (dir->types[i] != DT_LNK || !follow)) {
+        return 0;
+    }
+    return (follow ? stat(w->path, &st) : lstat(w->path, &st)) == 0 && S_ISDIR(st.st_mode);
+}
+
+static void glob_walk(struct glob_walk *w, size_t length, char **parts, int count, int index);
+
+// Matching a ** component at parts[index] against every directory below
+// the prefix, hidden entries and symlinked directories are not descended
+
+static void glob_walk_tree(struct glob_walk *w, size_t length, char **parts, int count, int index) {
+    int last = index == count - 1, i;
+    struct glob_dir *dir;
+
+    if ((dir = glob_read_dir(w->path)) == NULL) {
+        return;
+    }
+    for (i = 0; i < dir->count; i++) {
+        const char *name = dir->names + dir->offsets[i];
+        size_t name_len = strlen(name);
+        if (name[0] == '.' || length + name_len + 2 >= PATH_MAX) {
+            continue;
+        }
+        memcpy(w->path + length, name, name_len + 1);
+        int is_dir = glob_is_dir(w, dir, i, 0);
+        if (last && (!w->dir_only || is_dir || glob_is_dir(w, dir, i, 1))) {
+            glob_add(w, arena_strndup(w->arena, w->path, length + name_len));
+        }
+        if (is_dir) {
+            w->path[length + name_len] = '/';
+            w->path[length + name_len + 1] = '\0';
+            if (!last) {
+                glob_walk(w, length + name_len + 1, parts, count, index + 1);
+                w->path[length + name_len + 1] = '\0';
+            }
+            glob_walk_tree(w, length + name_len + 1, parts, count, index);
+        }
+    }
+}
+
+// Walking the remaining components from the directory prefix in
+// w->path[0, length), which ends in a slash unless it is empty
+
+static void glob_walk(struct glob_walk *w, size_t length, char **parts, int count, int index) {
+    const char *part = parts[index];
+    int last = index == count - 1, i;
+    struct glob_dir *dir;
+
+    if (strcmp(part, "**") == 0) {
+        if (!last) {
+            glob_walk(w, length, parts, count, index + 1);
+            w->path[length] = '\0';
+        } else if (length > 0) {
+            glob_add(w, arena_strndup(w->arena, w->path, length));
+        }
+        glob_walk_tree(w, length, parts, count, index);
+        return;
+    }
+
+    if (!glob_has_meta(part)) {
+        size_t n = length;
+        for (; *part != '\0' && n + 2 < PATH_MAX; part++) {
+            if (*part == '\\' && part[1] != '\0') {
+                part++;
+            }
+            w->path[n++] = *part;
+        }
+        w->path[n] = '\0';
+        if (last) {
+            struct stat st;
+            if (w->dir_only ? stat(w->path, &st) == 0 && S_ISDIR(st.st_mode) : lstat(w->path, &st) == 0) {
+                glob_add(w, arena_strndup(w->arena, w->path, n));
+            }
+            return;
+        }
+        w->path[n++] = '/';
+        w->path[n] = '\0';
+        glob_walk(w, n, parts, count, index + 1);
+        return;
+    }
+
+    if ((dir = glob_read_dir(w->path)) == NULL) {
+        return;
+    }
+    for (i = 0; i < dir->count; i++) {
+        const char *name = dir->names + dir->offsets[i];
+        size_t name_len = strlen(name);
+        if (!glob_match(part, name) || length + name_len + 2 >= PATH_MAX) {
+            continue;
+        }
+        memcpy(w->path + length, name, name_len + 1);
+        if (last && !w->dir_only) {
+            glob_add(w, arena_strndup(w->arena, w->path, length + name_len));
+        } else if (glob_is_dir(w, dir, i, 1)) {
+            if (last) {
+                glob_add(w, arena_strndup(w->arena, w->path, length + name_len));
+                continue;
+            }
+            w->path[length + name_len] = '/';
+            w->path[length + name_len + 1] = '\0';
+            glob_walk(w, length + name_len + 1, parts, count, index + 1);
+        }
+    }
+}
+
+static int glob_compare(const void *a, const void *b) {
+    return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+// Matching one brace-free pattern, the matches are appended to w->results
+
+static void glob_pattern(struct glob_walk *w, const char *pattern) {
+    char *copy = arena_strdup(w->arena, pattern), *parts[PATH_MAX / 2];
+    int count = 0, first = w->count, i;
+    size_t length = strlen(copy);
+
+    w->dir_only = length > 1 && copy[length - 1] == '/';
+    while (length > 1 && copy[length - 1] == '/') {
+        copy[--length] = '\0';
+    }
+
+    char *c = copy;
+    w->path[0] = '\0';
+    length = 0;
+    if (*c == '/') {
+        w->path[length++] = '/';
+        w->path[length] = '\0';
+        while (*c == '/') {
+            c++;
+        }
+    }
+    while (*c != '\0' && count < PATH_MAX / 2) {
+        parts[count++] = c;
+        c += strcspn(c, "/");
+        if (*c == '/') {
+            *c++ = '\0';
+            while (*c == '/') {
+                c++;
+            }
+        }
+    }
+    if (count == 0) {
+        return;
+    }
+
+    glob_walk(w, length, parts, count, 0);
+
+    if (!(wsh_shell->options & OPTION_GLOB_UNSORTED)) {
+        qsort(w->results + first, w->count - first, sizeof(char*), glob_compare);
+    }
+    if (w->dir_only) {
+        for (i = first; i < w->count; i++) {
+            size_t n = strlen(w->results[i]);
+            char *dir = (char*) arena_alloc(w->arena, n + 2);
+            memcpy(dir, w->results[i], n);
+            dir[n] = '/';
+            dir[n + 1] = '\0';
+            w->results[i] = dir;
+        }
+    }
+}
+
+// Expanding the first brace expression of a word ({a,b} or {1..3}), each
+// alternative is expanded again. Words without one are globbed
+
+static void glob_braces(struct glob_walk *w, const char *word) {
+    const char *c, *open;
+
+    for (open = word; *open != '\0'; open++) {
+        if (*open == '\\' && open[1] != '\0') {
+            open++;
+            continue;
+        }
+        if (*open != '{') {
+            continue;
+        }
+
+        const char *commas[TOKEN_BUFSIZE];
+        int depth = 0, count = 0;
+        for (c = open + 1; *c != '\0'; c++) {
+            if (*c == '\\' && c[1] != '\0') {
+                c++;
+            } else if (*c == '{') {
+                depth++;
+            } else if (*c == '}' && depth-- == 0) {
+                break;
+            } else if (*c == ',' && depth == 0 && count < TOKEN_BUFSIZE - 1) {
+                commas[count++] = c;
+            }
+        }
+        if (*c != '}') {
+            break;
+        }
+
+        size_t prefix = open - word, suffix = strlen(c + 1);
+        char *expanded;
+        if (count > 0) {
+            const char *start = open + 1;
+            int i;
+            commas[count] = c;
+            for (i = 0; i <= count; i++) {
+                size_t length = commas[i] - start;
+                expanded = (char*) arena_alloc(w->arena, prefix + length + suffix + 1);
+                memcpy(expanded, word, prefix);
+                memcpy(expanded + prefix, start, length);
+                memcpy(expanded + prefix + length, c + 1, suffix + 1);
+                glob_braces(w, expanded);
+                start = commas[i] + 1;
+            }
+            return;
+        }
+
+        char *end;
+        long from = strtol(open + 1, &end, 10), to = 0, step = 1;
+        int numeric = end != open + 1 && strncmp(end, "..", 2) == 0;
+        if (numeric) {
+            const char *start = end + 2;
+            to = strtol(start, &end, 10);
+            numeric = end != start;
+            if (numeric && strncmp(end, "..", 2) == 0) {
+                start = end + 2;
+                step = labs(strtol(start, &end, 10));
+                numeric = end != start && step != 0;
+            }
+            numeric = numeric && end == c;
+        }
+        if (!numeric) {
+            if (c - open != 5 || open[2] != '.' || open[3] != '.' || !isalpha((unsigned char) open[1])
+                    || !isalpha((unsigned char) open[4])) {
+                continue;
+            }
+            from = (unsigned char) open[1];
+            to = (unsigned char) open[4];
+        }
+        if (from > to) {
+            step = -step;
+        }
+        for (; step > 0 ? from <= to : from >= to; from += step) {
+            char item[32];
+            size_t length = numeric ? (size_t) snprintf(item, sizeof(item), "%ld", from) : 1;
+            if (!numeric) {
+                item[0] = from;
+            }
+            expanded = (char*) arena_alloc(w->arena, prefix + length + suffix + 1);
+            memcpy(expanded, word, prefix);
+            memcpy(expanded + prefix, item, length);
+            memcpy(expanded + prefix + length, c + 1, suffix + 1);
+            glob_braces(w, expanded);
+        }
+        return;
+    }
+
+    int before = w->count;
+    if (glob_has_meta(word)) {
+        glob_pattern(w, word);
+    }
+    if (w->count == before) {
+        glob_add(w, glob_unescape(w->arena, word));
+    }
+}
+
+// Expanding a glob word into *results, words that match nothing are kept
+// with their escapes removed. Returns the number of words
+
+int wsh_glob(const char *word, struct arena *arena, char ***results) {
+    struct glob_walk *w = (struct glob_walk*) malloc(sizeof(struct glob_walk));
+
+    if (!w) {
+        fprintf(stderr, "wsh: allocation error");
+        exit(EXIT_FAILURE);
+    }
+    if (wsh_shell->glob_cache_dirs > GLOB_CACHE_MAX_DIRS || !(wsh_shell->options & OPTION_GLOB_CACHE)) {
+        glob_cache_flush();
+    }
+
+    w->arena = arena;
+    w->results = NULL;
+    w->count = 0;
+    w->capacity = 0;
+    glob_braces(w, word);
+
+    int count = w->count;
+    *results = w->results;
+    free(w);
+
+    return count;
+}
+
+// Command substitution. $(...) words are kept raw by the parser and
+// expanded at launch: the command's output is captured into a buffer of
+// the shell that only grows, read CAPTURE_READ_SIZE at a time, and split
+// into fields unless quoted. A lone in-process utility writes into a
+// memfd kept open for this instead, so $(echo ...) never forks.
+
+// Finding the ) that closes the $( at line[i], skipping quoted text and
+// nested parentheses. Returns its index or -1 when there is none.
+
+int wsh_subst_end(const char *line, int i) {
+    int depth = 0;
+
+    for (i++; line[i] != '\0'; i++) {
+        if (line[i] == '\\' && line[i + 1] != '\0') {
+            i++;
+        } else if (line[i] == '\'' || line[i] == '"') {
+            char quote = line[i++];
+            while (line[i] != '\0' && line[i] != quote) {
+                if (quote == '"' && line[i] == '$' && line[i + 1] == '(') {
+                    i = wsh_subst_end(line, i);
+                    if (i < 0) {
+                        return -1;
+                    }
+                }
+                i += (quote == '"' && line[i] == '\\' && line[i + 1] != '\0') ? 2 : 1;
+            }
+            if (line[i] == '\0') {
+                return -1;
+            }
+        } else if (line[i] == '(') {
+            depth++;
+        } else if (line[i] == ')' && --depth == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// Making room for size bytes and a NUL in the capture buffer
+
+static void capture_reserve(size_t size) {
+    struct shell_info *shell = wsh_shell;
+
+    if (size + 1 > shell->capture_cap) {
+        shell->capture_cap = size + 1 > shell->capture_cap * 2 ? size + 1 : shell->capture_cap * 2;
+        shell->capture_buf = realloc(shell->capture_buf, shell->capture_cap);
+        if (!shell->capture_buf) {
+            fprintf(stderr, "wsh: allocation error");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// Reading a command's output from a pipe into the capture buffer
+
+static size_t capture_read(int fd) {
+    struct shell_info *shell = wsh_shell;
+    size_t used = 0;
+    ssize_t n;
+
+    while (1) {
+        n = read(fd, shell->capture_buf + used, CAPTURE_READ_SIZE);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        used += n;
+        capture_reserve(used + CAPTURE_READ_SIZE);
+    }
+    close(fd);
+
+    return used;
+}
+
+// Running commands with control flow in a forked copy of the shell, so
+// what they set stays out of the shell like in a subshell
+
+static size_t capture_subshell(const char *command) {
+    int fd[2], status = 0;
+
+    if (pipe2(fd, O_CLOEXEC) < 0) {
+        printf("wsh: $(...): %s\n", strerror(errno));
+        return 0;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(fd[1], 1);
+        wsh_run_text(command, strlen(command));
+        fflush(stdout);
+        _exit(wsh_shell->last_status);
+    }
+    close(fd[1]);
+    size_t used = capture_read(fd[0]);
+    if (pid > 0) {
+        waitpid(pid, &status, 0);
+        wsh_shell->subst_status = WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+    }
+
+    return used;
+}
+
+static int text_has_control(const char *text, size_t length);
+
+// Running a command and returning its output without the trailing
+// newlines. The text stays in the capture buffer until the next capture.
+
+char *wsh_capture(const char *command, size_t *length) {
+    struct shell_info *shell = wsh_shell;
+    int control = text_has_control(command, strlen(command));
+    char *line = strdup(command);
+    size_t used = 0;
+    ssize_t n;
+    TRACE_START(trace_start);
+
+    struct job *job = control ? NULL : wsh_parse_command(line);
+    free(line);
+    capture_reserve(CAPTURE_READ_SIZE);
+    if (control) {
+        used = capture_subshell(command);
+    }
+    if (job != NULL) {
+        wsh_apply_prefixes(job);
+    }
+
+    if (job != NULL && job->root->next == NULL && job->root->builtin != NULL && job->timeout_ms == 0 &&
+        (job->root->builtin->flags & BUILTIN_UTILITY)) {
+        if (shell->capture_fd < 0) {
+            shell->capture_fd = memfd_create("wsh-capture", MFD_CLOEXEC);
+        }
+        if (job->root->globs != NULL) {
+            wsh_expand_process(job->root, job->arena);
+        }
+        if (shell->capture_fd >= 0 && ftruncate(shell->capture_fd, 0) == 0) {
+            lseek(shell->capture_fd, 0, SEEK_SET);
+            shell->subst_status = wsh_run_builtin(job->root, 0, shell->capture_fd, FOREGROUND_EXECUTION) & 0xff;
+            off_t size = lseek(shell->capture_fd, 0, SEEK_CUR);
+            if (size < 0) {
+                size = 0;
+            }
+            capture_reserve(size);
+            while (used < (size_t) size && (n = pread(shell->capture_fd, shell->capture_buf + used,
+                                                      size - used, used)) > 0) {
+                used += n;
+            }
+        }
+        free_job(job);
+    } else if (job != NULL) {
+        int fd[2];
+        if (pipe2(fd, O_CLOEXEC) < 0) {
+            printf("wsh: $(...): %s\n", strerror(errno));
+            free_job(job);
+            job = NULL;
+        } else {
+            job->mode = PIPELINE_EXECUTION;
+            int job_id = insert_job(job);
+            wsh_start_job(job, fd[1]);
+            used = capture_read(fd[0]);
+            wait_for_job(job_id);
+            shell->subst_status = wsh_exit_code(job);
+            remove_job(job_id);
+        }
+    }
+
+    while (used > 0 && shell->capture_buf[used - 1] == '\n') {
+        used--;
+    }
+    shell->capture_buf[used] = '\0';
+    *length = used;
+    TRACE_SPAN("subst", 0, trace_start, command);
+
+    return shell->capture_buf;
+}
+
+// Building the fields of a word: text goes into the current field,
+// closing it adds it to the list. A field is open once anything, even
+// an empty quoted string, was put in it.
+
+static void expand_append(struct word_expansion *e, const char *str, size_t length) {
+    if (e->length + length + 1 > e->field_capacity) {
+        e->field_capacity = (e->length + length + 1) * 2;
+        e->field = realloc(e->field, e->field_capacity);
+        if (!e->field) {
+            fprintf(stderr, "wsh: allocation error");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(e->field + e->length, str, length);
+    e->length += length;
+    e->open = 1;
+}
+
+static void expand_close(struct word_expansion *e) {
+    if (!e->open) {
+        return;
+    }
+    if (e->count + 1 >= e->capacity) {
+        char **grown = (char**) arena_alloc(e->arena, (e->capacity * 2 + 4) * sizeof(char*));
+        memcpy(grown, e->fields, e->count * sizeof(char*));
+        e->fields = grown;
+        e->capacity = e->capacity * 2 + 4;
+    }
+    e->fields[e->count++] = arena_strndup(e->arena, e->field != NULL ? e->field : "", e->length);
+    e->length = 0;
+    e->open = 0;
+}
+
+// Putting expanded text into the fields, split on blanks and newlines
+// unless it was inside double quotes
+
+static void expand_split(struct word_expansion *e, const char *text, size_t length, int quoted) {
+    size_t i, start;
+
+    if (quoted) {
+        expand_append(e, text, length);
+        return;
+    }
+    for (i = 0; i < length; i = start) {
+        for (start = i; start < length && strchr(WHITESPACE_CHARS, text[start]) == NULL; start++);
+        if (start > i) {
+            expand_append(e, text + i, start - i);
+        }
+        if (start < length) {
+            expand_close(e);
+            start++;
+        }
+    }
+}
+
+static void expand_subst(struct word_expansion *e, const char *command, size_t command_length, int quoted) {
+    char *text = strndup(command, command_length);
+    size_t length;
+    char *out = wsh_capture(text, &length);
+
+    free(text);
+    expand_split(e, out, length, quoted);
+}
+
+// Putting the value of the parameter at c ($NAME, ${NAME}, $? or $$) into
+// the fields. Returns what follows the reference, c itself when the $
+// starts none and is just a character.
+
+static const char *expand_param(struct word_expansion *e, const char *c, int quoted) {
+    const char *name = c + 1, *value;
+    char number[16];
+
+    if (*name == '?' || *name == '$') {
+        snprintf(number, sizeof(number), "%d", *name == '?' ? wsh_shell->last_status : (int) getpid());
+        expand_split(e, number, strlen(number), quoted);
+        return name + 1;
+    }
+
+    int braced = *name == '{';
+    name += braced;
+    size_t length = isdigit((unsigned char) *name) ? 1 : var_name_length(name);
+    if (length == 0 || (braced && name[length] != '}')) {
+        return c;
+    }
+    value = wsh_get_var(name, length);
+    if (value != NULL) {
+        expand_split(e, value, strlen(value), quoted);
+    }
+
+    return name + length + braced;
+}
+
+// Expanding a raw word holding $(...) or parameters: substitutions are
+// run, variables looked up and quotes removed, giving zero or more
+// fields. Without split (the value of an assignment) it is one field.
+
+int wsh_expand_word(const char *raw, struct arena *arena, char ***fields, int split) {
+    struct word_expansion e = {.arena = arena, .open = !split};
+    const char *c = raw, *next;
+
+    while (*c != '\0') {
+        if (*c == '$' && c[1] == '(') {
+            int end = wsh_subst_end(raw, c - raw);
+            expand_subst(&e, c + 2, raw + end - (c + 2), !split);
+            c = raw + end + 1;
+        } else if (*c == '$' && (next = expand_param(&e, c, !split)) != c) {
+            c = next;
+        } else if (*c == '\\' && c[1] != '\0') {
+            expand_append(&e, c + 1, 1);
+            c += 2;
+        } else if (*c == '\'') {
+            const char *end = strchr(c + 1, '\'');
+            expand_append(&e, c + 1, end - c - 1);
+            c = end + 1;
+        } else if (*c == '"') {
+            expand_append(&e, "", 0);
+            for (c++; *c != '"'; ) {
+                if (*c == '$' && c[1] == '(') {
+                    int end = wsh_subst_end(raw, c - raw);
+                    expand_subst(&e, c + 2, raw + end - (c + 2), 1);
+                    c = raw + end + 1;
+                } else if (*c == '$' && (next = expand_param(&e, c, 1)) != c) {
+                    c = next;
+                } else if (*c == '\\' && strchr("$`\"\\", c[1]) != NULL) {
+                    expand_append(&e, c + 1, 1);
+                    c += 2;
+                } else {
+                    expand_append(&e, c++, 1);
+                }
+            }
+            c++;
+        } else {
+            expand_append(&e, c++, 1);
+        }
+    }
+    expand_close(&e);
+    free(e.field);
+
+    *fields = e.fields;
+    return e.count;
+}
+
+// Expanding the glob patterns, substitutions and parameters of a process'
+// arguments, done at launch time so a parsed (or cached) command line
+// always sees the current directory and variables. Leading assignments
+// become the command's own environment, or are run when they are all
+// there is. A command that expands to nothing runs as true.
+
+int wsh_expand_process(struct process *proc, struct arena *arena) {
+    int i, j, argc = 0, assigns = 0, bufsize = proc->argc + 1;
+    char **argv = NULL, *command = proc->argv[0];
+
+    if (proc->globs == NULL) {
+        return 0;
+    }
+
+    argv = (char**) arena_alloc(arena, bufsize * sizeof(char*));
+    for (i = 0; i < proc->argc; i++) {
+        char **matches = &proc->argv[i];
+        int glob_count = 1;
+        if (proc->globs[i] & WORD_ASSIGN) {
+            if (proc->globs[i] & WORD_EXPAND) {
+                wsh_expand_word(proc->argv[i], arena, &matches, 0);
+            }
+            assigns++;
+        } else if (proc->globs[i] & WORD_EXPAND) {
+            glob_count = wsh_expand_word(proc->argv[i], arena, &matches, 1);
+        } else if (proc->globs[i] & WORD_GLOB) {
+            glob_count = wsh_glob(proc->argv[i], arena, &matches);
+        }
+
+        if (argc + glob_count + 1 >= bufsize) {
+            char **grown = (char**) arena_alloc(arena, (bufsize + TOKEN_BUFSIZE + glob_count) * sizeof(char*));
+            memcpy(grown, argv, argc * sizeof(char*));
+            bufsize += TOKEN_BUFSIZE + glob_count;
+            argv = grown;
+        }
+        for (j = 0; j < glob_count; j++) {
+            argv[argc++] = matches[j];
+        }
+    }
+    if (argc == 0) {
+        argv[argc++] = "true";
+    }
+    argv[argc] = NULL;
+
+    if (assigns == argc) {
+        proc->builtin = &assign_builtin;
+    } else if (assigns > 0) {
+        proc->envp = var_overlay(argv, assigns, arena);
+        argv += assigns;
+        argc -= assigns;
+        proc->builtin = wsh_find_builtin(argv[0]);
+    } else if (argv[0] != command) {
+        proc->builtin = wsh_find_builtin(argv[0]);
+    }
+    proc->argv = argv;
+    proc->argc = argc;
+    proc->globs = NULL;
+    return 0;
+}
+
+// Parsing a size with an optional K/M/G suffix, -1 when malformed
+
+long wsh_parse_size(const char *str) {
+    char *end;
+    long size = strtol(str, &end, 10);
+
+    if (end == str || size < 0) {
+        return -1;
+    }
+    switch (*end) {
+        case 'k': case 'K': size <<= 10; end++; break;
+        case 'm': case 'M': size <<= 20; end++; break;
+        case 'g': case 'G': size <<= 30; end++; break;
+    }
+
+    return *end == '\0' ? size : -1;
+}
+
+// Stripping prefix builtins (pipesize SIZE cmd ..., prio N cmd ...,
+// time cmd ...) off the first stage and applying them to the job
+
+void wsh_apply_prefixes(struct job *job) {
+    struct process *root = job->root;
+
+    while (root->builtin != NULL && root->builtin->prefix != NULL) {
+        int skip = root->builtin->prefix(job, root->argc, root->argv);
+        if (skip <= 0 || skip >= root->argc) {
+            return;
+        }
+
+        root->argv += skip;
+        root->argc -= skip;
+        if (root->globs != NULL) {
+            root->globs += skip;
+        }
+        root->builtin = wsh_find_builtin(root->argv[0]);
+    }
+}
+
+// Creating a pipe between two stages, sized for the job when asked to
+
+int wsh_pipe(struct job *job, int fd[2]) {
+    int size = job->pipe_size > 0 ? job->pipe_size : wsh_shell->pipe_size;
+
+    if (pipe2(fd, O_CLOEXEC) < 0) {
+        return -1;
+    }
+    if (size > 0 && fcntl(fd[1], F_SETPIPE_SZ, size) < 0) {
+        fprintf(stderr, "wsh: pipesize %d: %s\n", size, strerror(errno));
+    }
+
+    return 0;
+}
+
+// Moving length bytes out of a pipe, with a read/write fallback for
+// targets splice does not support (O_APPEND files, some terminals)
+
+static int splice_out(int pipe_fd, int out_fd, size_t length) {
+    char buffer[PIPE_CHUNK_SIZE];
+
+    while (length > 0) {
+        ssize_t n = splice(pipe_fd, NULL, out_fd, NULL, length, SPLICE_F_MOVE);
+        if (n < 0 && errno == EINVAL) {
+            n = read(pipe_fd, buffer, length < sizeof(buffer) ? length : sizeof(buffer));
+            if (n > 0 && write(out_fd, buffer, n) != n) {
+                return -1;
+            }
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        length -= n;
+    }
+
+    return 0;
+}
+
+// Input helper for cmd < a < b: the files are spliced one after another
+// into the pipe feeding the first stage
+
+static void splice_inputs(char **paths, int out_fd) {
+    char buffer[PIPE_CHUNK_SIZE];
+    int i;
+
+    for (i = 0; paths[i] != NULL; i++) {
+        int in_fd = open(paths[i], O_RDONLY|O_CLOEXEC);
+        ssize_t n;
+        if (in_fd < 0) {
+            fprintf(stderr, "wsh: no such file or directory: %s\n", paths[i]);
+            continue;
+        }
+        while ((n = splice(in_fd, NULL, out_fd, NULL, PIPE_CHUNK_SIZE, SPLICE_F_MOVE)) > 0);
+        if (n < 0 && errno == EINVAL) {
+            while ((n = read(in_fd, buffer, sizeof(buffer))) > 0 && write(out_fd, buffer, n) == n);
+        }
+        close(in_fd);
+    }
+}
+
+// Output helper for cmd > a > b: tee(2) duplicates the stage's pipe into
+// one side pipe per extra file, everything reaches the files by splice(2)
+
+static void tee_outputs(int in_fd, int *out_fds, int count) {
+    int (*side)[2] = malloc((count - 1) * sizeof(*side));
+    int i, size = fcntl(in_fd, F_GETPIPE_SZ);
+
+    for (i = 0; i < count - 1; i++) {
+        pipe2(side[i], O_CLOEXEC);
+        fcntl(side[i][1], F_SETPIPE_SZ, size);
+    }
+
+    while (1) {
+        ssize_t n = tee(in_fd, side[0][1], INT_MAX, 0);
+        if (n <= 0) {
+            break;
+        }
+        for (i = 1; i < count - 1; i++) {
+            tee(in_fd, side[i][1], n, 0);    // the pipe only grows, so this is n too
+        }
+        for (i = 0; i < count - 1; i++) {
+            splice_out(side[i][0], out_fds[i], n);
+        }
+        if (splice_out(in_fd, out_fds[count - 1], n) < 0) {
+            break;
+        }
+    }
+}
+
+// Forking a plumbing helper into the job's process group. The helper is
+// appended to the job as a plumbing process so waits and jobs cover it;
+// returns 0 in the helper and the pid in the shell
+
+pid_t wsh_fork_plumbing(struct job *job, const char *command) {
+    pid_t childpid = fork();
+
+    if (childpid == 0) {
+        sigset_t mask;
+        signal(SIGINT, SIG_DFL);
+        signal(SIGQUIT, SIG_DFL);
+        signal(SIGTSTP, SIG_DFL);
+        signal(SIGTTIN, SIG_DFL);
+        signal(SIGTTOU, SIG_DFL);
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+        setpgid(0, job->pgid > 0 ? job->pgid : 0);
+        return 0;
+    }
+    if (childpid < 0) {
+        return -1;
+    }
+
+    if (job->pgid <= 0) {
+        job->pgid = childpid;
+    }
+    setpgid(childpid, job->pgid);
+
+    struct process *helper = (struct process*) arena_alloc(job->arena, sizeof(struct process)), *proc;
+    memset(helper, 0, sizeof(struct process));
+    helper->command = arena_strdup(job->arena, command);
+    helper->pid = childpid;
+    helper->status = STATUS_RUNNING;
+    helper->builtin = NULL;
+    helper->plumbing = 1;
+    clock_gettime(CLOCK_MONOTONIC, &helper->started);
+    for (proc = job->root; proc->next != NULL; proc = proc->next);
+    proc->next = helper;
+    if (job->id > 0) {
+        pid_index_insert(childpid, job->id, helper);
+    }
+
+    return childpid;
+}
+
+// Putting here-document or here-string text into a sealed memfd with its
+// offset at 0: the child gets a plain seekable file, nothing touches the
+// disk and the text is copied once, straight from the parsed command or
+// the script image into the page cache
+
+int wsh_open_here(const char *data, size_t length) {
+    int fd = memfd_create("wsh-here", MFD_CLOEXEC|MFD_ALLOW_SEALING);
+    size_t done = 0;
+
+    if (fd < 0) {
+        printf("wsh: here-document: %s\n", strerror(errno));
+        return -1;
+    }
+    while (done < length) {
+        ssize_t n = write(fd, data + done, length - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            printf("wsh: here-document: %s\n", strerror(errno));
+            close(fd);
+            return -1;
+        }
+        done += n;
+    }
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK|F_SEAL_GROW|F_SEAL_WRITE|F_SEAL_SEAL);
+    lseek(fd, 0, SEEK_SET);
+
+    return fd;
+}
+
+// Opening the stdin of a stage: here text goes through a memfd,
+// one file is handed over as is, several are concatenated into a pipe by
+// a splice helper
+
+int wsh_open_input(struct job *job, struct process *proc) {
+    int fd[2];
+
+    if (proc->here_doc != NULL) {
+        return wsh_open_here(proc->here_doc, proc->here_length);
+    }
+
+    if (proc->input_paths[1] == NULL) {
+        int in_fd = open(proc->input_paths[0], O_RDONLY|O_CLOEXEC);
+        if (in_fd < 0) {
+            printf("wsh: no such file or directory: %s\n", proc->input_paths[0]);
+        }
+        return in_fd;
+    }
+
+    if (wsh_pipe(job, fd) < 0) {
+        return -1;
+    }
+    pid_t pid = wsh_fork_plumbing(job, "[splice]");
+    if (pid == 0) {
+        close(fd[0]);
+        splice_inputs(proc->input_paths, fd[1]);
+        _exit(0);
+    }
+    close(fd[1]);
+
+    return fd[0];
+}
+
+// Opening the stdout of the last stage: one file is handed over as is,
+// several are fed from a pipe by a tee helper
+
+int wsh_open_output(struct job *job, struct process *proc) {
+    int count, i, fd[2];
+
+    for (count = 0; proc->output_paths[count] != NULL; count++);
+    int *out_fds = (int*) arena_alloc(job->arena, count * sizeof(int));
+    for (i = 0; i < count; i++) {
+        out_fds[i] = open(proc->output_paths[i], O_CREAT|O_WRONLY|O_TRUNC|O_CLOEXEC, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+        if (out_fds[i] < 0) {
+            printf("wsh: %s: %s\n", proc->output_paths[i], strerror(errno));
+            while (i-- > 0) {
+                close(out_fds[i]);
+            }
+            return -1;
+        }
+    }
+    if (count == 1) {
+        return out_fds[0];
+    }
+
+    if (wsh_pipe(job, fd) < 0) {
+        return -1;
+    }
+    pid_t pid = wsh_fork_plumbing(job, "[tee]");
+    if (pid == 0) {
+        close(fd[1]);
+        tee_outputs(fd[0], out_fds, count);
+        _exit(0);
+    }
+    close(fd[0]);
+    for (i = 0; i < count; i++) {
+        close(out_fds[i]);
+    }
+
+    return fd[1];
+}
+
+// Starting the processes of a job, the stages wired up with pipes. out_fd
+// is the stdout of the last stage unless it is redirected to files
+
+int wsh_start_job(struct job *job, int out_fd) {
+    struct process *proc;
+    int status = 0, in_fd = 0, fd[2];
+
+    clock_gettime(CLOCK_MONOTONIC, &job->started);
+    wsh_shell->subst_status = 0;        // set by substitutions as they expand
+    if (job->timeout_ms > 0 && job->id > 0) {
+        wsh_timer_add(job, wsh_timer_now() + job->timeout_ms, 0);
+    }
+    for (proc = job->root; proc != NULL && !proc->plumbing; proc = proc->next) {
+        if (proc->globs != NULL) {
+            TRACE_START(trace_start);
+            wsh_expand_process(proc, job->arena);
+            TRACE_SPAN("glob", job->id, trace_start, proc->command);
+        }
+        if (proc->input_paths != NULL || proc->here_doc != NULL) {
+            // a stage's own input replaces the pipe from the one before
+            if (in_fd != 0) {
+                close(in_fd);
+            }
+            in_fd = wsh_open_input(job, proc);
+            if (in_fd < 0) {
+                for (; proc != NULL; proc = proc->next) {
+                    proc->status = STATUS_DONE;
+                    proc->exit_status = W_EXITCODE(1, 0);
+                }
+                if (out_fd != 1) {
+                    close(out_fd);
+                }
+                return -1;
+            }
+        }
+        if (proc->next != NULL && !proc->next->plumbing) {
+            wsh_pipe(job, fd);
+            status = wsh_launch_process(job, proc, in_fd, fd[1], PIPELINE_EXECUTION);
+            in_fd = fd[0];
+        } else {
+            if (proc->output_paths != NULL) {
+                int file_fd = wsh_open_output(job, proc);
+                if (file_fd >= 0) {
+                    if (out_fd != 1) {
+                        close(out_fd);
+                    }
+                    out_fd = file_fd;
+                }
+            }
+            status = wsh_launch_process(job, proc, in_fd, out_fd, job->mode);
+        }
+    }
+    wsh_sched_account(job);
+
+    return status;
+}
+
+// Getting the exit code of a finished job the way $? shows it: the last
+// stage's, or 128 plus the signal number when it was killed, 124 (as
+// timeout(1) has it) when its deadline passed
+
+int wsh_exit_code(struct job *job) {
+    struct process *proc, *last = job->root;
+
+    if (job->timed_out) {
+        return TIMEOUT_EXIT_CODE;
+    }
+    for (proc = job->root; proc != NULL && !proc->plumbing; proc = proc->next) {
+        last = proc;
+    }
+    if (WIFSIGNALED(last->exit_status)) {
+        return 128 + WTERMSIG(last->exit_status);
+    }
+    return WEXITSTATUS(last->exit_status);
+}
+
+// Launching jobs
+
+int wsh_launch_job(struct job *job) {
+    int status, job_id = -1;
+    TRACE_START(trace_start);
+
+    check_zombie();
+    if (job->after != NULL && wsh_wait_after(job) != 0) {
+        fprintf(stderr, "wsh: %s: cancelled\n", job->command);
+        wsh_shell->last_status = CANCELLED_EXIT_CODE;
+        free_job(job);
+        return -1;
+    }
+    wsh_apply_prefixes(job);
+    int in_shell = job->root->next == NULL && job->root->builtin != NULL && job->timeout_ms == 0
+                   && wsh_builtin_in_shell(job->root, job->mode);
+    if (!in_shell) {
+        if (job->timeout_ms == 0) {
+            job->timeout_ms = wsh_shell->timeout_default_ms;
+        }
+        job_id = insert_job(job);
+        if (wsh_tracing) {
+            char name[TRACE_LABEL_SIZE];
+            snprintf(name, sizeof(name), "job %d", job_id);
+            wsh_trace_name(job_id, 0, name);
+        }
+        if (job->mode == BACKGROUND_EXECUTION && (wsh_shell->sched_queue != NULL || !wsh_sched_admit())) {
+            wsh_sched_enqueue(job);
+            wsh_sched_run();
+            TRACE_SPAN("launch", job_id, trace_start, "queued");
+            return 0;
+        }
+    }
+
+    status = wsh_start_job(job, 1);
+    TRACE_SPAN("launch", job_id, trace_start, job->command);
+    if (job->mode == FOREGROUND_EXECUTION) {
+        wsh_shell->last_status = wsh_exit_code(job);
+    }
+
+    if (!in_shell) {
+        if ((status >= 0 && job->mode == FOREGROUND_EXECUTION) || is_job_completed(job_id)) {
+            remove_job(job_id);
+        }
+    } else {
+        if (job->timed) {
+            wsh_time_report(job);
+        }
+        free_job(job);
+    }
+
+    return status;
+}
+
+// Waiting for a job in the table to finish and taking it out of the
+// table; its result is kept for later waits. Returns its exit code.
+
+int wsh_join_job(int id) {
+    struct job *job = get_job_by_id(id);
+    char spec[16];
+
+    while (job != NULL && job->root->status == STATUS_QUEUED) {
+        if (wsh_sched_running() == 0) {
+            wsh_sched_run();
+        } else {
+            wsh_event_wait_child(-1);
+        }
+        job = get_job_by_id(id);
+    }
+    if (job == NULL) {               // it finished as soon as it started
+        snprintf(spec, sizeof(spec), "%%%d", id);
+        struct job_result *result = job_result_find(spec);
+        return result != NULL ? result->status : 127;
+    }
+
+    job->mode = FOREGROUND_EXECUTION;     // reaping it must not remove it yet
+    wsh_sched_account(job);
+    wait_for_job(id);
+    int status = wsh_exit_code(job);
+    if (is_job_completed(id)) {
+        job->mode = BACKGROUND_EXECUTION;
+        remove_job(id);
+    }
+
+    return status;
+}
+
+// Waiting for the jobs a job comes after (after %a %b: cmd) when it is
+// run outside a script graph. Returns 0, or the exit code of the first of
+// them that failed, in which case the job is not run.
+
+int wsh_wait_after(struct job *job) {
+    struct job_result *result;
+    char spec[TOKEN_BUFSIZE * 4];
+    char **name;
+
+    for (name = job->after; *name != NULL; name++) {
+        int id = get_job_id_by_name(*name), status;
+        snprintf(spec, sizeof(spec), "%%%s", *name);
+        if (id > 0) {
+            status = wsh_join_job(id);
+        } else if ((result = job_result_find(spec)) != NULL) {
+            status = result->status;
+        } else {
+            printf("wsh: after: %s: no such job\n", spec);
+            status = 127;
+        }
+        if (status != 0) {
+            return status;
+        }
+    }
+
+    return 0;
+}
+
+// Background scheduler: & jobs over the concurrency limit (or started
+// while the load average is above the admission threshold) wait in a
+// queue ordered by priority, and start from check_zombie as running
+// background jobs complete
+
+int wsh_sched_running() {
+    return wsh_shell->sched_running;
+}
+
+// Keeping the count of running background jobs in step with a job whose
+// processes or mode changed, so admission never walks the job table.
+// Parallel workers share their run's id but are not in the table
+
+void wsh_sched_account(struct job *job) {
+    int running = job->id > 0 && get_job_by_id(job->id) == job && job->mode == BACKGROUND_EXECUTION &&
+                  job->parallel == NULL && job->root->status != STATUS_QUEUED && !is_job_completed(job->id);
+
+    if (running != job->sched_counted) {
+        wsh_shell->sched_running += running ? 1 : -1;
+        job->sched_counted = running;
+    }
+}
+
+// Admitting a job now or not. The load check only holds a job back while
+// another one is running, so its completion retries the queue
+
+int wsh_sched_admit() {
+    double load;
+    int running;
+
+    if (wsh_shell->sched_max_jobs <= 0 && wsh_shell->sched_max_load <= 0) {
+        return 1;
+    }
+
+    running = wsh_sched_running();
+    if (wsh_shell->sched_max_jobs > 0 && running >= wsh_shell->sched_max_jobs) {
+        return 0;
+    }
+    if (wsh_shell->sched_max_load > 0 && running > 0
+            && getloadavg(&load, 1) == 1 && load >= wsh_shell->sched_max_load) {
+        return 0;
+    }
+
+    return 1;
+}
+
+// Queueing a job behind every job of the same or a higher priority
+
+void wsh_sched_enqueue(struct job *job) {
+    struct job **link = &wsh_shell->sched_queue;
+    struct process *proc;
+
+    for (proc = job->root; proc != NULL; proc = proc->next) {
+        proc->status = STATUS_QUEUED;
+    }
+    while (*link != NULL && (*link)->priority <= job->priority) {
+        link = &(*link)->queue_next;
+    }
+    job->queue_next = *link;
+    *link = job;
+}
+
+void wsh_sched_dequeue(struct job *job) {
+    struct job **link = &wsh_shell->sched_queue;
+    struct process *proc;
+
+    while (*link != NULL && *link != job) {
+        link = &(*link)->queue_next;
+    }
+    if (*link == NULL) {
+        return;
+    }
+    *link = job->queue_next;
+    job->queue_next = NULL;
+
+    for (proc = job->root; proc != NULL; proc = proc->next) {
+        proc->status = STATUS_RUNNING;
+    }
+}
+
+// Starting queued jobs while they are admitted
+
+void wsh_sched_run() {
+    while (wsh_shell->sched_queue != NULL && wsh_sched_admit()) {
+        struct job *job = wsh_shell->sched_queue;
+        wsh_sched_dequeue(job);
+        wsh_start_job(job, 1);
+        if (is_job_completed(job->id)) {
+            remove_job(job->id);
+        }
+    }
+}
+
+// Job deadlines. Every running job with a timeout has one entry in a
+// binary min-heap ordered by deadline, and a single timerfd is armed at
+// the earliest one, so adding or dropping a deadline is O(log n) with a
+// syscall only when the earliest changes. The first expiry sends SIGTERM
+// to the job's process group, the second (timeout_grace_ms later) SIGKILL.
+
+long wsh_timer_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+static void timer_arm() {
+    struct itimerspec spec = {{0, 0}, {0, 0}};
+    long deadline = wsh_shell->timer_count > 0 ? wsh_shell->timers[0].deadline : 0;
+
+    if (deadline == wsh_shell->timer_armed) {
+        return;
+    }
+    spec.it_value.tv_sec = deadline / 1000;
+    spec.it_value.tv_nsec = (deadline % 1000) * 1000000;
+    timerfd_settime(wsh_shell->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL);
+    wsh_shell->timer_armed = deadline;
+}
+
+static void timer_place(int index, struct job_timer timer) {
+    struct job *job = get_job_by_id(timer.job_id);
+
+    wsh_shell->timers[index] = timer;
+    if (job != NULL) {
+        job->timer_index = index;
+    }
+}
+
+static void timer_sift(int index) {
+    struct job_timer *timers = wsh_shell->timers, timer = timers[index];
+
+    while (index > 0 && timers[(index - 1) / 2].deadline > timer.deadline) {
+        timer_place(index, timers[(index - 1) / 2]);
+        index = (index - 1) / 2;
+    }
+    while (1) {
+        int child = 2 * index + 1;
+        if (child >= wsh_shell->timer_count) {
+            break;
+        }
+        if (child + 1 < wsh_shell->timer_count && timers[child + 1].deadline < timers[child].deadline) {
+            child++;
+        }
+        if (timers[child].deadline >= timer.deadline) {
+            break;
+        }
+        timer_place(index, timers[child]);
+        index = child;
+    }
+    timer_place(index, timer);
+}
+
+void wsh_timer_add(struct job *job, long deadline, int stage) {
+    struct job_timer timer = { .deadline = deadline, .job_id = job->id, .stage = stage };
+
+    if (job->timer_index >= 0) {
+        wsh_shell->timers[job->timer_index] = timer;
+        timer_sift(job->timer_index);
+        timer_arm();
+        return;
+    }
+    if (wsh_shell->timer_count == wsh_shell->timer_capacity) {
+        wsh_shell->timer_capacity = wsh_shell->timer_capacity > 0 ? wsh_shell->timer_capacity * 2 : TIMER_HEAP_INITIAL_SIZE;
+        wsh_shell->timers = realloc(wsh_shell->timers, wsh_shell->timer_capacity * sizeof(struct job_timer));
+        if (!wsh_shell->timers) {
+            fprintf(stderr, "wsh: allocation error");
+            exit(EXIT_FAILURE);
+        }
+    }
+    wsh_shell->timers[wsh_shell->timer_count++] = timer;
+    timer_sift(wsh_shell->timer_count - 1);
+    timer_arm();
+}
+
+void wsh_timer_remove(struct job *job) {
+    int index = job->timer_index;
+
+    if (index < 0) {
+        return;
+    }
+    job->timer_index = -1;
+    if (index < --wsh_shell->timer_count) {
+        wsh_shell->timers[index] = wsh_shell->timers[wsh_shell->timer_count];
+        timer_sift(index);
+    }
+    timer_arm();
+}
+
+// Handling the deadlines that passed, called when the timerfd fires
+
+void wsh_timer_expire() {
+    uint64_t expirations;
+    long now = wsh_timer_now();
+
+    if (read(wsh_shell->timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+        return;
+    }
+    wsh_shell->timer_armed = -1;
+    while (wsh_shell->timer_count > 0 && wsh_shell->timers[0].deadline <= now) {
+        struct job_timer timer = wsh_shell->timers[0];
+        struct job *job = get_job_by_id(timer.job_id);
+
+        if (job == NULL || job->pgid <= 0 || is_job_completed(job->id)) {
+            if (job != NULL) {
+                wsh_timer_remove(job);
+            } else {
+                wsh_shell->timers[0] = wsh_shell->timers[--wsh_shell->timer_count];
+                if (wsh_shell->timer_count > 0) {
+                    timer_sift(0);
+                }
+            }
+            continue;
+        }
+        if (timer.stage == 0) {
+            fprintf(stderr, "wsh: [%d] timed out: %s\n", job->id, job->command);
+            job->timed_out = 1;
+            kill(-job->pgid, SIGTERM);
+            kill(-job->pgid, SIGCONT);
+            wsh_timer_add(job, now + wsh_shell->timeout_grace_ms, 1);
+        } else {
+            kill(-job->pgid, SIGKILL);
+            wsh_timer_remove(job);
+        }
+    }
+    timer_arm();
+}
+
+// Applying a job's priority to one of its processes: the nice value, and
+// the best-effort I/O priority the kernel would derive from it
+
+void wsh_apply_priority(pid_t pid, int priority) {
+    int level = (priority + 20) / 5;
+
+    if (setpriority(PRIO_PROCESS, pid, priority) < 0) {
+        fprintf(stderr, "wsh: prio %d: %s\n", priority, strerror(errno));
+    }
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, pid, IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT | level);
+}
+
+// Parallel executor: `parallel [-j N] [-k|-t] [-a file] template [::: input ...]`
+// runs the template once per input over N worker slots. Every worker owns
+// a queue of task indices and steals from the back of the longest queue
+// when its own runs dry; the whole run is one job in the job table and
+// is driven from check_zombie, so it also works in the background
+
+static int parallel_write(int fd, const char *buffer, size_t length) {
+    while (length > 0) {
+        ssize_t n = write(fd, buffer, length);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buffer += n;
+        length -= n;
+    }
+
+    return 0;
+}
+
+// Single-quoting a word for the lexer, a ' inside becomes '\''
+
+static char *parallel_quote(const char *word, struct arena *arena) {
+    size_t length = 3, n = 0;
+    const char *c;
+
+    for (c = word; *c != '\0'; c++) {
+        length += *c == '\'' ? 4 : 1;
+    }
+    char *quoted = (char*) arena_alloc(arena, length);
+    quoted[n++] = '\'';
+    for (c = word; *c != '\0'; c++) {
+        if (*c == '\'') {
+            memcpy(quoted + n, "'\\''", 4);
+            n += 4;
+        } else {
+            quoted[n++] = *c;
+        }
+    }
+    quoted[n++] = '\'';
+    quoted[n] = '\0';
+
+    return quoted;
+}
+
+// Building the command line of a task: {} is replaced by the quoted input,
+// without a {} the input is appended as the last argument. The template
+// words are quoted already, so a {} inside one closes and reopens it
+
+static char *parallel_command(struct parallel *run, const char *input, struct arena *arena) {
+    size_t template_len = strlen(run->template), i, n;
+    char *quoted = parallel_quote(input, arena);
+    size_t quoted_len = strlen(quoted);
+
+    char *line = (char*) arena_alloc(arena, template_len * (quoted_len + 1) + quoted_len + 2);
+    for (i = 0, n = 0; i < template_len; i++) {
+        if (run->template[i] == '{' && run->template[i + 1] == '}') {
+            memcpy(line + n, quoted, quoted_len);
+            n += quoted_len;
+            i++;
+        } else {
+            line[n++] = run->template[i];
+        }
+    }
+    if (!run->has_placeholder) {
+        line[n++] = ' ';
+        memcpy(line + n, quoted, quoted_len);
+        n += quoted_len;
+    }
+    line[n] = '\0';
+
+    return line;
+}
+
+// Taking the next task for a worker: the front of its own queue, or the
+// back of the longest other queue
+
+static int parallel_next_task(struct parallel *run, struct parallel_worker *worker) {
+    struct parallel_worker *victim = NULL;
+    int i;
+
+    if (worker->head < worker->tail) {
+        return worker->queue[worker->head++];
+    }
+
+    for (i = 0; i < run->worker_count; i++) {
+        struct parallel_worker *other = &run->workers[i];
+        if (other->tail - other->head > 0 && (victim == NULL || other->tail - other->head > victim->tail - victim->head)) {
+            victim = other;
+        }
+    }
+    if (victim == NULL) {
+        return -1;
+    }
+
+    run->steals++;
+    return victim->queue[--victim->tail];
+}
+
+// Writing the captured output of a task, tagged with its input if asked
+
+static void parallel_emit(struct parallel *run, struct parallel_task *task) {
+    if (task->output == NULL) {
+        return;
+    }
+    if (run->output_mode == PARALLEL_TAG) {
+        char *line = task->output, *end = task->output + task->output_len;
+        while (line < end) {
+            char *newline = memchr(line, '\n', end - line);
+            char *next = newline != NULL ? newline + 1 : end;
+            parallel_write(run->out_fd, task->input, strlen(task->input));
+            parallel_write(run->out_fd, "\t", 1);
+            parallel_write(run->out_fd, line, next - line);
+            if (newline == NULL) {
+                parallel_write(run->out_fd, "\n", 1);
+            }
+            line = next;
+        }
+    } else {
+        parallel_write(run->out_fd, task->output, task->output_len);
+    }
+
+    free(task->output);
+    task->output = NULL;
+}
+
+static int parallel_task_running(struct job *job) {
+    struct process *proc;
+
+    for (proc = job->root; proc != NULL; proc = proc->next) {
+        if (proc->pid > 0 && proc->status != STATUS_DONE && proc->status != STATUS_TERMINATED &&
+            proc->status != STATUS_TIMEDOUT) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Collecting a finished task: exit code, captured output, pid index entries
+
+static void parallel_finish(struct parallel *run, struct parallel_worker *worker) {
+    struct parallel_task *task = &run->tasks[worker->task];
+    struct process *proc;
+    struct stat st;
+    int status = 0;
+
+    if (worker->job != NULL) {
+        for (proc = worker->job->root; proc != NULL; proc = proc->next) {
+            if (proc->pid > 0) {
+                pid_index_remove(proc->pid);
+            }
+            if (!proc->plumbing) {
+                status = proc->exit_status;
+            }
+        }
+        free_job(worker->job);
+        worker->job = NULL;
+        task->exit_status = WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+    }
+
+    if (task->capture_fd >= 0) {
+        if (fstat(task->capture_fd, &st) == 0 && st.st_size > 0) {
+            task->output = (char*) malloc(st.st_size);
+            if (!task->output) {
+                fprintf(stderr, "wsh: allocation error");
+                exit(EXIT_FAILURE);
+            }
+            task->output_len = pread(task->capture_fd, task->output, st.st_size, 0);
+            if ((ssize_t) task->output_len < 0) {
+                task->output_len = 0;
+            }
+        }
+        close(task->capture_fd);
+        task->capture_fd = -1;
+    }
+
+    task->done = 1;
+    run->finished++;
+    if (task->exit_status != 0) {
+        run->failed++;
+    }
+    worker->task = -1;
+
+    if (run->output_mode != PARALLEL_KEEP_ORDER) {
+        parallel_emit(run, task);
+        return;
+    }
+    while (run->next_output < run->task_count && run->tasks[run->next_output].done) {
+        parallel_emit(run, &run->tasks[run->next_output++]);
+    }
+}
+
+// Starting a task on a worker, its stdout captured in a memfd unless the
+// output goes straight through
+
+static void parallel_start(struct job *group, struct parallel_worker *worker, int index) {
+    struct parallel *run = group->parallel;
+    struct parallel_task *task = &run->tasks[index];
+    char *line = parallel_command(run, task->input, group->arena);
+    int out_fd;
+
+    worker->task = index;
+    worker->job = wsh_parse_command(line);
+    if (worker->job == NULL || worker->job->root == NULL) {
+        fprintf(stderr, "wsh: parallel: cannot run: %s\n", line);
+        if (worker->job != NULL) {
+            free_job(worker->job);
+            worker->job = NULL;
+        }
+        task->exit_status = 2;
+        return;
+    }
+    worker->job->id = group->id;
+    worker->job->mode = BACKGROUND_EXECUTION;
+    worker->job->pipe_size = group->pipe_size;
+
+    if (run->output_mode == PARALLEL_UNGROUPED) {
+        out_fd = fcntl(run->out_fd, F_DUPFD_CLOEXEC, 3);
+    } else {
+        task->capture_fd = memfd_create("wsh-parallel", MFD_CLOEXEC);
+        out_fd = task->capture_fd < 0 ? -1 : fcntl(task->capture_fd, F_DUPFD_CLOEXEC, 3);
+    }
+    if (out_fd < 0) {
+        perror("wsh: parallel");
+        task->exit_status = 2;
+        return;
+    }
+
+    if (wsh_start_job(worker->job, out_fd) < 0) {
+        task->exit_status = 1;
+    }
+}
+
+// Advancing a parallel run: finished tasks are collected and idle workers
+// take their next task, until every worker is busy or the work is done
+
+void wsh_parallel_step(struct job *group) {
+    struct parallel *run = group->parallel;
+    int i, index;
+
+    if (group->root->status != STATUS_RUNNING) {
+        return;
+    }
+
+    for (i = 0; i < run->worker_count; i++) {
+        struct parallel_worker *worker = &run->workers[i];
+        while (1) {
+            if (worker->task >= 0) {
+                if (worker->job != NULL && parallel_task_running(worker->job)) {
+                    break;
+                }
+                parallel_finish(run, worker);
+            }
+            if ((index = parallel_next_task(run, worker)) < 0) {
+                break;
+            }
+            parallel_start(group, worker, index);
+        }
+    }
+
+    if (run->finished < run->task_count) {
+        return;
+    }
+
+    for (i = 0; i < run->task_count; i++) {
+        if (run->tasks[i].exit_status != 0) {
+            fprintf(stderr, "wsh: parallel: exit %d: %s\n", run->tasks[i].exit_status, run->tasks[i].input);
+        }
+    }
+    close(run->out_fd);
+    group->root->status = STATUS_DONE;
+    group->root->exit_status = W_EXITCODE(run->failed > 0, 0);
+}
+
+// Reading the inputs of a run from a file or a descriptor, one per line
+
+static int parallel_read_inputs(struct parallel *run, int fd, struct arena *arena) {
+    size_t length = 0, capacity = COMMAND_BUFSIZE;
+    char *buffer = (char*) malloc(capacity);
+    ssize_t n;
+    int count = 0;
+
+    if (!buffer) {
+        fprintf(stderr, "wsh: allocation error");
+        exit(EXIT_FAILURE);
+    }
+    while ((n = read(fd, buffer + length, capacity - length)) > 0) {
+        length += n;
+        if (length == capacity) {
+            capacity *= 2;
+            buffer = (char*) realloc(buffer, capacity);
+            if (!buffer) {
+                fprintf(stderr, "wsh: allocation error");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    char *line = buffer, *end = buffer + length;
+    while (line < end) {
+        char *newline = memchr(line, '\n', end - line);
+        if (newline == NULL) {
+            newline = end;
+        }
+        if (newline > line) {
+            count++;
+        }
+        line = newline + 1;
+    }
+
+    run->tasks = (struct parallel_task*) arena_alloc(arena, (count + 1) * sizeof(struct parallel_task));
+    run->task_count = 0;
+    for (line = buffer; line < end; ) {
+        char *newline = memchr(line, '\n', end - line);
+        if (newline == NULL) {
+            newline = end;
+        }
+        if (newline > line) {
+            run->tasks[run->task_count++].input = arena_strndup(arena, line, newline - line);
+        }
+        line = newline + 1;
+    }
+    free(buffer);
+
+    return run->task_count;
+}
+
+int wsh_parallel(int argc, char **argv) {
+    struct arena *arena = arena_create();
+    struct parallel *run = (struct parallel*) arena_alloc(arena, sizeof(struct parallel));
+    char *input_file = NULL;
+    int i, first, jobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+    memset(run, 0, sizeof(struct parallel));
+    run->output_mode = PARALLEL_GROUPED;
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            jobs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) {
+            input_file = argv[++i];
+        } else if (strcmp(argv[i], "-k") == 0) {
+            run->output_mode = PARALLEL_KEEP_ORDER;
+        } else if (strcmp(argv[i], "-t") == 0) {
+            run->output_mode = PARALLEL_TAG;
+        } else if (strcmp(argv[i], "-u") == 0) {
+            run->output_mode = PARALLEL_UNGROUPED;
+        } else {
+            break;
+        }
+    }
+    if (i >= argc || strcmp(argv[i], ":::") == 0) {
+        printf("usage: parallel [-j N] [-k|-t|-u] [-a file] command [::: input ...]\n");
+        arena_release(arena);
+        return -1;
+    }
+
+    // a single word is a command line of its own, as in GNU parallel;
+    // otherwise every word is quoted so a task keeps the argv as given
+    size_t template_len = 0;
+    char **words = (char**) arena_alloc(arena, argc * sizeof(char*));
+    int single = i + 1 >= argc || strcmp(argv[i + 1], ":::") == 0;
+    for (first = i; i < argc && strcmp(argv[i], ":::") != 0; i++) {
+        words[i] = single ? argv[i] : parallel_quote(argv[i], arena);
+        template_len += strlen(words[i]) + 1;
+    }
+    run->template = (char*) arena_alloc(arena, template_len);
+    run->template[0] = '\0';
+    for (i = first; i < argc && strcmp(argv[i], ":::") != 0; i++) {
+        if (i > first) {
+            strcat(run->template, " ");
+        }
+        strcat(run->template, words[i]);
+    }
+    run->has_placeholder = strstr(run->template, "{}") != NULL;
+
+    if (i < argc) {
+        run->tasks = (struct parallel_task*) arena_alloc(arena, (argc - i) * sizeof(struct parallel_task));
+        for (i++; i < argc; i++) {
+            run->tasks[run->task_count++].input = arena_strdup(arena, argv[i]);
+        }
+    } else if (input_file != NULL) {
+        int fd = open(input_file, O_RDONLY|O_CLOEXEC);
+        if (fd < 0) {
+            printf("wsh: parallel: %s: %s\n", input_file, strerror(errno));
+            arena_release(arena);
+            return -1;
+        }
+        parallel_read_inputs(run, fd, arena);
+        close(fd);
+    } else {
+        parallel_read_inputs(run, 0, arena);
+    }
+    for (i = 0; i < run->task_count; i++) {
+        run->tasks[i].output = NULL;
+        run->tasks[i].output_len = 0;
+        run->tasks[i].capture_fd = -1;
+        run->tasks[i].exit_status = 0;
+        run->tasks[i].done = 0;
+    }
+
+    // round-robin split, so in-order output rarely waits on a far task
+    run->worker_count = jobs > 0 ? jobs : 1;
+    run->workers = (struct parallel_worker*) arena_alloc(arena, run->worker_count * sizeof(struct parallel_worker));
+    for (i = 0; i < run->worker_count; i++) {
+        struct parallel_worker *worker = &run->workers[i];
+        int task;
+        worker->queue = (int*) arena_alloc(arena, (run->task_count / run->worker_count + 1) * sizeof(int));
+        worker->head = worker->tail = 0;
+        for (task = i; task < run->task_count; task += run->worker_count) {
+            worker->queue[worker->tail++] = task;
+        }
+        worker->task = -1;
+        worker->job = NULL;
+    }
+
+    run->out_fd = fcntl(1, F_DUPFD_CLOEXEC, 3);
+
+    struct job *group = (struct job*) arena_alloc(arena, sizeof(struct job));
+    struct process *root = (struct process*) arena_alloc(arena, sizeof(struct process));
+    memset(root, 0, sizeof(struct process));
+    root->command = arena_strdup(arena, run->template);
+    root->argv = NULL;
+    root->pid = -1;
+    root->builtin = NULL;
+    root->status = STATUS_RUNNING;
+    group->arena = arena;
+    group->root = root;
+    group->command = root->command;
+    group->pgid = -1;
+    group->mode = wsh_shell->builtin_mode == FOREGROUND_EXECUTION ? FOREGROUND_EXECUTION : BACKGROUND_EXECUTION;
+    group->pipe_size = 0;
+    group->priority = 0;
+    group->timed = 0;
+    group->queue_next = NULL;
+    group->timeout_ms = 0;
+    group->timer_index = -1;
+    group->timed_out = 0;
+    group->sched_counted = 0;
+    group->name = NULL;
+    group->after = NULL;
+    group->parallel = run;
+
+    int job_id = insert_job(group);
+    wsh_parallel_step(group);
+    if (group->mode == FOREGROUND_EXECUTION) {
+        wait_for_job(job_id);
+        remove_job(job_id);
+        return run->failed > 0;
+    }
+    if (group->root->status != STATUS_RUNNING) {
+        remove_job(job_id);
+    }
+
+    return 0;
+}
+
+// Character classes for the lexer, one table lookup per input byte
+
+#define CHAR_SPACE 1
+#define CHAR_OPERATOR 2
+#define CHAR_SPECIAL 4
+
+static unsigned char char_class[256];
+
+static void lex_init() {
+    const char *c;
+
+    for (c = WHITESPACE_CHARS; *c != '\0'; c++) {
+        char_class[(unsigned char) *c] |= CHAR_SPACE;
+    }
+    for (c = OPERATOR_CHARS; *c != '\0'; c++) {
+        char_class[(unsigned char) *c] |= CHAR_OPERATOR;
+    }
+    for (c = "\\'\"*?[]{}$"; *c != '\0'; c++) {
+        char_class[(unsigned char) *c] |= CHAR_SPECIAL;
+    }
+    char_class[0] |= CHAR_OPERATOR;   // NUL ends a word like an operator
+}
+
+// Checking whether what follows a $ makes it a parameter reference
+
+static int lex_param(const char *c) {
+    return *c == '{' || *c == '?' || *c == '$' || isdigit((unsigned char) *c) || var_name_length(c) > 0;
+}
+
+// Splitting a command line into tokens in a single pass. Tokens are spans
+// into the line; quotes and escapes are only validated here and removed
+// later by wsh_word when argv is built. A word starting NAME= is flagged
+// as an assignment, the parser decides whether it is one. Returns the
+// token count or -1.
+
+int wsh_lex(const char *line, struct token **tokens_out, struct arena *arena) {
+    int capacity = TOKEN_BUFSIZE / 4, count = 0, i = 0;
+    struct token *tokens = (struct token*) arena_alloc(arena, capacity * sizeof(struct token));
+
+    if (char_class[' '] == 0) {
+        lex_init();
+    }
+
+    while (1) {
+        while (char_class[(unsigned char) line[i]] & CHAR_SPACE) {
+            i++;
+        }
+        if (line[i] == '\0') {
+            break;
+        }
+
+        if (count == capacity) {
+            struct token *grown = (struct token*) arena_alloc(arena, capacity * 2 * sizeof(struct token));
+            memcpy(grown, tokens, count * sizeof(struct token));
+            tokens = grown;
+            capacity *= 2;
+        }
+
+        struct token *token = &tokens[count++];
+        token->start = i;
+        token->flags = 0;
+
+        if (line[i] == '<' && line[i + 1] == '<') {
+            token->type = line[i + 2] == '<' ? TOKEN_HERESTRING : TOKEN_HEREDOC;
+            token->length = token->type == TOKEN_HERESTRING ? 3 : 2;
+            i += token->length;
+            continue;
+        }
+        if ((line[i] == '&' || line[i] == '|') && line[i + 1] == line[i]) {
+            token->type = line[i] == '&' ? TOKEN_AND : TOKEN_OR;
+            token->length = 2;
+            i += 2;
+            continue;
+        }
+        if (char_class[(unsigned char) line[i]] & CHAR_OPERATOR) {
+            token->type = line[i] == '|' ? TOKEN_PIPE :
+                          line[i] == '<' ? TOKEN_INPUT :
+                          line[i] == '>' ? TOKEN_OUTPUT :
+                          line[i] == ';' ? TOKEN_SEMI : TOKEN_BACKGROUND;
+            token->length = 1;
+            i++;
+            continue;
+        }
+
+        int bracket = 0, brace = 0;
+        token->type = TOKEN_WORD;
+        while (1) {
+            const unsigned char *c = (const unsigned char*) line + i;
+            while (char_class[*c] == 0) {
+                c++;
+            }
+            i = c - (const unsigned char*) line;
+            if (char_class[*c] & (CHAR_SPACE | CHAR_OPERATOR)) {
+                break;
+            }
+            if (line[i] == '$' && line[i + 1] == '(') {
+                int end = wsh_subst_end(line, i);
+                if (end < 0) {
+                    fprintf(stderr, "wsh: syntax error: unterminated $(\n");
+                    return -1;
+                }
+                token->flags |= WORD_EXPAND;
+                i = end + 1;
+            } else if (line[i] == '\\') {
+                token->flags |= WORD_QUOTED;
+                i += line[i + 1] != '\0' ? 2 : 1;
+            } else if (line[i] == '\'' || line[i] == '"') {
+                char quote = line[i++];
+                token->flags |= WORD_QUOTED;
+                while (line[i] != '\0' && line[i] != quote) {
+                    if (quote == '"' && line[i] == '$' && line[i + 1] == '(') {
+                        int end = wsh_subst_end(line, i);
+                        if (end < 0) {
+                            fprintf(stderr, "wsh: syntax error: unterminated $(\n");
+                            return -1;
+                        }
+                        token->flags |= WORD_EXPAND;
+                        i = end + 1;
+                        continue;
+                    }
+                    if (quote == '"' && line[i] == '$' && lex_param(line + i + 1)) {
+                        token->flags |= WORD_EXPAND;
+                    }
+                    i += (quote == '"' && line[i] == '\\' && line[i + 1] != '\0') ? 2 : 1;
+                }
+                if (line[i] == '\0') {
+                    fprintf(stderr, "wsh: syntax error: unterminated %c\n", quote);
+                    return -1;
+                }
+                i++;
+            } else if (line[i] == '$') {
+                if (lex_param(line + i + 1)) {
+                    token->flags |= WORD_EXPAND;
+                }
+                i++;
+            } else {
+                if (line[i] == '*' || line[i] == '?' || (line[i] == ']' && bracket) || (line[i] == '}' && brace)) {
+                    token->flags |= WORD_GLOB;
+                }
+                bracket |= line[i] == '[';
+                brace |= line[i] == '{';
+                i++;
+            }
+        }
+        token->length = i - token->start;
+        size_t name = var_name_length(line + token->start);
+        if (name > 0 && line[token->start + name] == '=') {
+            token->flags |= WORD_ASSIGN;
+        }
+    }
+
+    *tokens_out = tokens;
+    return count;
+}
+
+// Writing the string of a word token to out: quotes and escapes are
+// removed. As a glob pattern, quoted metacharacters are kept escaped so
+// they match literally. Returns the length written, out gets a NUL too.
+
+int wsh_word(char *out, const char *line, struct token *token, int pattern) {
+    const char *c = line + token->start, *end = c + token->length;
+    char *word = out;
+
+    if (!(token->flags & WORD_QUOTED)) {
+        memcpy(out, c, token->length);
+        out[token->length] = '\0';
+        return token->length;
+    }
+
+    while (c < end) {
+        if (*c == '\\' && c + 1 < end) {
+            c++;
+            if (pattern && strchr(GLOB_CHARS, *c) != NULL) {
+                *out++ = '\\';
+            }
+            *out++ = *c++;
+        } else if (*c == '\'' || *c == '"') {
+            char quote = *c++;
+            while (*c != quote) {
+                if (quote == '"' && *c == '\\' && strchr("$`\"\\", c[1]) != NULL) {
+                    c++;
+                }
+                if (pattern && strchr(GLOB_CHARS, *c) != NULL) {
+                    *out++ = '\\';
+                }
+                *out++ = *c++;
+            }
+            c++;
+        } else {
+            *out++ = *c++;
+        }
+    }
+    *out = '\0';
+
+    return out - word;
+}
+
+// Removing the escapes of a glob pattern that matched nothing
+
+static char *glob_unescape(struct arena *arena, const char *pattern) {
+    char *word = arena_strdup(arena, pattern), *out = word;
+    const char *c;
+
+    for (c = pattern; *c != '\0'; c++) {
+        if (*c == '\\' && c[1] != '\0') {
+            c++;
+        }
+        *out++ = *c;
+    }
+    *out = '\0';
+
+    return word;
+}
+
+// Reading a job label word, %name, followed by the colon that ends a
+// prefix when colon is set. Returns the length of the name, 0 if no label.
+
+static int job_label(const char *line, struct token *token, int colon) {
+    const char *name = line + token->start + 1;
+    int length = 0;
+
+    if (token->type != TOKEN_WORD || token->flags != 0 || name[-1] != '%') {
+        return 0;
+    }
+    while (isalnum((unsigned char) name[length]) || name[length] == '_' || name[length] == '-') {
+        length++;
+    }
+    if (length == 0 || token->length != length + 1 + colon || (colon && name[length] != ':')) {
+        return 0;
+    }
+
+    return length;
+}
+
+// Parsing the command line: lex once, then build one process per pipeline
+// segment, materializing only argv strings and redirect paths
+
+static struct job *parse_command(char *line) {
+    struct arena *arena = arena_create();
+    struct process *root_proc = NULL, *proc = NULL;
+    struct token *tokens;
+    int mode = FOREGROUND_EXECUTION;
+    int count, i, first;
+
+    line = arena_strdup(arena, helper_strtrim(line));
+    count = wsh_lex(line, &tokens, arena);
+    if (count < 0) {
+        arena_release(arena);
+        return NULL;
+    }
+
+    if (count > 0 && tokens[count - 1].type == TOKEN_BACKGROUND) {
+        mode = BACKGROUND_EXECUTION;
+        count--;
+    }
+
+    // %name: names the job, after %a %b: has it wait for the jobs named
+    char *name = NULL, **after = NULL;
+    int length;
+    first = 0;
+    if (count > 1 && (length = job_label(line, &tokens[0], 1)) > 0) {
+        name = arena_strndup(arena, line + tokens[0].start + 1, length);
+        first = 1;
+    }
+    if (count > first + 2 && tokens[first].flags == 0 && tokens[first].length == 5 &&
+        strncmp(line + tokens[first].start, "after", 5) == 0) {
+        for (i = first + 1; i < count - 1 && job_label(line, &tokens[i], 0) > 0; i++);
+        if (i < count - 1 && job_label(line, &tokens[i], 1) > 0) {
+            after = (char**) arena_alloc(arena, (i - first + 1) * sizeof(char*));
+            for (length = 0; length < i - first; length++) {
+                struct token *label = &tokens[first + 1 + length];
+                after[length] = arena_strndup(arena, line + label->start + 1,
+                                              label->length - 1 - (first + 1 + length == i));
+            }
+            after[length] = NULL;
+            first = i + 1;
+        }
+    }
+
+    // every argv string, path and here-string of the line goes into one
+    // block, with room for the newline a here-string gets
+    size_t pool_size = 0;
+    for (i = 0; i < count; i++) {
+        pool_size += tokens[i].length * ((tokens[i].flags & WORD_QUOTED) ? 2 : 1) + 2;
+    }
+    char *pool = (char*) arena_alloc(arena, pool_size);
+
+    while (first <= count) {
+        int last = first, argc = 0, assigns = 0, globs = 0, inputs = 0, outputs = 0, heredocs = 0;
+
+        while (last < count && tokens[last].type != TOKEN_PIPE) {
+            if (tokens[last].type == TOKEN_WORD) {
+                // only the words before the command name are assignments
+                if (assigns == argc && (tokens[last].flags & WORD_ASSIGN)) {
+                    assigns++;
+                    globs |= WORD_ASSIGN;
+                }
+                argc++;
+                globs |= tokens[last].flags & (WORD_GLOB | WORD_EXPAND);
+            } else if (tokens[last].type == TOKEN_INPUT) {
+                inputs++;
+            } else if (tokens[last].type == TOKEN_OUTPUT) {
+                outputs++;
+            } else if (tokens[last].type == TOKEN_HEREDOC) {
+                heredocs++;
+            }
+            last++;
+        }
+
+        struct process *new_proc = (struct process*) arena_alloc(arena, sizeof(struct process));
+        char **argv = (char**) arena_alloc(arena, (argc + 1) * sizeof(char*));
+
+        new_proc->argv = argv;
+        new_proc->argc = 0;
+        new_proc->globs = globs ? (char*) arena_alloc(arena, argc) : NULL;
+        new_proc->input_paths = inputs ? (char**) arena_alloc(arena, (inputs + 1) * sizeof(char*)) : NULL;
+        new_proc->output_paths = outputs ? (char**) arena_alloc(arena, (outputs + 1) * sizeof(char*)) : NULL;
+        new_proc->here_doc = NULL;
+        new_proc->here_length = 0;
+        new_proc->here_delim = NULL;
+        new_proc->here_delims = heredocs ? (char**) arena_alloc(arena, (heredocs + 1) * sizeof(char*)) : NULL;
+        new_proc->envp = NULL;
+        inputs = outputs = heredocs = 0;
+
+        for (i = first; i < last; i++) {
+            struct token *token = &tokens[i];
+            if (token->type == TOKEN_WORD) {
+                int assign = new_proc->argc < assigns ? WORD_ASSIGN : 0;
+                int glob_word = assign ? 0 : token->flags & WORD_GLOB;
+                if (globs) {
+                    new_proc->globs[new_proc->argc] = (token->flags & WORD_EXPAND) | glob_word | assign;
+                }
+                argv[new_proc->argc++] = pool;
+                if (token->flags & WORD_EXPAND) {
+                    // kept raw, quotes are removed when it is expanded
+                    memcpy(pool, line + token->start, token->length);
+                    pool[token->length] = '\0';
+                    pool += token->length + 1;
+                } else {
+                    pool += wsh_word(pool, line, token, glob_word) + 1;
+                }
+            } else if (token->type == TOKEN_AND || token->type == TOKEN_OR || token->type == TOKEN_SEMI) {
+                fprintf(stderr, "wsh: syntax error near '%.*s'\n", token->length, line + token->start);
+                arena_release(arena);
+                return NULL;
+            } else if (token->type != TOKEN_BACKGROUND) {
+                if (i + 1 >= last || tokens[i + 1].type != TOKEN_WORD) {
+                    fprintf(stderr, "wsh: syntax error near '%c'\n", line[token->start]);
+                    arena_release(arena);
+                    return NULL;
+                }
+                char *path = pool;
+                int length = wsh_word(pool, line, &tokens[++i], 0);
+                pool += length + 1;
+                if (token->type == TOKEN_HEREDOC) {
+                    new_proc->here_delims[heredocs++] = path;
+                    new_proc->here_delims[heredocs] = NULL;
+                }
+                if (token->type == TOKEN_HEREDOC || token->type == TOKEN_HERESTRING) {
+                    // the last redirection of stdin wins over earlier ones,
+                    // every here-document still has its body read
+                    inputs = 0;
+                    new_proc->here_delim = token->type == TOKEN_HEREDOC ? path : NULL;
+                    new_proc->here_doc = NULL;
+                    new_proc->here_length = 0;
+                    if (token->type == TOKEN_HERESTRING) {
+                        path[length] = '\n';
+                        *pool++ = '\0';
+                        new_proc->here_doc = path;
+                        new_proc->here_length = length + 1;
+                    }
+                } else if (token->type == TOKEN_INPUT) {
+                    new_proc->here_doc = new_proc->here_delim = NULL;
+                    new_proc->input_paths[inputs++] = path;
+                    new_proc->input_paths[inputs] = NULL;
+                } else {
+                    new_proc->output_paths[outputs++] = path;
+                    new_proc->output_paths[outputs] = NULL;
+                }
+            } else {
+                fprintf(stderr, "wsh: syntax error near '&'\n");
+                arena_release(arena);
+                return NULL;
+            }
+        }
+        argv[new_proc->argc] = NULL;
+        if (inputs == 0) {
+            new_proc->input_paths = NULL;
+        }
+
+        if (new_proc->argc == 0) {
+            if (count > 0) {
+                fprintf(stderr, "wsh: syntax error near '|'\n");
+            }
+            arena_release(arena);
+            return NULL;
+        }
+
+        int start = tokens[first].start;
+        int end = tokens[last - 1].start + tokens[last - 1].length;
+        new_proc->command = first == 0 && last == count ? line : arena_strndup(arena, line + start, end - start);
+        new_proc->pid = -1;
+        new_proc->status = STATUS_RUNNING;
+        new_proc->exit_status = 0;
+        new_proc->plumbing = 0;
+        memset(&new_proc->usage, 0, sizeof(struct rusage));
+        memset(&new_proc->started, 0, sizeof(struct timespec));
+        memset(&new_proc->ended, 0, sizeof(struct timespec));
+        new_proc->builtin = assigns == argc ? &assign_builtin : wsh_find_builtin(argv[assigns]);
+        new_proc->next = NULL;
+
+        if (!root_proc) {
+            root_proc = new_proc;
+        } else {
+            proc->next = new_proc;
+        }
+        proc = new_proc;
+        first = last + 1;
+    }
+
+    struct job *new_job = (struct job*) arena_alloc(arena, sizeof(struct job));
+    new_job->arena = arena;
+    new_job->root = root_proc;
+    new_job->command = line;
+    new_job->id = -1;
+    new_job->pgid = -1;
+    new_job->mode = mode;
+    new_job->pipe_size = 0;
+    new_job->parallel = NULL;
+    new_job->priority = 0;
+    new_job->timed = 0;
+    new_job->queue_next = NULL;
+    new_job->timeout_ms = 0;
+    new_job->timer_index = -1;
+    new_job->timed_out = 0;
+    new_job->sched_counted = 0;
+    new_job->name = name;
+    new_job->after = after;
+    return new_job;
+}
+
+struct job* wsh_parse_command(char *line) {
+    TRACE_START(trace_start);
+    struct job *job = parse_command(line);
+
+    TRACE_SPAN("parse", 0, trace_start, line);
+    return job;
+}
+
+// Finding the body of a here-document in text: the lines from cursor up
+// to the one that is exactly delim. The body is [cursor, cursor + *length)
+// and the text after the delimiter line starts at the returned pointer.
+
+const char *wsh_here_span(const char *cursor, const char *end, const char *delim, size_t *length) {
+    size_t delim_length = strlen(delim);
+    const char *line = cursor;
+
+    while (line < end) {
+        const char *newline = memchr(line, '\n', end - line);
+        const char *next = newline != NULL ? newline + 1 : end;
+        if ((size_t) ((newline != NULL ? newline : end) - line) == delim_length &&
+            memcmp(line, delim, delim_length) == 0) {
+            *length = line - cursor;
+            return next;
+        }
+        line = next;
+    }
+
+    fprintf(stderr, "wsh: warning: here-document delimited by end-of-file (wanted '%s')\n", delim);
+    *length = end - cursor;
+    return end;
+}
+
+// Reading the bodies of the here-documents of a parsed job, line by line
+// from next_line until each delimiter, in the order they appear. Only the
+// body of a stage's stdin is kept. Returns -1 when the input ended first,
+// the job keeps what was read like other shells do.
+
+int wsh_read_here_docs(struct job *job, char *(*next_line)(const char *prompt)) {
+    struct process *proc;
+    char **delim;
+    int status = 0;
+
+    for (proc = job->root; proc != NULL; proc = proc->next) {
+        for (delim = proc->here_delims; delim != NULL && *delim != NULL; delim++) {
+            size_t capacity = COMMAND_BUFSIZE, length = 0;
+            char *body = (char*) arena_alloc(job->arena, capacity), *line;
+
+            while ((line = next_line("> ")) != NULL && strcmp(line, *delim) != 0) {
+                size_t line_length = strlen(line);
+                if (length + line_length + 1 > capacity) {
+                    char *grown;
+                    capacity = (length + line_length + 1) * 2;
+                    grown = (char*) arena_alloc(job->arena, capacity);
+                    memcpy(grown, body, length);
+                    body = grown;
+                }
+                memcpy(body + length, line, line_length);
+                body[length + line_length] = '\n';
+                length += line_length + 1;
+                free(line);
+            }
+            if (line == NULL) {
+                fprintf(stderr, "wsh: warning: here-document delimited by end-of-file (wanted '%s')\n", *delim);
+                status = -1;
+            }
+            free(line);
+            if (*delim == proc->here_delim) {
+                proc->here_doc = body;
+                proc->here_length = length;
+            }
+        }
+        proc->here_delims = NULL;
+    }
+
+    return status;
+}
+
+// Compiled scripts: the script is mmapped and parsed once into a flat
+// image (see struct script_image), which can be saved next to the script
+// and mmapped back on later runs without parsing anything
+
+struct image_buffer {
+    char *data;
+    size_t length;
+    size_t capacity;
+};
+
+static uint32_t image_append(struct image_buffer *buf, const void *data, size_t length) {
+    uint32_t offset = buf->length;
+
+    if (buf->length + length > buf->capacity) {
+        buf->capacity = (buf->length + length) * 2 + COMMAND_BUFSIZE;
+        buf->data = realloc(buf->data, buf->capacity);
+        if (!buf->data) {
+            fprintf(stderr, "wsh: allocation error");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(buf->data + buf->length, data, length);
+    buf->length += length;
+
+    return offset;
+}
+
+static uint32_t image_string(struct image_buffer *strings, const char *str) {
+    if (str == NULL) {
+        return 0;
+    }
+    return image_append(strings, str, strlen(str) + 1);
+}
+
+static inline const char *image_str(struct script_image *image, uint32_t offset) {
+    return offset == 0 ? NULL : (const char*) image + image->strings + offset;
+}
+
+static inline struct script_node *image_node(struct script_image *image, uint32_t index) {
+    return (struct script_node*) ((char*) image + image->nodes) + index;
+}
+
+#define IMAGE_ALIGN(n) (((n) + 7) & ~(size_t) 7)
+
+// Control flow. Each line is split at ;, && and || into commands and the
+// keywords in front of them; the commands are parsed into jobs as they
+// come, with their here-documents, and the keywords and separators go
+// into a list of items. Once the whole script is read the items are
+// parsed into a tree of nodes, so a loop body is parsed once however
+// many times it runs.
+
+static const char *script_keywords[] = {
+    "", "if", "then", "elif", "else", "fi", "while", "until", "do", "done", "for"
+};
+
+#define KEYWORD_COUNT (sizeof(script_keywords) / sizeof(script_keywords[0]))
+
+struct script_item {
+    int kind;
+    int sep;
+    uint32_t job;
+    uint32_t name;
+    uint32_t first_word;
+    uint32_t word_count;
+};
+
+struct image_builder {
+    struct image_buffer jobs;
+    struct image_buffer procs;
+    struct image_buffer words;
+    struct image_buffer strings;
+    struct image_buffer nodes;
+    struct image_buffer items;
+    uint32_t job_count;
+    uint32_t item_count;
+    uint32_t node_count;
+    int control;
+    int sep;
+    int error;
+};
+
+#define BUILDER_ITEM(b, i) ((struct script_item*) (b)->items.data + (i))
+#define BUILDER_NODE(b, i) ((struct script_node*) (b)->nodes.data + (i))
+
+// The keyword a word is, 0 for other words; only unquoted words count
+
+static int keyword_of(const char *word, size_t length) {
+    size_t i;
+
+    for (i = 1; i < KEYWORD_COUNT; i++) {
+        if (strlen(script_keywords[i]) == length && memcmp(script_keywords[i], word, length) == 0) {
+            return i;
+        }
+    }
+
+    return 0;
+}
+
+static int token_keyword(const char *line, struct token *token) {
+    return token->type == TOKEN_WORD && token->flags == 0 ? keyword_of(line + token->start, token->length) : 0;
+}
+
+// Checking cheaply whether text may use control flow: ;, && or || anywhere
+// or a keyword at the start of a line. A false positive only costs a lex.
+
+static int text_has_control(const char *text, size_t length) {
+    const char *c = text, *end = text + length;
+    int line_start = 1;
+
+    for (; c < end; c++) {
+        if (line_start && (*c == ' ' || *c == '\t')) {
+            continue;
+        }
+        if (line_start) {
+            const char *word = c;
+            while (c < end && isalpha((unsigned char) *c)) {
+                c++;
+            }
+            if (keyword_of(word, c - word) != 0 && (c == end || isspace((unsigned char) *c) || *c == ';')) {
+                return 1;
+            }
+            if (c == end) {
+                break;
+            }
+        }
+        if (*c == ';' || ((*c == '&' || *c == '|') && c + 1 < end && c[1] == *c)) {
+            return 1;
+        }
+        line_start = *c == '\n';
+    }
+
+    return 0;
+}
+
+// Scanning a line for control flow. Returns 0 when it has none, 1 when it
+// has some and 2 when it also ends in && or ||; depth gets the constructs
+// the line opens less the ones it closes.
+
+int wsh_control_scan(const char *line, int *depth) {
+    struct arena *arena = arena_create();
+    struct token *tokens;
+    int count = wsh_lex(line, &tokens, arena), command_start = 1, control = 0, i;
+
+    for (i = 0; i < count; i++) {
+        int keyword = command_start ? token_keyword(line, &tokens[i]) : 0;
+        if (tokens[i].type == TOKEN_AND || tokens[i].type == TOKEN_OR || tokens[i].type == TOKEN_SEMI) {
+            control = 1;
+            command_start = 1;
+        } else if (keyword != 0) {
+            control = 1;
+            if (keyword == KEYWORD_IF || keyword == KEYWORD_WHILE || keyword == KEYWORD_UNTIL ||
+                keyword == KEYWORD_FOR) {
+                (*depth)++;
+            } else if (keyword == KEYWORD_FI || keyword == KEYWORD_DONE) {
+                (*depth)--;
+            }
+            command_start = keyword != KEYWORD_FOR;
+        } else {
+            command_start = tokens[i].type == TOKEN_PIPE;
+        }
+    }
+    if (control && count > 0 && (tokens[count - 1].type == TOKEN_AND || tokens[count - 1].type == TOKEN_OR)) {
+        control = 2;
+    }
+    arena_release(arena);
+
+    return control;
+}
+
+// Adding a parsed job to the image, returns its index
+
+static uint32_t image_add_job(struct image_builder *b, struct job *job) {
+    struct process *proc;
+    struct script_job sjob = {
+        .command = image_string(&b->strings, job->command),
+        .first_proc = b->procs.length / sizeof(struct script_proc),
+        .proc_count = 0,
+        .mode = job->mode,
+        .name = job->name != NULL ? image_string(&b->strings, job->name) : 0,
+        .first_after = b->words.length / sizeof(uint32_t),
+        .after_count = 0
+    };
+    char **after;
+
+    for (after = job->after; after != NULL && *after != NULL; after++, sjob.after_count++) {
+        uint32_t word = image_string(&b->strings, *after);
+        image_append(&b->words, &word, sizeof(word));
+    }
+
+    for (proc = job->root; proc != NULL; proc = proc->next) {
+        struct script_proc sproc = {
+            .command = image_string(&b->strings, proc->command),
+            .first_word = b->words.length / sizeof(uint32_t),
+            .word_count = proc->argc,
+            .input_count = 0,
+            .output_count = 0,
+            .here_doc = 0,
+            .here_length = proc->here_length
+        };
+        int i;
+        if (proc->here_doc != NULL) {
+            sproc.here_doc = image_append(&b->strings, proc->here_doc, proc->here_length);
+            image_append(&b->strings, "", 1);
+        }
+        for (i = 0; i < proc->argc; i++) {
+            uint32_t word = image_string(&b->strings, proc->argv[i]);
+            if (proc->globs != NULL && (proc->globs[i] & WORD_GLOB)) {
+                word |= SCRIPT_WORD_GLOB;
+            }
+            if (proc->globs != NULL && (proc->globs[i] & WORD_EXPAND)) {
+                word |= SCRIPT_WORD_EXPAND;
+            }
+            if (proc->globs != NULL && (proc->globs[i] & WORD_ASSIGN)) {
+                word |= SCRIPT_WORD_ASSIGN;
+            }
+            image_append(&b->words, &word, sizeof(word));
+        }
+        for (i = 0; proc->input_paths != NULL && proc->input_paths[i] != NULL; i++, sproc.input_count++) {
+            uint32_t word = image_string(&b->strings, proc->input_paths[i]);
+            image_append(&b->words, &word, sizeof(word));
+        }
+        for (i = 0; proc->output_paths != NULL && proc->output_paths[i] != NULL; i++, sproc.output_count++) {
+            uint32_t word = image_string(&b->strings, proc->output_paths[i]);
+            image_append(&b->words, &word, sizeof(word));
+        }
+        image_append(&b->procs, &sproc, sizeof(sproc));
+        sjob.proc_count++;
+    }
+
+    image_append(&b->jobs, &sjob, sizeof(sjob));
+    return b->job_count++;
+}
+
+static void builder_item(struct image_builder *b, struct script_item *item) {
+    image_append(&b->items, item, sizeof(*item));
+    b->item_count++;
+    b->control |= item->kind != 0 || item->sep == TOKEN_AND || item->sep == TOKEN_OR;
+}
+
+// Parsing a command of a line into a job item; its here-documents are
+// read from *cursor on
+
+static void builder_command(struct image_builder *b, char *text, int sep, const char **cursor, const char *end) {
+    struct job *job = wsh_parse_command(text);
+    struct process *proc;
+    char **delim;
+
+    if (job == NULL) {
+        return;
+    }
+    for (proc = job->root; proc != NULL; proc = proc->next) {
+        for (delim = proc->here_delims; delim != NULL && *delim != NULL; delim++) {
+            const char *body = *cursor < end ? *cursor : end;
+            size_t length;
+            *cursor = wsh_here_span(body, end, *delim, &length);
+            if (*delim == proc->here_delim) {
+                proc->here_doc = (char*) body;
+                proc->here_length = length;
+            }
+        }
+    }
+    struct script_item item = {.kind = 0, .sep = sep, .job = image_add_job(b, job)};
+    builder_item(b, &item);
+    free_job(job);
+}
+
+// for NAME in WORDS: the words are parsed like the arguments of a command
+// and kept with their glob and expansion flags for every run of the loop
+
+static int builder_for(struct image_builder *b, const char *line, struct token *tokens, int first, int last, int sep) {
+    struct script_item item = {.kind = KEYWORD_FOR, .sep = sep};
+    struct token *name = &tokens[first + 1], *in = &tokens[first + 2];
+
+    if (last - first < 3 || name->type != TOKEN_WORD || name->flags != 0 ||
+        var_name_length(line + name->start) != (size_t) name->length ||
+        in->type != TOKEN_WORD || in->flags != 0 || in->length != 2 || strncmp(line + in->start, "in", 2) != 0) {
+        fprintf(stderr, "wsh: syntax error: for NAME in WORDS\n");
+        return -1;
+    }
+    char *name_text = strndup(line + name->start, name->length);
+    item.name = image_string(&b->strings, name_text);
+    item.first_word = b->words.length / sizeof(uint32_t);
+    free(name_text);
+
+    if (last - first > 3) {
+        int start = tokens[first + 3].start, stop = tokens[last - 1].start + tokens[last - 1].length;
+        char *text = strndup(line + start, stop - start);
+        struct job *job = wsh_parse_command(text);
+        free(text);
+        if (job == NULL || job->root->next != NULL) {
+            fprintf(stderr, "wsh: syntax error: for NAME in WORDS\n");
+            if (job != NULL) {
+                free_job(job);
+            }
+            return -1;
+        }
+        struct process *proc = job->root;
+        int i;
+        for (i = 0; i < proc->argc; i++, item.word_count++) {
+            uint32_t word = image_string(&b->strings, proc->argv[i]);
+            if (proc->globs != NULL && (proc->globs[i] & WORD_GLOB)) {
+                word |= SCRIPT_WORD_GLOB;
+            }
+            if (proc->globs != NULL && (proc->globs[i] & WORD_EXPAND)) {
+                word |= SCRIPT_WORD_EXPAND;
+            }
+            image_append(&b->words, &word, sizeof(word));
+        }
+        free_job(job);
+    }
+    builder_item(b, &item);
+
+    return 0;
+}
+
+// Splitting a line into items: keywords in front of each command, then
+// the command or for header itself
+
+static void builder_line(struct image_builder *b, const char *line, const char **cursor, const char *end) {
+    struct arena *arena = arena_create();
+    struct token *tokens;
+    int count = wsh_lex(line, &tokens, arena), first = 0, i;
+
+    for (i = 0; i <= count && count >= 0; i++) {
+        if (i < count && tokens[i].type != TOKEN_AND && tokens[i].type != TOKEN_OR && tokens[i].type != TOKEN_SEMI) {
+            continue;
+        }
+        int sep = i < count ? tokens[i].type : TOKEN_SEMI, keyword = 0;
+
+        if (first == i && i < count) {
+            fprintf(stderr, "wsh: syntax error near '%.*s'\n", tokens[i].length, line + tokens[i].start);
+            break;
+        }
+
+        for (; first < i && (keyword = token_keyword(line, &tokens[first])) != 0; first++) {
+            if (keyword == KEYWORD_FI || keyword == KEYWORD_DONE || keyword == KEYWORD_FOR) {
+                break;
+            }
+            struct script_item item = {.kind = keyword, .sep = first + 1 == i ? sep : 0};
+            builder_item(b, &item);
+        }
+        if (first < i && (keyword == KEYWORD_FI || keyword == KEYWORD_DONE)) {
+            if (first + 1 < i) {
+                fprintf(stderr, "wsh: syntax error near '%.*s'\n", tokens[first + 1].length, line + tokens[first + 1].start);
+                break;
+            }
+            struct script_item item = {.kind = keyword, .sep = sep};
+            builder_item(b, &item);
+        } else if (first < i && keyword == KEYWORD_FOR) {
+            if (builder_for(b, line, tokens, first, i, sep) < 0) {
+                break;
+            }
+        } else if (first < i) {
+            int stop = tokens[i - 1].start + tokens[i - 1].length;
+            char *text = strndup(line + tokens[first].start, stop - tokens[first].start);
+            builder_command(b, text, sep, cursor, end);
+            free(text);
+        }
+        first = i + 1;
+    }
+    arena_release(arena);
+}
+
+static uint32_t node_add(struct image_builder *b, uint32_t type) {
+    struct script_node node = {.type = type};
+
+    if (b->node_count == 0) {
+        image_append(&b->nodes, &node, sizeof(node));   // index 0 is no node
+        b->node_count++;
+    }
+    image_append(&b->nodes, &node, sizeof(node));
+
+    return b->node_count++;
+}
+
+static const char *builder_item_text(struct image_builder *b, uint32_t pos) {
+    struct script_item *item = BUILDER_ITEM(b, pos);
+
+    if (item->kind != 0) {
+        return script_keywords[item->kind];
+    }
+    return b->strings.data + ((struct script_job*) b->jobs.data)[item->job].command;
+}
+
+static int item_ends_list(int kind) {
+    return kind == KEYWORD_THEN || kind == KEYWORD_ELIF || kind == KEYWORD_ELSE || kind == KEYWORD_FI ||
+           kind == KEYWORD_DO || kind == KEYWORD_DONE;
+}
+
+// Taking the keyword that has to come next, 0 on a syntax error
+
+static int builder_expect(struct image_builder *b, uint32_t *pos, int kind) {
+    if (b->error) {
+        return 0;
+    }
+    if (*pos >= b->item_count) {
+        fprintf(stderr, "wsh: syntax error: unexpected end of file (wanted '%s')\n", script_keywords[kind]);
+        b->error = 1;
+        return 0;
+    }
+    if (BUILDER_ITEM(b, *pos)->kind != kind) {
+        fprintf(stderr, "wsh: syntax error near '%s' (wanted '%s')\n", builder_item_text(b, *pos), script_keywords[kind]);
+        b->error = 1;
+        return 0;
+    }
+    b->sep = BUILDER_ITEM(b, *pos)->sep;
+    (*pos)++;
+
+    return 1;
+}
+
+static uint32_t parse_script_list(struct image_builder *b, uint32_t *pos);
+
+// if LIST then LIST [elif LIST then LIST]... [else LIST] fi, past the if
+
+static uint32_t parse_script_if(struct image_builder *b, uint32_t *pos) {
+    uint32_t node = node_add(b, SCRIPT_NODE_IF), left, body, orelse = 0;
+
+    left = parse_script_list(b, pos);
+    builder_expect(b, pos, KEYWORD_THEN);
+    body = parse_script_list(b, pos);
+    if (!b->error && *pos < b->item_count && BUILDER_ITEM(b, *pos)->kind == KEYWORD_ELIF) {
+        (*pos)++;
+        orelse = parse_script_if(b, pos);
+    } else if (!b->error && *pos < b->item_count && BUILDER_ITEM(b, *pos)->kind == KEYWORD_ELSE) {
+        (*pos)++;
+        orelse = parse_script_list(b, pos);
+        builder_expect(b, pos, KEYWORD_FI);
+    } else {
+        builder_expect(b, pos, KEYWORD_FI);
+    }
+    BUILDER_NODE(b, node)->left = left;
+    BUILDER_NODE(b, node)->body = body;
+    BUILDER_NODE(b, node)->orelse = orelse;
+
+    return node;
+}
+
+// A command, if, while, until or for
+
+static uint32_t parse_script_command(struct image_builder *b, uint32_t *pos) {
+    struct script_item item = *BUILDER_ITEM(b, *pos);
+    uint32_t node, left = 0, body;
+
+    (*pos)++;
+    b->sep = item.sep;
+    switch (item.kind) {
+    case 0:
+        node = node_add(b, SCRIPT_NODE_JOB);
+        BUILDER_NODE(b, node)->job = item.job;
+        return node;
+    case KEYWORD_IF:
+        return parse_script_if(b, pos);
+    case KEYWORD_WHILE:
+    case KEYWORD_UNTIL:
+    case KEYWORD_FOR:
+        node = node_add(b, item.kind == KEYWORD_WHILE ? SCRIPT_NODE_WHILE :
+                           item.kind == KEYWORD_UNTIL ? SCRIPT_NODE_UNTIL : SCRIPT_NODE_FOR);
+        if (item.kind != KEYWORD_FOR) {
+            left = parse_script_list(b, pos);
+        }
+        builder_expect(b, pos, KEYWORD_DO);
+        body = parse_script_list(b, pos);
+        builder_expect(b, pos, KEYWORD_DONE);
+        BUILDER_NODE(b, node)->left = left;
+        BUILDER_NODE(b, node)->body = body;
+        BUILDER_NODE(b, node)->name = item.name;
+        BUILDER_NODE(b, node)->first_word = item.first_word;
+        BUILDER_NODE(b, node)->word_count = item.word_count;
+        return node;
+    default:
+        fprintf(stderr, "wsh: syntax error near '%s'\n", script_keywords[item.kind]);
+        b->error = 1;
+        return 0;
+    }
+}
+
+// Commands joined by && and ||, left to right
+
+static uint32_t parse_script_and_or(struct image_builder *b, uint32_t *pos) {
+    uint32_t node = parse_script_command(b, pos);
+
+    while (!b->error && (b->sep == TOKEN_AND || b->sep == TOKEN_OR)) {
+        uint32_t type = b->sep == TOKEN_AND ? SCRIPT_NODE_AND : SCRIPT_NODE_OR;
+        if (*pos >= b->item_count) {
+            fprintf(stderr, "wsh: syntax error: unexpected end of file after '%s'\n", type == SCRIPT_NODE_AND ? "&&" : "||");
+            b->error = 1;
+            break;
+        }
+        uint32_t right = parse_script_command(b, pos);
+        uint32_t joined = node_add(b, type);
+        BUILDER_NODE(b, joined)->left = node;
+        BUILDER_NODE(b, joined)->body = right;
+        node = joined;
+    }
+
+    return node;
+}
+
+// A list up to the keyword that ends it; constructs cut short by a syntax
+// error are left out
+
+static uint32_t parse_script_list(struct image_builder *b, uint32_t *pos) {
+    uint32_t first = 0, last = 0;
+
+    while (!b->error && *pos < b->item_count && !item_ends_list(BUILDER_ITEM(b, *pos)->kind)) {
+        uint32_t node = parse_script_and_or(b, pos);
+        if (b->error) {
+            break;
+        }
+        if (first == 0) {
+            first = node;
+        } else {
+            BUILDER_NODE(b, last)->next = node;
+        }
+        last = node;
+    }
+
+    return first;
+}
+
+// The wsh build an image was made by: a new build may lay jobs out
+// differently even at the same image version, so its images are rebuilt
+
+static uint32_t script_image_build_id() {
+    return wsh_hash_string(__DATE__ " " __TIME__);
+}
+
+// Parsing a whole script into an image. Without a path or stat it is
+// built from command text.
+
+struct script_image *script_image_build(const char *path, const char *data, size_t size, struct stat *st) {
+    struct image_builder b = {0};
+    const char *cursor = data, *end = data + size;
+    char *line = NULL;
+    size_t line_cap = 0;
+    uint32_t root = 0, i = 0;
+    int control = text_has_control(data, size);
+
+    image_append(&b.strings, "", 1);
+    uint32_t script_path = image_string(&b.strings, path);
+
+    while (cursor < end) {
+        const char *newline = memchr(cursor, '\n', end - cursor);
+        size_t length = (newline != NULL ? newline : end) - cursor;
+
+        if (length + 1 > line_cap) {
+            line_cap = length + COMMAND_BUFSIZE;
+            line = realloc(line, line_cap);
+            if (!line) {
+                fprintf(stderr, "wsh: allocation error");
+                exit(EXIT_FAILURE);
+            }
+        }
+        memcpy(line, cursor, length);
+        line[length] = '\0';
+        cursor += length + 1;
+
+        char *trimmed = helper_strtrim(line);
+        if (*trimmed == '\0' || *trimmed == '#') {
+            continue;
+        }
+        if (control) {
+            builder_line(&b, trimmed, &cursor, end);
+        } else {
+            builder_command(&b, trimmed, TOKEN_SEMI, &cursor, end);
+        }
+    }
+    free(line);
+
+    if (b.control) {
+        root = parse_script_list(&b, &i);
+    }
+    if (b.control && !b.error && i < b.item_count) {
+        fprintf(stderr, "wsh: syntax error near '%s'\n", builder_item_text(&b, i));
+    }
+
+    size_t jobs_at = IMAGE_ALIGN(sizeof(struct script_image));
+    size_t procs_at = IMAGE_ALIGN(jobs_at + b.jobs.length);
+    size_t words_at = IMAGE_ALIGN(procs_at + b.procs.length);
+    size_t nodes_at = IMAGE_ALIGN(words_at + b.words.length);
+    size_t strings_at = IMAGE_ALIGN(nodes_at + (b.control ? b.nodes.length : 0));
+    size_t total = strings_at + b.strings.length;
+
+    struct script_image *image = (struct script_image*) calloc(1, total);
+    if (!image) {
+        fprintf(stderr, "wsh: allocation error");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(image->magic, SCRIPT_IMAGE_MAGIC, sizeof(image->magic));
+    image->version = SCRIPT_IMAGE_VERSION;
+    image->build = script_image_build_id();
+    image->size = total;
+    if (st != NULL) {
+        image->script_size = st->st_size;
+        image->script_mtime_sec = st->st_mtim.tv_sec;
+        image->script_mtime_nsec = st->st_mtim.tv_nsec;
+    }
+    image->script_path = script_path;
+    image->job_count = b.job_count;
+    image->jobs = jobs_at;
+    image->proc_count = b.procs.length / sizeof(struct script_proc);
+    image->procs = procs_at;
+    image->word_count = b.words.length / sizeof(uint32_t);
+    image->words = words_at;
+    image->node_count = b.control ? b.node_count : 0;
+    image->nodes = nodes_at;
+    image->root = root;
+    image->strings = strings_at;
+    memcpy((char*) image + jobs_at, b.jobs.data, b.jobs.length);
+    memcpy((char*) image + procs_at, b.procs.data, b.procs.length);
+    memcpy((char*) image + words_at, b.words.data, b.words.length);
+    if (b.control) {
+        memcpy((char*) image + nodes_at, b.nodes.data, b.nodes.length);
+    }
+    memcpy((char*) image + strings_at, b.strings.data, b.strings.length);
+
+    free(b.jobs.data);
+    free(b.procs.data);
+    free(b.words.data);
+    free(b.nodes.data);
+    free(b.items.data);
+    free(b.strings.data);
+
+    return image;
+}
+
+static int image_fits(struct script_image *image, uint32_t offset, uint32_t count, size_t size) {
+    return offset <= image->size && (image->size - offset) / size >= count;
+}
+
+// Whether a string offset lies inside the string table, 0 (no string)
+// only where that is allowed; the image ends in a NUL
+
+static int image_str_fits(struct script_image *image, uint32_t offset, int optional) {
+    return offset == 0 ? optional : offset < image->size - image->strings;
+}
+
+// Words that may carry flags (arguments, for lists) or not (redirect
+// targets, after names); an assignment has to have its =
+
+static int image_words_fit(struct script_image *image, uint32_t first, uint32_t count, uint32_t flags) {
+    uint32_t *words = (uint32_t*) ((char*) image + image->words);
+    uint32_t i;
+
+    if (first > image->word_count || count > image->word_count - first) {
+        return 0;
+    }
+    for (i = 0; i < count; i++) {
+        uint32_t word = words[first + i];
+        if (!image_str_fits(image, word & ~flags, 0) ||
+            ((word & flags & SCRIPT_WORD_ASSIGN) && strchr(image_str(image, word & ~flags), '=') == NULL)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// Checking every region, index and string offset of a mapped image, so a
+// damaged cache file is parsed again instead of run. Tree nodes may have
+// one parent each and the root none, so the tree cannot loop
+
+static int script_image_valid(struct script_image *image, size_t size) {
+    struct script_job *sjobs = (struct script_job*) ((char*) image + image->jobs);
+    struct script_proc *procs = (struct script_proc*) ((char*) image + image->procs);
+    uint32_t i;
+
+    if (memcmp(image->magic, SCRIPT_IMAGE_MAGIC, sizeof(image->magic)) != 0 ||
+        image->version != SCRIPT_IMAGE_VERSION ||
+        image->build != script_image_build_id() ||
+        image->size != size ||
+        image->strings >= image->size ||
+        ((char*) image)[image->size - 1] != '\0' ||
+        !image_fits(image, image->jobs, image->job_count, sizeof(struct script_job)) ||
+        !image_fits(image, image->procs, image->proc_count, sizeof(struct script_proc)) ||
+        !image_fits(image, image->words, image->word_count, sizeof(uint32_t)) ||
+        !image_fits(image, image->nodes, image->node_count, sizeof(struct script_node)) ||
+        !image_str_fits(image, image->script_path, 0) ||
+        image->root >= (image->node_count > 0 ? image->node_count : 1)) {
+        return 0;
+    }
+
+    for (i = 0; i < image->proc_count; i++) {
+        struct script_proc *sproc = &procs[i];
+        if (!image_str_fits(image, sproc->command, 0) ||
+            !image_words_fit(image, sproc->first_word, sproc->word_count, SCRIPT_WORD_FLAGS) ||
+            !image_words_fit(image, sproc->first_word + sproc->word_count, sproc->input_count + sproc->output_count, 0) ||
+            (sproc->here_doc != 0 && (!image_str_fits(image, sproc->here_doc, 0) ||
+                                      sproc->here_length >= image->size - image->strings - sproc->here_doc))) {
+            return 0;
+        }
+    }
+    for (i = 0; i < image->job_count; i++) {
+        struct script_job *sjob = &sjobs[i];
+        if (!image_str_fits(image, sjob->command, 0) || !image_str_fits(image, sjob->name, 1) ||
+            sjob->proc_count == 0 || sjob->first_proc > image->proc_count ||
+            sjob->proc_count > image->proc_count - sjob->first_proc ||
+            !image_words_fit(image, sjob->first_after, sjob->after_count, 0)) {
+            return 0;
+        }
+    }
+
+    if (image->node_count == 0) {
+        return 1;
+    }
+    unsigned char *parents = (unsigned char*) calloc(image->node_count, 1);
+    int valid = 1;
+    if (!parents) {
+        fprintf(stderr, "wsh: allocation error");
+        exit(EXIT_FAILURE);
+    }
+    parents[image->root] = 1;
+    for (i = 1; i < image->node_count && valid; i++) {
+        struct script_node *node = image_node(image, i);
+        uint32_t links[] = {node->left, node->body, node->orelse, node->next};
+        size_t j;
+        if (node->type < SCRIPT_NODE_JOB || node->type > SCRIPT_NODE_FOR ||
+            (node->type == SCRIPT_NODE_JOB && node->job >= image->job_count) ||
+            (node->type == SCRIPT_NODE_FOR && (!image_str_fits(image, node->name, 0) ||
+                                               !image_words_fit(image, node->first_word, node->word_count,
+                                                                SCRIPT_WORD_FLAGS)))) {
+            valid = 0;
+        }
+        for (j = 0; j < sizeof(links) / sizeof(links[0]) && valid; j++) {
+            if (links[j] >= image->node_count || (links[j] != 0 && parents[links[j]]++ > 0)) {
+                valid = 0;
+            }
+        }
+    }
+    free(parents);
+
+    return valid;
+}
+
+// Mapping a saved image, NULL when missing, stale for this script or damaged
+
+struct script_image *script_image_load(const char *cache_path, const char *path, struct stat *st, size_t *length) {
+    struct script_image *image;
+    struct stat cache_st;
+    int fd = open(cache_path, O_RDONLY|O_CLOEXEC);
+
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &cache_st) < 0 || cache_st.st_size < (off_t) sizeof(struct script_image)) {
+        close(fd);
+        return NULL;
+    }
+
+    image = mmap(NULL, cache_st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        return NULL;
+    }
+
+    if (!script_image_valid(image, cache_st.st_size) ||
+        image->script_size != (uint64_t) st->st_size ||
+        image->script_mtime_sec != st->st_mtim.tv_sec ||
+        image->script_mtime_nsec != st->st_mtim.tv_nsec ||
+        strcmp(image_str(image, image->script_path), path) != 0) {
+        munmap(image, cache_st.st_size);
+        return NULL;
+    }
+
+    *length = cache_st.st_size;
+    return image;
+}
+
+// Saving an image next to the script, written aside and renamed into place
+
+static int image_write(const void *data, size_t size, const char *path) {
+    char tmp_path[PATH_MAX];
+    int fd;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, getpid());
+    fd = open(tmp_path, O_CREAT|O_WRONLY|O_TRUNC|O_CLOEXEC, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+    if (fd < 0) {
+        return -1;
+    }
+    if (write(fd, data, size) != (ssize_t) size || rename(tmp_path, path) < 0) {
+        close(fd);
+        unlink(tmp_path);
+        return -1;
+    }
+
+    close(fd);
+    return 0;
+}
+
+int script_image_save(struct script_image *image, const char *cache_path) {
+    return image_write(image, image->size, cache_path);
+}
+
+// Getting the cache file of a script: dir/.name.wshc
+
+char *script_image_cache_path(const char *path) {
+    const char *base = strrchr(path, '/');
+    int dir_length = base != NULL ? base - path + 1 : 0;
+    char *cache_path;
+
+    base = base != NULL ? base + 1 : path;
+    cache_path = malloc(strlen(path) + strlen(SCRIPT_IMAGE_SUFFIX) + 2);
+    sprintf(cache_path, "%.*s.%s%s", dir_length, path, base, SCRIPT_IMAGE_SUFFIX);
+
+    return cache_path;
+}
+
+// Building a runnable job from an image entry, argv points into the image
+
+struct job *script_image_job(struct script_image *image, int index) {
+    struct script_job *sjob = (struct script_job*) ((char*) image + image->jobs) + index;
+    struct script_proc *sproc = (struct script_proc*) ((char*) image + image->procs) + sjob->first_proc;
+    uint32_t *words = (uint32_t*) ((char*) image + image->words);
+    struct process *root_proc = NULL, *proc = NULL;
+    struct arena *arena = arena_create();
+    uint32_t i, j;
+
+    for (i = 0; i < sjob->proc_count; i++, sproc++) {
+        struct process *new_proc = (struct process*) arena_alloc(arena, sizeof(struct process));
+        char **argv = (char**) arena_alloc(arena, (sproc->word_count + 1) * sizeof(char*));
+        uint32_t *redirects = words + sproc->first_word + sproc->word_count, assigns = 0;
+
+        new_proc->globs = NULL;
+        for (j = 0; j < sproc->word_count; j++) {
+            uint32_t word = words[sproc->first_word + j];
+            if (word & SCRIPT_WORD_FLAGS) {
+                if (new_proc->globs == NULL) {
+                    new_proc->globs = (char*) arena_alloc(arena, sproc->word_count);
+                    memset(new_proc->globs, 0, sproc->word_count);
+                }
+                new_proc->globs[j] = ((word & SCRIPT_WORD_GLOB) ? WORD_GLOB : 0) |
+                                     ((word & SCRIPT_WORD_EXPAND) ? WORD_EXPAND : 0) |
+                                     ((word & SCRIPT_WORD_ASSIGN) ? WORD_ASSIGN : 0);
+                assigns += (word & SCRIPT_WORD_ASSIGN) != 0;
+            }
+            argv[j] = (char*) image_str(image, word & ~SCRIPT_WORD_FLAGS);
+        }
+        argv[j] = NULL;
+
+        new_proc->command = (char*) image_str(image, sproc->command);
+        new_proc->argv = argv;
+        new_proc->argc = sproc->word_count;
+        new_proc->input_paths = NULL;
+        new_proc->output_paths = NULL;
+        new_proc->here_doc = (char*) image_str(image, sproc->here_doc);
+        new_proc->here_length = sproc->here_length;
+        new_proc->here_delim = NULL;
+        new_proc->here_delims = NULL;
+        new_proc->envp = NULL;
+        if (sproc->input_count > 0) {
+            new_proc->input_paths = (char**) arena_alloc(arena, (sproc->input_count + 1) * sizeof(char*));
+            for (j = 0; j < sproc->input_count; j++) {
+                new_proc->input_paths[j] = (char*) image_str(image, redirects[j]);
+            }
+            new_proc->input_paths[j] = NULL;
+        }
+        if (sproc->output_count > 0) {
+            new_proc->output_paths = (char**) arena_alloc(arena, (sproc->output_count + 1) * sizeof(char*));
+            for (j = 0; j < sproc->output_count; j++) {
+                new_proc->output_paths[j] = (char*) image_str(image, redirects[sproc->input_count + j]);
+            }
+            new_proc->output_paths[j] = NULL;
+        }
+        new_proc->pid = -1;
+        new_proc->status = STATUS_RUNNING;
+        new_proc->exit_status = 0;
+        new_proc->plumbing = 0;
+        memset(&new_proc->usage, 0, sizeof(struct rusage));
+        memset(&new_proc->started, 0, sizeof(struct timespec));
+        memset(&new_proc->ended, 0, sizeof(struct timespec));
+        new_proc->builtin = assigns > 0 && assigns == sproc->word_count ? &assign_builtin :
+                            argv[assigns] != NULL ? wsh_find_builtin(argv[assigns]) : NULL;
+        new_proc->next = NULL;
+
+        if (!root_proc) {
+            root_proc = new_proc;
+        } else {
+            proc->next = new_proc;
+        }
+        proc = new_proc;
+    }
+
+    struct job *new_job = (struct job*) arena_alloc(arena, sizeof(struct job));
+    new_job->arena = arena;
+    new_job->root = root_proc;
+    new_job->command = (char*) image_str(image, sjob->command);
+    new_job->id = -1;
+    new_job->pgid = -1;
+    new_job->mode = sjob->mode;
+    new_job->pipe_size = 0;
+    new_job->parallel = NULL;
+    new_job->priority = 0;
+    new_job->timed = 0;
+    new_job->queue_next = NULL;
+    new_job->timeout_ms = 0;
+    new_job->timer_index = -1;
+    new_job->timed_out = 0;
+    new_job->sched_counted = 0;
+    new_job->name = (char*) image_str(image, sjob->name);
+    new_job->after = NULL;
+    if (sjob->after_count > 0) {
+        new_job->after = (char**) arena_alloc(arena, (sjob->after_count + 1) * sizeof(char*));
+        for (j = 0; j < sjob->after_count; j++) {
+            new_job->after[j] = (char*) image_str(image, words[sjob->first_after + j]);
+        }
+        new_job->after[j] = NULL;
+    }
+    return new_job;
+}
+
+// Printing the control flow tree of an image, one node a line
+
+static void script_node_dump(struct script_image *image, uint32_t index, int depth) {
+    static const char *names[] = {"", "job", "&&", "||", "if", "while", "until", "for"};
+    uint32_t *words = (uint32_t*) ((char*) image + image->words);
+    uint32_t i;
+
+    for (; index != 0; index = image_node(image, index)->next) {
+        struct script_node *node = image_node(image, index);
+        printf("%*s%s", depth * 4 + 4, "", names[node->type]);
+        if (node->type == SCRIPT_NODE_JOB) {
+            printf(" [%u]", node->job + 1);
+        } else if (node->type == SCRIPT_NODE_FOR) {
+            printf(" %s in", image_str(image, node->name));
+            for (i = 0; i < node->word_count; i++) {
+                printf(" %s", image_str(image, words[node->first_word + i] & ~SCRIPT_WORD_FLAGS));
+            }
+        }
+        printf("\n");
+        script_node_dump(image, node->left, depth + 1);
+        if (node->type == SCRIPT_NODE_IF || node->type == SCRIPT_NODE_WHILE || node->type == SCRIPT_NODE_UNTIL ||
+            node->type == SCRIPT_NODE_FOR) {
+            printf("%*s%s\n", depth * 4 + 4, "", node->type == SCRIPT_NODE_IF ? "then" : "do");
+        }
+        script_node_dump(image, node->body, depth + 1);
+        if (node->orelse != 0) {
+            printf("%*selse\n", depth * 4 + 4, "");
+            script_node_dump(image, node->orelse, depth + 1);
+        }
+    }
+}
+
+// Printing an image for --dump-parse
+
+void script_image_dump(struct script_image *image) {
+    struct script_job *sjob = (struct script_job*) ((char*) image + image->jobs);
+    struct script_proc *procs = (struct script_proc*) ((char*) image + image->procs);
+    uint32_t *words = (uint32_t*) ((char*) image + image->words);
+    uint32_t i, j, k;
+
+    printf("script: %s\n", image_str(image, image->script_path));
+    printf("image: version %u, %u bytes, %u jobs, %lu procs, %lu words, %u string bytes\n",
+           image->version, image->size, image->job_count,
+           (unsigned long) ((image->words - image->procs) / sizeof(struct script_proc)),
+           (unsigned long) ((image->nodes - image->words) / sizeof(uint32_t)),
+           image->size - image->strings);
+
+    for (i = 0; i < image->job_count; i++, sjob++) {
+        printf("[%u] %s: %s\n", i + 1, sjob->mode == BACKGROUND_EXECUTION ? "bg" : "fg",
+               image_str(image, sjob->command));
+        if (sjob->name != 0 || sjob->after_count > 0) {
+            printf("    name: %%%s, after:", sjob->name != 0 ? image_str(image, sjob->name) : "");
+            for (j = 0; j < sjob->after_count; j++) {
+                printf(" %%%s", image_str(image, words[sjob->first_after + j]));
+            }
+            printf("\n");
+        }
+        for (j = 0; j < sjob->proc_count; j++) {
+            struct script_proc *sproc = &procs[sjob->first_proc + j];
+            printf("    %u: argv[", j);
+            for (k = 0; k < sproc->word_count; k++) {
+                uint32_t word = words[sproc->first_word + k];
+                printf(k > 0 ? ", %s%s%s%s" : "%s%s%s%s", image_str(image, word & ~SCRIPT_WORD_FLAGS),
+                       (word & SCRIPT_WORD_GLOB) ? " (glob)" : "", (word & SCRIPT_WORD_EXPAND) ? " (expand)" : "",
+                       (word & SCRIPT_WORD_ASSIGN) ? " (assign)" : "");
+            }
+            printf("]");
+            uint32_t *redirects = words + sproc->first_word + sproc->word_count;
+            for (k = 0; k < sproc->input_count; k++) {
+                printf(" < %s", image_str(image, redirects[k]));
+            }
+            for (k = 0; k < sproc->output_count; k++) {
+                printf(" > %s", image_str(image, redirects[sproc->input_count + k]));
+            }
+            if (sproc->here_doc != 0) {
+                printf(" << (%u bytes)", sproc->here_length);
+            }
+            printf("\n");
+        }
+    }
+    if (image->node_count > 0) {
+        printf("tree: %u nodes\n", image->node_count - 1);
+        script_node_dump(image, image->root, 0);
+    }
+}
+
+// Finding the image a resident shell keeps for a script, a new entry
+// without one the first time
+
+static struct script_cache_entry *script_cache_entry(const char *path) {
+    struct script_cache_entry *entry;
+
+    for (entry = wsh_shell->script_cache; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->path, path) == 0) {
+            return entry;
+        }
+    }
+    entry = (struct script_cache_entry*) calloc(1, sizeof(struct script_cache_entry));
+    if (!entry) {
+        fprintf(stderr, "wsh: allocation error");
+        exit(EXIT_FAILURE);
+    }
+    entry->path = strdup(path);
+    entry->next = wsh_shell->script_cache;
+    wsh_shell->script_cache = entry;
+
+    return entry;
+}
+
+static void script_image_release(struct script_image *image, size_t mapped_length) {
+    if (mapped_length > 0) {
+        munmap(image, mapped_length);
+    } else {
+        free(image);
+    }
+}
+
+// Script job graph. A script whose lines name jobs (%name: cmd) or order
+// them (after %a %b: cmd) runs as a dependency graph instead of line by
+// line. Named, ordered and & jobs start as soon as the jobs they depend
+// on are done, as many at once as there are cores (or sched -j allows).
+// Plain lines keep their place: each depends on the plain line before it
+// and waits until every earlier job has started, so cd or an assignment
+// only affects the jobs after it. wait depends on the jobs it names, or
+// on all earlier ones. A job whose after jobs failed is cancelled, and so
+// are the jobs after it in turn.
+
+static long graph_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+static void graph_add_dep(struct graph_node *node, int dep) {
+    if ((node->dep_count & (node->dep_count + 1)) == 0) {      // grows at 1, 3, 7, ...
+        node->deps = (int*) realloc(node->deps, (node->dep_count * 2 + 2) * sizeof(int));
+        if (!node->deps) {
+            fprintf(stderr, "wsh: allocation error");
+            exit(EXIT_FAILURE);
+        }
+    }
+    node->deps[node->dep_count++] = dep;
+}
+
+// Finding the latest job before index named name, -1 when there is none
+
+static int graph_find(struct script_image *image, int index, const char *name) {
+    struct script_job *sjobs = (struct script_job*) ((char*) image + image->jobs);
+    int i;
+
+    for (i = index - 1; i >= 0; i--) {
+        if (sjobs[i].name != 0 && strcmp(image_str(image, sjobs[i].name), name) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// Linking every job to the jobs it depends on
+
+static void graph_build(struct script_image *image, struct graph_node *nodes) {
+    struct script_job *sjobs = (struct script_job*) ((char*) image + image->jobs);
+    struct script_proc *procs = (struct script_proc*) ((char*) image + image->procs);
+    uint32_t *words = (uint32_t*) ((char*) image + image->words);
+    int i, j, last_plain = -1, count = image->job_count;
+
+    for (i = 0; i < count; i++) {
+        struct script_job *sjob = &sjobs[i];
+        struct script_proc *sproc = &procs[sjob->first_proc];
+        struct graph_node *node = &nodes[i];
+
+        node->job_id = -1;
+        node->plain = sjob->name == 0 && sjob->after_count == 0 && sjob->mode != BACKGROUND_EXECUTION;
+        for (j = 0; j < (int) sjob->after_count; j++) {
+            const char *name = image_str(image, words[sjob->first_after + j]);
+            int dep = graph_find(image, i, name);
+            if (dep < 0) {
+                fprintf(stderr, "wsh: %s: after %%%s: no such job\n", image_str(image, sjob->command), name);
+                node->state = NODE_CANCELLED;
+                node->status = 127;
+                continue;
+            }
+            graph_add_dep(node, dep);
+        }
+        node->after_count = node->dep_count;
+        if (last_plain >= 0) {
+            graph_add_dep(node, last_plain);
+        }
+
+        const char *command = sproc->word_count > 0 ?
+                              image_str(image, words[sproc->first_word] & ~SCRIPT_WORD_FLAGS) : NULL;
+        if (node->plain && sjob->proc_count == 1 && command != NULL && strcmp(command, "wait") == 0) {
+            node->waits = 1;
+            for (j = 1; j < (int) sproc->word_count; j++) {
+                const char *arg = image_str(image, words[sproc->first_word + j] & ~SCRIPT_WORD_FLAGS);
+                int dep = arg != NULL && arg[0] == '%' ? graph_find(image, i, arg + 1) : -1;
+                if (dep >= 0) {
+                    graph_add_dep(node, dep);
+                    node->waits++;
+                }
+            }
+            if (sproc->word_count == 1) {
+                for (j = last_plain + 1; j < i; j++) {
+                    graph_add_dep(node, j);
+                }
+            }
+        }
+        if (node->plain) {
+            last_plain = i;
+        }
+    }
+}
+
+// Checking a pending job: 1 when it can start, 0 when it has to wait and
+// -1 when it is cancelled because a job it comes after did not succeed
+
+static int graph_ready(struct graph_node *nodes, struct graph_node *node) {
+    int i, cancel = 0;
+
+    for (i = 0; i < node->dep_count; i++) {
+        struct graph_node *dep = &nodes[node->deps[i]];
+        if (dep->state == NODE_PENDING || dep->state == NODE_RUNNING) {
+            return 0;
+        }
+        if (i < node->after_count && (dep->state == NODE_CANCELLED || dep->status != 0)) {
+            cancel = 1;
+        }
+    }
+
+    return cancel ? -1 : 1;
+}
+
+// Starting a job of the graph. wait is settled by the graph itself and
+// plain lines of shell builtins run in the shell right away; everything
+// else is launched without waiting and reaped by the event loop.
+
+static void graph_start(struct script_image *image, struct graph_node *nodes, int index) {
+    struct graph_node *node = &nodes[index];
+    struct job *job = script_image_job(image, index);
+    const struct builtin *builtin = job->root->builtin;
+
+    node->started = graph_now();
+    if (node->waits) {             // the status of the last job it names
+        node->status = node->waits > 1 ? nodes[node->deps[node->dep_count - 1]].status : 0;
+        free_job(job);
+        wsh_shell->last_status = node->status;
+    } else if (node->plain && job->root->next == NULL && builtin != NULL && builtin->prefix == NULL &&
+               !(builtin->flags & BUILTIN_UTILITY)) {
+        wsh_launch_job(job);
+        node->status = wsh_shell->last_status;
+    } else {
+        job->mode = PIPELINE_EXECUTION;
+        wsh_apply_prefixes(job);
+        if (job->timeout_ms == 0) {
+            job->timeout_ms = wsh_shell->timeout_default_ms;
+        }
+        node->job = job;
+        node->job_id = insert_job(job);
+        node->state = NODE_RUNNING;
+        wsh_start_job(job, 1);
+        return;
+    }
+    node->ended = graph_now();
+    node->state = NODE_DONE;
+}
+
+// Printing how long the run took against the time its jobs took one after
+// another, and the chain of jobs that decided the wall time
+
+static void graph_report(struct script_image *image, struct graph_node *nodes, long wall) {
+    struct script_job *sjobs = (struct script_job*) ((char*) image + image->jobs);
+    int i, j, count = image->job_count, failed = 0, cancelled = 0, last = -1;
+    long serial = 0;
+
+    for (i = 0; i < count; i++) {
+        struct graph_node *node = &nodes[i];
+        node->path = node->ended - node->started;
+        node->critical_prev = -1;
+        for (j = 0; j < node->dep_count; j++) {
+            struct graph_node *dep = &nodes[node->deps[j]];
+            if (node->critical_prev < 0 || dep->path > nodes[node->critical_prev].path) {
+                node->critical_prev = node->deps[j];
+            }
+        }
+        if (node->critical_prev >= 0) {
+            node->path += nodes[node->critical_prev].path;
+        }
+        if (last < 0 || node->path > nodes[last].path) {
+            last = i;
+        }
+        serial += node->ended - node->started;
+        failed += node->state == NODE_DONE && node->status != 0;
+        cancelled += node->state == NODE_CANCELLED;
+    }
+
+    fprintf(stderr, "wsh: %d jobs (%d failed, %d cancelled) in %.3fs, %.3fs one after another, %.3fs saved\n",
+            count, failed, cancelled, wall / 1e6, serial / 1e6, serial > wall ? (serial - wall) / 1e6 : 0.0);
+    if (last < 0) {
+        return;
+    }
+    int *path = (int*) malloc(count * sizeof(int)), length = 0;
+    if (!path) {
+        fprintf(stderr, "wsh: allocation error");
+        exit(EXIT_FAILURE);
+    }
+    for (i = last; i >= 0; i = nodes[i].critical_prev) {
+        path[length++] = i;
+    }
+    fprintf(stderr, "wsh: critical path %.3fs:", nodes[last].path / 1e6);
+    for (j = 0; length-- > 0; ) {
+        struct graph_node *node = &nodes[path[length]];
+        if (node->ended - node->started < 1000) {       // builtins and the like
+            continue;
+        }
+        fprintf(stderr, j++ > 0 ? " ->" : "");
+        if (sjobs[path[length]].name != 0) {
+            fprintf(stderr, " %%%s", image_str(image, sjobs[path[length]].name));
+        } else {
+            fprintf(stderr, " '%.32s'", image_str(image, sjobs[path[length]].command));
+        }
+        fprintf(stderr, " %.3fs", (node->ended - node->started) / 1e6);
+    }
+    fprintf(stderr, "\n");
+    free(path);
+}
+
+// Running a script image as a job graph. Returns the exit code of the
+// first job that failed or was cancelled, 0 when none did.
+
+int wsh_run_graph(struct script_image *image) {
+    int count = image->job_count, first_open = 0, first_pending = 0, running = 0, async = 0, status = 0, i;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN), start = graph_now();
+    struct graph_node *nodes = (struct graph_node*) calloc(count, sizeof(struct graph_node));
+
+    if (count > 0 && !nodes) {
+        fprintf(stderr, "wsh: allocation error");
+        exit(EXIT_FAILURE);
+    }
+    graph_build(image, nodes);
+
+    while (1) {
+        int progress = 0, limit = wsh_shell->sched_max_jobs > 0 ? wsh_shell->sched_max_jobs : cores > 0 ? cores : 1;
+
+        // running jobs all sit between the first unfinished and the first pending one
+        for (i = first_open; i < first_pending; i++) {
+            struct graph_node *node = &nodes[i];
+            if (node->state == NODE_RUNNING && is_job_completed(node->job_id)) {
+                node->status = wsh_exit_code(node->job);
+                node->ended = graph_now();
+                node->state = NODE_DONE;
+                if (node->plain) {
+                    wsh_shell->last_status = node->status;
+                }
+                remove_job(node->job_id);
+                node->job = NULL;
+                running--;
+                async -= !node->plain;
+                progress = 1;
+            }
+        }
+        while (first_open < count && nodes[first_open].state >= NODE_DONE) {
+            first_open++;
+        }
+
+        for (i = first_pending; i < count && !wsh_shell->exit_requested; i++) {
+            struct graph_node *node = &nodes[i];
+            if (node->state != NODE_PENDING) {
+                continue;
+            }
+            int ready = graph_ready(nodes, node);
+            if (ready == 0 || (node->plain && i != first_pending) || (!node->plain && ready > 0 && async >= limit)) {
+                if (node->plain) {
+                    break;           // everything after a plain line depends on it
+                }
+                continue;
+            }
+            if (ready < 0) {
+                fprintf(stderr, "wsh: %s: cancelled\n", image_str(image, ((struct script_job*)
+                        ((char*) image + image->jobs))[i].command));
+                node->state = NODE_CANCELLED;
+                node->status = CANCELLED_EXIT_CODE;
+                node->started = node->ended = graph_now();
+            } else {
+                graph_start(image, nodes, i);
+                if (node->state == NODE_RUNNING) {
+                    running++;
+                    async += !node->plain;
+                }
+            }
+            while (first_pending < count && nodes[first_pending].state != NODE_PENDING) {
+                first_pending++;
+            }
+            progress = 1;
+        }
+
+        if (first_open == count || (!progress && running == 0)) {
+            break;
+        }
+        if (!progress) {
+            wsh_event_wait_child(-1);
+        }
+    }
+
+    for (i = 0; i < count && status == 0; i++) {
+        status = nodes[i].status;
+    }
+    graph_report(image, nodes, graph_now() - start);
+    for (i = 0; i < count; i++) {
+        free(nodes[i].deps);
+    }
+    free(nodes);
+    if (!wsh_shell->exit_requested) {
+        wsh_shell->last_status = status;
+    }
+
+    return status;
+}
+
+// Running the control flow tree of an image. Jobs are built from the
+// image as they run, so every pass of a loop reuses what was parsed.
+
+// for NAME in WORDS: the words are expanded once, when the loop starts
+
+static int script_image_for(struct script_image *image, struct script_node *node) {
+    uint32_t *words = (uint32_t*) ((char*) image + image->words) + node->first_word;
+    const char *name = image_str(image, node->name);
+    struct arena *arena = arena_create();
+    char **values = NULL, **fields;
+    int count = 0, capacity = 0, status = 0, i, j;
+    uint32_t w;
+
+    for (w = 0; w < node->word_count; w++) {
+        char *raw = (char*) image_str(image, words[w] & ~SCRIPT_WORD_FLAGS);
+        int field_count = 1;
+        fields = &raw;
+        if (words[w] & SCRIPT_WORD_EXPAND) {
+            field_count = wsh_expand_word(raw, arena, &fields, 1);
+        } else if (words[w] & SCRIPT_WORD_GLOB) {
+            field_count = wsh_glob(raw, arena, &fields);
+        }
+        if (count + field_count > capacity) {
+            char **grown = (char**) arena_alloc(arena, (capacity * 2 + field_count + TOKEN_BUFSIZE) * sizeof(char*));
+            if (count > 0) {
+                memcpy(grown, values, count * sizeof(char*));
+            }
+            values = grown;
+            capacity = capacity * 2 + field_count + TOKEN_BUFSIZE;
+        }
+        for (j = 0; j < field_count; j++) {
+            values[count++] = fields[j];
+        }
+    }
+
+    for (i = 0; i < count && !wsh_shell->exit_requested; i++) {
+        wsh_set_var(name, strlen(name), values[i], 0);
+        status = script_image_run(image, node->body);
+    }
+    arena_release(arena);
+
+    return status;
+}
+
+// Running the list starting at a node, returns the status of its last
+// command and leaves it in $?
+
+int script_image_run(struct script_image *image, uint32_t index) {
+    int status = 0;
+
+    for (; index != 0 && !wsh_shell->exit_requested; index = image_node(image, index)->next) {
+        struct script_node *node = image_node(image, index);
+        switch (node->type) {
+        case SCRIPT_NODE_JOB: {
+            wsh_event_poll(0);
+            struct job *job = script_image_job(image, node->job);
+            int background = job->mode == BACKGROUND_EXECUTION;
+            wsh_launch_job(job);
+            status = background ? 0 : wsh_shell->last_status;
+            break;
+        }
+        case SCRIPT_NODE_AND:
+        case SCRIPT_NODE_OR:
+            status = script_image_run(image, node->left);
+            if ((status == 0) == (node->type == SCRIPT_NODE_AND)) {
+                status = script_image_run(image, node->body);
+            }
+            break;
+        case SCRIPT_NODE_IF:
+            if (script_image_run(image, node->left) == 0) {
+                status = script_image_run(image, node->body);
+            } else {
+                status = script_image_run(image, node->orelse);
+            }
+            break;
+        case SCRIPT_NODE_WHILE:
+        case SCRIPT_NODE_UNTIL:
             status = 0;
+            while (!wsh_shell->exit_requested &&
+                   (script_image_run(image, node->left) == 0) == (node->type == SCRIPT_NODE_WHILE)) {
+                status = script_image_run(image, node->body);
+            }
+            break;
+        case SCRIPT_NODE_FOR:
+            status = script_image_for(image, node);
+            break;
+        }
+        if (!wsh_shell->exit_requested) {
+            wsh_shell->last_status = status;
+        }
+    }
+
+    return status;
+}
+
+// Checking whether a script names or orders any of its jobs
+
+static int script_image_graph(struct script_image *image) {
+    struct script_job *sjobs = (struct script_job*) ((char*) image + image->jobs);
+    uint32_t i;
+
+    for (i = 0; i < image->job_count; i++) {
+        if (sjobs[i].name != 0 || sjobs[i].after_count > 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Running the jobs of an image: through its tree, as a graph when jobs
+// are named, or one after the other
+
+static void script_image_exec(struct script_image *image) {
+    uint32_t i;
+
+    if (image->node_count > 0) {
+        script_image_run(image, image->root);
+    } else if (script_image_graph(image)) {
+        wsh_run_graph(image);
+    } else {
+        for (i = 0; i < image->job_count && !wsh_shell->exit_requested; i++) {
+            wsh_event_poll(0);
+            wsh_launch_job(script_image_job(image, i));
+        }
+    }
+}
+
+// Running a script file. With SCRIPT_KEEP_IMAGE the image stays in memory
+// for the next run until the script changes.
+
+int wsh_run_script(const char *path, int flags) {
+    struct script_image *image = NULL;
+    struct script_cache_entry *kept = NULL;
+    struct timespec start, end;
+    struct stat st;
+    char real_path[PATH_MAX], *cache_path = NULL;
+    size_t mapped_length = 0;
+    int fd = open(path, O_RDONLY|O_CLOEXEC);
+
+    if (fd < 0 || fstat(fd, &st) < 0 || realpath(path, real_path) == NULL) {
+        printf("wsh: %s: %s\n", path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return EXIT_FAILURE;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (flags & SCRIPT_KEEP_IMAGE) {
+        kept = script_cache_entry(real_path);
+        if (kept->image != NULL && kept->image->script_size == (uint64_t) st.st_size &&
+            kept->image->script_mtime_sec == st.st_mtim.tv_sec &&
+            kept->image->script_mtime_nsec == st.st_mtim.tv_nsec) {
+            image = kept->image;
+            mapped_length = kept->mapped_length;
+        } else if (kept->image != NULL) {
+            script_image_release(kept->image, kept->mapped_length);
+            kept->image = NULL;
+        }
+    }
+    if (image == NULL && (flags & SCRIPT_USE_CACHE)) {
+        cache_path = script_image_cache_path(real_path);
+        image = script_image_load(cache_path, real_path, &st, &mapped_length);
+    }
+    if (image == NULL) {
+        char *data = st.st_size > 0 ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+        if (data == MAP_FAILED) {
+            printf("wsh: %s: %s\n", path, strerror(errno));
+            return EXIT_FAILURE;
+        }
+        image = script_image_build(real_path, data, st.st_size, &st);
+        if (data != NULL) {
+            munmap(data, st.st_size);
+        }
+        if (cache_path != NULL) {
+            script_image_save(image, cache_path);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    close(fd);
+
+    if (flags & SCRIPT_DUMP_PARSE) {
+        script_image_dump(image);
+        printf("parse: %.1f us (%s)\n",
+               (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_nsec - start.tv_nsec) / 1e3,
+               mapped_length > 0 ? "cached image" : "parsed");
+    } else {
+        script_image_exec(image);
+    }
+
+    if (kept != NULL) {
+        kept->image = image;
+        kept->mapped_length = mapped_length;
+    } else {
+        script_image_release(image, mapped_length);
+    }
+    free(cache_path);
+
+    return EXIT_SUCCESS;
+}
+
+// Running command text as a script would run: line by line, here-document
+// bodies taken from the lines that follow. Text with control flow is
+// built into an image first.
+
+int wsh_run_text(const char *text, size_t length) {
+    const char *cursor = text, *end = text + length;
+
+    if (text_has_control(text, length)) {
+        struct script_image *image = script_image_build(NULL, text, length, NULL);
+        script_image_exec(image);
+        free(image);
+        return wsh_shell->last_status;
+    }
+
+    while (cursor < end && !wsh_shell->exit_requested) {
+        const char *newline = memchr(cursor, '\n', end - cursor);
+        size_t line_length = (newline != NULL ? newline : end) - cursor;
+        char *line = strndup(cursor, line_length);
+        struct process *proc;
+        char **delim;
+
+        cursor += line_length + 1;
+        char *trimmed = helper_strtrim(line);
+        struct job *job = *trimmed != '\0' && *trimmed != '#' ? wsh_parse_command(trimmed) : NULL;
+        if (job == NULL && *trimmed != '\0' && *trimmed != '#') {
+            wsh_shell->last_status = 2;
+        }
+        free(line);
+        if (job == NULL) {
+            continue;
+        }
+        for (proc = job->root; proc != NULL; proc = proc->next) {
+            for (delim = proc->here_delims; delim != NULL && *delim != NULL; delim++) {
+                const char *body = cursor < end ? cursor : end;
+                size_t length;
+                cursor = wsh_here_span(body, end, *delim, &length);
+                if (*delim == proc->here_delim) {
+                    proc->here_doc = arena_strndup(job->arena, body, length);
+                    proc->here_length = length;
+                }
+            }
+        }
+        wsh_event_poll(0);
+        wsh_launch_job(job);
+    }
+
+    return wsh_shell->last_status;
+}
+
+// Startup. Every start runs $WSHRC (default ~/.wshrc) in the shell,
+// unless $WSH_SNAPSHOT (default ~/.wsh_snapshot) holds what that run left
+// behind: variables, hashed commands, options, sched and timeout
+// settings and the builtin table seed. The snapshot is mmapped and its
+// PATH cache entries point into the mapping; it is ignored when the rc
+// changed or a variable the rc set was inherited with another value.
+
+static char *home_file(const char *variable, const char *file) {
+    const char *path = getenv(variable), *home = getenv("HOME");
+    char *result;
+
+    if (path != NULL && path[0] != '\0') {
+        return strdup(path);
+    }
+    result = malloc(strlen(home != NULL ? home : ".") + strlen(file) + 2);
+    sprintf(result, "%s/%s", home != NULL ? home : ".", file);
+
+    return result;
+}
+
+static inline const char *snapshot_str(struct snapshot_image *image, uint32_t offset) {
+    return offset == 0 ? NULL : (const char*) image + image->strings + offset;
+}
+
+// Finding NAME= in an environment array
+
+static char *env_entry(char **env, const char *name, size_t length) {
+    for (; env != NULL && *env != NULL; env++) {
+        if (strncmp(*env, name, length) == 0 && (*env)[length] == '=') {
+            return *env;
+        }
+    }
+
+    return NULL;
+}
+
+static int snapshot_fits(struct snapshot_image *image, uint32_t offset, uint32_t count, size_t size) {
+    return offset <= image->size && (image->size - offset) / size >= count;
+}
+
+// Whether a string offset lies inside the string table, 0 (no string)
+// only where that is allowed. The file ends in a NUL, so a string that
+// starts inside it is terminated inside it too
+
+static int snapshot_str_fits(struct snapshot_image *image, uint32_t offset, int optional) {
+    return offset == 0 ? optional : offset < image->size - image->strings;
+}
+
+// Saving the shell's state; inherited is the environment the shell was
+// started with, only the variables that differ from it are kept
+
+int snapshot_save(const char *path, const char *rc_path, char **inherited) {
+    struct image_buffer vars = {0}, mtimes = {0}, paths = {0}, strings = {0};
+    struct var_store *store = wsh_shell->vars;
+    struct path_cache *cache = &wsh_shell->path_cache;
+    struct snapshot_image header = {
+        .version = SNAPSHOT_VERSION,
+        .rc_size = -1,
+        .options = wsh_shell->options,
+        .pipe_size = wsh_shell->pipe_size,
+        .sched_max_jobs = wsh_shell->sched_max_jobs,
+        .sched_max_load = wsh_shell->sched_max_load,
+        .timeout_default_ms = wsh_shell->timeout_default_ms,
+        .timeout_grace_ms = wsh_shell->timeout_grace_ms,
+    };
+    struct variable *var;
+    struct path_entry *entry;
+    struct stat st;
+    char **env;
+    int i;
+
+    image_append(&strings, "", 1);
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.rc_path = image_string(&strings, rc_path);
+    if (stat(rc_path, &st) == 0) {
+        header.rc_size = st.st_size;
+        header.rc_mtime_sec = st.st_mtim.tv_sec;
+        header.rc_mtime_nsec = st.st_mtim.tv_nsec;
+    }
+    if (builtin_seed == 0) {
+        wsh_builtin_init();
+    }
+    header.builtin_seed = builtin_seed;
+
+    for (i = 0; i < store->bucket_count; i++) {
+        for (var = store->buckets[i]; var != NULL; var = var->next) {
+            char *was = env_entry(inherited, var->entry, var->name_length);
+            if (was == NULL || strcmp(was, var->entry) != 0 || !var->exported) {
+                struct snapshot_var svar = {
+                    .entry = image_string(&strings, var->entry),
+                    .inherited = image_string(&strings, was),
+                    .flags = var->exported ? SNAPSHOT_VAR_EXPORTED : 0,
+                };
+                image_append(&vars, &svar, sizeof(svar));
+                header.var_count++;
+            }
+        }
+    }
+    for (env = inherited; env != NULL && *env != NULL; env++) {
+        size_t length = var_name_length(*env);
+        if (length > 0 && (*env)[length] == '=' && wsh_get_var(*env, length) == NULL) {
+            struct snapshot_var svar = {.inherited = image_string(&strings, *env)};
+            image_append(&vars, &svar, sizeof(svar));
+            header.var_count++;
+        }
+    }
+
+    if (cache->path_env != NULL) {
+        header.path_env = image_string(&strings, cache->path_env);
+        for (i = 0; i < cache->dir_count; i++) {
+            struct snapshot_mtime mtime = {cache->dir_mtimes[i].tv_sec, cache->dir_mtimes[i].tv_nsec};
+            image_append(&mtimes, &mtime, sizeof(mtime));
+        }
+        header.dir_count = cache->dir_count;
+        for (i = 0; i < PATH_CACHE_BUCKETS; i++) {
+            for (entry = cache->buckets[i]; entry != NULL; entry = entry->next) {
+                struct snapshot_path spath = {
+                    .name = image_string(&strings, entry->name),
+                    .path = image_string(&strings, entry->path),
+                };
+                image_append(&paths, &spath, sizeof(spath));
+                header.path_count++;
+            }
+        }
+    }
+
+    header.vars = IMAGE_ALIGN(sizeof(struct snapshot_image));
+    header.dir_mtimes = IMAGE_ALIGN(header.vars + vars.length);
+    header.paths = IMAGE_ALIGN(header.dir_mtimes + mtimes.length);
+    header.strings = IMAGE_ALIGN(header.paths + paths.length);
+    header.size = header.strings + strings.length;
+
+    char *image = (char*) calloc(1, header.size);
+    if (!image) {
+        fprintf(stderr, "wsh: allocation error");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(image, &header, sizeof(header));
+    memcpy(image + header.vars, vars.data, vars.length);
+    memcpy(image + header.dir_mtimes, mtimes.data, mtimes.length);
+    memcpy(image + header.paths, paths.data, paths.length);
+    memcpy(image + header.strings, strings.data, strings.length);
+    int status = image_write(image, header.size, path);
+
+    free(image);
+    free(vars.data);
+    free(mtimes.data);
+    free(paths.data);
+    free(strings.data);
+
+    return status;
+}
+
+// Checking a mapped snapshot against the rc file and the environment
+
+static int snapshot_valid(struct snapshot_image *image, size_t size, const char *rc_path) {
+    struct snapshot_var *svars = (struct snapshot_var*) ((char*) image + image->vars);
+    struct snapshot_path *spaths = (struct snapshot_path*) ((char*) image + image->paths);
+    struct stat st;
+    uint32_t i;
+
+    if (memcmp(image->magic, SNAPSHOT_MAGIC, sizeof(image->magic)) != 0 ||
+        image->version != SNAPSHOT_VERSION ||
+        image->size != size ||
+        image->strings >= image->size ||
+        ((char*) image)[image->size - 1] != '\0' ||
+        !snapshot_fits(image, image->vars, image->var_count, sizeof(struct snapshot_var)) ||
+        !snapshot_fits(image, image->dir_mtimes, image->dir_count, sizeof(struct snapshot_mtime)) ||
+        !snapshot_fits(image, image->paths, image->path_count, sizeof(struct snapshot_path)) ||
+        !snapshot_str_fits(image, image->rc_path, 0) ||
+        !snapshot_str_fits(image, image->path_env, 1) ||
+        strcmp(snapshot_str(image, image->rc_path), rc_path) != 0) {
+        return 0;
+    }
+    for (i = 0; i < image->path_count; i++) {
+        if (!snapshot_str_fits(image, spaths[i].name, 0) || !snapshot_str_fits(image, spaths[i].path, 0)) {
+            return 0;
+        }
+    }
+    if (stat(rc_path, &st) < 0 ? image->rc_size != -1 :
+        image->rc_size != st.st_size || image->rc_mtime_sec != st.st_mtim.tv_sec ||
+        image->rc_mtime_nsec != st.st_mtim.tv_nsec) {
+        return 0;
+    }
+
+    for (i = 0; i < image->var_count; i++) {
+        if (!snapshot_str_fits(image, svars[i].entry, 1) || !snapshot_str_fits(image, svars[i].inherited, 1)) {
+            return 0;
+        }
+        const char *entry = snapshot_str(image, svars[i].entry);
+        const char *was = snapshot_str(image, svars[i].inherited);
+        const char *name = entry != NULL ? entry : was;
+        const char *equals = name != NULL ? strchr(name, '=') : NULL;
+        if (equals == NULL) {
+            return 0;
+        }
+        // the loader splits the entry at its =, the inherited one must match it
+        size_t length = equals - name;
+        if (was != NULL && strncmp(was, name, length + 1) != 0) {
+            return 0;
+        }
+        const char *value = wsh_get_var(name, length);
+        if (was == NULL ? value != NULL : value == NULL || strcmp(value, was + length + 1) != 0) {
+            return 0;
+        }
+    }
+
+    return builtin_fill(image->builtin_seed);
+}
+
+// Taking the shell's state from a snapshot, -1 when it is missing or stale
+
+int snapshot_load(const char *path, const char *rc_path) {
+    struct snapshot_image *image;
+    struct path_cache *cache = &wsh_shell->path_cache;
+    struct stat st;
+    uint32_t i;
+    int fd = open(path, O_RDONLY|O_CLOEXEC);
+
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(struct snapshot_image)) {
+        close(fd);
+        return -1;
+    }
+    image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        return -1;
+    }
+    if (!snapshot_valid(image, st.st_size, rc_path)) {
+        munmap(image, st.st_size);
+        return -1;
+    }
+
+    struct snapshot_var *svars = (struct snapshot_var*) ((char*) image + image->vars);
+    for (i = 0; i < image->var_count; i++) {
+        const char *entry = snapshot_str(image, svars[i].entry);
+        if (entry == NULL) {
+            const char *was = snapshot_str(image, svars[i].inherited);
+            wsh_unset_var(was, strchr(was, '=') - was);
+        } else {
+            const char *equals = strchr(entry, '=');
+            wsh_set_var(entry, equals - entry, equals + 1, svars[i].flags & SNAPSHOT_VAR_EXPORTED ? VAR_EXPORT : 0);
+        }
+    }
+    wsh_shell->options = image->options;
+    wsh_shell->pipe_size = image->pipe_size;
+    wsh_shell->sched_max_jobs = image->sched_max_jobs;
+    wsh_shell->sched_max_load = image->sched_max_load;
+    wsh_shell->timeout_default_ms = image->timeout_default_ms;
+    wsh_shell->timeout_grace_ms = image->timeout_grace_ms;
+    wsh_shell->snapshot = image;
+    wsh_shell->snapshot_length = st.st_size;
+
+    // The entries are used as they are; the first lookup rechecks the
+    // PATH directories against the saved mtimes, as after any pause
+    const char *path_env = wsh_get_var("PATH", 4);
+    const char *saved_env = snapshot_str(image, image->path_env);
+    if (saved_env != NULL && strcmp(saved_env, path_env != NULL ? path_env : "/usr/local/bin:/usr/bin:/bin") == 0) {
+        struct snapshot_mtime *mtimes = (struct snapshot_mtime*) ((char*) image + image->dir_mtimes);
+        struct snapshot_path *spaths = (struct snapshot_path*) ((char*) image + image->paths);
+        path_cache_flush();
+        free(cache->path_env);
+        free(cache->dir_mtimes);
+        cache->path_env = strdup(saved_env);
+        cache->dir_count = image->dir_count;
+        cache->dir_mtimes = (struct timespec*) malloc((image->dir_count + 1) * sizeof(struct timespec));
+        if (!cache->path_env || !cache->dir_mtimes) {
+            fprintf(stderr, "wsh: allocation error");
+            exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < image->dir_count; i++) {
+            cache->dir_mtimes[i].tv_sec = mtimes[i].sec;
+            cache->dir_mtimes[i].tv_nsec = mtimes[i].nsec;
+        }
+        cache->checked_at = 0;
+        for (i = 0; i < image->path_count; i++) {
+            struct path_entry *entry = (struct path_entry*) malloc(sizeof(struct path_entry));
+            if (!entry) {
+                fprintf(stderr, "wsh: allocation error");
+                exit(EXIT_FAILURE);
+            }
+            entry->name = (char*) snapshot_str(image, spaths[i].name);
+            entry->path = (char*) snapshot_str(image, spaths[i].path);
+            entry->hits = 0;
+            unsigned int bucket = wsh_hash_string(entry->name) % PATH_CACHE_BUCKETS;
+            entry->next = cache->buckets[bucket];
+            cache->buckets[bucket] = entry;
+        }
+    }
+
+    return 0;
+}
+
+// wsh --save-snapshot [file]: running the rc and saving what it set up
+
+int wsh_save_snapshot(const char *path) {
+    char **inherited = environ;
+    char *rc_path = home_file("WSHRC", RC_FILE);
+    char *snapshot_path = path != NULL ? strdup(path) : home_file("WSH_SNAPSHOT", SNAPSHOT_FILE);
+    int status = EXIT_SUCCESS;
+
+    if (access(rc_path, F_OK) == 0) {
+        wsh_run_script(rc_path, 0);
+    }
+    if (snapshot_save(snapshot_path, rc_path, inherited) < 0) {
+        printf("wsh: %s: %s\n", snapshot_path, strerror(errno));
+        status = EXIT_FAILURE;
+    }
+    free(rc_path);
+    free(snapshot_path);
+
+    return status;
+}
+
+// Setting the shell up from the snapshot, or by running the rc
+
+void wsh_startup() {
+    char *rc_path = home_file("WSHRC", RC_FILE);
+    char *snapshot_path = home_file("WSH_SNAPSHOT", SNAPSHOT_FILE);
+
+    if (snapshot_load(snapshot_path, rc_path) < 0 && access(rc_path, F_OK) == 0) {
+        wsh_run_script(rc_path, 0);
+    }
+    free(rc_path);
+    free(snapshot_path);
+}
+
+// Resident shell: wsh --server SOCKET keeps one initialized shell around
+// and runs requests from wsh --client, one at a time, with warm path,
+// glob and script caches. A request carries the client's cwd, environment
+// and stdio; the shell switches to them for the request and back after,
+// so output goes straight to the client and only the exit status is sent
+// back over the socket.
+
+static void resident_request(int conn, int saved[SERVER_FD_COUNT]) {
+    struct resident_request request;
+    struct resident_reply reply;
+    char *payload = NULL, **env, *c, **server_environ = environ;
+    struct var_store *server_vars = wsh_shell->vars;
+    int fds[SERVER_FD_COUNT], cwd_fd, i;
+    // the settings set, sched, timeout and pipesize change, per request too
+    int options = wsh_shell->options, pipe_size = wsh_shell->pipe_size;
+    int sched_max_jobs = wsh_shell->sched_max_jobs;
+    double sched_max_load = wsh_shell->sched_max_load;
+    long timeout_default_ms = wsh_shell->timeout_default_ms, timeout_grace_ms = wsh_shell->timeout_grace_ms;
+    TRACE_START(trace_start);
+
+    if (server_receive(conn, &request, sizeof(request), &payload, fds) < 0 || request.envc < 0) {
+        free(payload);
+        return;
+    }
+
+    // payload: cwd, envc environment strings, text, each NUL terminated
+    env = (char**) malloc((request.envc + 1) * sizeof(char*));
+    c = payload + strlen(payload) + 1;
+    for (i = 0; i < request.envc && c < payload + request.size; i++, c += strlen(c) + 1) {
+        env[i] = c;
+    }
+    env[i] = NULL;
+    const char *text = c < payload + request.size ? c : "";
+
+    cwd_fd = open(".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if (chdir(payload) < 0) {
+        dprintf(fds[2], "wsh: %s: %s\n", payload, strerror(errno));
+    }
+    environ = env;
+    wsh_shell->vars = var_store_create(env);
+    for (i = 0; i < SERVER_FD_COUNT; i++) {
+        dup2(fds[i], i);
+        close(fds[i]);
+    }
+
+    wsh_shell->last_status = 0;
+    wsh_shell->exit_requested = 0;
+    if (request.kind == RESIDENT_SCRIPT) {
+        wsh_run_script(text, SCRIPT_KEEP_IMAGE);
+    } else {
+        wsh_run_text(text, strlen(text));
+    }
+    reply.status = wsh_shell->last_status;
+
+    fflush(stdout);
+    fflush(stderr);
+    for (i = 0; i < SERVER_FD_COUNT; i++) {
+        dup2(saved[i], i);
+    }
+    var_store_free(wsh_shell->vars);
+    wsh_shell->vars = server_vars;
+    environ = server_environ;
+    wsh_shell->options = options;
+    wsh_shell->pipe_size = pipe_size;
+    wsh_shell->sched_max_jobs = sched_max_jobs;
+    wsh_shell->sched_max_load = sched_max_load;
+    wsh_shell->timeout_default_ms = timeout_default_ms;
+    wsh_shell->timeout_grace_ms = timeout_grace_ms;
+    if (cwd_fd >= 0) {
+        if (fchdir(cwd_fd) < 0) {
+            perror("wsh: server");
+        }
+        close(cwd_fd);
+    }
+    if (write(conn, &reply, sizeof(reply)) != sizeof(reply)) {
+        perror("wsh: server");
+    }
+    TRACE_SPAN("request", 0, trace_start, text);
+    free(env);
+    free(payload);
+}
+
+int wsh_resident_serve(const char *socket_path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct epoll_event event = { .events = EPOLLIN, .data.u32 = EVENT_INPUT };
+    int saved[SERVER_FD_COUNT], listen_fd, i;
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "wsh: %s: socket path too long\n", socket_path);
+        return EXIT_FAILURE;
+    }
+    strcpy(addr.sun_path, socket_path);
+    listen_fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    unlink(socket_path);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+        listen(listen_fd, RESIDENT_BACKLOG) < 0) {
+        perror("wsh: server");
+        return EXIT_FAILURE;
+    }
+
+    // the listening socket takes the place of stdin in the event loop
+    epoll_ctl(wsh_shell->epoll_fd, EPOLL_CTL_DEL, 0, NULL);
+    epoll_ctl(wsh_shell->epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+    wsh_shell->input_pollable = 0;
+    wsh_shell->resident = 1;
+    for (i = 0; i < SERVER_FD_COUNT; i++) {
+        saved[i] = fcntl(i, F_DUPFD_CLOEXEC, 10);
+    }
+
+    while (1) {
+        while (!wsh_event_poll(-1));
+        int conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (conn < 0) {
+            continue;
+        }
+        resident_request(conn, saved);
+        close(conn);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// Sending one request to a resident shell: our cwd, environment and stdio
+// go along, returns the exit status or -1 when there is no server
+
+int wsh_client(const char *socket_path, int kind, const char *text) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct resident_request request = { .kind = kind, .envc = 0 };
+    struct resident_reply reply;
+    char cwd[PATH_MAX], control[CMSG_SPACE(SERVER_FD_COUNT * sizeof(int))];
+    int fds[SERVER_FD_COUNT] = {0, 1, 2}, fd, i;
+    size_t size;
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path) || getcwd(cwd, sizeof(cwd)) == NULL) {
+        fprintf(stderr, "wsh: %s: %s\n", socket_path, strerror(ENAMETOOLONG));
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+    fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "wsh: %s: %s\n", socket_path, strerror(errno));
+        return -1;
+    }
+
+    size = strlen(cwd) + 1 + strlen(text) + 1;
+    for (i = 0; environ[i] != NULL; i++) {
+        size += strlen(environ[i]) + 1;
+    }
+    request.envc = i;
+    request.size = size;
+    char *payload = malloc(size), *c = payload;
+    if (!payload) {
+        fprintf(stderr, "wsh: allocation error");
+        exit(EXIT_FAILURE);
+    }
+    c = stpcpy(c, cwd) + 1;
+    for (i = 0; environ[i] != NULL; i++) {
+        c = stpcpy(c, environ[i]) + 1;
+    }
+    strcpy(c, text);
+
+    struct iovec iov = { .iov_base = &request, .iov_len = sizeof(request) };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    int status = -1;
+    if (sendmsg(fd, &msg, 0) == sizeof(request) && write(fd, payload, size) == (ssize_t) size &&
+        server_read_full(fd, &reply, sizeof(reply)) == 0) {
+        status = reply.status;
+    } else {
+        fprintf(stderr, "wsh: %s: request failed\n", socket_path);
+    }
+    free(payload);
+    close(fd);
+
+    return status;
+}
+
+// Command history. Entries are appended as lines to $HISTFILE (default
+// ~/.wsh_history) and indexed in a side file: one record per block of
+// HISTORY_BLOCK_ENTRIES entries holding a bitmap of the trigrams in them,
+// so a search only scans blocks that can contain the text. Both files are
+// mmapped on first use and appends hold an flock on the index, catching
+// it up with whatever other sessions appended first
+
+static uint32_t history_trigram(const char *c) {
+    uint32_t key = ((unsigned char) c[0] << 16) | ((unsigned char) c[1] << 8) | (unsigned char) c[2];
+
+    return (key * 2654435761u) >> (32 - HISTORY_TRIGRAM_BITS);
+}
+
+static struct history_block *history_blocks(struct history *history) {
+    return (struct history_block*) (history->index + 1);
+}
+
+// Mapping the log and the index again when they outgrew the mappings.
+// The log is mapped with slack so appends rarely need a new mapping
+
+static void history_catch_up(struct history *history);
+
+// Taking or dropping the index lock, remembering which one is held
+
+static void history_lock(struct history *history, int operation) {
+    flock(history->index_fd, operation);
+    history->locked = operation == LOCK_UN ? 0 : operation;
+}
+
+// Emptying the index file down to a fresh header, the lock is held
+
+static int history_index_reset(struct history *history) {
+    struct history_header header;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, HISTORY_MAGIC, sizeof(header.magic));
+    header.version = HISTORY_VERSION;
+    header.block_entries = HISTORY_BLOCK_ENTRIES;
+    if (ftruncate(history->index_fd, 0) < 0
+            || ftruncate(history->index_fd, sizeof(header) + HISTORY_INDEX_GROW * sizeof(struct history_block)) < 0
+            || pwrite(history->index_fd, &header, sizeof(header), 0) != sizeof(header)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+// Mapping the log and the index again after either changed size. A log
+// that is now shorter than what the index covers was truncated or
+// rotated by someone else, the index is then rebuilt from what is left
+// so no read goes past the end of the file
+
+static int history_remap(struct history *history) {
+    struct stat st;
+
+    if (fstat(history->log_fd, &st) < 0) {
+        return -1;
+    }
+    if (history->log == NULL || (size_t) st.st_size > history->log_mapped) {
+        if (history->log != NULL) {
+            munmap(history->log, history->log_mapped);
+        }
+        history->log_mapped = st.st_size + HISTORY_MAP_SLACK;
+        history->log = mmap(NULL, history->log_mapped, PROT_READ, MAP_SHARED, history->log_fd, 0);
+        if (history->log == MAP_FAILED) {
+            history->log = NULL;
+            return -1;
+        }
+    }
+    history->log_size = st.st_size;
+
+    if (fstat(history->index_fd, &st) < 0) {
+        return -1;
+    }
+    if (history->index == NULL || (size_t) st.st_size != history->index_mapped) {
+        if (history->index != NULL) {
+            munmap(history->index, history->index_mapped);
+        }
+        history->index_mapped = st.st_size;
+        history->index = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, history->index_fd, 0);
+        if (history->index == MAP_FAILED) {
+            history->index = NULL;
+            return -1;
+        }
+    }
+
+    if (history->index_mapped < sizeof(struct history_header) || history->index->indexed_size > history->log_size) {
+        int held = history->locked, status = 0;
+        if (held != LOCK_EX) {
+            flock(history->index_fd, LOCK_EX);
+            history->locked = LOCK_EX;
+        }
+        // another shell may have rebuilt it while we waited for the lock
+        if (fstat(history->log_fd, &st) < 0) {
+            status = -1;
+        } else {
+            history->log_size = st.st_size;
+            if (history->index_mapped < sizeof(struct history_header) ||
+                history->index->indexed_size > history->log_size) {
+                status = history_index_reset(history) < 0 || history_remap(history) < 0 ? -1 : 0;
+                if (status == 0) {
+                    history_catch_up(history);
+                }
+            }
+        }
+        history_lock(history, held != 0 ? held : LOCK_UN);
+        return status;
+    }
+
+    return 0;
+}
+
+// Adding the entry at offset to the index, the index lock is held
+
+static int history_index_entry(struct history *history, uint64_t offset, size_t length) {
+    struct history_header *header = history->index;
+    struct history_block *block;
+    size_t i;
+
+    if (header->block_count == 0 || history_blocks(history)[header->block_count - 1].count == HISTORY_BLOCK_ENTRIES) {
+        size_t capacity = (history->index_mapped - sizeof(struct history_header)) / sizeof(struct history_block);
+        if (header->block_count == capacity) {
+            capacity = capacity ? capacity * 2 : HISTORY_INDEX_GROW;
+            if (ftruncate(history->index_fd, sizeof(struct history_header) + capacity * sizeof(struct history_block)) < 0
+                    || history_remap(history) < 0) {
+                return -1;
+            }
+            header = history->index;
+        }
+        block = &history_blocks(history)[header->block_count++];
+        block->offset = offset;
+        block->count = 0;
+    }
+
+    block = &history_blocks(history)[header->block_count - 1];
+    for (i = 0; i + 2 < length; i++) {
+        uint32_t bit = history_trigram(history->log + offset + i);
+        block->bits[bit >> 3] |= 1 << (bit & 7);
+    }
+    block->count++;
+    header->entry_count++;
+    header->indexed_size = offset + length + 1;
+
+    return 0;
+}
+
+// Indexing the complete lines past the indexed size, the lock is held
+
+static void history_catch_up(struct history *history) {
+    uint64_t offset = history->index->indexed_size;
+
+    while (offset < history->log_size) {
+        const char *newline = memchr(history->log + offset, '\n', history->log_size - offset);
+        if (newline == NULL) {
+            break;      // a write in progress, indexed once complete
+        }
+        uint64_t next = newline - history->log + 1;
+        if (history_index_entry(history, offset, next - offset - 1) < 0) {
             break;
+        }
+        offset = next;
+    }
+}
+
+// Opening the history on first use. Only a missing or damaged index is
+// rebuilt, so the cost of opening does not grow with the history
+
+struct history *wsh_history_open() {
+    struct history_header header;
+    struct history *history;
+    struct stat log_st, index_st;
+    const char *path = getenv("HISTFILE"), *home = getenv("HOME");
+
+    if (wsh_shell->history != NULL || wsh_shell->history_failed) {
+        return wsh_shell->history;
+    }
+    wsh_shell->history_failed = 1;
+
+    history = (struct history*) calloc(1, sizeof(struct history));
+    if (!history) {
+        fprintf(stderr, "wsh: allocation error");
+        exit(EXIT_FAILURE);
+    }
+    if (path != NULL && path[0] != '\0') {
+        history->path = strdup(path);
+    } else {
+        history->path = malloc(strlen(home != NULL ? home : ".") + sizeof(HISTORY_FILE) + 1);
+        sprintf(history->path, "%s/%s", home != NULL ? home : ".", HISTORY_FILE);
+    }
+
+    char *index_path = malloc(strlen(history->path) + sizeof(HISTORY_INDEX_SUFFIX));
+    sprintf(index_path, "%s%s", history->path, HISTORY_INDEX_SUFFIX);
+    history->log_fd = open(history->path, O_RDWR|O_APPEND|O_CREAT|O_CLOEXEC, 0600);
+    history->index_fd = open(index_path, O_RDWR|O_CREAT|O_CLOEXEC, 0600);
+    free(index_path);
+    if (history->log_fd < 0 || history->index_fd < 0) {
+        goto fail;
+    }
+
+    history_lock(history, LOCK_EX);
+    if (fstat(history->log_fd, &log_st) < 0 || fstat(history->index_fd, &index_st) < 0) {
+        goto fail_locked;
+    }
+    if (pread(history->index_fd, &header, sizeof(header), 0) != sizeof(header)
+            || memcmp(header.magic, HISTORY_MAGIC, sizeof(header.magic)) != 0
+            || header.version != HISTORY_VERSION || header.block_entries != HISTORY_BLOCK_ENTRIES
+            || header.indexed_size > (uint64_t) log_st.st_size
+            || sizeof(header) + header.block_count * sizeof(struct history_block) > (uint64_t) index_st.st_size) {
+        if (history_index_reset(history) < 0) {
+            goto fail_locked;
+        }
+    }
+    if (history_remap(history) < 0) {
+        goto fail_locked;
+    }
+    history_catch_up(history);
+    history_lock(history, LOCK_UN);
+
+    wsh_shell->history = history;
+    wsh_shell->history_failed = 0;
+    return history;
+
+fail_locked:
+    history_lock(history, LOCK_UN);
+fail:
+    wsh_shell->history = history;
+    wsh_history_close();
+    return NULL;
+}
+
+void wsh_history_close() {
+    struct history *history = wsh_shell->history;
+
+    if (history == NULL) {
+        return;
+    }
+    if (history->log != NULL) {
+        munmap(history->log, history->log_mapped);
+    }
+    if (history->index != NULL) {
+        munmap(history->index, history->index_mapped);
+    }
+    if (history->log_fd >= 0) {
+        close(history->log_fd);
+    }
+    if (history->index_fd >= 0) {
+        close(history->index_fd);
+    }
+    free(history->path);
+    free(history);
+    wsh_shell->history = NULL;
+}
+
+// Appending a line to the history with a single O_APPEND write, a line
+// repeating the last entry is not added again
+
+void wsh_history_add(const char *line) {
+    struct history *history = wsh_history_open();
+    size_t length = strlen(line);
+
+    if (history == NULL || length == 0 || memchr(line, '\n', length) != NULL) {
+        return;
+    }
+
+    history_lock(history, LOCK_EX);
+    if (history_remap(history) == 0) {
+        history_catch_up(history);
+
+        uint64_t end = history->index->indexed_size;
+        long last = end > 0 ? wsh_history_prev(end) : -1;
+        if (last < 0 || end - last - 1 != length || memcmp(history->log + last, line, length) != 0) {
+            char *entry = malloc(length + 1);
+            memcpy(entry, line, length);
+            entry[length] = '\n';
+            if (write(history->log_fd, entry, length + 1) == (ssize_t) length + 1 && history_remap(history) == 0) {
+                history_catch_up(history);
+            }
+            free(entry);
+        }
+    }
+    history_lock(history, LOCK_UN);
+}
+
+// Finding the newest entry containing query that starts before the
+// offset before (-1 for the end). Blocks missing one of the query's
+// trigrams are skipped; queries shorter than a trigram scan every block
+
+long wsh_history_search(const char *query, long before) {
+    struct history *history = wsh_history_open();
+    uint32_t trigrams[HISTORY_QUERY_TRIGRAMS];
+    size_t length = strlen(query), count = 0, i;
+    long result = -1, b;
+
+    if (history == NULL || length == 0) {
+        return -1;
+    }
+    for (i = 0; i + 2 < length && count < HISTORY_QUERY_TRIGRAMS; i++) {
+        trigrams[count++] = history_trigram(query + i);
+    }
+
+    history_lock(history, LOCK_SH);
+    if (history_remap(history) < 0) {
+        history_lock(history, LOCK_UN);
+        return -1;
+    }
+
+    struct history_header *header = history->index;
+    struct history_block *blocks = history_blocks(history);
+    if (before < 0 || (uint64_t) before > header->indexed_size) {
+        before = header->indexed_size;
+    }
+
+    for (b = header->block_count - 1; b >= 0 && result < 0; b--) {
+        if (blocks[b].offset >= (uint64_t) before) {
+            continue;
+        }
+        for (i = 0; i < count; i++) {
+            if (!(blocks[b].bits[trigrams[i] >> 3] & (1 << (trigrams[i] & 7)))) {
+                break;
+            }
+        }
+        if (i < count) {
+            continue;
+        }
+
+        const char *start = history->log + blocks[b].offset, *hit;
+        const char *end = history->log + ((uint64_t) b + 1 < header->block_count ? blocks[b + 1].offset : header->indexed_size);
+        while ((hit = memmem(start, end - start, query, length)) != NULL) {
+            const char *line = memrchr(start, '\n', hit - start);
+            line = line != NULL ? line + 1 : start;
+            if (line - history->log >= before) {
+                break;
+            }
+            result = line - history->log;
+            start = memchr(hit, '\n', end - hit);
+            if (start == NULL) {
+                break;
+            }
+            start++;
+        }
     }
+    history_lock(history, LOCK_UN);
 
-    return status;
+    return result;
 }
 
-// Launching external commands
+// Getting the entry before the one at offset (-1 for the end of the log)
 
-int wsh_launch_process(struct job *job, struct process *proc, int in_fd, int out_fd, int mode) {
-    proc->status = STATUS_RUNNING;
-    if (proc->type != COMMAND_EXTERNAL && wsh_execute_builtin_command(proc)) {
-        return 0;
+long wsh_history_prev(long offset) {
+    struct history *history = wsh_history_open();
+
+    if (history == NULL || history_remap(history) < 0) {
+        return -1;
+    }
+    if (offset < 0 || (uint64_t) offset > history->index->indexed_size) {
+        offset = history->index->indexed_size;
+    }
+    if (offset == 0) {
+        return -1;
     }
 
-    pid_t childpid;
-    int status = 0;
+    const char *newline = memrchr(history->log, '\n', offset - 1);
+    return newline != NULL ? newline - history->log + 1 : 0;
+}
 
-    childpid = fork();
+// Getting the entry after the one at offset, -1 past the newest
 
-    if (childpid < 0) {
+long wsh_history_next(long offset) {
+    struct history *history = wsh_history_open();
+
+    if (history == NULL || offset < 0 || history_remap(history) < 0
+            || (uint64_t) offset >= history->index->indexed_size) {
         return -1;
-    } else if (childpid == 0) {         // child process
-        signal(SIGINT, SIG_DFL);
-        signal(SIGQUIT, SIG_DFL);
-        signal(SIGTSTP, SIG_DFL);
-        signal(SIGTTIN, SIG_DFL);
-        signal(SIGTTOU, SIG_DFL);
-        signal(SIGCHLD, SIG_DFL);
+    }
 
-        proc->pid = getpid();
-        if (job->pgid > 0) {
-            setpgid(0, job->pgid);
-        } else {
-            job->pgid = proc->pid;
-            setpgid(0, job->pgid);
-        }
+    const char *newline = memchr(history->log + offset, '\n', history->index->indexed_size - offset);
+    offset = newline - history->log + 1;
+    return (uint64_t) offset < history->index->indexed_size ? offset : -1;
+}
 
-        if (in_fd != 0) {
-            dup2(in_fd, 0);
-            close(in_fd);
-        }
+// Copying the text of the entry at offset
 
-        if (out_fd != 1) {
-            dup2(out_fd, 1);
-            close(out_fd);
-        }
+char *wsh_history_entry(long offset) {
+    struct history *history = wsh_shell->history;
+    const char *start = history->log + offset;
+    const char *newline = memchr(start, '\n', history->log_size - offset);
+    size_t length = newline != NULL ? (size_t) (newline - start) : history->log_size - offset;
+    char *entry = malloc(length + 1);
 
-        if (execvp(proc->argv[0], proc->argv) < 0) {
-            printf("wsh: %s: command not found", proc->argv[0]);
-            exit(0);
-        }
+    if (!entry) {
+        fprintf(stderr, "wsh: allocation error");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(entry, start, length);
+    entry[length] = '\0';
 
-        exit(0);
-    } else {   // parent process
-        proc->pid = childpid;
-        if (job->pgid > 0) {
-            setpgid(childpid, job->pgid);
+    return entry;
+}
+
+// Getting the number of the entry at offset: the block is found by
+// binary search, then the entries before it in the block are counted
+
+static long history_number(struct history *history, long offset) {
+    struct history_block *blocks = history_blocks(history);
+    long low = 0, high = history->index->block_count - 1;
+
+    while (low < high) {
+        long mid = (low + high + 1) / 2;
+        if (blocks[mid].offset <= (uint64_t) offset) {
+            low = mid;
         } else {
-            job->pgid = proc->pid;
-            setpgid(childpid, job->pgid);
+            high = mid - 1;
         }
+    }
 
-        if (mode == FOREGROUND_EXECUTION) {
-            tcsetpgrp(0, job->pgid);
-            status = wait_for_job(job->id);
-            signal(SIGTTOU, SIG_IGN);
-            tcsetpgrp(0, getpid());
-            signal(SIGTTOU, SIG_DFL);
-        }
+    long number = low * HISTORY_BLOCK_ENTRIES + 1;
+    const char *c = history->log + blocks[low].offset, *end = history->log + offset;
+    while ((c = memchr(c, '\n', end - c)) != NULL) {
+        number++;
+        c++;
     }
 
-    return status;
+    return number;
 }
 
-// Launching jobs
+int wsh_history(int argc, char **argv) {
+    struct history *history = wsh_history_open();
+    long count = HISTORY_LIST_DEFAULT, offset, i;
 
-int wsh_launch_job(struct job *job) {
-    struct process *proc;
-    int status = 0, in_fd = 0, fd[2], job_id = -1;
+    if (history == NULL) {
+        printf("wsh: history: cannot open history file\n");
+        return -1;
+    }
 
-    check_zombie();
-    if (job->root->type == COMMAND_EXTERNAL) {
-        job_id = insert_job(job);
+    if (argc > 1 && strcmp(argv[1], "-i") == 0) {
+        history_remap(history);
+        printf("file: %s\n", history->path);
+        printf("entries: %lu (%lu bytes)\n", (unsigned long) history->index->entry_count,
+               (unsigned long) history->index->indexed_size);
+        printf("index: %lu blocks of %d entries (%lu bytes)\n", (unsigned long) history->index->block_count,
+               HISTORY_BLOCK_ENTRIES, (unsigned long) history->index_mapped);
+        return 0;
     }
 
-    for (proc = job->root; proc != NULL; proc = proc->next) {
-        if (proc == job->root && proc->input_path != NULL) {
-            in_fd = open(proc->input_path, O_RDONLY);
-            if (in_fd < 0) {
-                printf("wsh: no such file or directory: %s", proc->input_path);
-                remove_job(job_id);
-                return -1;
-            }
+    if (argc > 2 && strcmp(argv[1], "-s") == 0) {
+        if (argc > 3) {
+            count = atol(argv[3]);
         }
-        if (proc->next != NULL) {
-            pipe(fd);
-            status = wsh_launch_process(job, proc, in_fd, fd[1], PIPELINE_EXECUTION);
-            close(fd[1]);
-            in_fd = fd[0];
-        } else {
-            int out_fd = 1;
-            if (proc->output_path != NULL) {
-                out_fd = open(proc->output_path, O_CREAT|O_WRONLY, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
-                if (out_fd < 0) {
-                    out_fd = 1;
-                }
-            }
-            status = wsh_launch_process(job, proc, in_fd, out_fd, job->mode);
+        for (offset = -1, i = 0; i < count && (offset = wsh_history_search(argv[2], offset)) >= 0; i++) {
+            char *entry = wsh_history_entry(offset);
+            printf("%5ld  %s\n", history_number(history, offset), entry);
+            free(entry);
         }
+        return 0;
     }
 
-    if (job->root->type == COMMAND_EXTERNAL) {
-        if (status >= 0 && job->mode == FOREGROUND_EXECUTION) {
-            remove_job(job_id);
+    if (argc > 2 || (argc == 2 && (count = atol(argv[1])) <= 0)) {
+        printf("usage: history [n] | history -s text [n] | history -i\n");
+        return -1;
+    }
+
+    for (offset = -1, i = 0; i < count; i++) {
+        long prev = wsh_history_prev(offset);
+        if (prev < 0) {
+            break;
         }
+        offset = prev;
+    }
+    long number = history->index->entry_count - i + 1;
+    for (; i > 0 && offset >= 0; i--, offset = wsh_history_next(offset)) {
+        char *entry = wsh_history_entry(offset);
+        printf("%5ld  %s\n", number++, entry);
+        free(entry);
     }
 
-    return status;
+    return 0;
 }
 
-// Parsing the command line
-
-struct process* wsh_parse_command_segment(char *segment) {
-    int bufsize = TOKEN_BUFSIZE;
-    int position = 0;
-    char *command = strdup(segment);
-    char *token;
-    char **tokens = (char**) malloc(bufsize * sizeof(char*));
-
-    if (!tokens) {
-        fprintf(stderr, "wsh: allocation error");
-        exit(EXIT_FAILURE);
-    }
+// Line editor for terminals. Raw mode is only on while a line is edited,
+// so commands run with the terminal settings they expect. Keys come from
+// the shell's input buffer, filled through the event loop so children
+// are still reaped while the prompt waits
 
-    token = strtok(segment, TOKEN_DELIMITERS);
-    while (token != NULL) {
-        glob_t glob_buffer;
-        int glob_count = 0;
-        if (strchr(token, '*') != NULL || strchr(token, '?') != NULL) {
-            glob(token, 0, NULL, &glob_buffer);
-            glob_count = glob_buffer.gl_pathc;
-        }
+static int editor_key() {
+    struct shell_info *shell = wsh_shell;
 
-        if (position + glob_count >= bufsize) {
-            bufsize += TOKEN_BUFSIZE;
-            bufsize += glob_count;
-            tokens = (char**) realloc(tokens, bufsize * sizeof(char*));
-            if (!tokens) {
+    while (shell->input_pos >= shell->input_len) {
+        shell->input_pos = shell->input_len = 0;
+        if (shell->input_cap == 0) {
+            shell->input_cap = COMMAND_BUFSIZE;
+            shell->input_buf = realloc(shell->input_buf, shell->input_cap);
+            if (!shell->input_buf) {
                 fprintf(stderr, "wsh: allocation error");
                 exit(EXIT_FAILURE);
             }
         }
-
-        if (glob_count > 0) {
-            int i;
-            for (i = 0; i < glob_count; i++) {
-                tokens[position++] = strdup(glob_buffer.gl_pathv[i]);
-            }
-            globfree(&glob_buffer);
-        } else {
-            tokens[position] = token;
-            position++;
+        if (shell->input_pollable) {
+            while (!wsh_event_poll(-1));
         }
-
-        token = strtok(NULL, TOKEN_DELIMITERS);
+        ssize_t n = read(0, shell->input_buf, shell->input_cap);
+        if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        shell->input_len = n;
     }
 
-    int i = 0, argc = 0;
-    char *input_path = NULL, *output_path = NULL;
-    while (i < position) {
-        if (tokens[i][0] == '<' || tokens[i][0] == '>') {
-            break;
-        }
-        i++;
+    return (unsigned char) shell->input_buf[shell->input_pos++];
+}
+
+// Checking for more input within timeout ms, tells a lone ESC apart from
+// the start of an escape sequence
+
+static int editor_pending(int timeout) {
+    struct pollfd pfd = { .fd = 0, .events = POLLIN };
+
+    return wsh_shell->input_pos < wsh_shell->input_len || poll(&pfd, 1, timeout) > 0;
+}
+
+static void editor_refresh(struct line_editor *ed) {
+    const char *prompt = ed->searching ? (ed->failed ? "(failed reverse-i-search)`" : "(reverse-i-search)`") : ed->prompt;
+    size_t size = strlen(prompt) + ed->query_len + ed->len + 32;
+    char *out = malloc(size);
+    int n;
+
+    if (!out) {
+        fprintf(stderr, "wsh: allocation error");
+        exit(EXIT_FAILURE);
+    }
+    if (ed->searching) {
+        n = sprintf(out, "\r%s%.*s': %.*s\x1b[K", prompt, ed->query_len, ed->query, ed->len, ed->buf);
+    } else {
+        n = sprintf(out, "\r%s%.*s\x1b[K", prompt, ed->len, ed->buf);
+    }
+    if (ed->pos < ed->len) {
+        n += sprintf(out + n, "\x1b[%dD", ed->len - ed->pos);
     }
-    argc = i;
+    if (write(1, out, n) < 0) {
+        perror("wsh: write");
+    }
+    free(out);
+}
 
-    for (; i < position; i++) {
-        if (tokens[i][0] == '<') {
-            if (strlen(tokens[i]) == 1) {
-                input_path = (char *) malloc((strlen(tokens[i + 1]) + 1) * sizeof(char));
-                strcpy(input_path, tokens[i + 1]);
-                i++;
-            } else {
-                input_path = (char *) malloc(strlen(tokens[i]) * sizeof(char));
-                strcpy(input_path, tokens[i] + 1);
-            }
-        } else if (tokens[i][0] == '>') {
-            if (strlen(tokens[i]) == 1) {
-                output_path = (char *) malloc((strlen(tokens[i + 1]) + 1) * sizeof(char));
-                strcpy(output_path, tokens[i + 1]);
-                i++;
-            } else {
-                output_path = (char *) malloc(strlen(tokens[i]) * sizeof(char));
-                strcpy(output_path, tokens[i] + 1);
-            }
-        } else {
-            break;
+static void editor_set(struct line_editor *ed, const char *text) {
+    int length = strlen(text);
+
+    if (length + 1 > ed->cap) {
+        ed->cap = length + COMMAND_BUFSIZE;
+        ed->buf = realloc(ed->buf, ed->cap);
+        if (!ed->buf) {
+            fprintf(stderr, "wsh: allocation error");
+            exit(EXIT_FAILURE);
         }
     }
+    memcpy(ed->buf, text, length + 1);
+    ed->len = ed->pos = length;
+}
+
+static void editor_load(struct line_editor *ed, long offset) {
+    char *entry = wsh_history_entry(offset);
+
+    editor_set(ed, entry);
+    free(entry);
+}
 
-    for (i = argc; i <= position; i++) {
-        tokens[i] = NULL;
+// Searching again for the query from before (-1 for the newest entry)
+
+static void editor_search(struct line_editor *ed, long before) {
+    long match;
+
+    ed->query[ed->query_len] = '\0';
+    match = wsh_history_search(ed->query, before);
+    ed->failed = match < 0 && ed->query_len > 0;
+    if (match >= 0) {
+        ed->match = match;
+        editor_load(ed, match);
+        ed->pos = strstr(ed->buf, ed->query) - ed->buf;
     }
+}
+
+// Handling a key in reverse search mode. Returns 0 when the key ends the
+// search and should be handled by the editor too, with the match kept
 
-    // Initializing the process with the job details
+static int editor_search_key(struct line_editor *ed, int key) {
+    if (key == 18) {                        // Ctrl-R, the next older match
+        if (ed->match >= 0) {
+            editor_search(ed, ed->match);
+        }
+    } else if (key == 127 || key == 8) {
+        if (ed->query_len > 0) {
+            ed->query_len--;
+            editor_search(ed, -1);
+        }
+    } else if (key == 7 || key == 27) {     // Ctrl-G or ESC, back to the line
+        editor_set(ed, ed->saved);
+        ed->searching = 0;
+        if (key == 27 && editor_pending(0)) {
+            return 0;
+        }
+    } else if (key >= 32 && key != 127 && ed->query_len < COMMAND_BUFSIZE - 1) {
+        ed->query[ed->query_len++] = key;
+        editor_search(ed, ed->match >= 0 ? ed->match + 1 : -1);
+    } else {
+        ed->searching = 0;
+        return 0;
+    }
 
-    struct process *new_proc = (struct process*) malloc(sizeof(struct process));
-    new_proc->command = command;
-    new_proc->argv = tokens;
-    new_proc->argc = argc;
-    new_proc->input_path = input_path;
-    new_proc->output_path = output_path;
-    new_proc->pid = -1;
-    new_proc->type = get_command_type(tokens[0]);
-    new_proc->next = NULL;
-    return new_proc;
+    return 1;
 }
 
-// Parsing the command line
+static void editor_history(struct line_editor *ed, int older) {
+    long offset;
 
-struct job* wsh_parse_command(char *line) {
-    line = helper_strtrim(line);
-    char *command = strdup(line);
+    if (older) {
+        offset = wsh_history_prev(ed->history_pos);
+        if (offset < 0) {
+            return;
+        }
+        if (ed->history_pos < 0) {
+            free(ed->saved);
+            ed->saved = strdup(ed->buf);
+        }
+        ed->history_pos = offset;
+        editor_load(ed, offset);
+    } else if (ed->history_pos >= 0) {
+        ed->history_pos = wsh_history_next(ed->history_pos);
+        if (ed->history_pos >= 0) {
+            editor_load(ed, ed->history_pos);
+        } else {
+            editor_set(ed, ed->saved);
+        }
+    }
+}
 
-    struct process *root_proc = NULL, *proc = NULL;
-    char *line_cursor = line, *c = line, *seg;
-    int seg_len = 0, mode = FOREGROUND_EXECUTION;
+// Reading a line with editing, history browsing and Ctrl-R search.
+// Returns NULL at EOF
 
-    if (line[strlen(line) - 1] == '&') {
-        mode = BACKGROUND_EXECUTION;
-        line[strlen(line) - 1] = '\0';
+char *wsh_edit_line(const char *prompt) {
+    struct line_editor ed = { .prompt = prompt, .history_pos = -1 };
+    struct termios saved, raw;
+    int key, done = 0;
+
+    fflush(stdout);
+    if (tcgetattr(0, &saved) < 0) {
+        printf("%s", prompt);
+        fflush(stdout);
+        return wsh_read_line();
     }
+    raw = saved;
+    raw.c_iflag &= ~(ICRNL | IXON | BRKINT | INPCK | ISTRIP);
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(0, TCSADRAIN, &raw);
+
+    editor_set(&ed, "");
+    ed.saved = strdup("");
+    editor_refresh(&ed);
+
+    while (!done) {
+        key = editor_key();
+        if (key < 0) {
+            done = -1;
+            break;
+        }
+        if (ed.searching && editor_search_key(&ed, key)) {
+            editor_refresh(&ed);
+            continue;
+        }
 
-    while (1) {
-        if (*c == '\0' || *c == '|') {
-            seg = (char*) malloc((seg_len + 1) * sizeof(char));
-            strncpy(seg, line_cursor, seg_len);
-            seg[seg_len] = '\0';
-
-            struct process* new_proc = wsh_parse_command_segment(seg);
-            if (!root_proc) {
-                root_proc = new_proc;
-                proc = root_proc;
-            } else {
-                proc->next = new_proc;
-                proc = new_proc;
+        if (key == 27 && editor_pending(50)) {
+            int next = editor_key();
+            int code = next == '[' || next == 'O' ? editor_key() : -1;
+            if (code >= '0' && code <= '9') {
+                while (editor_pending(50) && (key = editor_key()) >= '0' && key <= '9');
             }
+            switch (code) {
+                case 'A': key = 16; break;
+                case 'B': key = 14; break;
+                case 'C': key = 6; break;
+                case 'D': key = 2; break;
+                case 'H': case '1': case '7': key = 1; break;
+                case 'F': case '4': case '8': key = 5; break;
+                case '3': key = 4 | 0x100; break;
+                default: key = 0; break;
+            }
+        }
 
-            if (*c != '\0') {
-                line_cursor = c;
-                while (*(++line_cursor) == ' ');
-                c = line_cursor;
-                seg_len = 0;
-                continue;
-            } else {
+        switch (key) {
+            case '\r':
+            case '\n':
+                done = 1;
                 break;
-            }
-        } else {
-            seg_len++;
-            c++;
+            case 1:                 // Ctrl-A
+                ed.pos = 0;
+                break;
+            case 5:                 // Ctrl-E
+                ed.pos = ed.len;
+                break;
+            case 2:                 // Ctrl-B
+                ed.pos -= ed.pos > 0;
+                break;
+            case 6:                 // Ctrl-F
+                ed.pos += ed.pos < ed.len;
+                break;
+            case 16:                // Ctrl-P
+                editor_history(&ed, 1);
+                break;
+            case 14:                // Ctrl-N
+                editor_history(&ed, 0);
+                break;
+            case 11:                // Ctrl-K
+                ed.len = ed.pos;
+                break;
+            case 21:                // Ctrl-U
+                memmove(ed.buf, ed.buf + ed.pos, ed.len - ed.pos);
+                ed.len -= ed.pos;
+                ed.pos = 0;
+                break;
+            case 127:
+            case 8:
+                if (ed.pos > 0) {
+                    memmove(ed.buf + ed.pos - 1, ed.buf + ed.pos, ed.len - ed.pos);
+                    ed.pos--;
+                    ed.len--;
+                }
+                break;
+            case 4:                 // Ctrl-D, EOF on an empty line
+                if (ed.len == 0) {
+                    done = -1;
+                    break;
+                }
+                /* fall through */
+            case 4 | 0x100:         // Delete
+                if (ed.pos < ed.len) {
+                    memmove(ed.buf + ed.pos, ed.buf + ed.pos + 1, ed.len - ed.pos - 1);
+                    ed.len--;
+                }
+                break;
+            case 3:                 // Ctrl-C, a fresh line
+                if (write(1, "^C\n", 3) < 0) {
+                    perror("wsh: write");
+                }
+                ed.len = ed.pos = 0;
+                ed.history_pos = -1;
+                break;
+            case 12:                // Ctrl-L
+                if (write(1, "\x1b[H\x1b[2J", 7) < 0) {
+                    perror("wsh: write");
+                }
+                break;
+            case 18:                // Ctrl-R
+                free(ed.saved);
+                ed.buf[ed.len] = '\0';
+                ed.saved = strdup(ed.buf);
+                ed.searching = 1;
+                ed.failed = 0;
+                ed.query_len = 0;
+                ed.match = -1;
+                break;
+            default:
+                if (key >= 32 && key < 256 && key != 127) {
+                    if (ed.len + 2 > ed.cap) {
+                        ed.cap += COMMAND_BUFSIZE;
+                        ed.buf = realloc(ed.buf, ed.cap);
+                        if (!ed.buf) {
+                            fprintf(stderr, "wsh: allocation error");
+                            exit(EXIT_FAILURE);
+                        }
+                    }
+                    memmove(ed.buf + ed.pos + 1, ed.buf + ed.pos, ed.len - ed.pos);
+                    ed.buf[ed.pos++] = key;
+                    ed.len++;
+                }
+                break;
+        }
+        if (!done) {
+            editor_refresh(&ed);
         }
     }
 
-    struct job *new_job = (struct job*) malloc(sizeof(struct job));
-    new_job->root = root_proc;
-    new_job->command = command;
-    new_job->pgid = -1;
-    new_job->mode = mode;
-    return new_job;
+    ed.searching = 0;
+    editor_refresh(&ed);
+    if (write(1, "\n", 1) < 0) {
+        perror("wsh: write");
+    }
+    tcsetattr(0, TCSADRAIN, &saved);
+    free(ed.saved);
+
+    if (done < 0) {
+        free(ed.buf);
+        return NULL;
+    }
+    ed.buf[ed.len] = '\0';
+    return ed.buf;
 }
 
-// Reading the command line
+// Reading the command line, input is buffered here and the event loop
+// keeps reaping children while we wait for the user. NULL means EOF.
 
 char* wsh_read_line() {
-    int bufsize = COMMAND_BUFSIZE;
-    int position = 0;
-    char *buffer = malloc(sizeof(char) * bufsize);
-    int c;
-
-    if (!buffer) {
-        fprintf(stderr, "wsh: allocation error");
-        exit(EXIT_FAILURE);
-    }
+    struct shell_info *shell = wsh_shell;
+    char *newline, *line;
+    int length;
 
     while (1) {
-        c = getchar();
-
-        if (c == EOF || c == '\n') {
-            buffer[position] = '\0';
-            return buffer;
-        } else {
-            buffer[position] = c;
+        newline = memchr(shell->input_buf + shell->input_pos, '\n', shell->input_len - shell->input_pos);
+        if (newline != NULL) {
+            length = newline - (shell->input_buf + shell->input_pos);
+            break;
         }
-        position++;
 
-        if (position >= bufsize) {
-            bufsize += COMMAND_BUFSIZE;
-            buffer = realloc(buffer, bufsize);
-            if (!buffer) {
+        if (shell->input_pos > 0) {
+            memmove(shell->input_buf, shell->input_buf + shell->input_pos, shell->input_len - shell->input_pos);
+            shell->input_len -= shell->input_pos;
+            shell->input_pos = 0;
+        }
+        if (shell->input_len >= shell->input_cap) {
+            shell->input_cap += COMMAND_BUFSIZE;
+            shell->input_buf = realloc(shell->input_buf, shell->input_cap);
+            if (!shell->input_buf) {
                 fprintf(stderr, "wsh: allocation error");
                 exit(EXIT_FAILURE);
             }
         }
+
+        if (shell->input_pollable) {
+            while (!wsh_event_poll(-1));
+        }
+
+        ssize_t n = read(0, shell->input_buf + shell->input_len, shell->input_cap - shell->input_len);
+        if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+            continue;
+        }
+        if (n <= 0) {
+            if (shell->input_len == 0) {
+                return NULL;
+            }
+            length = shell->input_len;       // last line without a newline
+            break;
+        }
+        shell->input_len += n;
+    }
+
+    line = malloc(length + 1);
+    if (!line) {
+        fprintf(stderr, "wsh: allocation error");
+        exit(EXIT_FAILURE);
     }
+    memcpy(line, shell->input_buf + shell->input_pos, length);
+    line[length] = '\0';
+    shell->input_pos += length + 1;
+    if (shell->input_pos > shell->input_len) {
+        shell->input_pos = shell->input_len;
+    }
+
+    return line;
+}
+
+// Reading a line of piped input after printing the prompt
+
+char *wsh_prompt_line(const char *prompt) {
+    printf("%s", prompt);
+    fflush(stdout);
+    return wsh_read_line();
 }
 
 // Main loop of the shell
 
 void wsh_loop() {
+    int editing = isatty(0) && isatty(1);
     char *line;
     struct job *job;
-    int status = 1;
 
     do {
-        printf("wsh> ");
-        line = wsh_read_line();
+        line = editing ? wsh_edit_line("wsh> ") : wsh_prompt_line("wsh> ");
+        if (line == NULL) {
+            break;
+        }
         if (strlen(line) == 0) {
-            check_zombie();
+            free(line);
+            continue;
+        }
+        if (editing) {
+            wsh_history_add(line);
+        }
+        int depth = 0, control = wsh_control_scan(line, &depth);
+        if (control) {
+            // an if, loop or trailing && takes lines until it is complete
+            size_t length = strlen(line);
+            char *more;
+            while ((depth > 0 || control == 2) &&
+                   (more = editing ? wsh_edit_line("> ") : wsh_prompt_line("> ")) != NULL) {
+                size_t more_length = strlen(more);
+                line = realloc(line, length + more_length + 2);
+                if (!line) {
+                    fprintf(stderr, "wsh: allocation error");
+                    exit(EXIT_FAILURE);
+                }
+                line[length++] = '\n';
+                memcpy(line + length, more, more_length + 1);
+                length += more_length;
+                control = wsh_control_scan(more, &depth);
+                free(more);
+            }
+            wsh_run_text(line, length);
+            free(line);
             continue;
         }
         job = wsh_parse_command(line);
-        status = wsh_launch_job(job);
+        free(line);
+        if (job != NULL) {
+            wsh_read_here_docs(job, editing ? wsh_edit_line : wsh_prompt_line);
+            wsh_launch_job(job);
+        }
     }while (1);
-    
-    printf("%d", status);
 }
 
 // Ctrl+C signal handler
 
 void signal_handler(int signo) {
-    for(int i=0; i<MAX_JOBS; i++){
-        kill(-wsh_shell->jobs[i]->pgid, signo);
-        set_job_status(i, STATUS_TERMINATED);
+    for(int i=1; i<wsh_shell->jobs_capacity; i++){
+        if (wsh_shell->jobs[i] != NULL) {
+            kill(-wsh_shell->jobs[i]->pgid, signo);
+            set_job_status(i, STATUS_TERMINATED);
+        }
     }
 }
 
@@ -849,35 +8887,120 @@ void wsh_init() {
     setpgid(pid, pid);
     tcsetpgrp(0, pid);
 
-    wsh_shell = (struct shell_info*) malloc(sizeof(struct shell_info));
+    wsh_shell_init();
+}
 
-    int i;
-    for (i = 0; i < MAX_JOBS; i++) {
-        wsh_shell->jobs[i] = NULL;
+// Allocating the shell state, shared by interactive and script mode
+
+void wsh_shell_init() {
+    wsh_shell = (struct shell_info*) malloc(sizeof(struct shell_info));
+    wsh_shell->pid = getpid();
+    wsh_shell->spawn_engine = wsh_get_spawn_engine();
+    wsh_shell->server_pid = -1;
+    wsh_shell->server_fd = -1;
+    wsh_shell->server_status_fd = -1;
+    if (wsh_shell->spawn_engine == SPAWN_ENGINE_SERVER && wsh_server_start() < 0) {
+        wsh_shell->spawn_engine = SPAWN_ENGINE_POSIX;
+    }
+    memset(&wsh_shell->path_cache, 0, sizeof(struct path_cache));
+    wsh_shell->vars = var_store_create(environ);
+    wsh_shell->pipe_size = 0;
+    wsh_shell->builtin_mode = FOREGROUND_EXECUTION;
+    wsh_shell->builtin_input = 0;
+    wsh_shell->sched_queue = NULL;
+    wsh_shell->sched_running = 0;
+    wsh_shell->sched_max_jobs = 0;
+    wsh_shell->sched_max_load = 0;
+    wsh_shell->glob_cache = (struct glob_dir**) calloc(GLOB_CACHE_BUCKETS, sizeof(struct glob_dir*));
+    wsh_shell->glob_cache_dirs = 0;
+    wsh_shell->glob_cache_hits = 0;
+    wsh_shell->glob_cache_misses = 0;
+    wsh_shell->options = OPTION_GLOB_CACHE;
+    wsh_shell->history = NULL;
+    wsh_shell->history_failed = 0;
+    if (!wsh_tracing && getenv("WSH_TRACE") != NULL) {
+        wsh_trace_init(getenv("WSH_TRACE"));
     }
+
+    wsh_shell->jobs_capacity = JOBS_INITIAL_CAPACITY;
+    wsh_shell->jobs = (struct job**) calloc(wsh_shell->jobs_capacity, sizeof(struct job*));
+    wsh_shell->job_id_map = (unsigned long*) calloc(wsh_shell->jobs_capacity / 8, 1);
+    wsh_shell->job_id_map[0] = 1;     // job ids start at 1
+    wsh_shell->job_id_hint = 0;
+    wsh_shell->pid_index_size = PID_INDEX_INITIAL_SIZE;
+    wsh_shell->pid_index_count = 0;
+    wsh_shell->pid_index = (struct pid_slot*) calloc(wsh_shell->pid_index_size, sizeof(struct pid_slot));
+
+    wsh_shell->input_buf = NULL;
+    wsh_shell->input_len = 0;
+    wsh_shell->input_pos = 0;
+    wsh_shell->input_cap = 0;
+    wsh_shell->capture_buf = NULL;
+    wsh_shell->capture_cap = 0;
+    wsh_shell->capture_fd = -1;
+    wsh_shell->subst_status = 0;
+    wsh_shell->last_status = 0;
+    wsh_shell->timer_fd = -1;
+    wsh_shell->timers = NULL;
+    wsh_shell->timer_count = 0;
+    wsh_shell->timer_capacity = 0;
+    wsh_shell->timer_armed = 0;
+    wsh_shell->timeout_default_ms = 0;
+    wsh_shell->timeout_grace_ms = TIMEOUT_GRACE_MS;
+    memset(wsh_shell->job_results, 0, sizeof(wsh_shell->job_results));
+    wsh_shell->job_result_next = 0;
+    wsh_shell->resident = 0;
+    wsh_shell->exit_requested = 0;
+    wsh_shell->script_cache = NULL;
+    wsh_shell->snapshot = NULL;
+    wsh_shell->snapshot_length = 0;
+    wsh_event_init();
 }
 
 // Main function
 
+#ifndef WSH_NO_MAIN
 int main(int argc, char **argv) {
-    if (argc ==2) {
-        char *line = NULL;
-        size_t len = 0;
-        ssize_t read;
-        FILE *fp = fopen(argv[1], "r");
-        if (fp == NULL) {
+    int flags = 0, i;
+
+    for (i = 1; i < argc && strncmp(argv[i], "--", 2) == 0; i++) {
+        if (strcmp(argv[i], "--cache") == 0) {
+            flags |= SCRIPT_USE_CACHE;
+        } else if (strcmp(argv[i], "--dump-parse") == 0) {
+            flags |= SCRIPT_DUMP_PARSE;
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            wsh_trace_init(argv[++i]);
+        } else if (strcmp(argv[i], "--save-snapshot") == 0) {
+            wsh_shell_init();
+            return wsh_save_snapshot(i + 1 < argc ? argv[i + 1] : NULL);
+        } else if (strcmp(argv[i], "--server") == 0 && i + 1 < argc) {
+            wsh_shell_init();
+            wsh_startup();
+            return wsh_resident_serve(argv[i + 1]);
+        } else if (strcmp(argv[i], "--client") == 0 && i + 2 < argc) {
+            int command = strcmp(argv[i + 2], "-c") == 0 && i + 3 < argc;
+            int status = wsh_client(argv[i + 1], command ? RESIDENT_COMMAND : RESIDENT_SCRIPT,
+                                    argv[i + (command ? 3 : 2)]);
+            return status < 0 ? EXIT_FAILURE : status;
+        } else {
+            fprintf(stderr, "usage: wsh [--cache] [--dump-parse] [--trace file] [script]\n"
+                            "       wsh --save-snapshot [file]\n"
+                            "       wsh --server socket\n"
+                            "       wsh --client socket (script | -c command)\n");
             exit(EXIT_FAILURE);
         }
-        while ((read = getline(&line, &len, fp)) != -1) {
-            struct job *job = wsh_parse_command(line);
-            wsh_launch_job(job);
-        }
-        fclose(fp);
-        
-    }else{
-        wsh_init();
-        wsh_loop();
     }
 
+    if (i < argc) {
+        wsh_shell_init();
+        wsh_startup();
+        return wsh_run_script(argv[i], flags);
+    }
+
+    wsh_init();
+    wsh_startup();
+    wsh_loop();
+
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
+#endif /* WSH_NO_MAIN */
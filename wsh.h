@@ -2,99 +2,834 @@
 #define WSH_H
 
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <sys/types.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <time.h>
 
-#define MAX_JOBS 256
+#define JOBS_INITIAL_CAPACITY 64
+#define JOB_ID_WORD_BITS (8 * sizeof(unsigned long))
+#define PID_INDEX_INITIAL_SIZE 128
 #define PATH_BUFSIZE 1024
 #define COMMAND_BUFSIZE 1024
 #define TOKEN_BUFSIZE 64
-#define TOKEN_DELIMITERS " "
+#define PIPE_CHUNK_SIZE 65536
+#define TIMER_HEAP_INITIAL_SIZE 64
+#define TIMEOUT_GRACE_MS 5000
+#define TIMEOUT_EXIT_CODE 124
+#define CANCELLED_EXIT_CODE 125
+#define JOB_RESULTS_MAX 64
+#define WHITESPACE_CHARS " \t\r\n\v\f"
+#define OPERATOR_CHARS "|<>&;"
+#define GLOB_CHARS "*?[]{},\\"
+#define ARENA_CHUNK_SIZE 4096
+#define ARENA_POOL_MAX 32
+#define PATH_CACHE_BUCKETS 256
+#define PATH_CACHE_RECHECK 1
+#define GLOB_CACHE_BUCKETS 256
+#define GLOB_CACHE_MAX_DIRS 4096
+#define GLOB_DIRENT_BUFSIZE 32768
+#define VAR_BUCKETS_INITIAL 64
+
+#define HISTORY_MAGIC "WSHHIST"
+#define HISTORY_VERSION 1
+#define HISTORY_FILE ".wsh_history"
+#define HISTORY_INDEX_SUFFIX ".idx"
+#define HISTORY_BLOCK_ENTRIES 64
+#define HISTORY_TRIGRAM_BITS 13
+#define HISTORY_INDEX_GROW 16
+#define HISTORY_MAP_SLACK (64 << 20)
+#define HISTORY_LIST_DEFAULT 32
+#define HISTORY_QUERY_TRIGRAMS 64
+
+#define TRACE_BUFFER_EVENTS 4096
+#define TRACE_LABEL_SIZE 64
+
+#define OPTION_GLOB_CACHE 1
+#define OPTION_GLOB_UNSORTED 2
+
+#define VAR_EXPORT 1
 
 #define BACKGROUND_EXECUTION 0
 #define FOREGROUND_EXECUTION 1
 #define PIPELINE_EXECUTION 2
 
-#define COMMAND_EXTERNAL 0
-#define COMMAND_EXIT 1
-#define COMMAND_CD 2
-#define COMMAND_JOBS 3
-#define COMMAND_FG 4
-#define COMMAND_BG 5
+#define BUILTIN_UTILITY 1
+#define BUILTIN_BLOCKING 2
+#define BUILTIN_TABLE_BITS 6
+
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_SHIFT 13
 
 #define STATUS_RUNNING 0
 #define STATUS_DONE 1
 #define STATUS_SUSPENDED 2
 #define STATUS_CONTINUED 3
 #define STATUS_TERMINATED 4
+#define STATUS_QUEUED 5
+#define STATUS_TIMEDOUT 6
+
+#define SCRIPT_IMAGE_MAGIC "WSHIMG\0"
+#define SCRIPT_IMAGE_VERSION 9
+#define SCRIPT_WORD_GLOB 0x80000000u
+#define SCRIPT_WORD_EXPAND 0x40000000u
+#define SCRIPT_WORD_ASSIGN 0x20000000u
+#define SCRIPT_WORD_FLAGS (SCRIPT_WORD_GLOB | SCRIPT_WORD_EXPAND | SCRIPT_WORD_ASSIGN)
+#define SCRIPT_IMAGE_SUFFIX ".wshc"
+#define SCRIPT_USE_CACHE 1
+#define SCRIPT_DUMP_PARSE 2
+#define SCRIPT_KEEP_IMAGE 4
+
+#define RC_FILE ".wshrc"
+#define SNAPSHOT_FILE ".wsh_snapshot"
+#define SNAPSHOT_MAGIC "WSHSNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_VAR_EXPORTED 1
+
+#define TOKEN_WORD 0
+#define TOKEN_PIPE 1
+#define TOKEN_INPUT 2
+#define TOKEN_OUTPUT 3
+#define TOKEN_BACKGROUND 4
+#define TOKEN_HEREDOC 5
+#define TOKEN_HERESTRING 6
+#define TOKEN_AND 7
+#define TOKEN_OR 8
+#define TOKEN_SEMI 9
+
+#define WORD_QUOTED 1
+#define WORD_GLOB 2
+#define WORD_EXPAND 4
+#define WORD_ASSIGN 8
+
+#define CAPTURE_READ_SIZE 65536
+
+#define EVENT_INPUT 0
+#define EVENT_SIGCHLD 1
+#define EVENT_TIMER 2
+#define EVENT_BATCH 16
+
+#define PARALLEL_GROUPED 0
+#define PARALLEL_KEEP_ORDER 1
+#define PARALLEL_TAG 2
+#define PARALLEL_UNGROUPED 3
 
 #define PROC_FILTER_ALL 0
 #define PROC_FILTER_DONE 1
 #define PROC_FILTER_REMAINING 2
 
+#define NODE_PENDING 0
+#define NODE_RUNNING 1
+#define NODE_DONE 2
+#define NODE_CANCELLED 3
+
+#define KEYWORD_IF 1
+#define KEYWORD_THEN 2
+#define KEYWORD_ELIF 3
+#define KEYWORD_ELSE 4
+#define KEYWORD_FI 5
+#define KEYWORD_WHILE 6
+#define KEYWORD_UNTIL 7
+#define KEYWORD_DO 8
+#define KEYWORD_DONE 9
+#define KEYWORD_FOR 10
+
+#define SCRIPT_NODE_JOB 1
+#define SCRIPT_NODE_AND 2
+#define SCRIPT_NODE_OR 3
+#define SCRIPT_NODE_IF 4
+#define SCRIPT_NODE_WHILE 5
+#define SCRIPT_NODE_UNTIL 6
+#define SCRIPT_NODE_FOR 7
+
+#define SPAWN_ENGINE_POSIX 0
+#define SPAWN_ENGINE_FORK 1
+#define SPAWN_ENGINE_SERVER 2
+
+#define SERVER_FD_COUNT 3
+
+#define RESIDENT_COMMAND 0
+#define RESIDENT_SCRIPT 1
+#define RESIDENT_BACKLOG 64
+
 //Declaring all the required structures
 
+// Per-job bump allocator. Everything parsed for one command line lives in
+// its job's arena and goes away with a single arena_release().
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;
+    size_t used;
+    char data[];
+};
+
+struct arena {
+    struct arena_chunk *head;
+    struct arena *next_free;
+};
+
+struct alloc_stats {
+    long arenas_created;
+    long arenas_reused;
+    long arenas_live;
+    long arenas_pooled;
+    long chunk_mallocs;
+    long allocations;
+    long bytes;
+};
+
+struct token {
+    int type;
+    int flags;
+    int start;
+    int length;
+};
+
+// A builtin command. Utilities are forked when they sit mid-pipeline or
+// run in the background; prefix builtins can wrap a whole job
+
+struct job;
+
+struct builtin {
+    const char *name;
+    int (*run)(int argc, char **argv);
+    int (*prefix)(struct job *job, int argc, char **argv);
+    int flags;
+};
+
 struct process {
     char *command;
     int argc;
     char **argv;
-    char *input_path;
-    char *output_path;
+    char *globs;
+    char **input_paths;
+    char **output_paths;
+    char *here_doc;
+    size_t here_length;
+    char *here_delim;
+    char **here_delims;
+    char **envp;
     pid_t pid;
-    int type;
+    const struct builtin *builtin;
     int status;
+    int exit_status;
+    int plumbing;
+    struct rusage usage;
+    struct timespec started;
+    struct timespec ended;
     struct process *next;
 };
 
 struct job {
     int job_id;
     int id;
+    struct arena *arena;
     struct process *root;
     char *command;
     pid_t pgid;
     int mode;
+    int pipe_size;
+    struct parallel *parallel;
+    int priority;
+    struct job *queue_next;
+    int timed;
+    struct timespec started;
+    long timeout_ms;
+    int timer_index;
+    int timed_out;
+    char *name;
+    char **after;
+    int sched_counted;
+};
+
+// The exit code of a background job that has been removed, kept for wait
+
+struct job_result {
+    int job_id;
+    pid_t pgid;
+    char *name;
+    int status;
+};
+
+// A job of a script run as a graph. deps are indices of earlier nodes,
+// the first after_count of them named with after: a failure there
+// cancels this node. Times are in microseconds.
+
+struct graph_node {
+    struct job *job;
+    int job_id;
+    int state;
+    int status;
+    int *deps;
+    int dep_count;
+    int after_count;
+    int plain;
+    int waits;
+    int critical_prev;
+    long started;
+    long ended;
+    long path;
+};
+
+struct job_timer {
+    long deadline;
+    int job_id;
+    int stage;
+};
+
+// One input of a parallel run; the captured stdout is kept until its turn
+// when the output is kept in order
+
+struct parallel_task {
+    char *input;
+    char *output;
+    size_t output_len;
+    int capture_fd;
+    int exit_status;
+    int done;
+};
+
+// A worker slot: its own queue of task indices, [head, tail), and the task
+// it is running. Idle workers steal from the tail of the longest queue
+
+struct parallel_worker {
+    int *queue;
+    int head;
+    int tail;
+    int task;
+    struct job *job;
+};
+
+struct parallel {
+    char *template;
+    int has_placeholder;
+    struct parallel_task *tasks;
+    int task_count;
+    struct parallel_worker *workers;
+    int worker_count;
+    int output_mode;
+    int out_fd;
+    int next_output;
+    int finished;
+    int failed;
+    int steals;
+};
+
+struct path_entry {
+    char *name;
+    char *path;
+    int hits;
+    struct path_entry *next;
+};
+
+struct path_cache {
+    struct path_entry *buckets[PATH_CACHE_BUCKETS];
+    char *path_env;
+    int dir_count;
+    struct timespec *dir_mtimes;
+    time_t checked_at;
+    long hits;
+    long misses;
+};
+
+// A shell variable, kept as its "NAME=value" string so the exported ones
+// can go into a child's environment as they are
+
+struct variable {
+    char *entry;
+    size_t name_length;
+    unsigned int hash;
+    int exported;
+    struct variable *next;
+};
+
+// Variables hashed by name. envp is the environment handed to children,
+// pointers to the entries of the exported variables; it is rebuilt only
+// once one of them changed, and the entries it still points at are kept
+// in retired until then
+
+struct var_store {
+    struct variable **buckets;
+    int bucket_count;
+    int count;
+    int exported;
+    char **envp;
+    int envp_stale;
+    long envp_builds;
+    char **retired;
+    int retired_count;
+    int retired_capacity;
+};
+
+struct glob_dir {
+    char *path;
+    struct timespec mtime;
+    ino_t ino;
+    int racy;
+    int count;
+    char *names;
+    uint32_t *offsets;
+    unsigned char *types;
+    struct glob_dir *next;
+};
+
+// History index: a header, then one record per block of entries with a
+// bitmap of the trigrams hashed from their text. Offsets are into the log
+
+struct history_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t block_entries;
+    uint64_t indexed_size;
+    uint64_t entry_count;
+    uint64_t block_count;
+};
+
+struct history_block {
+    uint64_t offset;
+    uint32_t count;
+    uint32_t reserved;
+    unsigned char bits[(1 << HISTORY_TRIGRAM_BITS) / 8];
+};
+
+struct history {
+    char *path;
+    int log_fd;
+    int index_fd;
+    char *log;
+    size_t log_mapped;
+    size_t log_size;
+    struct history_header *index;
+    size_t index_mapped;
+    int locked;
+};
+
+struct line_editor {
+    const char *prompt;
+    char *buf;
+    int len;
+    int pos;
+    int cap;
+    long history_pos;
+    char *saved;
+    int searching;
+    int failed;
+    char query[COMMAND_BUFSIZE];
+    int query_len;
+    long match;
+};
+
+// Fork server messages. A request is followed by its payload: the path,
+// the cwd, then argc argv strings and envc environment strings, each NUL
+// terminated; stdin, stdout and stderr travel as SCM_RIGHTS with it
+
+struct server_request {
+    uint32_t size;
+    int32_t pgid;
+    int32_t argc;
+    int32_t envc;
+};
+
+struct server_reply {
+    int32_t pid;
+    int32_t error;
+};
+
+struct resident_request {
+    uint32_t size;
+    int32_t kind;
+    int32_t envc;
+};
+
+struct resident_reply {
+    int32_t status;
+};
+
+struct server_status {
+    int32_t pid;
+    int32_t status;
+    struct rusage usage;
+};
+
+struct trace_event {
+    char phase;
+    const char *name;
+    int pid;
+    int tid;
+    long start;
+    long duration;
+    char label[TRACE_LABEL_SIZE];
+};
+
+struct pid_slot {
+    pid_t pid;
+    int job_id;
+    struct process *proc;
+};
+
+struct script_cache_entry {
+    char *path;
+    struct script_image *image;
+    size_t mapped_length;
+    struct script_cache_entry *next;
+};
+
+struct word_expansion {
+    struct arena *arena;
+    char **fields;
+    int count;
+    int capacity;
+    char *field;
+    size_t length;
+    size_t field_capacity;
+    int open;
 };
 
 struct shell_info {
-    struct job *jobs[MAX_JOBS + 1];
+    pid_t pid;
+    struct job **jobs;
+    int jobs_capacity;
+    unsigned long *job_id_map;
+    int job_id_hint;
+    struct pid_slot *pid_index;
+    int pid_index_size;
+    int pid_index_count;
+    int spawn_engine;
+    pid_t server_pid;
+    int server_fd;
+    int server_status_fd;
+    int pipe_size;
+    int builtin_mode;
+    int builtin_input;
+    struct job *sched_queue;
+    int sched_running;
+    int sched_max_jobs;
+    double sched_max_load;
+    struct path_cache path_cache;
+    struct var_store *vars;
+    struct glob_dir **glob_cache;
+    int glob_cache_dirs;
+    long glob_cache_hits;
+    long glob_cache_misses;
+    int options;
+    struct history *history;
+    int history_failed;
+    int epoll_fd;
+    int signal_fd;
+    int input_pollable;
+    char *input_buf;
+    int input_len;
+    int input_pos;
+    int input_cap;
+    char *capture_buf;
+    size_t capture_cap;
+    int capture_fd;
+    int subst_status;
+    int last_status;
+    int timer_fd;
+    struct job_timer *timers;
+    int timer_count;
+    int timer_capacity;
+    long timer_armed;
+    long timeout_default_ms;
+    long timeout_grace_ms;
+    struct job_result job_results[JOB_RESULTS_MAX];
+    int job_result_next;
+    int resident;
+    int exit_requested;
+    struct script_cache_entry *script_cache;
+    struct snapshot_image *snapshot;
+    size_t snapshot_length;
+};
+
+// Compiled script image. One flat blob, either built in memory or mmapped
+// from the cache file next to the script. Every reference is a byte offset
+// from the start of the blob and string offset 0 is the empty/NULL string.
+// A process' redirect paths follow its argv words in the words array.
+
+struct script_image {
+    char magic[8];
+    uint32_t version;
+    uint32_t size;
+    uint32_t build;
+    uint32_t reserved;
+    uint64_t script_size;
+    int64_t script_mtime_sec;
+    int64_t script_mtime_nsec;
+    uint32_t script_path;
+    uint32_t job_count;
+    uint32_t jobs;
+    uint32_t proc_count;
+    uint32_t procs;
+    uint32_t word_count;
+    uint32_t words;
+    uint32_t node_count;
+    uint32_t nodes;
+    uint32_t root;
+    uint32_t strings;
+};
+
+// A node of the control flow tree of a script, indices into the nodes
+// array with 0 for none. Lists are chained through next; && and || keep
+// their sides in left and body. A script without if/for/while, && or ||
+// has no nodes and runs its jobs in order.
+
+struct script_node {
+    uint32_t type;
+    uint32_t job;
+    uint32_t left;
+    uint32_t body;
+    uint32_t orelse;
+    uint32_t name;
+    uint32_t first_word;
+    uint32_t word_count;
+    uint32_t next;
+};
+
+struct script_job {
+    uint32_t command;
+    uint32_t first_proc;
+    uint32_t proc_count;
+    uint32_t mode;
+    uint32_t name;
+    uint32_t first_after;
+    uint32_t after_count;
+};
+
+struct script_proc {
+    uint32_t command;
+    uint32_t first_word;
+    uint32_t word_count;
+    uint16_t input_count;
+    uint16_t output_count;
+    uint32_t here_doc;
+    uint32_t here_length;
+};
+
+// Startup snapshot: the state the rc file leaves behind, saved by
+// wsh --save-snapshot and mmapped by later starts instead of running the
+// rc. Laid out like a script image, offsets from the start of the file.
+// Variables are kept as changes to the inherited environment, each with
+// the inherited entry it replaced so a changed environment makes the
+// snapshot stale.
+
+struct snapshot_image {
+    char magic[8];
+    uint32_t version;
+    uint32_t size;
+    uint32_t rc_path;
+    uint32_t builtin_seed;
+    int64_t rc_size;
+    int64_t rc_mtime_sec;
+    int64_t rc_mtime_nsec;
+    uint32_t options;
+    int32_t pipe_size;
+    int32_t sched_max_jobs;
+    int32_t reserved;
+    double sched_max_load;
+    int64_t timeout_default_ms;
+    int64_t timeout_grace_ms;
+    uint32_t var_count;
+    uint32_t vars;
+    uint32_t path_env;
+    uint32_t dir_count;
+    uint32_t dir_mtimes;
+    uint32_t path_count;
+    uint32_t paths;
+    uint32_t strings;
+};
+
+struct snapshot_var {
+    uint32_t entry;
+    uint32_t inherited;
+    uint32_t flags;
+};
+
+struct snapshot_mtime {
+    int64_t sec;
+    int64_t nsec;
+};
+
+struct snapshot_path {
+    uint32_t name;
+    uint32_t path;
 };
 
 extern const char *STATUS_STRING[];
+extern struct alloc_stats wsh_alloc_stats;
+extern int wsh_tracing;
+
+// Trace probes, a single branch on wsh_tracing while tracing is off
+
+#define TRACE_START(start) long start = wsh_tracing ? wsh_trace_now() : 0
+#define TRACE_SPAN(name, id, start, label) \
+    do { if (wsh_tracing) { wsh_trace_span(name, id, start, label); } } while (0)
 
 //Declaring all the required functions
 
+void pid_index_insert(pid_t pid, int job_id, struct process *proc);
+void pid_index_remove(pid_t pid);
 int get_job_id_by_pid(int pid);
 struct job *get_job_by_id(int id);
 int get_pgid_by_job_id(int id);
 int get_proc_count(int id, int filter);
 int get_next_job_id();
 int release_job(int id);
-int small_job_id();
+void free_job(struct job *job);
+int get_last_job_id();
+int get_job_id_by_name(const char *name);
 int insert_job(struct job *job);
 int remove_job(int id);
 int is_job_completed(int id);
+struct process *get_process_by_pid(int pid);
 int set_process_status(int pid, int status);
 int set_job_status(int id, int status);
 int wait_for_pid(int pid);
 int wait_for_job(int id);
-int get_command_type(char *command);
+void wsh_builtin_init();
+const struct builtin *wsh_find_builtin(const char *name);
 char *helper_strtrim(char *line);
 int wsh_cd(int argc, char **argv);
 int print_job_status(int id);
 int wsh_jobs(int argc, char **argv);
 int wsh_fg(int argc, char **argv);
+int wsh_wait(int argc, char **argv);
 int wsh_bg(int argc, char **argv);
-int wsh_exit();
+int wsh_hash(int argc, char **argv);
+int wsh_export(int argc, char **argv);
+int wsh_unset(int argc, char **argv);
+int wsh_memstat(int argc, char **argv);
+int wsh_pipesize(int argc, char **argv);
+int wsh_sched(int argc, char **argv);
+int wsh_set(int argc, char **argv);
+int wsh_history(int argc, char **argv);
+int wsh_time(int argc, char **argv);
+int wsh_parallel(int argc, char **argv);
+void wsh_parallel_step(struct job *group);
+int wsh_exit(int argc, char **argv);
+int wsh_echo(int argc, char **argv);
+int wsh_true(int argc, char **argv);
+int wsh_false(int argc, char **argv);
+int wsh_printf(int argc, char **argv);
+int wsh_pwd(int argc, char **argv);
+int wsh_sleep(int argc, char **argv);
+int wsh_signal_number(const char *name);
+int wsh_kill(int argc, char **argv);
+int wsh_read(int argc, char **argv);
+int wsh_test(int argc, char **argv);
+int wsh_prio(int argc, char **argv);
+long wsh_parse_duration(const char *str);
+int wsh_timeout(int argc, char **argv);
+long wsh_timer_now();
+void wsh_timer_add(struct job *job, long deadline, int stage);
+void wsh_timer_remove(struct job *job);
+void wsh_timer_expire();
+double wsh_process_wall(struct process *proc);
+void wsh_time_report(struct job *job);
+void print_job_usage(int id);
+int wsh_trace_init(const char *path);
+long wsh_trace_now();
+void wsh_trace_span(const char *name, int id, long start, const char *label);
+void wsh_trace_name(int id, int tid, const char *label);
+void wsh_trace_process(int id, struct process *proc);
+void wsh_trace_flush();
+void wsh_trace_close();
+void wsh_child_changed(pid_t pid, int status, struct rusage *usage);
 void check_zombie();
-int wsh_execute_builtin_command(struct process *proc);
+void wsh_event_init();
+int wsh_event_poll(int timeout);
+void wsh_event_wait_child(int timeout);
+int wsh_run_builtin(struct process *proc, int in_fd, int out_fd, int mode);
+pid_t wsh_fork_builtin(struct job *job, struct process *proc, int in_fd, int out_fd);
+int wsh_builtin_in_shell(struct process *proc, int mode);
+struct arena *arena_create();
+void *arena_alloc(struct arena *arena, size_t size);
+char *arena_strdup(struct arena *arena, const char *str);
+char *arena_strndup(struct arena *arena, const char *str, size_t length);
+void arena_release(struct arena *arena);
+unsigned int wsh_hash_string(const char *str);
+struct var_store *var_store_create(char **env);
+void var_store_free(struct var_store *store);
+const char *wsh_get_var(const char *name, size_t length);
+void wsh_set_var(const char *name, size_t length, const char *value, int flags);
+int wsh_unset_var(const char *name, size_t length);
+char **wsh_var_envp();
+void path_cache_flush();
+int path_cache_dirs_changed();
+char *path_cache_lookup(char *name);
+int wsh_get_spawn_engine();
+pid_t wsh_spawn_process(struct job *job, struct process *proc, int in_fd, int out_fd);
+int wsh_server_start();
+pid_t wsh_server_spawn(struct job *job, struct process *proc, int in_fd, int out_fd);
+pid_t wsh_fork_process(struct job *job, struct process *proc, int in_fd, int out_fd);
 int wsh_launch_process(struct job *job, struct process *proc, int in_fd, int out_fd, int mode);
+int wsh_wait_foreground(struct job *job);
+long wsh_parse_size(const char *str);
+void wsh_apply_prefixes(struct job *job);
+int wsh_pipe(struct job *job, int fd[2]);
+pid_t wsh_fork_plumbing(struct job *job, const char *command);
+int wsh_open_here(const char *data, size_t length);
+int wsh_open_input(struct job *job, struct process *proc);
+int wsh_open_output(struct job *job, struct process *proc);
+int wsh_start_job(struct job *job, int out_fd);
+int wsh_sched_running();
+void wsh_sched_account(struct job *job);
+int wsh_sched_admit();
+void wsh_sched_enqueue(struct job *job);
+void wsh_sched_dequeue(struct job *job);
+void wsh_sched_run();
+void wsh_apply_priority(pid_t pid, int priority);
+int wsh_exit_code(struct job *job);
 int wsh_launch_job(struct job *job);
-struct process *wsh_parse_command_segment(char *segment);
+int wsh_join_job(int id);
+int wsh_wait_after(struct job *job);
+int wsh_lex(const char *line, struct token **tokens_out, struct arena *arena);
+int wsh_word(char *out, const char *line, struct token *token, int pattern);
 struct job *wsh_parse_command(char *line);
+const char *wsh_here_span(const char *cursor, const char *end, const char *delim, size_t *length);
+int wsh_read_here_docs(struct job *job, char *(*next_line)(const char *prompt));
+void glob_cache_flush();
+struct glob_dir *glob_read_dir(const char *path);
+int glob_match(const char *pattern, const char *name);
+int wsh_glob(const char *word, struct arena *arena, char ***results);
+int wsh_subst_end(const char *line, int i);
+char *wsh_capture(const char *command, size_t *length);
+int wsh_expand_word(const char *raw, struct arena *arena, char ***fields, int split);
+int wsh_expand_process(struct process *proc, struct arena *arena);
+struct script_image *script_image_build(const char *path, const char *data, size_t size, struct stat *st);
+struct script_image *script_image_load(const char *cache_path, const char *path, struct stat *st, size_t *length);
+int script_image_save(struct script_image *image, const char *cache_path);
+struct job *script_image_job(struct script_image *image, int index);
+void script_image_dump(struct script_image *image);
+char *script_image_cache_path(const char *path);
+int wsh_run_graph(struct script_image *image);
+int script_image_run(struct script_image *image, uint32_t node);
+int wsh_control_scan(const char *line, int *depth);
+int snapshot_save(const char *path, const char *rc_path, char **inherited);
+int snapshot_load(const char *path, const char *rc_path);
+int wsh_save_snapshot(const char *path);
+void wsh_startup();
+int wsh_run_script(const char *path, int flags);
+int wsh_run_text(const char *text, size_t length);
+int wsh_resident_serve(const char *socket_path);
+int wsh_client(const char *socket_path, int kind, const char *text);
+struct history *wsh_history_open();
+void wsh_history_close();
+void wsh_history_add(const char *line);
+long wsh_history_search(const char *query, long before);
+long wsh_history_prev(long offset);
+long wsh_history_next(long offset);
+char *wsh_history_entry(long offset);
+char *wsh_edit_line(const char *prompt);
 char *wsh_read_line();
+char *wsh_prompt_line(const char *prompt);
 void wsh_loop();
 void signal_handler(int signo);
+void wsh_shell_init();
 void wsh_init();
 
 #endif /* WSH_H */